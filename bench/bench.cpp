@@ -0,0 +1,457 @@
+/*
+Benchmark harness for the storage core.
+
+Runs fixed, seeded workloads against a fresh database file each and prints
+one machine-readable record per workload: throughput plus p50/p99/p99.9
+latency of a single operation.
+
+  bench [--workload all|seq_insert|random_insert|scan|point_lookup|mixed]
+        [--rows N] [--ops N] [--scans N] [--read-percent P]
+        [--commit-every N] [--sync normal|full] [--mmap] [--hash-keys] [--compress]
+        [--records variable|fixed|columnar] [--seed S] [--dir DIR] [--page-size N]
+        [--cache-pages N] [--format json|csv]
+*/
+#include "storage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef enum
+{
+  FORMAT_JSON,
+  FORMAT_CSV
+} Format;
+
+typedef struct
+{
+  uint32_t rows;
+  uint32_t ops;   // point lookups or mixed operations
+  uint32_t scans; // full scans, each counted as one op
+  uint32_t read_percent;
+  uint32_t commit_every;
+  WalSyncMode sync_mode;
+  bool use_mmap;
+  bool hash_keys;
+  bool compress;
+  RecordFormat records;
+  uint32_t page_size;
+  uint32_t cache_pages;
+  uint64_t seed;
+  const char *dir;
+  Format format;
+} Options;
+
+typedef struct
+{
+  const char *workload;
+  uint32_t ops;
+  double seconds;
+  uint64_t *latencies; // nanoseconds, one per op
+  uint64_t checksum;   // keeps the reads from being optimized away
+} Result;
+
+uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64*, so every run with the same seed sees the same keys.
+uint64_t next_random(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 2685821657736338717ull;
+}
+
+void make_row(Row *row, uint32_t id)
+{
+  memset(row, 0, sizeof(Row));
+  row->id = id;
+  snprintf(row->username, sizeof(row->username), "user%u", id);
+  snprintf(row->email, sizeof(row->email), "user%u@example.com", id);
+}
+
+void check_insert(ExecuteResult result)
+{
+  if (result != EXECUTE_SUCCESS)
+  {
+    fprintf(stderr, "Insert failed: %d\n", result);
+    exit(EXIT_FAILURE);
+  }
+}
+
+Table *open_fresh(const Options *options, const char *workload, char *path, size_t path_size)
+{
+  snprintf(path, path_size, "%s/bench-%d-%s.db", options->dir, (int)getpid(), workload);
+  unlink(path);
+  Table *table = db_open(path, options->use_mmap, options->sync_mode, options->records, options->page_size);
+  if (options->hash_keys)
+  {
+    table_hash_keys(table);
+  }
+  if (options->compress)
+  {
+    pager_compress_pages(table->pager);
+  }
+  if (options->cache_pages != PAGER_CACHE_PAGES && !pager_set_cache_size(table->pager, options->cache_pages))
+  {
+    fprintf(stderr, "bench: the cache size cannot be set on a memory-mapped database, a reader, or while a reader "
+                    "or a pinned page is open\n");
+    exit(EXIT_FAILURE);
+  }
+  return table;
+}
+
+void close_and_remove(Table *table, const char *path)
+{
+  db_close(table);
+  unlink(path);
+}
+
+// Fill the table with ids 1..rows through the sorted bulk-load path.
+void preload(Table *table, uint32_t rows)
+{
+  const uint32_t chunk = 16384;
+  Row *batch = (Row *)malloc(chunk * sizeof(Row));
+  for (uint32_t first = 1; first <= rows; first += chunk)
+  {
+    uint32_t count = rows - first + 1 < chunk ? rows - first + 1 : chunk;
+    for (uint32_t i = 0; i < count; i++)
+    {
+      make_row(&batch[i], first + i);
+    }
+    check_insert(insert_rows(table, batch, count));
+  }
+  pager_commit(table->pager);
+  free(batch);
+}
+
+void run_inserts(const Options *options, Result *result, bool shuffle)
+{
+  uint32_t *ids = (uint32_t *)malloc(options->rows * sizeof(uint32_t));
+  for (uint32_t i = 0; i < options->rows; i++)
+  {
+    ids[i] = i + 1;
+  }
+  if (shuffle)
+  {
+    uint64_t state = options->seed;
+    for (uint32_t i = options->rows; i > 1; i--)
+    {
+      uint32_t j = (uint32_t)(next_random(&state) % i);
+      uint32_t t = ids[i - 1];
+      ids[i - 1] = ids[j];
+      ids[j] = t;
+    }
+  }
+
+  char path[512];
+  Table *table = open_fresh(options, result->workload, path, sizeof(path));
+  Row row;
+  result->ops = options->rows;
+  uint64_t start = now_ns();
+  for (uint32_t i = 0; i < options->rows; i++)
+  {
+    make_row(&row, ids[i]);
+    uint64_t t0 = now_ns();
+    check_insert(insert_rows(table, &row, 1));
+    if ((i + 1) % options->commit_every == 0)
+    {
+      pager_commit(table->pager);
+    }
+    result->latencies[i] = now_ns() - t0;
+  }
+  pager_commit(table->pager);
+  result->seconds = (now_ns() - start) / 1e9;
+  close_and_remove(table, path);
+  free(ids);
+}
+
+void run_scan(const Options *options, Result *result)
+{
+  char path[512];
+  Table *table = open_fresh(options, result->workload, path, sizeof(path));
+  preload(table, options->rows);
+  result->ops = options->scans;
+  uint64_t start = now_ns();
+  for (uint32_t i = 0; i < options->scans; i++)
+  {
+    uint64_t t0 = now_ns();
+    pager_advise(table->pager, PAGER_ACCESS_SEQUENTIAL);
+    Cursor *cursor = table_start(table);
+    while (!cursor->end_of_table)
+    {
+      RowView row = cursor_row(cursor);
+      result->checksum += row_view_id(row) + row_view_email_length(row);
+      cursor_advance(cursor);
+    }
+    free(cursor);
+    pager_advise(table->pager, PAGER_ACCESS_NORMAL);
+    result->latencies[i] = now_ns() - t0;
+  }
+  result->seconds = (now_ns() - start) / 1e9;
+  close_and_remove(table, path);
+}
+
+// Point lookups of existing ids, mixed with appends when read_percent < 100.
+void run_lookups(const Options *options, Result *result, uint32_t read_percent)
+{
+  char path[512];
+  Table *table = open_fresh(options, result->workload, path, sizeof(path));
+  preload(table, options->rows);
+  pager_advise(table->pager, PAGER_ACCESS_RANDOM);
+  uint64_t state = options->seed;
+  uint32_t max_id = options->rows;
+  uint32_t writes = 0;
+  Row row;
+  result->ops = options->ops;
+  uint64_t start = now_ns();
+  for (uint32_t i = 0; i < options->ops; i++)
+  {
+    bool read = next_random(&state) % 100 < read_percent;
+    uint32_t id = (uint32_t)(next_random(&state) % max_id) + 1;
+    uint64_t t0 = now_ns();
+    if (read || max_id == 0)
+    {
+      Cursor *cursor = table_find(table, id);
+      if (!cursor->end_of_table && cursor_key(cursor) == id)
+      {
+        result->checksum += row_view_username_length(cursor_row(cursor));
+      }
+      free(cursor);
+    }
+    else
+    {
+      make_row(&row, ++max_id);
+      check_insert(insert_rows(table, &row, 1));
+      if (++writes % options->commit_every == 0)
+      {
+        pager_commit(table->pager);
+      }
+    }
+    result->latencies[i] = now_ns() - t0;
+  }
+  pager_commit(table->pager);
+  result->seconds = (now_ns() - start) / 1e9;
+  close_and_remove(table, path);
+}
+
+int compare_latency(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+double percentile_us(const uint64_t *sorted, uint32_t count, double fraction)
+{
+  if (count == 0)
+  {
+    return 0;
+  }
+  uint32_t index = (uint32_t)(fraction * count);
+  if (index >= count)
+  {
+    index = count - 1;
+  }
+  return sorted[index] / 1000.0;
+}
+
+void report(const Options *options, Result *result, bool *header_printed)
+{
+  qsort(result->latencies, result->ops, sizeof(uint64_t), compare_latency);
+  double ops_per_sec = result->seconds > 0 ? result->ops / result->seconds : 0;
+  double p50 = percentile_us(result->latencies, result->ops, 0.50);
+  double p99 = percentile_us(result->latencies, result->ops, 0.99);
+  double p999 = percentile_us(result->latencies, result->ops, 0.999);
+  const char *sync = options->sync_mode == WAL_SYNC_FULL ? "full" : "normal";
+  const char *io = options->use_mmap ? "mmap" : "pread";
+  const char *records = options->records == RECORD_FIXED      ? "fixed"
+                        : options->records == RECORD_COLUMNAR ? "columnar"
+                                                              : "variable";
+
+  if (options->format == FORMAT_CSV)
+  {
+    if (!*header_printed)
+    {
+      printf("workload,rows,ops,page_size,cache_pages,io,sync,records,seconds,ops_per_sec,p50_us,p99_us,p999_us,"
+             "checksum\n");
+      *header_printed = true;
+    }
+    printf("%s,%u,%u,%u,%u,%s,%s,%s,%.6f,%.1f,%.3f,%.3f,%.3f,%llu\n", result->workload, options->rows,
+           result->ops, options->page_size, options->cache_pages, io, sync, records, result->seconds, ops_per_sec,
+           p50, p99, p999, (unsigned long long)result->checksum);
+  }
+  else
+  {
+    printf("{\"workload\":\"%s\",\"rows\":%u,\"ops\":%u,\"page_size\":%u,\"cache_pages\":%u,\"io\":\"%s\","
+           "\"sync\":\"%s\",\"records\":\"%s\",\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"p50_us\":%.3f,\"p99_us\":%.3f,"
+           "\"p999_us\":%.3f,\"checksum\":%llu}\n",
+           result->workload, options->rows, result->ops, options->page_size, options->cache_pages, io, sync, records,
+           result->seconds, ops_per_sec, p50, p99, p999, (unsigned long long)result->checksum);
+  }
+  fflush(stdout);
+}
+
+void usage()
+{
+  fprintf(stderr, "usage: bench [--workload all|seq_insert|random_insert|scan|point_lookup|mixed]\n"
+                  "             [--rows N] [--ops N] [--scans N] [--read-percent P]\n"
+                  "             [--commit-every N] [--sync normal|full] [--mmap] [--hash-keys] [--compress]\n"
+                  "             [--records variable|fixed|columnar] [--seed S] [--dir DIR] [--page-size N]\n"
+                  "             [--cache-pages N] [--format json|csv]\n");
+  exit(EXIT_FAILURE);
+}
+
+uint32_t parse_count(const char *text)
+{
+  char *end;
+  unsigned long value = strtoul(text, &end, 10);
+  if (*text == '\0' || *end != '\0' || value > UINT32_MAX)
+  {
+    usage();
+  }
+  return (uint32_t)value;
+}
+
+int main(int argc, char *argv[])
+{
+  Options options;
+  options.rows = 500;
+  options.ops = 5000;
+  options.scans = 10;
+  options.read_percent = 90;
+  options.commit_every = 1;
+  options.sync_mode = WAL_SYNC_NORMAL;
+  options.use_mmap = false;
+  options.hash_keys = false;
+  options.compress = false;
+  options.records = RECORD_VARIABLE;
+  options.seed = 42;
+  options.dir = "/tmp";
+  options.format = FORMAT_JSON;
+  options.page_size = DEFAULT_PAGE_SIZE;
+  options.cache_pages = PAGER_CACHE_PAGES;
+  const char *workload = "all";
+
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    if (strcmp(arg, "--mmap") == 0)
+    {
+      options.use_mmap = true;
+      continue;
+    }
+    if (strcmp(arg, "--hash-keys") == 0)
+    {
+      options.hash_keys = true;
+      continue;
+    }
+    if (strcmp(arg, "--compress") == 0)
+    {
+      options.compress = true;
+      continue;
+    }
+    if (i + 1 >= argc)
+    {
+      usage();
+    }
+    const char *value = argv[++i];
+    if (strcmp(arg, "--workload") == 0)
+      workload = value;
+    else if (strcmp(arg, "--rows") == 0)
+      options.rows = parse_count(value);
+    else if (strcmp(arg, "--ops") == 0)
+      options.ops = parse_count(value);
+    else if (strcmp(arg, "--scans") == 0)
+      options.scans = parse_count(value);
+    else if (strcmp(arg, "--read-percent") == 0)
+      options.read_percent = parse_count(value);
+    else if (strcmp(arg, "--commit-every") == 0)
+      options.commit_every = parse_count(value);
+    else if (strcmp(arg, "--seed") == 0)
+      options.seed = parse_count(value);
+    else if (strcmp(arg, "--dir") == 0)
+      options.dir = value;
+    else if (strcmp(arg, "--page-size") == 0)
+      options.page_size = parse_count(value);
+    else if (strcmp(arg, "--cache-pages") == 0)
+      options.cache_pages = parse_count(value);
+    else if (strcmp(arg, "--sync") == 0 && strcmp(value, "full") == 0)
+      options.sync_mode = WAL_SYNC_FULL;
+    else if (strcmp(arg, "--sync") == 0 && strcmp(value, "normal") == 0)
+      options.sync_mode = WAL_SYNC_NORMAL;
+    else if (strcmp(arg, "--records") == 0 && strcmp(value, "variable") == 0)
+      options.records = RECORD_VARIABLE;
+    else if (strcmp(arg, "--records") == 0 && strcmp(value, "fixed") == 0)
+      options.records = RECORD_FIXED;
+    else if (strcmp(arg, "--records") == 0 && strcmp(value, "columnar") == 0)
+      options.records = RECORD_COLUMNAR;
+    else if (strcmp(arg, "--format") == 0 && strcmp(value, "json") == 0)
+      options.format = FORMAT_JSON;
+    else if (strcmp(arg, "--format") == 0 && strcmp(value, "csv") == 0)
+      options.format = FORMAT_CSV;
+    else
+      usage();
+  }
+  if (!page_size_valid(options.page_size) || options.rows == 0 || options.commit_every == 0 ||
+      options.read_percent > 100 || options.seed == 0)
+  {
+    usage();
+  }
+
+  const char *workloads[] = {"seq_insert", "random_insert", "scan", "point_lookup", "mixed"};
+  bool header_printed = false;
+  bool matched = false;
+  for (uint32_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+  {
+    if (strcmp(workload, "all") != 0 && strcmp(workload, workloads[w]) != 0)
+    {
+      continue;
+    }
+    matched = true;
+    Result result;
+    memset(&result, 0, sizeof(result));
+    result.workload = workloads[w];
+    uint32_t max_ops = options.rows;
+    if (options.ops > max_ops)
+      max_ops = options.ops;
+    if (options.scans > max_ops)
+      max_ops = options.scans;
+    result.latencies = (uint64_t *)malloc((size_t)max_ops * sizeof(uint64_t));
+    switch (w)
+    {
+    case 0:
+      run_inserts(&options, &result, false);
+      break;
+    case 1:
+      run_inserts(&options, &result, true);
+      break;
+    case 2:
+      run_scan(&options, &result);
+      break;
+    case 3:
+      run_lookups(&options, &result, 100);
+      break;
+    case 4:
+      run_lookups(&options, &result, options.read_percent);
+      break;
+    }
+    report(&options, &result, &header_printed);
+    free(result.latencies);
+  }
+  if (!matched)
+  {
+    usage();
+  }
+  return 0;
+}
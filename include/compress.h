@@ -0,0 +1,25 @@
+/*
+Page compression.
+
+A byte-oriented LZ77 coder in the manner of LZ4's block format, sized for
+one page at a time: no entropy stage, so a page decodes in about the time
+it takes to copy it. The input is a run of sequences, each a token byte
+whose high nibble counts the literals that follow it and whose low nibble
+is the match length less 4, with any nibble of 15 continued in further
+bytes of up to 255 each; then the literals; then a two-byte little-endian
+distance back to the match. The last sequence is literals alone.
+*/
+#ifndef SQLITE_COMPRESS_H
+#define SQLITE_COMPRESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Compress length bytes of in, at most 65536, into out. Returns the
+// compressed length, or 0 if it would take more than capacity bytes.
+uint32_t page_compress(const char *in, uint32_t length, char *out, uint32_t capacity);
+// Decompress in_length bytes of in into exactly out_length bytes of out.
+// Returns false if the input is damaged; out is then undefined.
+bool page_decompress(const char *in, uint32_t in_length, char *out, uint32_t out_length);
+
+#endif
@@ -0,0 +1,31 @@
+/*
+Scan kernels over one column of a columnar leaf.
+
+Each kernel works on a contiguous array of values and is vectorized with
+AVX2, SSE2 or NEON, whichever the build targets (see SQLITE_NATIVE_ARCH
+in CMakeLists.txt), falling back to a scalar loop. Selections are written
+as ascending indices into the array.
+*/
+#ifndef SQLITE_KERNELS_H
+#define SQLITE_KERNELS_H
+
+#include <stdint.h>
+
+// Number of values in [low, high].
+uint32_t kernel_count_range(const uint32_t *values, uint32_t count, uint32_t low, uint32_t high);
+// Indices of the values in [low, high]; returns how many were written.
+uint32_t kernel_select_range(const uint32_t *values, uint32_t count, uint32_t low, uint32_t high,
+                             uint16_t *selected);
+// Smallest and largest of count > 0 values.
+void kernel_min_max(const uint32_t *values, uint32_t count, uint32_t *min, uint32_t *max);
+// Total of count values.
+uint64_t kernel_sum(const uint32_t *values, uint32_t count);
+// Indices of the fixed-width text values whose first length bytes equal
+// prefix. length must not exceed width.
+uint32_t kernel_select_prefix(const char *values, uint32_t width, uint32_t count, const char *prefix,
+                              uint32_t length, uint16_t *selected);
+
+// Name of the instruction set the kernels were built for, for diagnostics.
+const char *kernel_isa();
+
+#endif
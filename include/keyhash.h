@@ -0,0 +1,28 @@
+/*
+In-memory hash of uint32 keys to uint32 values.
+
+Buckets are one cache line of seven keys and their values, chained to
+overflow buckets when full, and placed by linear hashing: the table grows
+one bucket at a time by splitting the next bucket in turn between itself
+and a new one, so there is never a rehash of the whole table and a put
+does at most one split. Buckets live in fixed-size segments, so growing
+never moves them either. Keys are never removed.
+*/
+#ifndef SQLITE_KEYHASH_H
+#define SQLITE_KEYHASH_H
+
+#include <stdint.h>
+
+// What key_hash_get returns for a key that is not there; never a value.
+#define KEY_HASH_MISSING UINT32_MAX
+
+typedef struct KeyHash KeyHash;
+
+KeyHash *key_hash_open();
+void key_hash_close(KeyHash *hash);
+// Set key's value, adding the key if it is new.
+void key_hash_put(KeyHash *hash, uint32_t key, uint32_t value);
+uint32_t key_hash_get(const KeyHash *hash, uint32_t key);
+uint32_t key_hash_count(const KeyHash *hash);
+
+#endif
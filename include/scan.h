@@ -0,0 +1,31 @@
+/*
+Worker pool for parallel scans.
+
+scan_pool_run calls task once for every item in [0, num_items), spread
+over the pool's workers with the calling thread as worker 0. Each worker
+starts on an equal share of the items and, once it runs out, steals the
+upper half of the largest share still left, so a few slow items do not
+hold up the rest. Items are claimed one at a time and never run twice.
+*/
+#ifndef SQLITE_SCAN_H
+#define SQLITE_SCAN_H
+
+#include <stdint.h>
+
+// Each worker pins one page at a time, so this stays well below the
+// pager's cache size.
+#define SCAN_MAX_WORKERS 16
+
+typedef void (*ScanTask)(void *context, uint32_t worker, uint32_t item);
+
+typedef struct ScanPool ScanPool;
+
+// num_workers counts the caller; a pool of one runs every item inline.
+ScanPool *scan_pool_open(uint32_t num_workers);
+void scan_pool_close(ScanPool *pool);
+uint32_t scan_pool_workers(const ScanPool *pool);
+
+// Returns once every item has run.
+void scan_pool_run(ScanPool *pool, uint32_t num_items, ScanTask task, void *context);
+
+#endif
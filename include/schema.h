@@ -0,0 +1,283 @@
+/*
+Table schemas.
+
+A compile-time schema lists SCHEMA_FIELD entries naming members of a row
+struct. Schema<> turns the list into column offsets, the row size and
+straight-line serialize/deserialize code, so rows of a table known when
+the engine is built are copied with fixed-offset memcpys and no per-column
+dispatch.
+
+Tables made with CREATE TABLE are described at runtime by a TableSchema,
+which the engine reads and writes column by column. A compile-time schema
+can fill in the TableSchema for its table, so both paths agree on layout.
+
+The first column of every table is an integer and is the B+tree key.
+
+Rows are built in the fixed layout above. A table stored in the variable
+format keeps each row as a record instead: integers as their 4 bytes and
+text as a length byte followed by just its bytes, so short strings no
+longer carry their column's padding onto the page. A columnar table keeps
+no records at all; its leaves store each column as one array (see
+storage.h).
+*/
+#ifndef SQLITE_SCHEMA_H
+#define SQLITE_SCHEMA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sqlite.h"
+
+#define SCHEMA_MAX_COLUMNS 16
+#define SCHEMA_NAME_SIZE 32
+#define SCHEMA_MAX_TEXT_SIZE 255 // fits the length byte of a variable record
+// Small enough that a leaf of the smallest page size still holds two rows.
+#define SCHEMA_MAX_ROW_SIZE 1024
+
+typedef struct
+{
+  char name[SCHEMA_NAME_SIZE + 1];
+  ColumnType type;
+  uint32_t size; // 4 for integers, the declared width for text
+  uint32_t offset;
+} ColumnDef;
+
+typedef struct
+{
+  char name[SCHEMA_NAME_SIZE + 1];
+  uint32_t num_columns;
+  ColumnDef columns[SCHEMA_MAX_COLUMNS];
+  uint32_t row_size;
+} TableSchema;
+
+// Returns false if the name is too long.
+bool schema_init(TableSchema *schema, const char *name, uint32_t length);
+// Append a column after the last one. Returns false if the name is too
+// long or taken, or the column does not fit.
+bool schema_add_column(TableSchema *schema, const char *name, uint32_t length, ColumnType type, uint32_t size);
+// Index of the named column (case-insensitive), or -1.
+int32_t schema_find_column(const TableSchema *schema, const char *name, uint32_t length);
+
+inline uint32_t schema_read_int(const TableSchema *schema, const char *row, uint32_t column)
+{
+  uint32_t value;
+  memcpy(&value, row + schema->columns[column].offset, sizeof(value));
+  return value;
+}
+
+inline void schema_write_int(const TableSchema *schema, char *row, uint32_t column, uint32_t value)
+{
+  memcpy(row + schema->columns[column].offset, &value, sizeof(value));
+}
+
+// Text columns are NUL padded to their width, so the value ends at the
+// first NUL or the end of the column.
+inline const char *schema_read_text(const TableSchema *schema, const char *row, uint32_t column,
+                                    uint32_t *length)
+{
+  const ColumnDef *def = &schema->columns[column];
+  *length = strnlen(row + def->offset, def->size);
+  return row + def->offset;
+}
+
+/*
+Stored records
+*/
+typedef enum
+{
+  RECORD_FIXED,    // the row as built, every column at its full width
+  RECORD_VARIABLE, // integers as 4 bytes, text as a length byte and its bytes
+  RECORD_COLUMNAR, // no records: each leaf keeps every column's values together
+} RecordFormat;
+
+// Largest variable record: every text column gains its length byte.
+#define SCHEMA_MAX_RECORD_SIZE (SCHEMA_MAX_ROW_SIZE + SCHEMA_MAX_COLUMNS)
+
+// Size of the variable record for a fixed-layout row.
+uint32_t record_encoded_size(const TableSchema *schema, const char *row);
+// Write the variable record for a fixed-layout row; returns its size.
+uint32_t record_encode(const TableSchema *schema, const char *row, char *record);
+
+// Start of a column in a variable record. Columns are found by walking the
+// ones before it, which is a handful of adds for the widths allowed here.
+inline const char *record_column(const TableSchema *schema, const char *record, uint32_t column,
+                                 uint32_t *length)
+{
+  const char *position = record;
+  for (uint32_t i = 0; i < column; i++)
+  {
+    position += schema->columns[i].type == COLUMN_TYPE_INTEGER ? sizeof(uint32_t) : 1 + (uint8_t)*position;
+  }
+  if (schema->columns[column].type == COLUMN_TYPE_INTEGER)
+  {
+    *length = sizeof(uint32_t);
+    return position;
+  }
+  *length = (uint8_t)*position;
+  return position + 1;
+}
+
+inline uint32_t record_read_int(const TableSchema *schema, RecordFormat format, const char *record,
+                                uint32_t column)
+{
+  if (format == RECORD_FIXED)
+  {
+    return schema_read_int(schema, record, column);
+  }
+  uint32_t length;
+  uint32_t value;
+  memcpy(&value, record_column(schema, record, column, &length), sizeof(value));
+  return value;
+}
+
+inline const char *record_read_text(const TableSchema *schema, RecordFormat format, const char *record,
+                                    uint32_t column, uint32_t *length)
+{
+  if (format == RECORD_FIXED)
+  {
+    return schema_read_text(schema, record, column, length);
+  }
+  return record_column(schema, record, column, length);
+}
+
+/*
+Compile-time schemas
+*/
+template <typename Member>
+struct ColumnTypeOf;
+
+template <>
+struct ColumnTypeOf<uint32_t>
+{
+  static const ColumnType type = COLUMN_TYPE_INTEGER;
+};
+
+template <size_t N>
+struct ColumnTypeOf<char[N]>
+{
+  static const ColumnType type = COLUMN_TYPE_TEXT;
+};
+
+// One column, serialized from member Field of Struct at its full width.
+template <typename Struct, typename Member, Member Struct::*Field>
+struct SchemaField
+{
+  static const uint32_t size = sizeof(Member);
+  static const ColumnType type = ColumnTypeOf<Member>::type;
+
+  static void write(const Struct &row, char *destination)
+  {
+    memcpy(destination, &(row.*Field), size);
+  }
+
+  static void read(const char *source, Struct &row)
+  {
+    memcpy(&(row.*Field), source, size);
+  }
+};
+
+#define SCHEMA_FIELD(Struct, Member) SchemaField<Struct, decltype(Struct::Member), &Struct::Member>
+
+// Fields laid out from byte Offset on. Each level of the recursion handles
+// one column, so serialize inlines to one memcpy per column.
+template <uint32_t Offset, typename... Fields>
+struct FieldList
+{
+  static const uint32_t offset = Offset;
+  static const uint32_t end = Offset;
+
+  template <typename Struct>
+  static void serialize(const Struct &, char *)
+  {
+  }
+
+  template <typename Struct>
+  static void deserialize(const char *, Struct &)
+  {
+  }
+
+  static bool describe(TableSchema *, const char *const *)
+  {
+    return true;
+  }
+};
+
+template <uint32_t Offset, typename First, typename... Rest>
+struct FieldList<Offset, First, Rest...>
+{
+  typedef First field;
+  typedef FieldList<Offset + First::size, Rest...> next;
+  static const uint32_t offset = Offset;
+  static const uint32_t end = next::end;
+
+  template <typename Struct>
+  static void serialize(const Struct &row, char *destination)
+  {
+    First::write(row, destination + Offset);
+    next::serialize(row, destination);
+  }
+
+  template <typename Struct>
+  static void deserialize(const char *source, Struct &row)
+  {
+    First::read(source + Offset, row);
+    next::deserialize(source, row);
+  }
+
+  static bool describe(TableSchema *schema, const char *const *names)
+  {
+    return schema_add_column(schema, names[0], strlen(names[0]), First::type, First::size) &&
+           next::describe(schema, names + 1);
+  }
+};
+
+template <uint32_t I, typename List>
+struct FieldAt
+{
+  typedef typename FieldAt<I - 1, typename List::next>::list list;
+};
+
+template <typename List>
+struct FieldAt<0, List>
+{
+  typedef List list;
+};
+
+template <typename... Fields>
+struct Schema
+{
+  typedef FieldList<0, Fields...> fields;
+  static const uint32_t num_columns = sizeof...(Fields);
+  static const uint32_t row_size = fields::end;
+
+  template <uint32_t I>
+  struct column
+  {
+    static const uint32_t offset = FieldAt<I, fields>::list::offset;
+    static const uint32_t size = FieldAt<I, fields>::list::field::size;
+  };
+
+  template <typename Struct>
+  static void serialize(const Struct &row, void *destination)
+  {
+    fields::serialize(row, (char *)destination);
+  }
+
+  template <typename Struct>
+  static void deserialize(const void *source, Struct &row)
+  {
+    fields::deserialize((const char *)source, row);
+  }
+
+  // Fill in the runtime description; names[i] names column i.
+  static bool describe(TableSchema *schema, const char *table_name, const char *const *names)
+  {
+    static_assert(num_columns <= SCHEMA_MAX_COLUMNS, "too many columns for a TableSchema");
+    static_assert(row_size <= SCHEMA_MAX_ROW_SIZE, "row too large for a TableSchema");
+    return schema_init(schema, table_name, strlen(table_name)) && fields::describe(schema, names);
+  }
+};
+
+#endif
@@ -0,0 +1,49 @@
+/*
+Network server for one shared Database.
+
+A single thread runs an epoll loop over every client, on a TCP port and a
+Unix socket, so one engine and its page cache serve them all. Requests are
+lines, and a client may send any number before reading the replies, which
+come back in order:
+
+  <sql>                  run the statement, through the plan cache
+  .prepare <n> <sql>     prepare sql as the connection's statement n
+  .run <n> [value ...]   bind the values to statement n's parameters, in
+                         order, and run it; a value is an integer or a
+                         'quoted' text with '' for a quote
+  .finalize <n>          release statement n
+  .stats                 the engine's statistics, as one row of JSON
+  .stats reset           start the statistics again from zero
+  .quit                  close the connection once its replies are sent
+
+Blank lines are skipped. Each reply is a line per result row, "+" and the
+row as CSV, then "." on success or "!" and a message on failure.
+
+Each turn of the loop runs every request that has arrived and then
+commits them together, before any of their replies go out, so a reply
+always reports a committed change and concurrent writers share one log
+write. A client that stops reading its replies is not read from until
+they drain, and a select's rows are produced only as fast as they do,
+except that a change from any client first finishes the selects under
+way.
+*/
+#ifndef SQLITE_SERVER_H
+#define SQLITE_SERVER_H
+
+#include "sqlite.h"
+
+typedef struct
+{
+  // TCP address to listen on, in host byte order, and port; port 0 for
+  // none.
+  uint32_t tcp_address;
+  uint16_t tcp_port;
+  // Unix socket path, or NULL for none. An existing file there is replaced.
+  const char *unix_path;
+} ServerOptions;
+
+// Serve db until SIGINT or SIGTERM. Returns false if a socket could not
+// be opened.
+bool server_run(Database *db, const ServerOptions *options);
+
+#endif
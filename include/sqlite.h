@@ -0,0 +1,216 @@
+/*
+Engine API. A Database is one open file; statements are prepared against
+it, bound, and then stepped one result row at a time:
+
+  Database *db = sqlite_open("users.db", 0);
+  Statement *statement;
+  sqlite_prepare(db, "select id, email from users where id > ?", &statement);
+  sqlite_bind_int(statement, 0, 10);
+  while (sqlite_step(statement) == EXECUTE_ROW)
+  {
+    uint32_t length;
+    const char *email = sqlite_column_text(statement, 1, &length);
+    ...
+  }
+  sqlite_finalize(statement);
+  sqlite_close(db);
+
+The REPL is one client of this header; it does not reach past it.
+*/
+#ifndef SQLITE_API_H
+#define SQLITE_API_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+  PREPARE_SUCCESS,
+  PREPARE_NEGATIVE_ID,
+  PREPARE_STRING_TOO_LONG,
+  PREPARE_UNKNOWN_TABLE,
+  PREPARE_UNRECOGNIZED_STATEMENT,
+  PREPARE_SYNTAX_ERROR,
+  PREPARE_ROW_TOO_LARGE // a create table column or row wider than the storage allows
+} PrepareResult;
+
+typedef enum
+{
+  EXECUTE_SUCCESS, // the statement has run to completion
+  EXECUTE_DUPLICATE_KEY,
+  EXECUTE_TABLE_FULL,
+  EXECUTE_UNBOUND_PARAMETER,
+  EXECUTE_FAILED,
+  EXECUTE_TABLE_EXISTS,
+  EXECUTE_INDEX_EXISTS,
+  EXECUTE_READ_ONLY, // an insert or create table on a snapshot reader
+  EXECUTE_ROW, // sqlite_step produced a row; read it with sqlite_column_*
+} ExecuteResult;
+
+typedef enum
+{
+  BIND_SUCCESS,
+  BIND_RANGE_ERROR, // no parameter with that index
+  BIND_TYPE_MISMATCH,
+  BIND_STRING_TOO_LONG
+} BindResult;
+
+typedef enum
+{
+  COLUMN_TYPE_INTEGER,
+  COLUMN_TYPE_TEXT,
+  COLUMN_TYPE_INTEGER64 // an aggregate's value; only results have it
+} ColumnType;
+
+typedef struct Database Database;
+typedef struct Statement Statement;
+
+// sqlite_open flags
+#define SQLITE_OPEN_MMAP 0x1      // map the file instead of going through the read path
+#define SQLITE_OPEN_SYNC_FULL 0x2 // every commit waits for its log sync
+// A new file stores users rows at full width, or column by column, rather
+// than as variable records. An existing file keeps the format it was
+// created with.
+#define SQLITE_OPEN_FIXED_ROWS 0x4
+#define SQLITE_OPEN_COLUMNAR_ROWS 0x8
+// A new file's page size, a power of two from 4096 to 65536 bytes, given
+// as SQLITE_OPEN_PAGE_SIZE(bytes); the default is set at build time. An
+// existing file keeps the page size it was created with.
+#define SQLITE_OPEN_PAGE_SIZE_SHIFT 8
+#define SQLITE_OPEN_PAGE_SIZE_MASK (0x1f << SQLITE_OPEN_PAGE_SIZE_SHIFT)
+#define SQLITE_OPEN_PAGE_SIZE(bytes) ((uint32_t)__builtin_ctz(bytes) << SQLITE_OPEN_PAGE_SIZE_SHIFT)
+// Keep an in-memory hash of every table's ids, built as the table is
+// opened, so "id = N" selects and duplicate checks on insert skip the
+// descent from the root. Costs about 12 bytes of memory per row.
+#define SQLITE_OPEN_HASH_KEYS 0x10
+// Store database file pages compressed where that frees disk blocks,
+// which takes pages of 8192 bytes or more. Any file with compressed pages
+// reads back with or without it.
+#define SQLITE_OPEN_COMPRESS 0x20
+
+// Returns NULL if the catalog of tables and indexes beside the file,
+// "<filename>-catalog", is there but cannot be read. A change that cannot
+// be recorded in the catalog fails with EXECUTE_FAILED.
+Database *sqlite_open(const char *filename, uint32_t flags);
+void sqlite_close(Database *db);
+
+/*
+sqlite_open_reader opens a read-only connection to db for another thread,
+or returns NULL if db is memory-mapped or too many readers are open. Each
+select on it sees the database as of the last commit before its first
+step, however much db commits meanwhile, and never waits for those
+commits. It knows the tables db had when it was opened. Call it from db's
+thread, and close every reader before db.
+*/
+Database *sqlite_open_reader(Database *db);
+
+// Threads, the caller included, that a select filtering or aggregating a
+// large table scans it with. Defaults to the number of online CPUs, up to
+// 16; 1 always scans serially.
+void sqlite_set_scan_threads(Database *db, uint32_t threads);
+
+// Bytes of rows a select's order by may hold in memory. A larger result
+// is sorted in runs written to a temporary file in $TMPDIR, or /tmp, and
+// merged from there; a select whose file cannot be made, written or read
+// fails with EXECUTE_FAILED. Defaults to 64 MiB; anything under 1 MiB is
+// taken as 1 MiB.
+void sqlite_set_sort_memory(Database *db, size_t bytes);
+
+// Pages db's cache holds, for sizing it by the cache hit rate in
+// sqlite_format_stats. Defaults to 32, the least it can be. Commits
+// pending changes and empties the cache, so call it between statements.
+// Returns false, changing nothing, on a reader, a memory-mapped db, or
+// while a reader of db is open.
+bool sqlite_set_cache_pages(Database *db, uint32_t pages);
+
+/*
+Group the inserts that follow into one transaction: none of them commits
+on its own, and sqlite_commit commits them all together, which saves a
+log write per statement. Nothing is rolled back; a failed insert keeps
+what it did as it would outside. Creating a table or an index, opening a
+reader and closing db still commit straight away and take the pending
+changes with them.
+*/
+void sqlite_begin(Database *db);
+void sqlite_commit(Database *db);
+
+/*
+sqlite_prepare parses sql into a statement the caller owns. A select may
+have one aggregate, count(*) or min, max or sum of an integer column, in
+place of its columns; two aggregates, or min or max of a text column,
+are PREPARE_SYNTAX_ERROR. Each "?" is a
+parameter, numbered from 0 in order of appearance, that must be bound
+before the first step.
+
+sqlite_prepare_cached looks sql up in the database's plan cache, so text
+that differs only in its literal values is parsed once. The statement it
+returns belongs to the database and is only valid until the next
+sqlite_prepare_cached call, unless it has been stepped since; then it
+stays valid until it is reset or finalized.
+
+Either kind is released with sqlite_finalize.
+*/
+PrepareResult sqlite_prepare(Database *db, const char *sql, Statement **out);
+PrepareResult sqlite_prepare_cached(Database *db, const char *sql, Statement **out);
+
+BindResult sqlite_bind_int(Statement *statement, uint32_t index, uint32_t value);
+BindResult sqlite_bind_text(Statement *statement, uint32_t index, const char *text, uint32_t length);
+
+// Run the statement until it produces a row (EXECUTE_ROW) or finishes
+// (EXECUTE_SUCCESS or an error). An insert does all of its work on the
+// first step. A select reads only as far as it needs to for the rows
+// stepped through, so stopping early, or a limit, ends the scan there.
+// Without an order by, rows come in key order, except from a select read
+// through an index, whose rows come in the order of the indexed values.
+ExecuteResult sqlite_step(Statement *statement);
+
+// Columns of the current row. Text points into the page cache and stays
+// valid until the next step; it is not NUL terminated.
+uint32_t sqlite_column_count(Statement *statement);
+ColumnType sqlite_column_type(Statement *statement, uint32_t column);
+uint32_t sqlite_column_int(Statement *statement, uint32_t column);
+// An aggregate is a COLUMN_TYPE_INTEGER64 column, since a sum can outgrow
+// 32 bits; sqlite_column_int gives only its low half.
+uint64_t sqlite_column_int64(Statement *statement, uint32_t column);
+const char *sqlite_column_text(Statement *statement, uint32_t column, uint32_t *length);
+
+// Abandon any step in progress and forget the bound values, so the
+// statement can be bound and run again.
+void sqlite_reset(Statement *statement);
+void sqlite_finalize(Statement *statement);
+
+typedef enum
+{
+  IMPORT_SUCCESS,
+  IMPORT_OPEN_FAILED,
+  IMPORT_BAD_RECORD,
+  IMPORT_STRING_TOO_LONG,
+  IMPORT_INSERT_FAILED
+} ImportResult;
+
+typedef struct
+{
+  uint32_t rows_imported;
+  uint32_t line;        // line the failing record starts on
+  ExecuteResult insert; // why the insert failed
+} ImportStatus;
+
+// Bulk load a CSV file of id,username,email records.
+ImportResult sqlite_import_csv(Database *db, const char *path, ImportStatus *status);
+
+/*
+Engine statistics, summed over every thread since the last reset: page
+cache hits and misses, pages allocated, rows selects scanned and returned,
+and counts and latency histograms of parses, statement executions and
+fsyncs. sqlite_format_stats writes them into buffer as a table, or as one
+line of JSON, and returns the length in the manner of snprintf.
+*/
+size_t sqlite_format_stats(char *buffer, size_t size, bool json);
+void sqlite_reset_stats();
+
+// Diagnostics for the REPL's .btree and .constants.
+void sqlite_print_tree(Database *db);
+void sqlite_print_constants(Database *db);
+
+#endif
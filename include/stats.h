@@ -0,0 +1,62 @@
+/*
+Engine statistics.
+
+Counters and latency histograms for the hot paths, kept per thread so
+that counting is an add to memory no other thread writes: a thread's
+block is made on its first count and found through a thread-local
+pointer, and reading the statistics sums every block. The counts of a
+thread that exits are folded into one block for all such threads. A reset
+does not touch the blocks under their threads; it notes the current sums
+as the new zero.
+*/
+#ifndef SQLITE_STATS_H
+#define SQLITE_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+  STAT_CACHE_HITS,
+  STAT_CACHE_MISSES,
+  STAT_PAGES_ALLOCATED, // new pages at the end of the file
+  STAT_ROWS_SCANNED,    // rows a select looked at
+  STAT_ROWS_RETURNED,   // rows a select handed back
+  STAT_NUM_COUNTERS
+} StatCounter;
+
+typedef enum
+{
+  STAT_PARSE,   // one statement's parse
+  STAT_EXECUTE, // one statement, from its first step to its last
+  STAT_SYNC,    // one fsync of the log or the database file
+  STAT_NUM_TIMERS
+} StatTimer;
+
+// Bucket i of a latency histogram counts times from 2^i to 2^(i+1)
+// nanoseconds; the last also counts everything longer, from about 2 s.
+#define STAT_HISTOGRAM_BUCKETS 32
+
+typedef struct
+{
+  uint64_t counters[STAT_NUM_COUNTERS];
+  uint64_t total_ns[STAT_NUM_TIMERS];
+  uint64_t buckets[STAT_NUM_TIMERS][STAT_HISTOGRAM_BUCKETS];
+} Stats;
+
+void stats_count(StatCounter counter, uint64_t amount);
+// Nanoseconds on the monotonic clock, for stats_time to measure from.
+uint64_t stats_clock();
+// Record one time, from start to now.
+void stats_time(StatTimer timer, uint64_t start);
+void stats_time_ns(StatTimer timer, uint64_t ns);
+
+// Every thread's counts since the last reset.
+void stats_read(Stats *stats);
+void stats_reset();
+// Write stats into buffer as a table, or as one line of JSON, and return
+// the length, or the length it would have had, in the manner of snprintf.
+size_t stats_format(const Stats *stats, bool json, char *buffer, size_t size);
+
+#endif
@@ -0,0 +1,437 @@
+/*
+Storage core: row layout, the pager and its write-ahead log, and the
+B+tree keyed on the first column of each table. The engine (engine.cpp) is
+built on it, and the benchmark harness drives it directly.
+*/
+#ifndef SQLITE_STORAGE_H
+#define SQLITE_STORAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "keyhash.h"
+#include "schema.h"
+#include "sqlite.h"
+
+#define COLUMN_USERNAME_SIZE 32
+#define COLUMN_EMAIL_SIZE 255
+typedef struct
+{
+  uint32_t id;
+  char username[COLUMN_USERNAME_SIZE];
+  char email[COLUMN_EMAIL_SIZE];
+} Row;
+
+// The built-in users table.
+typedef Schema<SCHEMA_FIELD(Row, id), SCHEMA_FIELD(Row, username), SCHEMA_FIELD(Row, email)> UsersSchema;
+
+const uint32_t ID_SIZE = UsersSchema::column<0>::size;
+const uint32_t USERNAME_SIZE = UsersSchema::column<1>::size;
+const uint32_t EMAIL_SIZE = UsersSchema::column<2>::size;
+const uint32_t ID_OFFSET = UsersSchema::column<0>::offset;
+const uint32_t USERNAME_OFFSET = UsersSchema::column<1>::offset;
+const uint32_t EMAIL_OFFSET = UsersSchema::column<2>::offset;
+const uint32_t ROW_SIZE = UsersSchema::row_size;
+
+void serialize_row(Row *source, void *destination);
+void deserialize_row(void *source, Row *destination);
+
+// Read-only view of a stored row, in any format. Columns are read in place
+// from the page, so scans never copy a row out just to look at it. A
+// columnar row is the one at index cell in the leaf at data, whose column
+// arrays start at the offsets in columns.
+typedef struct
+{
+  const char *data;
+  RecordFormat format;
+  uint32_t cell;
+  const uint32_t *columns;
+} RowView;
+
+inline RowView row_view(const void *source, RecordFormat format)
+{
+  RowView view = {(const char *)source, format, 0, NULL};
+  return view;
+}
+
+// Start of a column's value in a columnar row.
+inline const char *row_view_columnar(RowView row, const TableSchema *schema, uint32_t column)
+{
+  return row.data + row.columns[column] + row.cell * schema->columns[column].size;
+}
+
+inline uint32_t row_read_int(const TableSchema *schema, RowView row, uint32_t column)
+{
+  if (row.format == RECORD_COLUMNAR)
+  {
+    uint32_t value;
+    memcpy(&value, row_view_columnar(row, schema, column), sizeof(value));
+    return value;
+  }
+  return record_read_int(schema, row.format, row.data, column);
+}
+
+inline const char *row_read_text(const TableSchema *schema, RowView row, uint32_t column, uint32_t *length)
+{
+  if (row.format == RECORD_COLUMNAR)
+  {
+    const char *text = row_view_columnar(row, schema, column);
+    *length = strnlen(text, schema->columns[column].size);
+    return text;
+  }
+  return record_read_text(schema, row.format, row.data, column, length);
+}
+
+/*
+Users rows. The id is the first column, at the start of a fixed or
+variable row. Fixed string columns are NUL-padded but may fill their whole
+slot, so always pair them with their bounded length.
+*/
+inline uint32_t row_view_id(RowView row)
+{
+  uint32_t id;
+  const char *source = row.format == RECORD_COLUMNAR ? row.data + row.columns[0] + row.cell * ID_SIZE
+                                                     : row.data + ID_OFFSET;
+  memcpy(&id, source, ID_SIZE);
+  return id;
+}
+
+inline const char *row_view_username(RowView row)
+{
+  switch (row.format)
+  {
+  case (RECORD_FIXED):
+    return row.data + USERNAME_OFFSET;
+  case (RECORD_VARIABLE):
+    return row.data + ID_SIZE + 1;
+  default:
+    return row.data + row.columns[1] + row.cell * USERNAME_SIZE;
+  }
+}
+
+inline uint32_t row_view_username_length(RowView row)
+{
+  return row.format == RECORD_VARIABLE ? (uint8_t)row.data[ID_SIZE]
+                                       : strnlen(row_view_username(row), USERNAME_SIZE);
+}
+
+inline const char *row_view_email(RowView row)
+{
+  switch (row.format)
+  {
+  case (RECORD_FIXED):
+    return row.data + EMAIL_OFFSET;
+  case (RECORD_VARIABLE):
+    return row_view_username(row) + row_view_username_length(row) + 1;
+  default:
+    return row.data + row.columns[2] + row.cell * EMAIL_SIZE;
+  }
+}
+
+inline uint32_t row_view_email_length(RowView row)
+{
+  return row.format == RECORD_VARIABLE ? (uint8_t)row_view_email(row)[-1]
+                                       : strnlen(row_view_email(row), EMAIL_SIZE);
+}
+
+/*
+Each database has its own page size, a power of two from MIN_PAGE_SIZE to
+MAX_PAGE_SIZE chosen when the file is created and recorded in it. New
+files get DEFAULT_PAGE_SIZE unless told otherwise; see SQLITE_PAGE_SIZE in
+CMakeLists.txt. A file grows a page at a time with no fixed limit.
+*/
+#ifndef SQLITE_PAGE_SIZE
+#define SQLITE_PAGE_SIZE 4096
+#endif
+
+const uint32_t MIN_PAGE_SIZE = 4096;
+const uint32_t MAX_PAGE_SIZE = 65536;
+const uint32_t DEFAULT_PAGE_SIZE = SQLITE_PAGE_SIZE;
+
+constexpr bool page_size_valid(uint32_t page_size)
+{
+  return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE && (page_size & (page_size - 1)) == 0;
+}
+
+static_assert(page_size_valid(DEFAULT_PAGE_SIZE), "SQLITE_PAGE_SIZE must be a power of two from 4096 to 65536");
+
+// Leaf geometry for fixed rows of a given size in pages of a given size
+// (see the node layout in storage.cpp): a 12-byte header, then cells of a 4-byte key and the row,
+// padded so every key stays 4-byte aligned. Variable records go in slotted
+// leaves instead, and how many fit depends on their contents; columnar
+// leaves hold about one more row than fixed ones, as keys are not stored
+// twice.
+const uint32_t LEAF_NODE_HEADER_SIZE = 12;
+
+constexpr uint32_t leaf_node_cell_size(uint32_t row_size)
+{
+  return (sizeof(uint32_t) + row_size + 3) & ~3u;
+}
+
+constexpr uint32_t leaf_node_max_cells(uint32_t row_size, uint32_t page_size)
+{
+  return (page_size - LEAF_NODE_HEADER_SIZE) / leaf_node_cell_size(row_size);
+}
+
+template <typename S>
+constexpr uint32_t schema_rows_per_page(uint32_t page_size = DEFAULT_PAGE_SIZE)
+{
+  return leaf_node_max_cells(S::row_size, page_size);
+}
+
+static_assert(leaf_node_max_cells(SCHEMA_MAX_ROW_SIZE, MIN_PAGE_SIZE) >= 2, "a leaf must hold at least two rows");
+
+typedef struct
+{
+  RecordFormat format;
+  uint32_t page_size;
+  uint32_t row_size; // of the fixed-layout rows the table is given
+  // Fixed and columnar leaves.
+  uint32_t cell_size;
+  uint32_t max_cells;
+  uint32_t left_split_count;
+  uint32_t right_split_count;
+  // Columnar leaves: where each column's array starts in the page.
+  uint32_t columns[SCHEMA_MAX_COLUMNS];
+} LeafLayout;
+
+LeafLayout leaf_layout(const TableSchema *schema, RecordFormat format, uint32_t page_size);
+
+// Number of page frames kept in memory. Pages beyond this are evicted in
+// least-recently-used order and re-read from the database file on demand.
+// It is the size of a reader's cache, and the size a writer's starts at
+// and cannot be set below.
+#define PAGER_CACHE_PAGES 32
+// The most frames pager_set_cache_size gives a writer.
+#define PAGER_MAX_CACHE_PAGES (1u << 24)
+#define PAGER_NO_FRAME -1
+// Page numbers stay below this, so frame numbers fit an int32_t.
+#define PAGER_MAX_PAGES 0x7fffffffu
+// In mmap mode the file and its mapping grow this many pages at a time.
+#define PAGER_MMAP_CHUNK_PAGES 64
+
+typedef enum
+{
+  PAGER_ACCESS_NORMAL,
+  PAGER_ACCESS_SEQUENTIAL,
+  PAGER_ACCESS_RANDOM
+} PagerAccessPattern;
+
+typedef enum
+{
+  WAL_SYNC_NORMAL,
+  WAL_SYNC_FULL
+} WalSyncMode;
+
+// Opaque to callers; defined in storage.cpp.
+typedef struct Pager Pager;
+
+// One B+tree. Tables share their database's pager.
+typedef struct
+{
+  Pager *pager;
+  uint32_t root_page_num;
+  const TableSchema *schema; // column types, to encode variable records
+  LeafLayout layout;
+  // Key to the leaf it was last found in, when table_hash_keys is on;
+  // NULL otherwise and in views. keys_hashed says it holds every key.
+  KeyHash *key_pages;
+  bool keys_hashed;
+  // Rows in the tree, or TABLE_ROWS_UNKNOWN for an existing tree nothing
+  // has counted yet, and in views, whose snapshots move.
+  uint32_t num_rows;
+} Table;
+
+#define TABLE_ROWS_UNKNOWN UINT32_MAX
+
+typedef struct
+{
+  Table *table;
+  uint32_t page_num;
+  uint32_t cell_num;
+  bool end_of_table; // Indicates a position one past the last element
+} Cursor;
+
+void pager_advise(Pager *pager, PagerAccessPattern pattern);
+// Start reading pages the caller will want soon, without waiting for them
+// or taking cache frames; a later fetch then finds them in the OS cache.
+void pager_prefetch(Pager *pager, const uint32_t *pages, uint32_t count);
+// From now on, store pages compressed where that saves disk blocks as
+// checkpoints copy them into the database file. Compressed pages are read
+// back the same either way. Does nothing in mmap mode, where the kernel
+// writes the file, or on a reader.
+void pager_compress_pages(Pager *pager);
+void pager_commit(Pager *pager);
+/*
+Give a writer's cache cache_size frames, clamped to PAGER_CACHE_PAGES and
+PAGER_MAX_CACHE_PAGES, committing its changes first and starting out
+empty. Returns false, changing nothing, on a reader, in mmap mode, while
+a reader is open, whose frames come from the same memory, or while a page
+is pinned.
+*/
+bool pager_set_cache_size(Pager *pager, uint32_t cache_size);
+uint32_t pager_page_size(const Pager *pager);
+// Pages in the database, written or not.
+uint32_t pager_num_pages(const Pager *pager);
+
+/*
+Snapshot readers. pager_open_reader opens a read-only pager on the
+writer's file and log, for use by another thread, or returns NULL in mmap
+mode or when too many are open. From pager_begin_read to pager_end_read it
+sees the database as of the last commit before the begin, whatever the
+writer commits meanwhile, and neither side waits for the other. Both calls
+do nothing on a writer's pager. Readers must be closed, with pager_close,
+before their writer.
+*/
+Pager *pager_open_reader(Pager *writer);
+void pager_begin_read(Pager *pager);
+void pager_end_read(Pager *pager);
+void pager_close(Pager *pager);
+
+// The users table's columns.
+const TableSchema *users_schema();
+
+/*
+Open the database with its users table, rooted at page 0. format and
+page_size are how a new file stores users rows and how big its pages are;
+an existing file keeps the page size it was created with and its tree the
+format it was built in, which every leaf records.
+*/
+Table *db_open(const char *filename, bool use_mmap, WalSyncMode sync_mode, RecordFormat format,
+               uint32_t page_size);
+void db_close(Table *table);
+
+// Further tables in the same file. table_create starts an empty tree on a
+// fresh page and returns NULL if the file cannot grow; the caller records
+// root_page_num, the schema and the format to table_open it later. The
+// schema must outlive the table.
+Table *table_create(Pager *pager, const TableSchema *schema, RecordFormat format);
+Table *table_open(Pager *pager, uint32_t root_page_num, const TableSchema *schema, RecordFormat format);
+// The same tree read through another pager, such as a snapshot reader.
+Table *table_view(Pager *pager, const Table *table, const TableSchema *schema);
+void table_close(Table *table);
+/*
+Keep an in-memory hash of the table's keys from now on, so that finding a
+key present in it starts at the leaf it was last seen in instead of
+descending from the root, and batch inserts check for duplicates without
+touching the tree. It starts with the keys lookups and inserts come
+across, and is filled from every leaf the first time an insert needs to
+know that a key is new, so opening a large table does not read it all.
+*/
+void table_hash_keys(Table *table);
+
+Cursor *table_start(Table *table);
+Cursor *table_find(Table *table, uint32_t key);
+// Move an existing cursor to where table_find would put a new one.
+void cursor_seek(Cursor *cursor, uint32_t key);
+uint32_t cursor_key(Cursor *cursor);
+RowView cursor_row(Cursor *cursor);
+
+/*
+Leaf-at-a-time access to columnar tables, for the scan kernels. The
+cursor's leaf has cursor_leaf_cells cells, column c of each of them is in
+the array at cursor_leaf_column, and cursor_next_leaf moves to the first
+cell of the next leaf.
+*/
+uint32_t cursor_leaf_cells(Cursor *cursor);
+const char *cursor_leaf_column(Cursor *cursor, uint32_t column);
+void cursor_next_leaf(Cursor *cursor);
+void cursor_advance(Cursor *cursor);
+
+/*
+Parallel scans. table_leaves lists, in key order, the leaves that may hold
+keys in [low, high] in an array it sets *pages to, which the caller frees;
+it reads only internal nodes. Worker threads then read leaves with
+leaf_acquire, which fetches and pins the page under the pager's latch so
+other workers' fetches cannot evict it until leaf_release. Nothing else
+may use the pager while workers are running.
+*/
+typedef struct
+{
+  Table *table;
+  uint32_t page_num;
+  const void *node;
+  uint32_t num_cells;
+} Leaf;
+
+uint32_t table_leaves(Table *table, uint32_t low, uint32_t high, uint32_t **pages);
+// Most cells any leaf of the table can hold.
+uint32_t table_max_leaf_cells(const Table *table);
+
+/*
+Key-range summaries answered from the tree's own structure, without
+reading any row: the smallest key at least low, the largest key at most
+high, and how many keys lie in [low, high]. The first two visit one node
+per level; the count reads the header of each leaf in range.
+*/
+bool table_first_key(Table *table, uint32_t low, uint32_t *key);
+bool table_last_key(Table *table, uint32_t high, uint32_t *key);
+uint32_t table_count_keys(Table *table, uint32_t low, uint32_t high);
+void leaf_acquire(Table *table, uint32_t page_num, Leaf *leaf);
+void leaf_release(Leaf *leaf);
+uint32_t leaf_key(const Leaf *leaf, uint32_t cell_num);
+RowView leaf_row(const Leaf *leaf, uint32_t cell_num);
+// Columnar tables: the array holding column of every cell.
+const char *leaf_column(const Leaf *leaf, uint32_t column);
+
+/*
+Records are serialized rows of table->layout.row_size bytes in the fixed
+layout, whose first column is the key; a variable-format table encodes
+them as it stores them. insert_records takes them packed back to back.
+*/
+ExecuteResult btree_insert(Table *table, uint32_t key, Row *value);
+ExecuteResult btree_insert_record(Table *table, uint32_t key, const void *record);
+ExecuteResult insert_rows(Table *table, Row *rows, uint32_t num_rows);
+ExecuteResult insert_records(Table *table, const char *records, uint32_t num_records);
+
+/*
+Secondary indexes. An index is a B+tree of its own in the table's file
+over one text column. Each entry is a row's value of the column, NUL
+padded to the column's width, then the row's key; entries are sorted by
+value and then key, so equal values each keep an entry and the values
+sharing a prefix sit together. Every entry is the same size, so nodes are
+plain arrays of them. index_create starts an empty index on a fresh page
+and returns NULL if the file cannot grow; as with a table, the caller
+records root_page_num and the width to index_open it later.
+
+Entries are only ever added, by the caller, after it inserts their rows.
+*/
+typedef struct
+{
+  Pager *pager;
+  uint32_t root_page_num;
+  uint32_t value_size; // width of the indexed column
+  uint32_t entry_size; // the value padded to 4 bytes, then the key
+} Index;
+
+typedef struct
+{
+  Index *index;
+  uint32_t page_num;
+  uint32_t entry_num;
+  bool end_of_index;
+} IndexCursor;
+
+Index *index_create(Pager *pager, uint32_t value_size);
+Index *index_open(Pager *pager, uint32_t root_page_num, uint32_t value_size);
+Index *index_view(Pager *pager, const Index *index);
+void index_close(Index *index);
+// Add the entry for a row; length is at most value_size. An entry that is
+// already there is left alone and returns EXECUTE_DUPLICATE_KEY.
+ExecuteResult index_insert(Index *index, const char *value, uint32_t length, uint32_t key);
+// Position the cursor at the first entry whose value is not less than
+// value, which is the first row with that value or with any value it is a
+// prefix of. length is at most value_size.
+void index_seek(Index *index, const char *value, uint32_t length, IndexCursor *cursor);
+// The current entry's value without its padding, valid until the next
+// page is read, and its row's key.
+const char *index_cursor_value(IndexCursor *cursor, uint32_t *length);
+uint32_t index_cursor_key(IndexCursor *cursor);
+void index_cursor_advance(IndexCursor *cursor);
+
+void print_tree(Table *table, uint32_t page_num, uint32_t indentation_level);
+void print_constants(uint32_t page_size);
+
+#endif
@@ -0,0 +1,195 @@
+#include "compress.h"
+
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_DISTANCE 65535
+// Nibble value that says the length goes on in the next bytes.
+#define LZ_LENGTH_MORE 15
+// The match finder remembers the last position of each of this many
+// hashes of 4 bytes; 16 KiB of stack.
+#define LZ_HASH_BITS 12
+// After this many bytes in a row without a match the finder starts
+// skipping ahead, one more byte each time, so data that does not compress
+// is given up on quickly.
+#define LZ_SKIP_SHIFT 5
+
+uint32_t lz_load32(const char *p)
+{
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+uint32_t lz_hash(uint32_t sequence)
+{
+  return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// The rest of a length that did not fit its nibble.
+bool lz_put_length(char *out, uint32_t *op, uint32_t capacity, uint32_t value)
+{
+  while (value >= 255)
+  {
+    if (*op >= capacity)
+    {
+      return false;
+    }
+    out[(*op)++] = (char)255;
+    value -= 255;
+  }
+  if (*op >= capacity)
+  {
+    return false;
+  }
+  out[(*op)++] = (char)value;
+  return true;
+}
+
+// Literals, then a match of match_length bytes distance back, or none if
+// match_length is 0.
+bool lz_put_sequence(char *out, uint32_t *op, uint32_t capacity, const char *literals, uint32_t num_literals,
+                     uint32_t distance, uint32_t match_length)
+{
+  uint32_t match_code = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+  uint32_t literal_nibble = num_literals < LZ_LENGTH_MORE ? num_literals : LZ_LENGTH_MORE;
+  uint32_t match_nibble = match_code < LZ_LENGTH_MORE ? match_code : LZ_LENGTH_MORE;
+  if (*op >= capacity)
+  {
+    return false;
+  }
+  out[(*op)++] = (char)(literal_nibble << 4 | match_nibble);
+  if (literal_nibble == LZ_LENGTH_MORE && !lz_put_length(out, op, capacity, num_literals - LZ_LENGTH_MORE))
+  {
+    return false;
+  }
+  if (num_literals > capacity - *op)
+  {
+    return false;
+  }
+  memcpy(out + *op, literals, num_literals);
+  *op += num_literals;
+  if (match_length == 0)
+  {
+    return true;
+  }
+  if (capacity - *op < 2)
+  {
+    return false;
+  }
+  out[(*op)++] = (char)(distance & 0xff);
+  out[(*op)++] = (char)(distance >> 8);
+  return match_nibble < LZ_LENGTH_MORE || lz_put_length(out, op, capacity, match_code - LZ_LENGTH_MORE);
+}
+
+uint32_t page_compress(const char *in, uint32_t length, char *out, uint32_t capacity)
+{
+  // Each entry is a position plus one, so 0 is none.
+  uint32_t last_seen[1u << LZ_HASH_BITS];
+  memset(last_seen, 0, sizeof(last_seen));
+  uint32_t op = 0;
+  uint32_t anchor = 0;
+  uint32_t pos = 0;
+  while (length >= LZ_MIN_MATCH && pos <= length - LZ_MIN_MATCH)
+  {
+    uint32_t sequence = lz_load32(in + pos);
+    uint32_t hash = lz_hash(sequence);
+    uint32_t candidate = last_seen[hash];
+    last_seen[hash] = pos + 1;
+    if (candidate == 0 || pos - (candidate - 1) > LZ_MAX_DISTANCE || lz_load32(in + candidate - 1) != sequence)
+    {
+      pos += 1 + ((pos - anchor) >> LZ_SKIP_SHIFT);
+      continue;
+    }
+    uint32_t match = candidate - 1;
+    uint32_t match_length = LZ_MIN_MATCH;
+    while (pos + match_length < length && in[match + match_length] == in[pos + match_length])
+    {
+      match_length++;
+    }
+    if (!lz_put_sequence(out, &op, capacity, in + anchor, pos - anchor, pos - match, match_length))
+    {
+      return 0;
+    }
+    pos += match_length;
+    anchor = pos;
+  }
+  if (!lz_put_sequence(out, &op, capacity, in + anchor, length - anchor, 0, 0))
+  {
+    return 0;
+  }
+  return op;
+}
+
+bool lz_get_length(const char *in, uint32_t in_length, uint32_t *ip, uint32_t *value)
+{
+  uint8_t byte;
+  do
+  {
+    if (*ip >= in_length)
+    {
+      return false;
+    }
+    byte = (uint8_t)in[(*ip)++];
+    *value += byte;
+  } while (byte == 255);
+  return true;
+}
+
+bool page_decompress(const char *in, uint32_t in_length, char *out, uint32_t out_length)
+{
+  uint32_t ip = 0;
+  uint32_t op = 0;
+  while (ip < in_length)
+  {
+    uint8_t token = (uint8_t)in[ip++];
+    uint32_t num_literals = token >> 4;
+    if (num_literals == LZ_LENGTH_MORE && !lz_get_length(in, in_length, &ip, &num_literals))
+    {
+      return false;
+    }
+    if (num_literals > in_length - ip || num_literals > out_length - op)
+    {
+      return false;
+    }
+    memcpy(out + op, in + ip, num_literals);
+    ip += num_literals;
+    op += num_literals;
+    if (ip == in_length)
+    {
+      break;
+    }
+
+    if (in_length - ip < 2)
+    {
+      return false;
+    }
+    uint32_t distance = (uint8_t)in[ip] | (uint32_t)(uint8_t)in[ip + 1] << 8;
+    ip += 2;
+    uint32_t match_length = token & 0xf;
+    if (match_length == LZ_LENGTH_MORE && !lz_get_length(in, in_length, &ip, &match_length))
+    {
+      return false;
+    }
+    match_length += LZ_MIN_MATCH;
+    if (distance == 0 || distance > op || match_length > out_length - op)
+    {
+      return false;
+    }
+    // A match may overlap the bytes it produces, repeating a short run.
+    const char *match = out + op - distance;
+    if (distance >= match_length)
+    {
+      memcpy(out + op, match, match_length);
+    }
+    else
+    {
+      for (uint32_t i = 0; i < match_length; i++)
+      {
+        out[op + i] = match[i];
+      }
+    }
+    op += match_length;
+  }
+  return op == out_length;
+}
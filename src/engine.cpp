@@ -0,0 +1,4885 @@
+#include "kernels.h"
+#include "scan.h"
+#include "sqlite.h"
+#include "stats.h"
+#include "storage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+
+typedef enum
+{
+  STATEMENT_INSERT,
+  STATEMENT_SELECT,
+  STATEMENT_CREATE_TABLE,
+  STATEMENT_CREATE_INDEX
+} StatementType;
+
+// Bounds on the key column from a select's where clause. A missing bound
+// is open.
+typedef struct
+{
+  bool has_lower;
+  bool lower_inclusive;
+  uint32_t lower;
+  bool has_upper;
+  bool upper_inclusive;
+  uint32_t upper;
+} KeyRange;
+
+typedef enum
+{
+  EXPR_COLUMN,
+  EXPR_INTEGER,
+  EXPR_STRING,
+  EXPR_PARAM, // "?" whose type is not known until its comparison is parsed
+  EXPR_COMPARE,
+  EXPR_AND,
+  EXPR_OR
+} ExprType;
+
+typedef enum
+{
+  COMPARE_EQ,
+  COMPARE_NE,
+  COMPARE_LT,
+  COMPARE_LE,
+  COMPARE_GT,
+  COMPARE_GE,
+  // text like pattern, where % in the pattern stands for any run of
+  // characters and _ for any one. Case matters, as it does for =.
+  COMPARE_LIKE
+} CompareOp;
+
+// Node of a where clause. Children are indices into Statement::exprs, and
+// string literals point into the statement text.
+typedef struct
+{
+  ExprType type;
+  CompareOp op;
+  uint32_t column; // index into the table's schema
+  uint32_t integer;
+  const char *string;
+  uint32_t length;
+  int32_t left;
+  int32_t right;
+} Expr;
+
+typedef enum
+{
+  AGGREGATE_NONE,
+  AGGREGATE_COUNT,
+  AGGREGATE_MIN,
+  AGGREGATE_MAX,
+  AGGREGATE_SUM
+} Aggregate;
+
+/*
+A conjunct of the where clause that a scan kernel evaluates over a whole
+columnar leaf at once: an integer column within [low, high], or a text
+column whose first length bytes are text. exact is set when it is the
+whole where clause and, unlike a like pattern with more after its prefix,
+decides it alone, so the rows it selects need no further check.
+*/
+typedef struct
+{
+  bool active;
+  bool exact;
+  bool matches_nothing;
+  uint32_t column;
+  uint32_t low;
+  uint32_t high;
+  char text[SCHEMA_MAX_TEXT_SIZE + 1];
+  uint32_t length;
+} KernelFilter;
+
+/*
+A conjunct of the where clause answered through a secondary index: a text
+column equal to text, or like a pattern that starts with the length bytes
+of text. The rows come in index order and are fetched from the table by
+key; exact is set when the conjunct is the whole where clause and its
+matches need no further check.
+*/
+typedef struct
+{
+  bool active;
+  bool exact;
+  bool prefix;
+  const char *text;
+  uint32_t length;
+  uint32_t column;
+  Index *index;
+  IndexCursor cursor;
+} IndexLookup;
+
+typedef struct ParallelScan ParallelScan;
+typedef struct SortSpill SortSpill;
+
+/*
+The rows passed between the operators of a select, a batch at a time: up
+to BATCH_MAX_ROWS cells of one leaf, which stays pinned until the batch is
+released so its rows are read in place, or when records is set, rows the
+sort copied out in the fixed layout. contiguous is set while the cells are
+a run of consecutive cells, as a scan reads them, so a kernel can take the
+same run of a column's array.
+*/
+#define BATCH_MAX_ROWS 1024
+
+typedef struct
+{
+  Leaf leaf;
+  bool pinned;
+  bool contiguous;
+  const char *records;
+  uint32_t num_rows;
+  uint16_t cells[BATCH_MAX_ROWS];
+} Batch;
+
+typedef struct Operator Operator;
+
+// Fill batch, which is empty and unpinned, with the next rows. Returns
+// false once there are none.
+typedef bool (*OperatorNext)(Operator *op, Batch *batch);
+
+struct Operator
+{
+  OperatorNext next;
+  Operator *input;
+  Statement *statement;
+};
+
+// A running select: its operators from the source up to top, and the
+// batch whose rows it is handing out one step at a time.
+typedef struct
+{
+  Operator source;
+  Operator filter;
+  Operator sort;
+  Operator offset;
+  Operator limit;
+  Operator *top;
+  Batch batch;
+  uint32_t next_row;
+  // Rows the offset still drops, and those the limit still lets through.
+  // scan_skip is the offset when the scan drops the rows itself.
+  uint32_t skip;
+  uint32_t scan_skip;
+  uint32_t remaining;
+  // The sort's copies of every row, in order once sorted, and how many it
+  // has handed on.
+  char *sorted;
+  uint32_t num_sorted;
+  uint32_t next_sorted;
+  // A sort past its memory budget instead merges runs it wrote out, and
+  // sorted holds a batch of the merged rows; NULL otherwise.
+  SortSpill *spill;
+  // An operator could not go on, as when the sort's file could not be
+  // written or read back; the select ends there and fails.
+  bool failed;
+  // The leaves a serial scan to the end of its range will read, in order,
+  // so they can be asked for ahead of it; NULL when not reading ahead. The
+  // scan is on leaves[scan_leaf] and has asked for those before prefetched.
+  uint32_t *leaves;
+  uint32_t num_leaves;
+  uint32_t scan_leaf;
+  uint32_t prefetched;
+  // A backwards scan lists the leaves last first, and hands out cells of
+  // leaves[scan_leaf] from the one before back_cell down; SCAN_NEW_LEAF
+  // before it has looked at the leaf.
+  uint32_t back_cell;
+} Executor;
+
+#define STATEMENT_MAX_EXPRS 32
+#define STATEMENT_MAX_COLUMNS 16
+#define EXPR_NONE -1
+
+// Where a bound parameter value is stored: a column of a row to insert,
+// a literal node of the where clause or a select's limit or offset.
+typedef enum
+{
+  PARAM_TARGET_COLUMN,
+  PARAM_TARGET_EXPR,
+  PARAM_TARGET_LIMIT,
+  PARAM_TARGET_OFFSET
+} ParamTarget;
+
+#define STATEMENT_MAX_PARAMS 16
+#define PARAM_TEXT_SIZE SCHEMA_MAX_TEXT_SIZE
+
+typedef struct
+{
+  ParamTarget target;
+  int32_t expr;
+  uint32_t row; // insert row the value goes into
+  uint32_t column;
+  bool is_integer;
+  bool bound;
+  // Backing store for a string bound into a where clause.
+  char text[PARAM_TEXT_SIZE];
+} Param;
+
+// Who releases a statement: the caller, the plan cache, or nobody because
+// it is the database's scratch statement for uncacheable text.
+typedef enum
+{
+  STATEMENT_OWNED,
+  STATEMENT_CACHED,
+  STATEMENT_SCRATCH
+} StatementOwner;
+
+// A table known to the database: its schema and its tree.
+typedef struct
+{
+  TableSchema schema;
+  Table *table;
+} CatalogTable;
+
+// A secondary index: its name, the table (an index into Database::tables)
+// and column it covers, and its tree.
+typedef struct
+{
+  char name[SCHEMA_NAME_SIZE + 1];
+  uint32_t table;
+  uint32_t column;
+  Index *index;
+} CatalogIndex;
+
+struct Statement
+{
+  StatementType type;
+  // The table an insert or select works on.
+  CatalogTable *table;
+  // insert: the rows to add, serialized in the table's layout. records is
+  // record_to_insert for a single row and a heap array once a multi-row
+  // insert outgrows it.
+  char record_to_insert[SCHEMA_MAX_ROW_SIZE];
+  char *records;
+  uint32_t num_rows;
+  uint32_t rows_capacity;
+  // select: projected columns, optional where clause and the key range the
+  // planner pulled out of it for the tree seek.
+  uint32_t num_columns;
+  uint32_t columns[STATEMENT_MAX_COLUMNS];
+  int32_t where;
+  bool where_is_range; // every predicate is captured by range
+  KeyRange range;
+  // An aggregate replaces the projected columns with its single value.
+  Aggregate aggregate;
+  uint32_t aggregate_column;
+  uint64_t aggregate_value;
+  // The order and most rows a select produces, when it asks, and how many
+  // rows from the start it leaves out.
+  bool has_order;
+  uint32_t order_column;
+  bool order_descending;
+  bool has_limit;
+  uint32_t limit;
+  uint32_t offset;
+  // Columnar tables: the comparison a scan kernel runs over each batch.
+  KernelFilter kernel_filter;
+  // Set while a select's rows come from a parallel scan.
+  ParallelScan *parallel;
+  // The index the planner chose for the select, if any.
+  IndexLookup lookup;
+  uint32_t num_exprs;
+  Expr exprs[STATEMENT_MAX_EXPRS];
+  uint32_t num_params;
+  Param params[STATEMENT_MAX_PARAMS];
+  // create table: the new table and how its rows are stored.
+  TableSchema create_schema;
+  RecordFormat create_format;
+  // create index: the new index and the column of table it covers.
+  char create_index_name[SCHEMA_NAME_SIZE + 1];
+  uint32_t create_index_column;
+  // Private copy of the statement text for prepared statements, which
+  // string literals point into. NULL when parsed in place.
+  char *sql;
+  Database *db;
+  StatementOwner owner;
+  // Execution state between steps. cursor is NULL until a select's first
+  // step; executor runs its operators and row is the row it last produced.
+  Cursor *cursor;
+  Executor *executor;
+  bool done;
+  RowView row;
+  // When the first step was taken, 0 before it, and the rows stepped out
+  // since; both are recorded once, as the statement finishes or stops.
+  uint64_t execute_start;
+  uint64_t rows_returned;
+};
+
+typedef struct PlanCache PlanCache;
+
+#define CATALOG_MAX_TABLES 16
+#define CATALOG_MAX_INDEXES 16
+
+struct Database
+{
+  // tables[0] is the built-in users table; the rest come from the catalog.
+  CatalogTable tables[CATALOG_MAX_TABLES];
+  uint32_t num_tables;
+  CatalogIndex indexes[CATALOG_MAX_INDEXES];
+  uint32_t num_indexes;
+  char *catalog_path;
+  // The catalog on disk says the database was closed cleanly, and still
+  // holds, until the first change; see the catalog.
+  bool clean;
+  PlanCache *plan_cache;
+  // Holds text the plan cache could not take, until the next prepare.
+  Statement scratch;
+  bool scratch_in_use;
+  // Threads a select may scan with, and the pool of them, started by the
+  // first parallel scan.
+  uint32_t scan_threads;
+  ScanPool *scan_pool;
+  // Bytes of rows a select's sort may hold before it spills them to disk.
+  size_t sort_memory;
+  // Whether tables keep a hash of their keys, from SQLITE_OPEN_HASH_KEYS.
+  bool hash_keys;
+  // Between sqlite_begin and sqlite_commit, inserts leave their changes
+  // for sqlite_commit to commit.
+  bool in_transaction;
+  // A snapshot reader's own pager, which its tables read through; NULL
+  // for the writer.
+  Pager *reader;
+};
+
+
+typedef enum
+{
+  TOKEN_END,
+  TOKEN_ERROR,
+  TOKEN_WORD,    // identifier or keyword, or a bare value after "insert N"
+  TOKEN_INTEGER, // unsigned decimal literal
+  TOKEN_STRING,  // 'quoted', with '' standing for a single quote
+  TOKEN_COMMA,
+  TOKEN_LPAREN,
+  TOKEN_RPAREN,
+  TOKEN_STAR,
+  TOKEN_MINUS,
+  TOKEN_SEMICOLON,
+  TOKEN_QUESTION, // parameter placeholder
+  TOKEN_COMPARE
+} TokenType;
+
+typedef struct
+{
+  TokenType type;
+  const char *start;
+  uint32_t length;
+  uint32_t integer; // TOKEN_INTEGER value
+  bool overflow;    // TOKEN_INTEGER did not fit in 32 bits
+  bool escaped;     // TOKEN_STRING still contains doubled quotes
+  CompareOp op;     // TOKEN_COMPARE operator
+} Token;
+
+/*
+Single pass over the statement text with one token of lookahead. Quoted
+strings are unescaped in place, so every token is a span of the input
+buffer and nothing is copied until a value is stored in a Row.
+*/
+typedef struct
+{
+  char *pos;
+  bool unescape; // false leaves string tokens raw so the text is unchanged
+  Token current;
+} Lexer;
+
+bool is_word_char(char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+bool is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+void lexer_skip_space(Lexer *lexer)
+{
+  while (is_space(*lexer->pos))
+  {
+    lexer->pos++;
+  }
+}
+
+void lex_string(Lexer *lexer)
+{
+  Token *token = &lexer->current;
+  char *in = lexer->pos + 1;
+  char *out = in;
+  token->start = in;
+  token->escaped = false;
+  while (true)
+  {
+    if (*in == '\0')
+    {
+      token->type = TOKEN_ERROR;
+      lexer->pos = in;
+      return;
+    }
+    if (*in == '\'')
+    {
+      if (in[1] != '\'')
+      {
+        break;
+      }
+      if (!lexer->unescape)
+      {
+        token->escaped = true;
+        in += 2;
+        out += 2;
+        continue;
+      }
+      in++;
+    }
+    if (lexer->unescape)
+    {
+      *out = *in;
+    }
+    out++;
+    in++;
+  }
+  token->type = TOKEN_STRING;
+  token->length = out - token->start;
+  lexer->pos = in + 1;
+}
+
+void lex_integer(Lexer *lexer)
+{
+  Token *token = &lexer->current;
+  uint64_t value = 0;
+  token->type = TOKEN_INTEGER;
+  token->start = lexer->pos;
+  token->overflow = false;
+  while (*lexer->pos >= '0' && *lexer->pos <= '9')
+  {
+    value = value * 10 + (*lexer->pos - '0');
+    if (value > UINT32_MAX)
+    {
+      token->overflow = true;
+      value = UINT32_MAX;
+    }
+    lexer->pos++;
+  }
+  // "12abc" is one malformed word, not a number followed by a word.
+  if (is_word_char(*lexer->pos))
+  {
+    token->type = TOKEN_ERROR;
+  }
+  token->integer = (uint32_t)value;
+  token->length = lexer->pos - token->start;
+}
+
+void lexer_next(Lexer *lexer)
+{
+  lexer_skip_space(lexer);
+  Token *token = &lexer->current;
+  char c = *lexer->pos;
+  token->start = lexer->pos;
+  token->length = 1;
+
+  if (c == '\0')
+  {
+    token->type = TOKEN_END;
+    token->length = 0;
+    return;
+  }
+  if (c >= '0' && c <= '9')
+  {
+    lex_integer(lexer);
+    return;
+  }
+  if (is_word_char(c))
+  {
+    while (is_word_char(*lexer->pos))
+    {
+      lexer->pos++;
+    }
+    token->type = TOKEN_WORD;
+    token->length = lexer->pos - token->start;
+    return;
+  }
+  if (c == '\'')
+  {
+    lex_string(lexer);
+    return;
+  }
+
+  lexer->pos++;
+  char next = *lexer->pos;
+  switch (c)
+  {
+  case ',':
+    token->type = TOKEN_COMMA;
+    return;
+  case '(':
+    token->type = TOKEN_LPAREN;
+    return;
+  case ')':
+    token->type = TOKEN_RPAREN;
+    return;
+  case '*':
+    token->type = TOKEN_STAR;
+    return;
+  case '-':
+    token->type = TOKEN_MINUS;
+    return;
+  case ';':
+    token->type = TOKEN_SEMICOLON;
+    return;
+  case '?':
+    token->type = TOKEN_QUESTION;
+    return;
+  case '=':
+    token->type = TOKEN_COMPARE;
+    token->op = COMPARE_EQ;
+    return;
+  case '!':
+    if (next == '=')
+    {
+      lexer->pos++;
+      token->type = TOKEN_COMPARE;
+      token->op = COMPARE_NE;
+      token->length = 2;
+      return;
+    }
+    break;
+  case '<':
+    token->type = TOKEN_COMPARE;
+    token->op = COMPARE_LT;
+    if (next == '=' || next == '>')
+    {
+      lexer->pos++;
+      token->op = next == '=' ? COMPARE_LE : COMPARE_NE;
+      token->length = 2;
+    }
+    return;
+  case '>':
+    token->type = TOKEN_COMPARE;
+    token->op = COMPARE_GT;
+    if (next == '=')
+    {
+      lexer->pos++;
+      token->op = COMPARE_GE;
+      token->length = 2;
+    }
+    return;
+  }
+  token->type = TOKEN_ERROR;
+}
+
+// Lex a whitespace-delimited value as a word, as in "insert 1 user a@b.c".
+void lexer_next_bare_value(Lexer *lexer)
+{
+  lexer_skip_space(lexer);
+  if (*lexer->pos == '\'')
+  {
+    lex_string(lexer);
+    return;
+  }
+  Token *token = &lexer->current;
+  token->start = lexer->pos;
+  while (*lexer->pos != '\0' && !is_space(*lexer->pos))
+  {
+    lexer->pos++;
+  }
+  token->length = lexer->pos - token->start;
+  token->type = token->length == 0 ? TOKEN_END : TOKEN_WORD;
+}
+
+typedef struct
+{
+  Lexer lexer;
+  Database *db;
+  Statement *statement;
+  PrepareResult error;
+  bool auto_params; // turn every literal into a parameter
+} Parser;
+
+bool token_is_keyword(const Token *token, const char *keyword)
+{
+  return token->type == TOKEN_WORD && strlen(keyword) == token->length &&
+         strncasecmp(token->start, keyword, token->length) == 0;
+}
+
+bool parser_fail(Parser *parser, PrepareResult error)
+{
+  if (parser->error == PREPARE_SUCCESS)
+  {
+    parser->error = error;
+  }
+  return false;
+}
+
+bool accept_keyword(Parser *parser, const char *keyword)
+{
+  if (token_is_keyword(&parser->lexer.current, keyword))
+  {
+    lexer_next(&parser->lexer);
+    return true;
+  }
+  return false;
+}
+
+bool accept(Parser *parser, TokenType type)
+{
+  if (parser->lexer.current.type == type)
+  {
+    lexer_next(&parser->lexer);
+    return true;
+  }
+  return false;
+}
+
+bool expect_keyword(Parser *parser, const char *keyword)
+{
+  return accept_keyword(parser, keyword) || parser_fail(parser, PREPARE_SYNTAX_ERROR);
+}
+
+bool expect(Parser *parser, TokenType type)
+{
+  return accept(parser, type) || parser_fail(parser, PREPARE_SYNTAX_ERROR);
+}
+
+// Resolve a column name of the statement's table.
+bool resolve_column(Parser *parser, const char *name, uint32_t length, uint32_t *column)
+{
+  int32_t index = schema_find_column(&parser->statement->table->schema, name, length);
+  if (index < 0)
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  *column = index;
+  return true;
+}
+
+bool parse_column_name(Parser *parser, uint32_t *column)
+{
+  Token *token = &parser->lexer.current;
+  if (token->type != TOKEN_WORD || !resolve_column(parser, token->start, token->length, column))
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  lexer_next(&parser->lexer);
+  return true;
+}
+
+CatalogTable *find_table(Database *db, const char *name, uint32_t length)
+{
+  for (uint32_t i = 0; i < db->num_tables; i++)
+  {
+    const char *table_name = db->tables[i].schema.name;
+    if (strlen(table_name) == length && strncasecmp(table_name, name, length) == 0)
+    {
+      return &db->tables[i];
+    }
+  }
+  return NULL;
+}
+
+bool parse_table_name(Parser *parser)
+{
+  Token *token = &parser->lexer.current;
+  if (token->type != TOKEN_WORD)
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  parser->statement->table = find_table(parser->db, token->start, token->length);
+  if (parser->statement->table == NULL)
+  {
+    return parser_fail(parser, PREPARE_UNKNOWN_TABLE);
+  }
+  lexer_next(&parser->lexer);
+  return true;
+}
+
+// Register a parameter. Placeholders always get one; literals do too when
+// the parser is building a cached plan whose literals are re-bound per use.
+bool add_param(Parser *parser, ParamTarget target, int32_t expr, uint32_t column, bool is_integer)
+{
+  Statement *statement = parser->statement;
+  if (statement->num_params >= STATEMENT_MAX_PARAMS)
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  Param *param = &statement->params[statement->num_params++];
+  param->target = target;
+  param->expr = expr;
+  param->row = statement->num_rows - 1;
+  param->column = column;
+  param->is_integer = is_integer;
+  param->bound = false;
+  return true;
+}
+
+bool parse_integer_value(Parser *parser, uint32_t column, char *record)
+{
+  Token *token = &parser->lexer.current;
+  if (token->type == TOKEN_MINUS)
+  {
+    return parser_fail(parser, PREPARE_NEGATIVE_ID);
+  }
+  if (token->type == TOKEN_QUESTION || (token->type == TOKEN_INTEGER && parser->auto_params))
+  {
+    if (!add_param(parser, PARAM_TARGET_COLUMN, EXPR_NONE, column, true))
+    {
+      return false;
+    }
+  }
+  else if (token->type != TOKEN_INTEGER || token->overflow)
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  schema_write_int(&parser->statement->table->schema, record, column, token->integer);
+  lexer_next(&parser->lexer);
+  return true;
+}
+
+// Copy a string token into a fixed-width column, rejecting values that do
+// not fit rather than overflowing into the next field.
+bool store_string(Parser *parser, const Token *token, uint32_t column, char *record)
+{
+  if (token->type != TOKEN_STRING && token->type != TOKEN_WORD && token->type != TOKEN_INTEGER &&
+      token->type != TOKEN_QUESTION)
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  bool placeholder = token->type == TOKEN_QUESTION ||
+                     (token->type == TOKEN_WORD && token->length == 1 && token->start[0] == '?');
+  if (placeholder || parser->auto_params)
+  {
+    return add_param(parser, PARAM_TARGET_COLUMN, EXPR_NONE, column, false);
+  }
+  const ColumnDef *def = &parser->statement->table->schema.columns[column];
+  if (token->length > def->size)
+  {
+    return parser_fail(parser, PREPARE_STRING_TOO_LONG);
+  }
+  memset(record + def->offset, 0, def->size);
+  memcpy(record + def->offset, token->start, token->length);
+  return true;
+}
+
+bool parse_string_value(Parser *parser, uint32_t column, char *record)
+{
+  TokenType type = parser->lexer.current.type;
+  if (type != TOKEN_STRING && type != TOKEN_QUESTION)
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  if (!store_string(parser, &parser->lexer.current, column, record))
+  {
+    return false;
+  }
+  lexer_next(&parser->lexer);
+  return true;
+}
+
+// Start a new, zeroed insert row, moving the rows to the heap once there
+// is more than one.
+char *statement_add_row(Statement *statement)
+{
+  uint32_t row_size = statement->table->schema.row_size;
+  if (statement->num_rows == statement->rows_capacity)
+  {
+    uint32_t capacity = statement->rows_capacity * 2;
+    char *records = (char *)malloc((size_t)capacity * row_size);
+    memcpy(records, statement->records, (size_t)statement->num_rows * row_size);
+    if (statement->records != statement->record_to_insert)
+    {
+      free(statement->records);
+    }
+    statement->records = records;
+    statement->rows_capacity = capacity;
+  }
+  char *record = statement->records + (size_t)statement->num_rows++ * row_size;
+  memset(record, 0, row_size);
+  return record;
+}
+
+// Abandon a select that is part way through its rows.
+void batch_release(Batch *batch)
+{
+  if (batch->pinned)
+  {
+    leaf_release(&batch->leaf);
+    batch->pinned = false;
+  }
+  batch->records = NULL;
+  batch->num_rows = 0;
+}
+
+// Defined with the sort, below.
+void sort_spill_close(SortSpill *spill);
+
+void statement_stop(Statement *statement)
+{
+  if (statement->cursor != NULL)
+  {
+    free(statement->cursor);
+    statement->cursor = NULL;
+    if (statement->executor != NULL)
+    {
+      batch_release(&statement->executor->batch);
+      free(statement->executor->sorted);
+      sort_spill_close(statement->executor->spill);
+      free(statement->executor->leaves);
+      free(statement->executor);
+      statement->executor = NULL;
+    }
+    free(statement->parallel);
+    statement->parallel = NULL;
+    pager_advise(statement->table->table->pager, PAGER_ACCESS_NORMAL);
+    pager_end_read(statement->table->table->pager);
+  }
+  statement->done = false;
+}
+
+// Free what the parser allocated beyond the Statement itself.
+void statement_release(Statement *statement)
+{
+  statement_stop(statement);
+  free(statement->sql);
+  statement->sql = NULL;
+  if (statement->records != statement->record_to_insert)
+  {
+    free(statement->records);
+  }
+  statement->records = statement->record_to_insert;
+  statement->num_rows = 0;
+  statement->rows_capacity = 1;
+}
+
+// One value per column of the table, in schema order.
+bool parse_values_row(Parser *parser)
+{
+  const TableSchema *schema = &parser->statement->table->schema;
+  char *record = statement_add_row(parser->statement);
+  if (!expect(parser, TOKEN_LPAREN))
+  {
+    return false;
+  }
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    if (i > 0 && !expect(parser, TOKEN_COMMA))
+    {
+      return false;
+    }
+    bool parsed = schema->columns[i].type == COLUMN_TYPE_INTEGER ? parse_integer_value(parser, i, record)
+                                                                 : parse_string_value(parser, i, record);
+    if (!parsed)
+    {
+      return false;
+    }
+  }
+  return expect(parser, TOKEN_RPAREN);
+}
+
+/*
+insert <id> <username> <email>
+insert into <table> values (<value>, ...) [, (...)]*
+
+The shorthand form always targets users.
+*/
+bool parse_insert(Parser *parser)
+{
+  Statement *statement = parser->statement;
+  statement->type = STATEMENT_INSERT;
+
+  Token *token = &parser->lexer.current;
+  if (token->type == TOKEN_MINUS)
+  {
+    return parser_fail(parser, PREPARE_NEGATIVE_ID);
+  }
+  if (token->type == TOKEN_INTEGER || token->type == TOKEN_QUESTION)
+  {
+    if (token->type == TOKEN_INTEGER && token->overflow)
+    {
+      return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    }
+    statement->table = &parser->db->tables[0];
+    char *record = statement_add_row(statement);
+    if ((token->type == TOKEN_QUESTION || parser->auto_params) &&
+        !add_param(parser, PARAM_TARGET_COLUMN, EXPR_NONE, 0, true))
+    {
+      return false;
+    }
+    schema_write_int(&statement->table->schema, record, 0, token->integer);
+    // The shorthand form takes its two strings as bare words, lexed from
+    // just past the id.
+    Lexer *lexer = &parser->lexer;
+    lexer_next_bare_value(lexer);
+    if (!store_string(parser, token, 1, record))
+    {
+      return false;
+    }
+    lexer_next_bare_value(lexer);
+    if (!store_string(parser, token, 2, record))
+    {
+      return false;
+    }
+    lexer_next(lexer);
+    return true;
+  }
+
+  if (!expect_keyword(parser, "into") || !parse_table_name(parser) || !expect_keyword(parser, "values") ||
+      !parse_values_row(parser))
+  {
+    return false;
+  }
+  while (accept(parser, TOKEN_COMMA))
+  {
+    if (!parse_values_row(parser))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+int32_t new_expr(Parser *parser, ExprType type)
+{
+  Statement *statement = parser->statement;
+  if (statement->num_exprs >= STATEMENT_MAX_EXPRS)
+  {
+    parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    return EXPR_NONE;
+  }
+  int32_t index = statement->num_exprs++;
+  Expr *expr = &statement->exprs[index];
+  memset(expr, 0, sizeof(Expr));
+  expr->type = type;
+  expr->left = EXPR_NONE;
+  expr->right = EXPR_NONE;
+  return index;
+}
+
+int32_t parse_or(Parser *parser);
+
+// operand := column | integer | string | '?' | '(' or_expr ')'
+int32_t parse_operand(Parser *parser)
+{
+  Token *token = &parser->lexer.current;
+  int32_t index;
+  switch (token->type)
+  {
+  case TOKEN_LPAREN:
+    lexer_next(&parser->lexer);
+    index = parse_or(parser);
+    if (index == EXPR_NONE || !expect(parser, TOKEN_RPAREN))
+    {
+      return EXPR_NONE;
+    }
+    return index;
+  case TOKEN_INTEGER:
+    if (token->overflow)
+    {
+      parser_fail(parser, PREPARE_SYNTAX_ERROR);
+      return EXPR_NONE;
+    }
+    index = new_expr(parser, EXPR_INTEGER);
+    if (index == EXPR_NONE || (parser->auto_params && !add_param(parser, PARAM_TARGET_EXPR, index, 0, true)))
+    {
+      return EXPR_NONE;
+    }
+    parser->statement->exprs[index].integer = token->integer;
+    lexer_next(&parser->lexer);
+    return index;
+  case TOKEN_STRING:
+    index = new_expr(parser, EXPR_STRING);
+    if (index == EXPR_NONE || (parser->auto_params && !add_param(parser, PARAM_TARGET_EXPR, index, 0, false)))
+    {
+      return EXPR_NONE;
+    }
+    parser->statement->exprs[index].string = token->start;
+    parser->statement->exprs[index].length = token->length;
+    lexer_next(&parser->lexer);
+    return index;
+  case TOKEN_QUESTION:
+    // Typed once the other side of the comparison is known.
+    index = new_expr(parser, EXPR_PARAM);
+    if (index == EXPR_NONE || !add_param(parser, PARAM_TARGET_EXPR, index, 0, false))
+    {
+      return EXPR_NONE;
+    }
+    parser->statement->exprs[index].integer = parser->statement->num_params - 1;
+    lexer_next(&parser->lexer);
+    return index;
+  case TOKEN_WORD:
+    index = new_expr(parser, EXPR_COLUMN);
+    if (index != EXPR_NONE && !parse_column_name(parser, &parser->statement->exprs[index].column))
+    {
+      return EXPR_NONE;
+    }
+    return index;
+  case TOKEN_MINUS:
+    parser_fail(parser, PREPARE_NEGATIVE_ID);
+    return EXPR_NONE;
+  default:
+    parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    return EXPR_NONE;
+  }
+}
+
+// True when the operand yields an integer, false for a string. Nested
+// boolean expressions are not values.
+bool expr_is_integer(const Statement *statement, const Expr *expr)
+{
+  return expr->type == EXPR_INTEGER ||
+         (expr->type == EXPR_COLUMN &&
+          statement->table->schema.columns[expr->column].type == COLUMN_TYPE_INTEGER);
+}
+
+bool expr_is_value(const Expr *expr)
+{
+  return expr->type == EXPR_COLUMN || expr->type == EXPR_INTEGER || expr->type == EXPR_STRING ||
+         expr->type == EXPR_PARAM;
+}
+
+// Give a placeholder the type of the value it is compared with.
+void resolve_param_type(Statement *statement, Expr *param_expr, bool is_integer)
+{
+  Param *param = &statement->params[param_expr->integer];
+  param->is_integer = is_integer;
+  param_expr->type = is_integer ? EXPR_INTEGER : EXPR_STRING;
+  param_expr->integer = 0;
+}
+
+// comparison := operand [op operand]; op is a symbol or "like"
+int32_t parse_comparison(Parser *parser)
+{
+  int32_t left = parse_operand(parser);
+  if (left == EXPR_NONE)
+  {
+    return EXPR_NONE;
+  }
+  Token *token = &parser->lexer.current;
+  bool like = token_is_keyword(token, "like");
+  if (token->type != TOKEN_COMPARE && !like)
+  {
+    // A bare value is not a predicate; only parenthesized conditions are.
+    if (expr_is_value(&parser->statement->exprs[left]))
+    {
+      parser_fail(parser, PREPARE_SYNTAX_ERROR);
+      return EXPR_NONE;
+    }
+    return left;
+  }
+  CompareOp op = like ? COMPARE_LIKE : token->op;
+  lexer_next(&parser->lexer);
+  int32_t right = parse_operand(parser);
+  if (right == EXPR_NONE)
+  {
+    return EXPR_NONE;
+  }
+
+  Statement *statement = parser->statement;
+  Expr *lhs = &statement->exprs[left];
+  Expr *rhs = &statement->exprs[right];
+  if (!expr_is_value(lhs) || !expr_is_value(rhs) || (lhs->type == EXPR_PARAM && rhs->type == EXPR_PARAM))
+  {
+    parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    return EXPR_NONE;
+  }
+  if (lhs->type == EXPR_PARAM)
+  {
+    resolve_param_type(statement, lhs, expr_is_integer(statement, rhs));
+  }
+  if (rhs->type == EXPR_PARAM)
+  {
+    resolve_param_type(statement, rhs, expr_is_integer(statement, lhs));
+  }
+  if (expr_is_integer(statement, lhs) != expr_is_integer(statement, rhs) ||
+      (op == COMPARE_LIKE && expr_is_integer(statement, lhs)))
+  {
+    parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    return EXPR_NONE;
+  }
+
+  int32_t index = new_expr(parser, EXPR_COMPARE);
+  if (index != EXPR_NONE)
+  {
+    Expr *expr = &statement->exprs[index];
+    expr->op = op;
+    expr->left = left;
+    expr->right = right;
+  }
+  return index;
+}
+
+// and_expr := comparison {and comparison}
+int32_t parse_and(Parser *parser)
+{
+  int32_t left = parse_comparison(parser);
+  while (left != EXPR_NONE && accept_keyword(parser, "and"))
+  {
+    int32_t right = parse_comparison(parser);
+    if (right == EXPR_NONE)
+    {
+      return EXPR_NONE;
+    }
+    int32_t index = new_expr(parser, EXPR_AND);
+    if (index != EXPR_NONE)
+    {
+      parser->statement->exprs[index].left = left;
+      parser->statement->exprs[index].right = right;
+    }
+    left = index;
+  }
+  return left;
+}
+
+// or_expr := and_expr {or and_expr}
+int32_t parse_or(Parser *parser)
+{
+  int32_t left = parse_and(parser);
+  while (left != EXPR_NONE && accept_keyword(parser, "or"))
+  {
+    int32_t right = parse_and(parser);
+    if (right == EXPR_NONE)
+    {
+      return EXPR_NONE;
+    }
+    int32_t index = new_expr(parser, EXPR_OR);
+    if (index != EXPR_NONE)
+    {
+      parser->statement->exprs[index].left = left;
+      parser->statement->exprs[index].right = right;
+    }
+    left = index;
+  }
+  return left;
+}
+
+CompareOp flip_compare(CompareOp op)
+{
+  switch (op)
+  {
+  case COMPARE_LT:
+    return COMPARE_GT;
+  case COMPARE_LE:
+    return COMPARE_GE;
+  case COMPARE_GT:
+    return COMPARE_LT;
+  case COMPARE_GE:
+    return COMPARE_LE;
+  default:
+    return op;
+  }
+}
+
+// Applies "key <op> N" to the range. Returns false for operators that do
+// not describe a contiguous range of ids.
+bool add_key_bound(KeyRange *range, CompareOp op, uint32_t value)
+{
+  bool lower = false, upper = false, inclusive = false;
+  switch (op)
+  {
+  case COMPARE_EQ:
+    lower = upper = inclusive = true;
+    break;
+  case COMPARE_GT:
+    lower = true;
+    break;
+  case COMPARE_GE:
+    lower = inclusive = true;
+    break;
+  case COMPARE_LT:
+    upper = true;
+    break;
+  case COMPARE_LE:
+    upper = inclusive = true;
+    break;
+  case COMPARE_NE:
+  case COMPARE_LIKE:
+    return false;
+  }
+
+  // Intersect with any bound already present, keeping the tighter one.
+  if (lower && (!range->has_lower || value > range->lower ||
+                (value == range->lower && !inclusive)))
+  {
+    range->has_lower = true;
+    range->lower = value;
+    range->lower_inclusive = inclusive;
+  }
+  if (upper && (!range->has_upper || value < range->upper ||
+                (value == range->upper && !inclusive)))
+  {
+    range->has_upper = true;
+    range->upper = value;
+    range->upper_inclusive = inclusive;
+  }
+  return true;
+}
+
+/*
+Narrow the range with every "key <op> N" found in the top-level conjunction.
+Returns true when the whole expression was absorbed, so rows inside the
+range need no further filtering.
+*/
+bool extract_key_range(Statement *statement, int32_t index, KeyRange *range)
+{
+  Expr *expr = &statement->exprs[index];
+  if (expr->type == EXPR_AND)
+  {
+    bool left = extract_key_range(statement, expr->left, range);
+    bool right = extract_key_range(statement, expr->right, range);
+    return left && right;
+  }
+  if (expr->type != EXPR_COMPARE)
+  {
+    return false;
+  }
+  Expr *lhs = &statement->exprs[expr->left];
+  Expr *rhs = &statement->exprs[expr->right];
+  if (lhs->type == EXPR_COLUMN && lhs->column == 0 && rhs->type == EXPR_INTEGER)
+  {
+    return add_key_bound(range, expr->op, rhs->integer);
+  }
+  if (rhs->type == EXPR_COLUMN && rhs->column == 0 && lhs->type == EXPR_INTEGER)
+  {
+    return add_key_bound(range, flip_compare(expr->op), lhs->integer);
+  }
+  return false;
+}
+
+// count '(' '*' ')' | {min | max | sum} '(' column ')', from just past
+// the '('. The column is named in *column until the table is known.
+bool parse_aggregate(Parser *parser, const Token *function, Token *column)
+{
+  Statement *statement = parser->statement;
+  Token *token = &parser->lexer.current;
+  if (token_is_keyword(function, "count"))
+  {
+    statement->aggregate = AGGREGATE_COUNT;
+    return expect(parser, TOKEN_STAR) && expect(parser, TOKEN_RPAREN);
+  }
+  if (token_is_keyword(function, "min"))
+    statement->aggregate = AGGREGATE_MIN;
+  else if (token_is_keyword(function, "max"))
+    statement->aggregate = AGGREGATE_MAX;
+  else if (token_is_keyword(function, "sum"))
+    statement->aggregate = AGGREGATE_SUM;
+  else
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  if (token->type != TOKEN_WORD)
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  *column = *token;
+  lexer_next(&parser->lexer);
+  return expect(parser, TOKEN_RPAREN);
+}
+
+// The row count of a limit or offset: integer | '?'
+bool parse_row_count(Parser *parser, ParamTarget target, uint32_t *count)
+{
+  Token *token = &parser->lexer.current;
+  *count = 0;
+  if (token->type == TOKEN_QUESTION || (token->type == TOKEN_INTEGER && parser->auto_params))
+  {
+    if (!add_param(parser, target, EXPR_NONE, 0, true))
+    {
+      return false;
+    }
+  }
+  else if (token->type != TOKEN_INTEGER || token->overflow)
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  if (token->type == TOKEN_INTEGER)
+  {
+    *count = token->integer;
+  }
+  lexer_next(&parser->lexer);
+  return true;
+}
+
+/*
+select [* | column {, column} | aggregate] [from <table>] [where or_expr]
+       [order by column [asc | desc]] [limit n] [offset m]
+
+Without a from clause the table is users. Column names are resolved once
+the table is known. An aggregate is count(*), or min, max or sum of an
+integer column; all but count produce no row from no rows. A select has
+at most one aggregate and no columns beside it, and min or max of a text
+column is a syntax error. Without an order by, rows follow the access
+path: key order from a scan of the table, but the order of the indexed
+values, and of keys among equal ones, when the planner reads them
+through an index. Rows of equal order value keep the order they would
+have had without it. The offset leaves out that many rows from the
+start, before the limit counts any.
+*/
+bool parse_select(Parser *parser)
+{
+  Statement *statement = parser->statement;
+  statement->type = STATEMENT_SELECT;
+  statement->table = &parser->db->tables[0];
+  statement->where = EXPR_NONE;
+  statement->where_is_range = true;
+  statement->aggregate = AGGREGATE_NONE;
+  statement->has_order = false;
+  statement->has_limit = false;
+  statement->offset = 0;
+  memset(&statement->range, 0, sizeof(KeyRange));
+
+  Token *token = &parser->lexer.current;
+  Token names[STATEMENT_MAX_COLUMNS];
+  uint32_t num_names = 0;
+  Token aggregate_column;
+  bool all_columns = accept(parser, TOKEN_STAR) || token->type == TOKEN_END || token_is_keyword(token, "from") ||
+                     token_is_keyword(token, "where") || token_is_keyword(token, "order") ||
+                     token_is_keyword(token, "limit") || token_is_keyword(token, "offset");
+  if (!all_columns)
+  {
+    do
+    {
+      if (num_names >= STATEMENT_MAX_COLUMNS || token->type != TOKEN_WORD)
+      {
+        return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+      }
+      names[num_names++] = *token;
+      lexer_next(&parser->lexer);
+      if (num_names == 1 && accept(parser, TOKEN_LPAREN))
+      {
+        if (!parse_aggregate(parser, &names[0], &aggregate_column))
+        {
+          return false;
+        }
+        break;
+      }
+    } while (accept(parser, TOKEN_COMMA));
+  }
+
+  if (accept_keyword(parser, "from") && !parse_table_name(parser))
+  {
+    return false;
+  }
+
+  const TableSchema *schema = &statement->table->schema;
+  if (statement->aggregate != AGGREGATE_NONE)
+  {
+    statement->num_columns = 1;
+    statement->columns[0] = 0;
+    if (statement->aggregate != AGGREGATE_COUNT &&
+        (!resolve_column(parser, aggregate_column.start, aggregate_column.length, &statement->aggregate_column) ||
+         schema->columns[statement->aggregate_column].type != COLUMN_TYPE_INTEGER))
+    {
+      return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    }
+  }
+  else if (all_columns)
+  {
+    statement->num_columns = schema->num_columns;
+    for (uint32_t i = 0; i < schema->num_columns; i++)
+    {
+      statement->columns[i] = i;
+    }
+  }
+  else
+  {
+    statement->num_columns = num_names;
+    for (uint32_t i = 0; i < num_names; i++)
+    {
+      if (!resolve_column(parser, names[i].start, names[i].length, &statement->columns[i]))
+      {
+        return false;
+      }
+    }
+  }
+
+  if (accept_keyword(parser, "where"))
+  {
+    statement->where = parse_or(parser);
+    if (statement->where == EXPR_NONE)
+    {
+      return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    }
+  }
+  if (accept_keyword(parser, "order"))
+  {
+    if (!expect_keyword(parser, "by") || !parse_column_name(parser, &statement->order_column))
+    {
+      return false;
+    }
+    statement->has_order = true;
+    statement->order_descending = accept_keyword(parser, "desc");
+    if (!statement->order_descending)
+    {
+      accept_keyword(parser, "asc");
+    }
+  }
+  if (accept_keyword(parser, "limit"))
+  {
+    statement->has_limit = true;
+    if (!parse_row_count(parser, PARAM_TARGET_LIMIT, &statement->limit))
+    {
+      return false;
+    }
+  }
+  return !accept_keyword(parser, "offset") || parse_row_count(parser, PARAM_TARGET_OFFSET, &statement->offset);
+}
+
+// type := integer | int | text '(' size ')' | varchar '(' size ')'
+bool parse_column_type(Parser *parser, ColumnType *type, uint32_t *size)
+{
+  if (accept_keyword(parser, "integer") || accept_keyword(parser, "int"))
+  {
+    *type = COLUMN_TYPE_INTEGER;
+    *size = sizeof(uint32_t);
+    return true;
+  }
+  if (!accept_keyword(parser, "text") && !accept_keyword(parser, "varchar"))
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  Token *token = &parser->lexer.current;
+  if (!expect(parser, TOKEN_LPAREN) || token->type != TOKEN_INTEGER || token->overflow)
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  *type = COLUMN_TYPE_TEXT;
+  *size = token->integer;
+  lexer_next(&parser->lexer);
+  if (*size == 0)
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  if (*size > SCHEMA_MAX_TEXT_SIZE)
+  {
+    return parser_fail(parser, PREPARE_ROW_TOO_LARGE);
+  }
+  return expect(parser, TOKEN_RPAREN);
+}
+
+/*
+create table <name> (<column> <type> {, <column> <type>}) [fixed | columnar]
+
+The first column must be an integer; it is the table's key. Rows are
+stored as variable records unless the table is declared fixed, which
+keeps every column at its full width for tables whose text is mostly full,
+or columnar, which stores each leaf column by column for scans that
+filter or aggregate a few columns.
+*/
+bool parse_create_table(Parser *parser)
+{
+  Statement *statement = parser->statement;
+  statement->type = STATEMENT_CREATE_TABLE;
+  statement->table = NULL;
+  TableSchema *schema = &statement->create_schema;
+
+  Token *token = &parser->lexer.current;
+  if (!expect_keyword(parser, "table"))
+  {
+    return false;
+  }
+  if (token->type != TOKEN_WORD || !schema_init(schema, token->start, token->length))
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  lexer_next(&parser->lexer);
+  if (!expect(parser, TOKEN_LPAREN))
+  {
+    return false;
+  }
+  do
+  {
+    if (token->type != TOKEN_WORD)
+    {
+      return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    }
+    Token name = *token;
+    lexer_next(&parser->lexer);
+    ColumnType type;
+    uint32_t size;
+    if (!parse_column_type(parser, &type, &size))
+    {
+      return false;
+    }
+    if (schema->row_size + size > SCHEMA_MAX_ROW_SIZE)
+    {
+      return parser_fail(parser, PREPARE_ROW_TOO_LARGE);
+    }
+    if (!schema_add_column(schema, name.start, name.length, type, size))
+    {
+      return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+    }
+  } while (accept(parser, TOKEN_COMMA));
+  if (!expect(parser, TOKEN_RPAREN))
+  {
+    return false;
+  }
+  if (accept_keyword(parser, "fixed"))
+    statement->create_format = RECORD_FIXED;
+  else if (accept_keyword(parser, "columnar"))
+    statement->create_format = RECORD_COLUMNAR;
+  else
+    statement->create_format = RECORD_VARIABLE;
+  return true;
+}
+
+/*
+create index <name> on <table> (<column>)
+
+Indexes cover one text column; the key is already ordered by the table's
+own tree.
+*/
+bool parse_create_index(Parser *parser)
+{
+  Statement *statement = parser->statement;
+  statement->type = STATEMENT_CREATE_INDEX;
+  statement->table = NULL;
+
+  Token *token = &parser->lexer.current;
+  if (token->type != TOKEN_WORD || token->length > SCHEMA_NAME_SIZE)
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  memcpy(statement->create_index_name, token->start, token->length);
+  statement->create_index_name[token->length] = '\0';
+  lexer_next(&parser->lexer);
+  if (!expect_keyword(parser, "on") || !parse_table_name(parser) || !expect(parser, TOKEN_LPAREN) ||
+      !parse_column_name(parser, &statement->create_index_column) || !expect(parser, TOKEN_RPAREN))
+  {
+    return false;
+  }
+  if (statement->table->schema.columns[statement->create_index_column].type != COLUMN_TYPE_TEXT)
+  {
+    return parser_fail(parser, PREPARE_SYNTAX_ERROR);
+  }
+  return true;
+}
+
+// Parse sql into statement. Literals point into sql, which must outlive the
+// statement; quoted strings are unescaped in place.
+PrepareResult prepare_text(Database *db, char *sql, Statement *statement, bool auto_params)
+{
+  Parser parser;
+  parser.db = db;
+  parser.lexer.pos = sql;
+  parser.lexer.unescape = true;
+  parser.statement = statement;
+  parser.error = PREPARE_SUCCESS;
+  parser.auto_params = auto_params;
+  statement->num_exprs = 0;
+  statement->num_params = 0;
+  statement->sql = NULL;
+  statement->table = NULL;
+  statement->records = statement->record_to_insert;
+  statement->num_rows = 0;
+  statement->rows_capacity = 1;
+  statement->cursor = NULL;
+  statement->executor = NULL;
+  statement->parallel = NULL;
+  statement->done = false;
+  statement->execute_start = 0;
+  statement->rows_returned = 0;
+  uint64_t start = stats_clock();
+  lexer_next(&parser.lexer);
+
+  bool parsed;
+  if (accept_keyword(&parser, "insert"))
+  {
+    parsed = parse_insert(&parser);
+  }
+  else if (accept_keyword(&parser, "select"))
+  {
+    parsed = parse_select(&parser);
+  }
+  else if (accept_keyword(&parser, "create"))
+  {
+    parsed = accept_keyword(&parser, "index") ? parse_create_index(&parser) : parse_create_table(&parser);
+  }
+  else
+  {
+    stats_time(STAT_PARSE, start);
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+  }
+
+  if (parsed)
+  {
+    accept(&parser, TOKEN_SEMICOLON);
+    if (parser.lexer.current.type != TOKEN_END)
+    {
+      parser_fail(&parser, PREPARE_SYNTAX_ERROR);
+    }
+  }
+  PrepareResult result = parser.error == PREPARE_SUCCESS && !parsed ? PREPARE_SYNTAX_ERROR : parser.error;
+  if (result != PREPARE_SUCCESS)
+  {
+    statement_release(statement);
+  }
+  stats_time(STAT_PARSE, start);
+  return result;
+}
+
+// Parse a private copy of sql, which the statement keeps for its literals
+// to point into and frees on release.
+PrepareResult prepare_copy(Database *db, const char *sql, Statement *statement, bool auto_params)
+{
+  char *text = strdup(sql);
+  PrepareResult result = prepare_text(db, text, statement, auto_params);
+  if (result != PREPARE_SUCCESS)
+  {
+    free(text);
+    return result;
+  }
+  statement->sql = text;
+  return PREPARE_SUCCESS;
+}
+
+void statement_finalize(Statement *statement)
+{
+  statement_release(statement);
+  free(statement);
+}
+
+// Forget every bound value so the statement can be bound and run again.
+void statement_reset(Statement *statement)
+{
+  statement_stop(statement);
+  for (uint32_t i = 0; i < statement->num_params; i++)
+  {
+    statement->params[i].bound = false;
+  }
+}
+
+BindResult statement_bind_int(Statement *statement, uint32_t index, uint32_t value)
+{
+  if (index >= statement->num_params)
+  {
+    return BIND_RANGE_ERROR;
+  }
+  Param *param = &statement->params[index];
+  if (!param->is_integer)
+  {
+    return BIND_TYPE_MISMATCH;
+  }
+  if (param->target == PARAM_TARGET_COLUMN)
+  {
+    const TableSchema *schema = &statement->table->schema;
+    schema_write_int(schema, statement->records + (size_t)param->row * schema->row_size, param->column, value);
+  }
+  else if (param->target == PARAM_TARGET_LIMIT)
+  {
+    statement->limit = value;
+  }
+  else if (param->target == PARAM_TARGET_OFFSET)
+  {
+    statement->offset = value;
+  }
+  else
+  {
+    statement->exprs[param->expr].integer = value;
+  }
+  param->bound = true;
+  return BIND_SUCCESS;
+}
+
+// Copy text into a column of size bytes, collapsing doubled quotes when the
+// text is still escaped. Returns false, leaving destination as it was, if
+// it does not fit.
+bool copy_text_value(char *destination, uint32_t size, const char *text, uint32_t length, bool escaped,
+                     uint32_t *copied)
+{
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < length; i++, n++)
+  {
+    if (escaped && text[i] == '\'')
+    {
+      i++;
+    }
+  }
+  if (n > size)
+  {
+    return false;
+  }
+  n = 0;
+  for (uint32_t i = 0; i < length; i++)
+  {
+    if (escaped && text[i] == '\'')
+    {
+      i++;
+    }
+    destination[n++] = text[i];
+  }
+  memset(destination + n, 0, size - n);
+  *copied = n;
+  return true;
+}
+
+BindResult bind_text(Statement *statement, uint32_t index, const char *text, uint32_t length, bool escaped)
+{
+  if (index >= statement->num_params)
+  {
+    return BIND_RANGE_ERROR;
+  }
+  Param *param = &statement->params[index];
+  if (param->is_integer)
+  {
+    return BIND_TYPE_MISMATCH;
+  }
+
+  // A value that does not fit leaves the statement as it was, bound to
+  // its earlier value if it had one.
+  uint32_t copied = 0;
+  if (param->target == PARAM_TARGET_COLUMN)
+  {
+    const TableSchema *schema = &statement->table->schema;
+    const ColumnDef *column = &schema->columns[param->column];
+    char *record = statement->records + (size_t)param->row * schema->row_size;
+    if (!copy_text_value(record + column->offset, column->size, text, length, escaped, &copied))
+    {
+      return BIND_STRING_TOO_LONG;
+    }
+  }
+  else
+  {
+    if (!copy_text_value(param->text, PARAM_TEXT_SIZE, text, length, escaped, &copied))
+    {
+      return BIND_STRING_TOO_LONG;
+    }
+    statement->exprs[param->expr].string = param->text;
+    statement->exprs[param->expr].length = copied;
+  }
+  param->bound = true;
+  return BIND_SUCCESS;
+}
+
+BindResult statement_bind_text(Statement *statement, uint32_t index, const char *text, uint32_t length)
+{
+  return bind_text(statement, index, text, length, false);
+}
+
+bool statement_is_bound(Statement *statement)
+{
+  for (uint32_t i = 0; i < statement->num_params; i++)
+  {
+    if (!statement->params[i].bound)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+Plan cache
+
+Statements are looked up by their shape: the text with keywords lowercased,
+whitespace collapsed and every literal replaced by a marker. On a hit the
+literals pulled out while normalizing are bound into the cached plan, so
+statements that differ only in their values are parsed once.
+*/
+#define PLAN_CACHE_ENTRIES 64
+#define PLAN_CACHE_KEY_SIZE 512
+
+typedef struct
+{
+  bool placeholder; // an explicit "?", left for the caller to bind
+  bool is_integer;
+  uint32_t integer;
+  const char *start;
+  uint32_t length;
+  bool escaped;
+} Literal;
+
+typedef struct
+{
+  uint64_t hash;
+  char *key;
+  uint32_t key_length;
+  Statement *statement;
+  uint64_t last_used;
+} PlanCacheEntry;
+
+struct PlanCache
+{
+  PlanCacheEntry entries[PLAN_CACHE_ENTRIES];
+  uint64_t clock;
+};
+
+PlanCache *new_plan_cache()
+{
+  PlanCache *cache = (PlanCache *)malloc(sizeof(PlanCache));
+  memset(cache, 0, sizeof(PlanCache));
+  return cache;
+}
+
+void free_plan_cache(PlanCache *cache)
+{
+  for (uint32_t i = 0; i < PLAN_CACHE_ENTRIES; i++)
+  {
+    if (cache->entries[i].statement != NULL)
+    {
+      statement_finalize(cache->entries[i].statement);
+      free(cache->entries[i].key);
+    }
+  }
+  free(cache);
+}
+
+bool key_append(char *key, uint32_t *key_length, const char *text, uint32_t length, bool lowercase)
+{
+  if (*key_length + length + 1 > PLAN_CACHE_KEY_SIZE)
+  {
+    return false;
+  }
+  for (uint32_t i = 0; i < length; i++)
+  {
+    char c = text[i];
+    key[(*key_length)++] = lowercase && c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+  }
+  key[(*key_length)++] = ' ';
+  return true;
+}
+
+bool add_literal(Literal *literals, uint32_t *num_literals, const Token *token, bool placeholder)
+{
+  if (*num_literals >= STATEMENT_MAX_PARAMS)
+  {
+    return false;
+  }
+  Literal *literal = &literals[(*num_literals)++];
+  literal->placeholder = placeholder;
+  literal->is_integer = token->type == TOKEN_INTEGER;
+  literal->integer = token->integer;
+  literal->start = token->start;
+  literal->length = token->length;
+  literal->escaped = token->type == TOKEN_STRING && token->escaped;
+  return true;
+}
+
+/*
+Build the cache key for sql, collecting its literals in the order the
+parser turns them into parameters. Walks the same tokens as the parser,
+including the bare values of "insert <id> <username> <email>". Returns
+false for text that cannot be cached, which is left to the parser to
+report.
+*/
+bool normalize_statement(const char *sql, char *key, uint32_t *key_length, Literal *literals, uint32_t *num_literals)
+{
+  Lexer lexer;
+  // Without unescaping the lexer only reads the text.
+  lexer.pos = (char *)sql;
+  lexer.unescape = false;
+  *key_length = 0;
+  *num_literals = 0;
+  lexer_next(&lexer);
+  bool shorthand_insert = token_is_keyword(&lexer.current, "insert");
+  uint32_t position = 0;
+
+  while (lexer.current.type != TOKEN_END)
+  {
+    Token *token = &lexer.current;
+    bool ok;
+    switch (token->type)
+    {
+    case TOKEN_ERROR:
+      return false;
+    case TOKEN_INTEGER:
+      ok = !token->overflow && add_literal(literals, num_literals, token, false) &&
+           key_append(key, key_length, "#", 1, false);
+      break;
+    case TOKEN_STRING:
+      ok = add_literal(literals, num_literals, token, false) && key_append(key, key_length, "'", 1, false);
+      break;
+    case TOKEN_QUESTION:
+      ok = add_literal(literals, num_literals, token, true) && key_append(key, key_length, "?", 1, false);
+      break;
+    case TOKEN_SEMICOLON:
+      ok = true;
+      break;
+    default:
+      ok = key_append(key, key_length, token->start, token->length, token->type == TOKEN_WORD);
+      break;
+    }
+    if (!ok)
+    {
+      return false;
+    }
+
+    position++;
+    if (position == 2 && shorthand_insert &&
+        (token->type == TOKEN_INTEGER || token->type == TOKEN_QUESTION))
+    {
+      for (int i = 0; i < 2; i++)
+      {
+        lexer_next_bare_value(&lexer);
+        token = &lexer.current;
+        if (token->type == TOKEN_END || token->type == TOKEN_ERROR)
+        {
+          return false;
+        }
+        bool placeholder = token->type == TOKEN_WORD && token->length == 1 && token->start[0] == '?';
+        if (!add_literal(literals, num_literals, token, placeholder) ||
+            !key_append(key, key_length, placeholder ? "?" : "'", 1, false))
+        {
+          return false;
+        }
+      }
+    }
+    lexer_next(&lexer);
+  }
+  return true;
+}
+
+uint64_t hash_bytes(const char *data, uint32_t length)
+{
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (uint32_t i = 0; i < length; i++)
+  {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+PrepareResult bind_literals(Statement *statement, const Literal *literals, uint32_t num_literals)
+{
+  statement_reset(statement);
+  for (uint32_t i = 0; i < num_literals && i < statement->num_params; i++)
+  {
+    const Literal *literal = &literals[i];
+    if (literal->placeholder)
+    {
+      continue;
+    }
+    BindResult result = literal->is_integer
+                            ? statement_bind_int(statement, i, literal->integer)
+                            : bind_text(statement, i, literal->start, literal->length, literal->escaped);
+    if (result == BIND_STRING_TOO_LONG)
+    {
+      return PREPARE_STRING_TOO_LONG;
+    }
+    if (result != BIND_SUCCESS)
+    {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  return PREPARE_SUCCESS;
+}
+
+// Stepped and not yet reset or finalized: a select part way through its
+// rows, or any statement that has finished.
+bool statement_in_use(const Statement *statement)
+{
+  return statement->cursor != NULL || statement->done;
+}
+
+// Parse sql without the cache, into scratch, or into a statement of the
+// caller's own when scratch is NULL.
+PrepareResult prepare_uncached(Database *db, const char *sql, Statement *scratch, Statement **out)
+{
+  if (scratch == NULL)
+  {
+    return sqlite_prepare(db, sql, out);
+  }
+  *out = scratch;
+  return prepare_copy(db, sql, scratch, false);
+}
+
+/*
+Find or build the plan for sql and bind its literals. *out points at a
+cached statement, valid until the next call unless it has been stepped
+since, and then until it is reset or finalized. It points at scratch when
+the text could not be cached and was parsed into it, or at a statement of
+the caller's own when scratch is NULL. A cached statement in use is
+neither handed out again nor evicted, so sql then gets scratch or a
+statement of its own.
+*/
+PrepareResult plan_cache_prepare(Database *db, PlanCache *cache, const char *sql, Statement *scratch,
+                                 Statement **out)
+{
+  char key[PLAN_CACHE_KEY_SIZE];
+  uint32_t key_length;
+  Literal literals[STATEMENT_MAX_PARAMS];
+  uint32_t num_literals;
+  if (!normalize_statement(sql, key, &key_length, literals, &num_literals))
+  {
+    return prepare_uncached(db, sql, scratch, out);
+  }
+
+  uint64_t hash = hash_bytes(key, key_length);
+  PlanCacheEntry *victim = NULL;
+  for (uint32_t i = 0; i < PLAN_CACHE_ENTRIES; i++)
+  {
+    PlanCacheEntry *entry = &cache->entries[i];
+    if (entry->statement != NULL && entry->hash == hash && entry->key_length == key_length &&
+        memcmp(entry->key, key, key_length) == 0)
+    {
+      if (statement_in_use(entry->statement))
+      {
+        return prepare_uncached(db, sql, scratch, out);
+      }
+      entry->last_used = ++cache->clock;
+      *out = entry->statement;
+      return bind_literals(entry->statement, literals, num_literals);
+    }
+    if (entry->statement != NULL && statement_in_use(entry->statement))
+    {
+      continue;
+    }
+    if (victim == NULL || entry->statement == NULL ||
+        (victim->statement != NULL && entry->last_used < victim->last_used))
+    {
+      victim = entry;
+    }
+  }
+  if (victim == NULL)
+  {
+    return prepare_uncached(db, sql, scratch, out);
+  }
+
+  // Miss: parse a private copy with every literal turned into a parameter.
+  Statement *statement = (Statement *)malloc(sizeof(Statement));
+  PrepareResult result = prepare_copy(db, sql, statement, true);
+  if (result != PREPARE_SUCCESS || statement->num_params != num_literals)
+  {
+    if (result == PREPARE_SUCCESS)
+    {
+      statement_release(statement);
+    }
+    free(statement);
+    return prepare_uncached(db, sql, scratch, out);
+  }
+  statement->owner = STATEMENT_CACHED;
+
+  if (victim->statement != NULL)
+  {
+    statement_finalize(victim->statement);
+    free(victim->key);
+  }
+  victim->hash = hash;
+  victim->key = (char *)malloc(key_length);
+  memcpy(victim->key, key, key_length);
+  victim->key_length = key_length;
+  victim->statement = statement;
+  victim->last_used = ++cache->clock;
+
+  *out = statement;
+  return bind_literals(statement, literals, num_literals);
+}
+
+bool table_has_key(Table *table, uint32_t key)
+{
+  Cursor *cursor = table_find(table, key);
+  bool found = !cursor->end_of_table && cursor_key(cursor) == key;
+  free(cursor);
+  return found;
+}
+
+/*
+Give every index of the table an entry for each row of a batch that
+insert_records just added, so the entries commit with their rows. A batch
+that ran out of pages stopped part way, so then each row is looked up
+first; one rejected for a duplicate key added nothing.
+*/
+ExecuteResult index_records(Database *db, const CatalogTable *table, const char *records, uint32_t num_records,
+                            ExecuteResult inserted)
+{
+  if (inserted != EXECUTE_SUCCESS && inserted != EXECUTE_TABLE_FULL)
+  {
+    return inserted;
+  }
+  const TableSchema *schema = &table->schema;
+  uint32_t table_num = (uint32_t)(table - db->tables);
+  for (uint32_t i = 0; i < db->num_indexes; i++)
+  {
+    const CatalogIndex *entry = &db->indexes[i];
+    if (entry->table != table_num)
+    {
+      continue;
+    }
+    for (uint32_t j = 0; j < num_records; j++)
+    {
+      const char *record = records + (size_t)j * schema->row_size;
+      uint32_t key = schema_read_int(schema, record, 0);
+      if (inserted != EXECUTE_SUCCESS && !table_has_key(table->table, key))
+      {
+        continue;
+      }
+      uint32_t length;
+      const char *value = schema_read_text(schema, record, entry->column, &length);
+      if (index_insert(entry->index, value, length, key) == EXECUTE_TABLE_FULL)
+      {
+        return EXECUTE_TABLE_FULL;
+      }
+    }
+  }
+  return inserted;
+}
+
+/*
+CSV import
+
+Load rows from a CSV file of id,username,email records (RFC 4180 quoting,
+so fields may hold commas, doubled quotes and line breaks). A first line
+whose id is not a number is taken as a header. Rows are gathered into
+chunks and handed to insert_records, so a sorted file loads into an empty
+table bottom-up; an error stops the import but keeps the chunks already
+inserted.
+*/
+#define IMPORT_CHUNK_ROWS 16384
+#define IMPORT_FIELD_SIZE (COLUMN_EMAIL_SIZE + 1)
+
+// Read one record into fields. Returns the number of fields, 0 at end of
+// file, or -1 if a field does not fit or a quote is left open.
+int read_csv_record(FILE *file, char fields[][IMPORT_FIELD_SIZE], int max_fields, uint32_t *line)
+{
+  int num_fields = 0;
+  uint32_t length = 0;
+  bool quoted = false;
+  bool started = false; // anything read for this record
+  bool overflow = false;
+  int c;
+  while ((c = getc(file)) != EOF)
+  {
+    if (quoted)
+    {
+      if (c == '"')
+      {
+        int next = getc(file);
+        if (next != '"')
+        {
+          quoted = false;
+          if (next != EOF)
+          {
+            ungetc(next, file);
+          }
+          continue;
+        }
+      }
+      else if (c == '\n')
+      {
+        (*line)++;
+      }
+    }
+    else if (c == '"' && length == 0)
+    {
+      quoted = true;
+      started = true;
+      continue;
+    }
+    else if (c == ',' || c == '\n')
+    {
+      if (c == '\n')
+      {
+        (*line)++;
+        if (!started)
+        {
+          continue; // blank line
+        }
+      }
+      if (num_fields < max_fields)
+      {
+        fields[num_fields][length] = '\0';
+      }
+      num_fields++;
+      length = 0;
+      if (c == '\n')
+      {
+        return overflow || num_fields > max_fields ? -1 : num_fields;
+      }
+      continue;
+    }
+    else if (c == '\r')
+    {
+      continue;
+    }
+
+    started = true;
+    if (num_fields >= max_fields || length + 1 >= IMPORT_FIELD_SIZE)
+    {
+      overflow = true;
+      continue;
+    }
+    fields[num_fields][length++] = (char)c;
+  }
+
+  if (!started)
+  {
+    return 0;
+  }
+  if (quoted || overflow || num_fields >= max_fields)
+  {
+    return -1;
+  }
+  fields[num_fields][length] = '\0';
+  return num_fields + 1;
+}
+
+// Before the first change since a clean open, note on disk that the
+// database is no longer closed cleanly. Returns false if that could not be
+// written. Defined with the catalog, below.
+bool catalog_mark_changed(Database *db);
+
+// Commit an insert's changes, unless a transaction is collecting them.
+void database_commit(Database *db, Pager *pager)
+{
+  if (!db->in_transaction)
+  {
+    pager_commit(pager);
+  }
+}
+
+// Insert and commit one chunk of users rows, with their index entries.
+ExecuteResult import_rows(Database *db, Row *rows, uint32_t num_rows)
+{
+  CatalogTable *users = &db->tables[0];
+  char *records = (char *)malloc((size_t)num_rows * ROW_SIZE);
+  for (uint32_t i = 0; i < num_rows; i++)
+  {
+    serialize_row(&rows[i], records + (size_t)i * ROW_SIZE);
+  }
+  if (!catalog_mark_changed(db))
+  {
+    free(records);
+    return EXECUTE_FAILED;
+  }
+  ExecuteResult result = insert_records(users->table, records, num_rows);
+  result = index_records(db, users, records, num_rows, result);
+  database_commit(db, users->table->pager);
+  free(records);
+  return result;
+}
+
+bool parse_import_id(const char *text, uint32_t *id)
+{
+  if (*text < '0' || *text > '9')
+  {
+    return false;
+  }
+  uint64_t value = 0;
+  for (; *text >= '0' && *text <= '9'; text++)
+  {
+    value = value * 10 + (uint64_t)(*text - '0');
+    if (value > UINT32_MAX)
+    {
+      return false;
+    }
+  }
+  *id = (uint32_t)value;
+  return *text == '\0';
+}
+
+ImportResult import_csv(Database *db, const char *path, ImportStatus *status)
+{
+  status->rows_imported = 0;
+  status->line = 0;
+  status->insert = EXECUTE_SUCCESS;
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    return IMPORT_OPEN_FAILED;
+  }
+
+  Row *rows = (Row *)malloc(IMPORT_CHUNK_ROWS * sizeof(Row));
+  uint32_t num_rows = 0;
+  char fields[3][IMPORT_FIELD_SIZE];
+  uint32_t line = 1;
+  bool first = true;
+  ImportResult result = IMPORT_SUCCESS;
+  while (result == IMPORT_SUCCESS)
+  {
+    uint32_t record_line = line;
+    int num_fields = read_csv_record(file, fields, 3, &line);
+    if (num_fields == 0)
+    {
+      break;
+    }
+    status->line = record_line;
+    Row *row = &rows[num_rows];
+    memset(row, 0, sizeof(Row));
+    if (num_fields != 3 || !parse_import_id(fields[0], &row->id))
+    {
+      if (first && num_fields == 3)
+      {
+        first = false;
+        continue;
+      }
+      result = IMPORT_BAD_RECORD;
+      break;
+    }
+    first = false;
+    if (strlen(fields[1]) > COLUMN_USERNAME_SIZE || strlen(fields[2]) > COLUMN_EMAIL_SIZE)
+    {
+      result = IMPORT_STRING_TOO_LONG;
+      break;
+    }
+    memcpy(row->username, fields[1], strlen(fields[1]));
+    memcpy(row->email, fields[2], strlen(fields[2]));
+    num_rows++;
+
+    if (num_rows == IMPORT_CHUNK_ROWS)
+    {
+      status->insert = import_rows(db, rows, num_rows);
+      if (status->insert != EXECUTE_SUCCESS)
+      {
+        result = IMPORT_INSERT_FAILED;
+        break;
+      }
+      status->rows_imported += num_rows;
+      num_rows = 0;
+    }
+  }
+  if (result == IMPORT_SUCCESS && num_rows > 0)
+  {
+    status->insert = import_rows(db, rows, num_rows);
+    if (status->insert != EXECUTE_SUCCESS)
+    {
+      result = IMPORT_INSERT_FAILED;
+    }
+    else
+    {
+      status->rows_imported += num_rows;
+    }
+  }
+  free(rows);
+  fclose(file);
+  return result;
+}
+
+ExecuteResult execute_insert(Statement *statement, Table *table)
+{
+  if (!catalog_mark_changed(statement->db))
+  {
+    return EXECUTE_FAILED;
+  }
+  ExecuteResult result = insert_records(table, statement->records, statement->num_rows);
+  result = index_records(statement->db, statement->table, statement->records, statement->num_rows, result);
+  // A batch that ran out of pages keeps the rows it inserted.
+  database_commit(statement->db, table->pager);
+  return result;
+}
+
+typedef struct
+{
+  bool is_integer;
+  uint32_t integer;
+  const char *string;
+  uint32_t length;
+} Value;
+
+Value eval_value(const Statement *statement, int32_t index, RowView row)
+{
+  const Expr *expr = &statement->exprs[index];
+  Value value = {false, 0, NULL, 0};
+  if (expr->type == EXPR_INTEGER)
+  {
+    value.is_integer = true;
+    value.integer = expr->integer;
+  }
+  else if (expr->type == EXPR_STRING)
+  {
+    value.string = expr->string;
+    value.length = expr->length;
+  }
+  else
+  {
+    const TableSchema *schema = &statement->table->schema;
+    if (schema->columns[expr->column].type == COLUMN_TYPE_INTEGER)
+    {
+      value.is_integer = true;
+      value.integer = row_read_int(schema, row, expr->column);
+    }
+    else
+    {
+      value.string = row_read_text(schema, row, expr->column, &value.length);
+    }
+  }
+  return value;
+}
+
+int compare_values(Value left, Value right)
+{
+  if (left.is_integer)
+  {
+    return left.integer < right.integer ? -1 : left.integer > right.integer;
+  }
+  uint32_t common = left.length < right.length ? left.length : right.length;
+  int result = memcmp(left.string, right.string, common);
+  if (result != 0)
+  {
+    return result;
+  }
+  return left.length < right.length ? -1 : left.length > right.length;
+}
+
+// Whether text matches a like pattern. A % retries from one character
+// further on each time the rest fails, which is enough as a later % can
+// always absorb what an earlier one would have.
+bool like_matches(const char *pattern, uint32_t pattern_length, const char *text, uint32_t text_length)
+{
+  uint32_t p = 0, t = 0;
+  uint32_t star = UINT32_MAX, resume = 0;
+  while (t < text_length)
+  {
+    if (p < pattern_length && pattern[p] == '%')
+    {
+      star = p++;
+      resume = t;
+    }
+    else if (p < pattern_length && (pattern[p] == '_' || pattern[p] == text[t]))
+    {
+      p++;
+      t++;
+    }
+    else if (star != UINT32_MAX)
+    {
+      p = star + 1;
+      t = ++resume;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  while (p < pattern_length && pattern[p] == '%')
+  {
+    p++;
+  }
+  return p == pattern_length;
+}
+
+// Length of the literal text a like pattern starts with. *only_prefix is
+// set when nothing but % follows it, so the prefix decides the match.
+uint32_t like_prefix(const char *pattern, uint32_t length, bool *only_prefix)
+{
+  uint32_t prefix = 0;
+  while (prefix < length && pattern[prefix] != '%' && pattern[prefix] != '_')
+  {
+    prefix++;
+  }
+  uint32_t rest = prefix;
+  while (rest < length && pattern[rest] == '%')
+  {
+    rest++;
+  }
+  *only_prefix = prefix < length && rest == length;
+  return prefix;
+}
+
+bool eval_predicate(const Statement *statement, int32_t index, RowView row)
+{
+  const Expr *expr = &statement->exprs[index];
+  switch (expr->type)
+  {
+  case (EXPR_AND):
+    return eval_predicate(statement, expr->left, row) && eval_predicate(statement, expr->right, row);
+  case (EXPR_OR):
+    return eval_predicate(statement, expr->left, row) || eval_predicate(statement, expr->right, row);
+  case (EXPR_COMPARE):
+    break;
+  default:
+    return false;
+  }
+
+  Value left = eval_value(statement, expr->left, row);
+  Value right = eval_value(statement, expr->right, row);
+  if (expr->op == COMPARE_LIKE)
+  {
+    return like_matches(right.string, right.length, left.string, left.length);
+  }
+  int cmp = compare_values(left, right);
+  switch (expr->op)
+  {
+  case (COMPARE_EQ):
+    return cmp == 0;
+  case (COMPARE_NE):
+    return cmp != 0;
+  case (COMPARE_LT):
+    return cmp < 0;
+  case (COMPARE_LE):
+    return cmp <= 0;
+  case (COMPARE_GT):
+    return cmp > 0;
+  case (COMPARE_GE):
+    return cmp >= 0;
+  case (COMPARE_LIKE):
+    break;
+  }
+  return false;
+}
+
+bool past_upper_bound(const KeyRange *range, uint32_t key)
+{
+  return range->has_upper && (key > range->upper || (key == range->upper && !range->upper_inclusive));
+}
+
+// The range as inclusive bounds. Returns false if it holds no key.
+bool key_bounds(const KeyRange *range, uint32_t *low, uint32_t *high)
+{
+  *low = 0;
+  *high = UINT32_MAX;
+  if (range->has_lower)
+  {
+    if (range->lower == UINT32_MAX && !range->lower_inclusive)
+    {
+      return false;
+    }
+    *low = range->lower_inclusive ? range->lower : range->lower + 1;
+  }
+  if (range->has_upper)
+  {
+    if (range->upper == 0 && !range->upper_inclusive)
+    {
+      return false;
+    }
+    *high = range->upper_inclusive ? range->upper : range->upper - 1;
+  }
+  return *low <= *high;
+}
+
+// Run the kernel filter over cells [first, first + count) of a columnar
+// leaf, given the array of its filter column. Returns how many cells pass.
+uint32_t kernel_filter_cells(const Statement *statement, const char *values, uint32_t first, uint32_t count,
+                             uint16_t *selected)
+{
+  const KernelFilter *filter = &statement->kernel_filter;
+  const ColumnDef *column = &statement->table->schema.columns[filter->column];
+  uint32_t num_selected;
+  if (filter->matches_nothing)
+  {
+    num_selected = 0;
+  }
+  else if (column->type == COLUMN_TYPE_INTEGER)
+  {
+    num_selected = kernel_select_range((const uint32_t *)values + first, count, filter->low, filter->high, selected);
+  }
+  else
+  {
+    num_selected = kernel_select_prefix(values + (size_t)first * column->size, column->size, count, filter->text,
+                                        filter->length, selected);
+  }
+  for (uint32_t i = 0; i < num_selected; i++)
+  {
+    selected[i] += first;
+  }
+  return num_selected;
+}
+
+/*
+Narrow cells [first, end) of a leaf to those the where clause passes, into
+selected. Each stage is one loop over all of them: the kernel filter, if
+there is one, over its column's array, and then the rest of the clause
+over the cells the kernel let through. Returns how many pass.
+*/
+uint32_t filter_cells(const Statement *statement, const Leaf *leaf, uint32_t first, uint32_t end,
+                      uint16_t *selected)
+{
+  const KernelFilter *filter = &statement->kernel_filter;
+  uint32_t num_selected = 0;
+  if (!filter->active)
+  {
+    for (uint32_t cell = first; cell < end; cell++)
+    {
+      if (eval_predicate(statement, statement->where, leaf_row(leaf, cell)))
+      {
+        selected[num_selected++] = (uint16_t)cell;
+      }
+    }
+    return num_selected;
+  }
+  uint32_t candidates =
+      kernel_filter_cells(statement, leaf_column(leaf, filter->column), first, end - first, selected);
+  if (filter->exact)
+  {
+    return candidates;
+  }
+  for (uint32_t i = 0; i < candidates; i++)
+  {
+    if (eval_predicate(statement, statement->where, leaf_row(leaf, selected[i])))
+    {
+      selected[num_selected++] = selected[i];
+    }
+  }
+  return num_selected;
+}
+
+// Fill in filter from "column <op> literal" if a kernel can evaluate it.
+bool kernel_filter_from(const Statement *statement, const Expr *expr, KernelFilter *filter)
+{
+  if (expr->type != EXPR_COMPARE)
+  {
+    return false;
+  }
+  const Expr *lhs = &statement->exprs[expr->left];
+  const Expr *rhs = &statement->exprs[expr->right];
+  CompareOp op = expr->op;
+  // The pattern of a like cannot trade places with the text.
+  if (lhs->type != EXPR_COLUMN && op != COMPARE_LIKE)
+  {
+    const Expr *swap = lhs;
+    lhs = rhs;
+    rhs = swap;
+    op = flip_compare(op);
+  }
+  // The key column is already narrowed by the range.
+  if (lhs->type != EXPR_COLUMN || lhs->column == 0 || op == COMPARE_NE)
+  {
+    return false;
+  }
+  const ColumnDef *column = &statement->table->schema.columns[lhs->column];
+  memset(filter, 0, sizeof(KernelFilter));
+  filter->column = lhs->column;
+  filter->exact = true;
+
+  if (rhs->type == EXPR_STRING && op == COMPARE_LIKE)
+  {
+    // Cells must start with the pattern's literal prefix, and that is all
+    // when only % follows it.
+    filter->length = like_prefix(rhs->string, rhs->length, &filter->exact);
+    if (filter->length == 0)
+    {
+      return false;
+    }
+    filter->matches_nothing = filter->length > column->size;
+    if (!filter->matches_nothing)
+    {
+      memcpy(filter->text, rhs->string, filter->length);
+    }
+    filter->active = true;
+    return true;
+  }
+  if (rhs->type == EXPR_STRING && op == COMPARE_EQ)
+  {
+    // Values are NUL padded, so the text and the NUL after it (unless it
+    // fills the column) are a prefix only the equal value has.
+    filter->matches_nothing = rhs->length > column->size;
+    if (!filter->matches_nothing)
+    {
+      memcpy(filter->text, rhs->string, rhs->length);
+      filter->length = rhs->length < column->size ? rhs->length + 1 : rhs->length;
+    }
+    filter->active = true;
+    return true;
+  }
+  if (rhs->type != EXPR_INTEGER || column->type != COLUMN_TYPE_INTEGER)
+  {
+    return false;
+  }
+
+  uint32_t value = rhs->integer;
+  filter->low = 0;
+  filter->high = UINT32_MAX;
+  switch (op)
+  {
+  case COMPARE_EQ:
+    filter->low = filter->high = value;
+    break;
+  case COMPARE_LT:
+    filter->matches_nothing = value == 0;
+    filter->high = value - 1;
+    break;
+  case COMPARE_LE:
+    filter->high = value;
+    break;
+  case COMPARE_GT:
+    filter->matches_nothing = value == UINT32_MAX;
+    filter->low = value + 1;
+    break;
+  case COMPARE_GE:
+    filter->low = value;
+    break;
+  case COMPARE_NE:
+  case COMPARE_LIKE:
+    break;
+  }
+  filter->active = true;
+  return true;
+}
+
+// Look through the top-level conjunction for a comparison to run as the
+// kernel filter.
+bool find_kernel_filter(const Statement *statement, int32_t index, KernelFilter *filter)
+{
+  const Expr *expr = &statement->exprs[index];
+  if (expr->type == EXPR_AND)
+  {
+    return find_kernel_filter(statement, expr->left, filter) || find_kernel_filter(statement, expr->right, filter);
+  }
+  if (!kernel_filter_from(statement, expr, filter))
+  {
+    return false;
+  }
+  filter->exact = filter->exact && index == statement->where;
+  return true;
+}
+
+// The index over a column of the statement's table, or NULL.
+Index *find_column_index(const Statement *statement, uint32_t column)
+{
+  const Database *db = statement->db;
+  uint32_t table_num = (uint32_t)(statement->table - db->tables);
+  for (uint32_t i = 0; i < db->num_indexes; i++)
+  {
+    if (db->indexes[i].table == table_num && db->indexes[i].column == column)
+    {
+      return db->indexes[i].index;
+    }
+  }
+  return NULL;
+}
+
+// Fill in lookup from "column = text" or "column like pattern" if the
+// column is indexed and the pattern starts with literal text.
+bool index_lookup_from(const Statement *statement, const Expr *expr, IndexLookup *lookup)
+{
+  if (expr->type != EXPR_COMPARE || (expr->op != COMPARE_EQ && expr->op != COMPARE_LIKE))
+  {
+    return false;
+  }
+  const Expr *lhs = &statement->exprs[expr->left];
+  const Expr *rhs = &statement->exprs[expr->right];
+  if (lhs->type != EXPR_COLUMN && expr->op == COMPARE_EQ)
+  {
+    const Expr *swap = lhs;
+    lhs = rhs;
+    rhs = swap;
+  }
+  if (lhs->type != EXPR_COLUMN || rhs->type != EXPR_STRING)
+  {
+    return false;
+  }
+  lookup->index = find_column_index(statement, lhs->column);
+  if (lookup->index == NULL)
+  {
+    return false;
+  }
+  lookup->column = lhs->column;
+  lookup->prefix = expr->op == COMPARE_LIKE;
+  lookup->exact = true;
+  lookup->text = rhs->string;
+  lookup->length = lookup->prefix ? like_prefix(rhs->string, rhs->length, &lookup->exact) : rhs->length;
+  return !lookup->prefix || lookup->length > 0;
+}
+
+// Look through the top-level conjunction for a comparison to answer through
+// an index, taking an equality over a like, which may match far more rows.
+bool find_index_lookup(const Statement *statement, int32_t index, IndexLookup *lookup)
+{
+  const Expr *expr = &statement->exprs[index];
+  if (expr->type == EXPR_AND)
+  {
+    bool found = find_index_lookup(statement, expr->left, lookup);
+    if (found && !lookup->prefix)
+    {
+      return true;
+    }
+    IndexLookup right;
+    if (!find_index_lookup(statement, expr->right, &right))
+    {
+      return found;
+    }
+    if (!found || !right.prefix)
+    {
+      *lookup = right;
+    }
+    return true;
+  }
+  if (!index_lookup_from(statement, expr, lookup))
+  {
+    return false;
+  }
+  lookup->exact = lookup->exact && index == statement->where;
+  return true;
+}
+
+// Whether a select reads the table's key range backwards, last key first,
+// for an order by id descending. Keys are unique, so there are no ties
+// for the order to keep.
+bool select_scans_backwards(const Statement *statement)
+{
+  return statement->has_order && statement->order_descending && statement->order_column == 0 &&
+         !statement->lookup.active && statement->aggregate == AGGREGATE_NONE;
+}
+
+// Whether a select asks for its rows in another order than its source
+// reads them in: key order either way, or an index's column order and
+// then key order.
+bool select_needs_sort(const Statement *statement)
+{
+  if (!statement->has_order)
+  {
+    return false;
+  }
+  if (statement->lookup.active)
+  {
+    return statement->order_descending || statement->order_column != statement->lookup.column;
+  }
+  return statement->order_column != 0;
+}
+
+// Whether a limit in scan order may stop the scan before its range ends.
+bool select_stops_early(const Statement *statement)
+{
+  return statement->has_limit && !select_needs_sort(statement);
+}
+
+// Running count, min, max and sum of an aggregate. Parallel scans keep one
+// per worker, padded so workers do not share a cache line.
+typedef struct
+{
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t sum;
+  char padding[64];
+} AggregatePartial;
+
+// Fold in count values whose smallest is min, largest is max and total is
+// sum.
+void partial_add(AggregatePartial *partial, uint32_t count, uint32_t min, uint32_t max, uint64_t sum)
+{
+  if (count == 0)
+  {
+    return;
+  }
+  partial->min = partial->count == 0 || min < partial->min ? min : partial->min;
+  partial->max = partial->count == 0 || max > partial->max ? max : partial->max;
+  partial->count += count;
+  partial->sum += sum;
+}
+
+// Fold in count > 0 values of a columnar leaf's array, with the one kernel
+// the aggregate needs.
+void partial_add_array(const Statement *statement, AggregatePartial *partial, const uint32_t *values,
+                       uint32_t count)
+{
+  if (statement->aggregate == AGGREGATE_SUM)
+  {
+    partial_add(partial, count, 0, 0, kernel_sum(values, count));
+    return;
+  }
+  uint32_t min, max;
+  kernel_min_max(values, count, &min, &max);
+  partial_add(partial, count, min, max, 0);
+}
+
+// Whether the aggregate is over a key range and the tree's structure holds
+// its answer: how many keys are in the range, or the smallest or largest.
+bool aggregate_from_keys(const Statement *statement)
+{
+  bool of_key = (statement->aggregate == AGGREGATE_MIN || statement->aggregate == AGGREGATE_MAX) &&
+                statement->aggregate_column == 0;
+  return statement->where_is_range && (statement->aggregate == AGGREGATE_COUNT || of_key);
+}
+
+// Answer such an aggregate without reading a row.
+void aggregate_keys(Statement *statement, Table *table, AggregatePartial *total)
+{
+  uint32_t low, high, key;
+  if (!key_bounds(&statement->range, &low, &high))
+  {
+    return;
+  }
+  switch (statement->aggregate)
+  {
+  case (AGGREGATE_MIN):
+    if (table_first_key(table, low, &key) && key <= high)
+    {
+      partial_add(total, 1, key, key, key);
+    }
+    break;
+  case (AGGREGATE_MAX):
+    if (table_last_key(table, high, &key) && key >= low)
+    {
+      partial_add(total, 1, key, key, key);
+    }
+    break;
+  default:
+    partial_add(total, table_count_keys(table, low, high), 0, 0, 0);
+    break;
+  }
+}
+
+/*
+Parallel scan
+
+A select that filters or aggregates rows over enough leaves hands the
+leaves to the database's scan pool. Each worker takes whole leaves: for a
+plain select it lists the cells that pass, and the rows are then produced
+from those lists in leaf order, so they come out in key order just as
+from a serial scan. An aggregate is kept per worker and merged after.
+*/
+#define SCAN_PARALLEL_MIN_LEAVES 8
+static_assert(SCAN_MAX_WORKERS < PAGER_CACHE_PAGES, "every scan worker pins a page while it reads it");
+
+struct ParallelScan
+{
+  const Statement *statement;
+  Table *table;
+  uint32_t low;
+  uint32_t high;
+  uint32_t num_leaves;
+  uint32_t *pages;
+  // Leaf i's cells that pass: num_selected[i] of them from selected + i * max_cells.
+  uint32_t max_cells;
+  uint16_t *selected;
+  uint32_t *num_selected;
+  AggregatePartial partials[SCAN_MAX_WORKERS];
+  // Where the executor has got to in the lists.
+  uint32_t leaf;
+  uint32_t next;
+};
+
+// Fold cells [first, end) of the leaf, all of which pass, into partial.
+void aggregate_leaf_run(const Statement *statement, const Leaf *leaf, uint32_t first, uint32_t end,
+                        AggregatePartial *partial)
+{
+  if (statement->aggregate == AGGREGATE_COUNT || first == end)
+  {
+    partial_add(partial, end - first, 0, 0, 0);
+  }
+  else if (leaf->table->layout.format == RECORD_COLUMNAR)
+  {
+    const uint32_t *values = (const uint32_t *)leaf_column(leaf, statement->aggregate_column) + first;
+    partial_add_array(statement, partial, values, end - first);
+  }
+  else
+  {
+    for (uint32_t cell = first; cell < end; cell++)
+    {
+      uint32_t value = row_read_int(&statement->table->schema, leaf_row(leaf, cell), statement->aggregate_column);
+      partial_add(partial, 1, value, value, value);
+    }
+  }
+}
+
+void scan_leaf(void *context, uint32_t worker, uint32_t item)
+{
+  ParallelScan *scan = (ParallelScan *)context;
+  const Statement *statement = scan->statement;
+  Leaf leaf;
+  leaf_acquire(scan->table, scan->pages[item], &leaf);
+
+  // Keys are sorted, so the cells in range are a run that only the first
+  // and last leaves cut into.
+  uint32_t first = 0, end = leaf.num_cells;
+  while (first < end && leaf_key(&leaf, first) < scan->low)
+  {
+    first++;
+  }
+  while (end > first && leaf_key(&leaf, end - 1) > scan->high)
+  {
+    end--;
+  }
+  stats_count(STAT_ROWS_SCANNED, end - first);
+
+  if (statement->where_is_range)
+  {
+    // Only aggregates are scanned in parallel without a filter.
+    aggregate_leaf_run(statement, &leaf, first, end, &scan->partials[worker]);
+    leaf_release(&leaf);
+    return;
+  }
+
+  uint16_t *selected = scan->selected + (size_t)item * scan->max_cells;
+  uint32_t num_selected = filter_cells(statement, &leaf, first, end, selected);
+
+  if (statement->aggregate == AGGREGATE_NONE)
+  {
+    scan->num_selected[item] = num_selected;
+  }
+  else
+  {
+    AggregatePartial *partial = &scan->partials[worker];
+    for (uint32_t i = 0; i < num_selected; i++)
+    {
+      uint32_t value = statement->aggregate == AGGREGATE_COUNT
+                           ? 0
+                           : row_read_int(&statement->table->schema, leaf_row(&leaf, selected[i]),
+                                          statement->aggregate_column);
+      partial_add(partial, 1, value, value, value);
+    }
+  }
+  leaf_release(&leaf);
+}
+
+// Scan the select's range in parallel if it is worth it. Returns false to
+// leave it to the serial scan.
+bool parallel_scan_start(Statement *statement, Table *table)
+{
+  Database *db = statement->db;
+  uint32_t low, high;
+  if (db->scan_threads < 2 || statement->lookup.active || aggregate_from_keys(statement) ||
+      (statement->aggregate == AGGREGATE_NONE &&
+       (statement->where_is_range || select_stops_early(statement) || select_scans_backwards(statement))) ||
+      statement->cursor->end_of_table || !key_bounds(&statement->range, &low, &high))
+  {
+    return false;
+  }
+  uint32_t *pages;
+  uint32_t num_leaves = table_leaves(table, low, high, &pages);
+  if (num_leaves < SCAN_PARALLEL_MIN_LEAVES)
+  {
+    free(pages);
+    return false;
+  }
+  // The leaves, their counts and then the selections follow the scan in
+  // the same block.
+  uint32_t max_cells = table_max_leaf_cells(table);
+  ParallelScan *scan = (ParallelScan *)malloc(sizeof(ParallelScan) + (size_t)num_leaves * 2 * sizeof(uint32_t) +
+                                              (size_t)num_leaves * max_cells * sizeof(uint16_t));
+  scan->num_leaves = num_leaves;
+  scan->pages = (uint32_t *)(scan + 1);
+  memcpy(scan->pages, pages, num_leaves * sizeof(uint32_t));
+  free(pages);
+  scan->num_selected = scan->pages + num_leaves;
+  scan->max_cells = max_cells;
+  scan->selected = (uint16_t *)(scan->num_selected + num_leaves);
+  scan->statement = statement;
+  scan->table = table;
+  scan->low = low;
+  scan->high = high;
+  memset(scan->partials, 0, sizeof(scan->partials));
+  scan->leaf = 0;
+  scan->next = 0;
+
+  if (db->scan_pool == NULL)
+  {
+    db->scan_pool = scan_pool_open(db->scan_threads);
+  }
+  scan_pool_run(db->scan_pool, scan->num_leaves, scan_leaf, scan);
+  statement->parallel = scan;
+  return true;
+}
+
+/*
+Select executor
+
+A select runs as a pipeline of operators, each pulling batches from the
+one below it. The source reads rows in: the scan over the key range, the
+lists a parallel scan made or the lookup through an index. A filter runs
+the rest of the where clause over a batch at a time, a sort puts the rows
+in the order asked for when they do not come in it, an offset drops rows
+from the front, and a limit ends the pipeline once it has let enough rows
+through. Nothing is read before the first step asks for a row. On top, each step projects
+the next row of the current batch, whose selected columns are read in
+place as the caller asks for them, and an aggregate folds whole batches.
+*/
+
+RowView batch_row(const Statement *statement, const Batch *batch, uint32_t row)
+{
+  if (batch->records != NULL)
+  {
+    return row_view(batch->records + (size_t)row * statement->table->schema.row_size, RECORD_FIXED);
+  }
+  return leaf_row(&batch->leaf, batch->cells[row]);
+}
+
+void batch_pin(Batch *batch, Table *table, uint32_t page_num)
+{
+  leaf_acquire(table, page_num, &batch->leaf);
+  batch->pinned = true;
+  batch->contiguous = false;
+  batch->num_rows = 0;
+}
+
+// One past the last of cells [first, end) within the upper bound. Keys
+// are sorted within a leaf.
+uint32_t leaf_range_end(const Leaf *leaf, const KeyRange *range, uint32_t first, uint32_t end)
+{
+  while (first < end)
+  {
+    uint32_t middle = first + (end - first) / 2;
+    if (past_upper_bound(range, leaf_key(leaf, middle)))
+      end = middle;
+    else
+      first = middle + 1;
+  }
+  return first;
+}
+
+/*
+Scan read-ahead. A scan that will run to the end of its range lists its
+leaves up front, reading only internal nodes, and keeps the pager asking
+for the next SCAN_READ_AHEAD_LEAVES of them, half a window at a time, so
+that leaves scattered over the file arrive while earlier ones are read.
+*/
+#define SCAN_READ_AHEAD_LEAVES 64
+
+void scan_read_ahead(Statement *statement)
+{
+  Executor *executor = statement->executor;
+  if (executor->leaves == NULL || executor->prefetched == executor->num_leaves ||
+      executor->prefetched - executor->scan_leaf > SCAN_READ_AHEAD_LEAVES / 2)
+  {
+    return;
+  }
+  uint32_t end = executor->scan_leaf + SCAN_READ_AHEAD_LEAVES;
+  end = end < executor->num_leaves ? end : executor->num_leaves;
+  pager_prefetch(statement->table->table->pager, executor->leaves + executor->prefetched,
+                 end - executor->prefetched);
+  executor->prefetched = end;
+}
+
+// Move the cursor to the next leaf, keeping the read-ahead in step.
+void scan_next_leaf(Statement *statement)
+{
+  cursor_next_leaf(statement->cursor);
+  statement->executor->scan_leaf++;
+  scan_read_ahead(statement);
+}
+
+/*
+Source: the key range in key order, from the cursor on, in runs of up to
+a batch of one leaf. An offset straight over the scan is taken off the
+front of the runs here, so a skipped leaf costs only the search for the
+end of the range in it and none of its rows are looked at.
+*/
+bool scan_next(Operator *op, Batch *batch)
+{
+  Statement *statement = op->statement;
+  Executor *executor = statement->executor;
+  Cursor *cursor = statement->cursor;
+  while (!cursor->end_of_table)
+  {
+    batch_pin(batch, statement->table->table, cursor->page_num);
+    uint32_t num_cells = batch->leaf.num_cells;
+    uint32_t first = cursor->cell_num;
+    uint32_t end = num_cells - first > BATCH_MAX_ROWS ? first + BATCH_MAX_ROWS : num_cells;
+    uint32_t in_range = leaf_range_end(&batch->leaf, &statement->range, first, end);
+    if (in_range < end)
+      cursor->end_of_table = true;
+    else if (end < num_cells)
+      cursor->cell_num = end;
+    else
+      scan_next_leaf(statement);
+
+    uint32_t skipped = in_range - first < executor->scan_skip ? in_range - first : executor->scan_skip;
+    executor->scan_skip -= skipped;
+    first += skipped;
+    stats_count(STAT_ROWS_SCANNED, in_range - first);
+    for (uint32_t cell = first; cell < in_range; cell++)
+    {
+      batch->cells[batch->num_rows++] = (uint16_t)cell;
+    }
+    batch->contiguous = true;
+    if (batch->num_rows > 0)
+    {
+      return true;
+    }
+    batch_release(batch);
+  }
+  return false;
+}
+
+/*
+Source: the key range backwards, for select_scans_backwards. The leaves
+are listed up front, last first, and each one's cells in the range are
+handed out from the highest key down, up to a batch at a time.
+*/
+#define SCAN_NEW_LEAF UINT32_MAX
+
+// The first of cells [first, end) whose key is at least key.
+uint32_t leaf_key_search(const Leaf *leaf, uint32_t key, uint32_t first, uint32_t end)
+{
+  while (first < end)
+  {
+    uint32_t middle = first + (end - first) / 2;
+    if (leaf_key(leaf, middle) < key)
+      first = middle + 1;
+    else
+      end = middle;
+  }
+  return first;
+}
+
+bool scan_backwards_next(Operator *op, Batch *batch)
+{
+  Statement *statement = op->statement;
+  Executor *executor = statement->executor;
+  uint32_t low, high;
+  key_bounds(&statement->range, &low, &high);
+  while (executor->scan_leaf < executor->num_leaves)
+  {
+    batch_pin(batch, statement->table->table, executor->leaves[executor->scan_leaf]);
+    if (executor->back_cell == SCAN_NEW_LEAF)
+    {
+      executor->back_cell = leaf_range_end(&batch->leaf, &statement->range, 0, batch->leaf.num_cells);
+    }
+    uint32_t first = leaf_key_search(&batch->leaf, low, 0, executor->back_cell);
+    uint32_t end = executor->back_cell;
+    uint32_t start = end - first > BATCH_MAX_ROWS ? end - BATCH_MAX_ROWS : first;
+    if (start > first)
+    {
+      executor->back_cell = start;
+    }
+    else
+    {
+      executor->back_cell = SCAN_NEW_LEAF;
+      executor->scan_leaf++;
+      scan_read_ahead(statement);
+    }
+    stats_count(STAT_ROWS_SCANNED, end - start);
+    for (uint32_t cell = end; cell > start; cell--)
+    {
+      batch->cells[batch->num_rows++] = (uint16_t)(cell - 1);
+    }
+    if (batch->num_rows > 0)
+    {
+      return true;
+    }
+    batch_release(batch);
+  }
+  return false;
+}
+
+// Source: the lists a parallel scan made, whose cells have already passed
+// the where clause, in leaf order.
+bool parallel_next(Operator *op, Batch *batch)
+{
+  ParallelScan *scan = op->statement->parallel;
+  while (scan->leaf < scan->num_leaves && scan->next == scan->num_selected[scan->leaf])
+  {
+    scan->leaf++;
+    scan->next = 0;
+  }
+  if (scan->leaf == scan->num_leaves)
+  {
+    return false;
+  }
+  batch_pin(batch, scan->table, scan->pages[scan->leaf]);
+  uint32_t count = scan->num_selected[scan->leaf] - scan->next;
+  if (count > BATCH_MAX_ROWS)
+  {
+    count = BATCH_MAX_ROWS;
+  }
+  memcpy(batch->cells, scan->selected + (size_t)scan->leaf * scan->max_cells + scan->next, count * sizeof(uint16_t));
+  batch->num_rows = count;
+  scan->next += count;
+  return true;
+}
+
+/*
+Source: the rows found through an index. Entries from the seek on are
+checked against the text, and each match's row is fetched from the table
+by key. Entries are in value order, so the first that no longer matches
+ends the select. Matches whose rows share a leaf share a batch; the first
+in another leaf starts the next one.
+*/
+bool index_next(Operator *op, Batch *batch)
+{
+  Statement *statement = op->statement;
+  IndexLookup *lookup = &(statement->lookup);
+  Cursor *cursor = statement->cursor;
+  while (!lookup->cursor.end_of_index && batch->num_rows < BATCH_MAX_ROWS)
+  {
+    uint32_t length;
+    const char *value = index_cursor_value(&lookup->cursor, &length);
+    bool matches = lookup->prefix ? length >= lookup->length : length == lookup->length;
+    if (!matches || memcmp(value, lookup->text, lookup->length) != 0)
+    {
+      lookup->cursor.end_of_index = true;
+      break;
+    }
+    uint32_t key = index_cursor_key(&lookup->cursor);
+    cursor_seek(cursor, key);
+    if (cursor->end_of_table || cursor_key(cursor) != key)
+    {
+      index_cursor_advance(&lookup->cursor);
+      continue;
+    }
+    if (!batch->pinned)
+    {
+      batch_pin(batch, statement->table->table, cursor->page_num);
+    }
+    else if (cursor->page_num != batch->leaf.page_num)
+    {
+      break;
+    }
+    batch->cells[batch->num_rows++] = (uint16_t)cursor->cell_num;
+    index_cursor_advance(&lookup->cursor);
+  }
+  stats_count(STAT_ROWS_SCANNED, batch->num_rows);
+  return batch->num_rows > 0;
+}
+
+// Filter: narrows each batch to the rows the where clause passes, and
+// skips the batches that leaves empty.
+bool filter_next(Operator *op, Batch *batch)
+{
+  const Statement *statement = op->statement;
+  while (op->input->next(op->input, batch))
+  {
+    if (batch->contiguous)
+    {
+      uint32_t first = batch->cells[0];
+      batch->num_rows = filter_cells(statement, &batch->leaf, first, first + batch->num_rows, batch->cells);
+      batch->contiguous = false;
+    }
+    else
+    {
+      uint32_t kept = 0;
+      for (uint32_t i = 0; i < batch->num_rows; i++)
+      {
+        if (eval_predicate(statement, statement->where, leaf_row(&batch->leaf, batch->cells[i])))
+        {
+          batch->cells[kept++] = batch->cells[i];
+        }
+      }
+      batch->num_rows = kept;
+    }
+    if (batch->num_rows > 0)
+    {
+      return true;
+    }
+    batch_release(batch);
+  }
+  return false;
+}
+
+// A row's order value and its place among the rows the sort was given.
+typedef struct
+{
+  Value value;
+  uint32_t row;
+  bool descending;
+} SortEntry;
+
+int compare_sort_entries(const void *a, const void *b)
+{
+  const SortEntry *x = (const SortEntry *)a, *y = (const SortEntry *)b;
+  int cmp = compare_values(x->value, y->value);
+  if (x->descending)
+  {
+    cmp = -cmp;
+  }
+  return cmp != 0 ? cmp : x->row < y->row ? -1 : x->row > y->row;
+}
+
+// Copy a stored row out in the fixed layout of its table.
+void row_copy_fixed(const TableSchema *schema, RowView row, char *record)
+{
+  for (uint32_t c = 0; c < schema->num_columns; c++)
+  {
+    const ColumnDef *column = &schema->columns[c];
+    if (column->type == COLUMN_TYPE_INTEGER)
+    {
+      schema_write_int(schema, record, c, row_read_int(schema, row, c));
+      continue;
+    }
+    uint32_t length;
+    const char *text = row_read_text(schema, row, c, &length);
+    memcpy(record + column->offset, text, length);
+    memset(record + column->offset + length, 0, column->size - length);
+  }
+}
+
+// The order column's value in a row the sort copied out.
+Value sort_value(const Statement *statement, const char *record)
+{
+  const TableSchema *schema = &statement->table->schema;
+  RowView row = row_view(record, RECORD_FIXED);
+  Value value;
+  value.is_integer = schema->columns[statement->order_column].type == COLUMN_TYPE_INTEGER;
+  if (value.is_integer)
+    value.integer = row_read_int(schema, row, statement->order_column);
+  else
+    value.string = row_read_text(schema, row, statement->order_column, &value.length);
+  return value;
+}
+
+// Order the num_rows copied rows, in entries.
+void sort_entries(const Statement *statement, const char *rows, uint32_t num_rows, SortEntry *entries)
+{
+  uint32_t row_size = statement->table->schema.row_size;
+  for (uint32_t i = 0; i < num_rows; i++)
+  {
+    SortEntry *entry = &entries[i];
+    entry->value = sort_value(statement, rows + (size_t)i * row_size);
+    entry->row = i;
+    entry->descending = statement->order_descending;
+  }
+  qsort(entries, num_rows, sizeof(SortEntry), compare_sort_entries);
+}
+
+/*
+External sort. The sort takes rows in until they fill its memory budget,
+and if there are more, sorts what it has and writes it to a temporary
+file as a run, and so on until its input ends. The runs are then merged
+as many at a time as the budget has room to buffer, through a loser tree:
+while there are too many, a pass merges them in groups into fewer longer
+runs, and the last merge hands its rows on as they come. Runs hold rows
+in the order they came in and ties go to the earlier run, so rows of
+equal value keep that order, as they do in memory. The file is unlinked
+as soon as it is made, so it goes away with the select however it ends.
+A file that cannot be made, written or read back fails the select.
+*/
+#define SORT_DEFAULT_MEMORY ((size_t)64 * 1024 * 1024)
+#define SORT_MIN_MEMORY ((size_t)1024 * 1024)
+// Each run being merged reads through a buffer of up to this size, and
+// runs are written through one.
+#define SORT_RUN_BUFFER_SIZE (256 * 1024)
+// Merges take at least this many runs at once however small the budget.
+#define SORT_MIN_MERGE_WIDTH 2
+
+typedef struct
+{
+  off_t offset;
+  uint32_t num_rows;
+} SortRunExtent;
+
+// A run being merged: the rows of it in buffer, [next, buffered) still to
+// come, and those still in the file from offset on.
+typedef struct
+{
+  off_t offset;
+  uint32_t unread;
+  char *buffer;
+  uint32_t buffered;
+  uint32_t next;
+} SortRun;
+
+struct SortSpill
+{
+  const Statement *statement;
+  uint32_t row_size;
+  size_t memory;
+  int file_descriptor;
+  off_t length;
+  // The runs to merge, in input order.
+  SortRunExtent *runs;
+  uint32_t num_runs;
+  uint32_t runs_capacity;
+  // The merge in progress over width runs, each buffering up to run_rows,
+  // and its loser tree: the winner in tree[0], and in tree[n] the loser of
+  // the match at node n, whose children are nodes 2n and 2n + 1 and whose
+  // leaves, from node width on, are the runs.
+  SortRun *merge;
+  uint32_t width;
+  uint32_t run_rows;
+  uint32_t *tree;
+  // Rows on their way into the run being written.
+  char *pending;
+  uint32_t num_pending;
+  uint32_t pending_capacity;
+  // A write or read of the file failed. Rows written after it are
+  // dropped, and a run that could not be read back ends there.
+  bool failed;
+};
+
+SortSpill *sort_spill_open(const Statement *statement)
+{
+  const char *dir = getenv("TMPDIR");
+  if (dir == NULL || dir[0] == '\0')
+  {
+    dir = "/tmp";
+  }
+  size_t length = strlen(dir);
+  char *path = (char *)malloc(length + sizeof("/sqlite-sort-XXXXXX"));
+  memcpy(path, dir, length);
+  memcpy(path + length, "/sqlite-sort-XXXXXX", sizeof("/sqlite-sort-XXXXXX"));
+  int fd = mkstemp(path);
+  if (fd == -1)
+  {
+    free(path);
+    return NULL;
+  }
+  unlink(path);
+  free(path);
+
+  SortSpill *spill = (SortSpill *)malloc(sizeof(SortSpill));
+  spill->statement = statement;
+  spill->row_size = statement->table->schema.row_size;
+  spill->memory = statement->db->sort_memory;
+  spill->file_descriptor = fd;
+  spill->length = 0;
+  spill->runs = NULL;
+  spill->num_runs = 0;
+  spill->runs_capacity = 0;
+  spill->merge = NULL;
+  spill->width = 0;
+  spill->run_rows = 0;
+  spill->tree = NULL;
+  spill->pending_capacity = SORT_RUN_BUFFER_SIZE / spill->row_size > 0 ? SORT_RUN_BUFFER_SIZE / spill->row_size : 1;
+  spill->pending = (char *)malloc((size_t)spill->pending_capacity * spill->row_size);
+  spill->num_pending = 0;
+  spill->failed = false;
+  return spill;
+}
+
+void sort_merge_close(SortSpill *spill)
+{
+  for (uint32_t i = 0; i < spill->width; i++)
+  {
+    free(spill->merge[i].buffer);
+  }
+  free(spill->merge);
+  free(spill->tree);
+  spill->merge = NULL;
+  spill->tree = NULL;
+  spill->width = 0;
+}
+
+void sort_spill_close(SortSpill *spill)
+{
+  if (spill == NULL)
+  {
+    return;
+  }
+  sort_merge_close(spill);
+  close(spill->file_descriptor);
+  free(spill->runs);
+  free(spill->pending);
+  free(spill);
+}
+
+void sort_flush_pending(SortSpill *spill)
+{
+  size_t length = (size_t)spill->num_pending * spill->row_size;
+  spill->num_pending = 0;
+  if (spill->failed ||
+      (length > 0 && pwrite(spill->file_descriptor, spill->pending, length, spill->length) != (ssize_t)length))
+  {
+    spill->failed = true;
+    return;
+  }
+  spill->length += length;
+}
+
+// Where the next row written to the run goes.
+char *sort_pending_row(SortSpill *spill)
+{
+  if (spill->num_pending == spill->pending_capacity)
+  {
+    sort_flush_pending(spill);
+  }
+  return spill->pending + (size_t)spill->num_pending * spill->row_size;
+}
+
+// Add the rows written from start on to runs as one run.
+void sort_end_run(SortSpill *spill, off_t start, SortRunExtent **runs, uint32_t *num_runs, uint32_t *capacity)
+{
+  sort_flush_pending(spill);
+  if (*num_runs == *capacity)
+  {
+    *capacity = *capacity == 0 ? 16 : *capacity * 2;
+    *runs = (SortRunExtent *)realloc(*runs, *capacity * sizeof(SortRunExtent));
+  }
+  (*runs)[*num_runs].offset = start;
+  (*runs)[*num_runs].num_rows = (uint32_t)((spill->length - start) / spill->row_size);
+  (*num_runs)++;
+}
+
+// Sort num_rows copied rows and write them out as the next run.
+void sort_spill_rows(SortSpill *spill, const char *rows, uint32_t num_rows, SortEntry *entries)
+{
+  sort_entries(spill->statement, rows, num_rows, entries);
+  off_t start = spill->length;
+  for (uint32_t i = 0; i < num_rows; i++)
+  {
+    memcpy(sort_pending_row(spill), rows + (size_t)entries[i].row * spill->row_size, spill->row_size);
+    spill->num_pending++;
+  }
+  sort_end_run(spill, start, &spill->runs, &spill->num_runs, &spill->runs_capacity);
+}
+
+void sort_run_fill(SortSpill *spill, SortRun *run)
+{
+  uint32_t count = run->unread < spill->run_rows ? run->unread : spill->run_rows;
+  size_t length = (size_t)count * spill->row_size;
+  run->next = 0;
+  if (pread(spill->file_descriptor, run->buffer, length, run->offset) != (ssize_t)length)
+  {
+    spill->failed = true;
+    run->unread = 0;
+    run->buffered = 0;
+    return;
+  }
+  run->offset += length;
+  run->unread -= count;
+  run->buffered = count;
+}
+
+// Whether run a's next row goes before run b's. A run with none left goes
+// after every other.
+bool sort_merge_before(const SortSpill *spill, uint32_t a, uint32_t b)
+{
+  const SortRun *x = &spill->merge[a], *y = &spill->merge[b];
+  if (x->next == x->buffered)
+  {
+    return false;
+  }
+  if (y->next == y->buffered)
+  {
+    return true;
+  }
+  const Statement *statement = spill->statement;
+  int cmp = compare_values(sort_value(statement, x->buffer + (size_t)x->next * spill->row_size),
+                           sort_value(statement, y->buffer + (size_t)y->next * spill->row_size));
+  if (statement->order_descending)
+  {
+    cmp = -cmp;
+  }
+  return cmp != 0 ? cmp < 0 : a < b;
+}
+
+// Play the matches of the subtree at node, leaving each one's loser at its
+// node, and return the winner.
+uint32_t sort_merge_play(SortSpill *spill, uint32_t node)
+{
+  if (node >= spill->width)
+  {
+    return node - spill->width;
+  }
+  uint32_t left = sort_merge_play(spill, 2 * node);
+  uint32_t right = sort_merge_play(spill, 2 * node + 1);
+  bool right_wins = sort_merge_before(spill, right, left);
+  spill->tree[node] = right_wins ? left : right;
+  return right_wins ? right : left;
+}
+
+// Merge the width runs from runs on.
+void sort_merge_open(SortSpill *spill, const SortRunExtent *runs, uint32_t width)
+{
+  size_t buffer_size = spill->memory / width < SORT_RUN_BUFFER_SIZE ? spill->memory / width : SORT_RUN_BUFFER_SIZE;
+  spill->run_rows = buffer_size / spill->row_size > 0 ? (uint32_t)(buffer_size / spill->row_size) : 1;
+  spill->width = width;
+  spill->merge = (SortRun *)malloc(width * sizeof(SortRun));
+  spill->tree = (uint32_t *)malloc(width * sizeof(uint32_t));
+  for (uint32_t i = 0; i < width; i++)
+  {
+    SortRun *run = &spill->merge[i];
+    run->offset = runs[i].offset;
+    run->unread = runs[i].num_rows;
+    run->buffer = (char *)malloc((size_t)spill->run_rows * spill->row_size);
+    sort_run_fill(spill, run);
+  }
+  spill->tree[0] = sort_merge_play(spill, 1);
+}
+
+// Copy the next row of the merge to record. Returns false once every run
+// is used up. Only the matches on the winner's path are played again.
+bool sort_merge_next(SortSpill *spill, char *record)
+{
+  uint32_t winner = spill->tree[0];
+  SortRun *run = &spill->merge[winner];
+  if (run->next == run->buffered)
+  {
+    return false;
+  }
+  memcpy(record, run->buffer + (size_t)run->next++ * spill->row_size, spill->row_size);
+  if (run->next == run->buffered && run->unread > 0)
+  {
+    sort_run_fill(spill, run);
+  }
+  for (uint32_t node = (winner + spill->width) / 2; node > 0; node /= 2)
+  {
+    if (sort_merge_before(spill, spill->tree[node], winner))
+    {
+      uint32_t loser = winner;
+      winner = spill->tree[node];
+      spill->tree[node] = loser;
+    }
+  }
+  spill->tree[0] = winner;
+  return true;
+}
+
+// Merge the runs in passes until one merge takes them all, and start it.
+// Each run's space in the file is given back once it has been merged.
+void sort_spill_finish(SortSpill *spill)
+{
+  size_t widest = spill->memory / SORT_RUN_BUFFER_SIZE;
+  uint32_t max_width = widest < SORT_MIN_MERGE_WIDTH ? SORT_MIN_MERGE_WIDTH
+                       : widest > UINT32_MAX       ? UINT32_MAX
+                                                   : (uint32_t)widest;
+  while (spill->num_runs > max_width)
+  {
+    SortRunExtent *merged = NULL;
+    uint32_t num_merged = 0, capacity = 0;
+    for (uint32_t first = 0; first < spill->num_runs; first += max_width)
+    {
+      uint32_t width = spill->num_runs - first < max_width ? spill->num_runs - first : max_width;
+      off_t start = spill->length;
+      sort_merge_open(spill, spill->runs + first, width);
+      while (sort_merge_next(spill, sort_pending_row(spill)))
+      {
+        spill->num_pending++;
+      }
+      sort_merge_close(spill);
+      sort_end_run(spill, start, &merged, &num_merged, &capacity);
+#ifdef FALLOC_FL_PUNCH_HOLE
+      // A group's runs were written one after another.
+      const SortRunExtent *last = &spill->runs[first + width - 1];
+      off_t from = spill->runs[first].offset;
+      off_t to = last->offset + (off_t)last->num_rows * spill->row_size;
+      fallocate(spill->file_descriptor, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to - from);
+#endif
+    }
+    free(spill->runs);
+    spill->runs = merged;
+    spill->num_runs = num_merged;
+    spill->runs_capacity = capacity;
+  }
+  sort_merge_open(spill, spill->runs, spill->num_runs);
+}
+
+// Take in every row the sort's input produces, copying each out since its
+// leaf is released as the sort goes on, and put them in order: in memory,
+// or once they outgrow the budget, in runs on disk ready to merge. Returns
+// false if the runs could not be written.
+bool sort_rows(Operator *op, Batch *batch)
+{
+  Statement *statement = op->statement;
+  Executor *executor = statement->executor;
+  const TableSchema *schema = &statement->table->schema;
+  uint32_t row_size = schema->row_size;
+  size_t budget_rows = statement->db->sort_memory / (row_size + sizeof(SortEntry));
+  uint32_t max_rows = budget_rows < 1 ? 1 : budget_rows > UINT32_MAX - 1 ? UINT32_MAX - 1 : (uint32_t)budget_rows;
+  uint32_t capacity = BATCH_MAX_ROWS < max_rows ? BATCH_MAX_ROWS : max_rows;
+  uint32_t num_rows = 0;
+  char *rows = (char *)malloc((size_t)capacity * row_size);
+  SortEntry *entries = NULL;
+  while (op->input->next(op->input, batch))
+  {
+    for (uint32_t i = 0; i < batch->num_rows; i++)
+    {
+      if (num_rows == capacity && capacity < max_rows)
+      {
+        capacity = capacity <= max_rows / 2 ? capacity * 2 : max_rows;
+        rows = (char *)realloc(rows, (size_t)capacity * row_size);
+      }
+      else if (num_rows == capacity)
+      {
+        if (executor->spill == NULL)
+        {
+          executor->spill = sort_spill_open(statement);
+          if (executor->spill == NULL)
+          {
+            batch_release(batch);
+            free(rows);
+            return false;
+          }
+          entries = (SortEntry *)malloc((size_t)max_rows * sizeof(SortEntry));
+        }
+        sort_spill_rows(executor->spill, rows, num_rows, entries);
+        num_rows = 0;
+        if (executor->spill->failed)
+        {
+          batch_release(batch);
+          free(entries);
+          free(rows);
+          return false;
+        }
+      }
+      row_copy_fixed(schema, batch_row(statement, batch, i), rows + (size_t)num_rows++ * row_size);
+    }
+    batch_release(batch);
+  }
+
+  if (executor->spill != NULL)
+  {
+    if (num_rows > 0)
+    {
+      sort_spill_rows(executor->spill, rows, num_rows, entries);
+    }
+    free(entries);
+    free(rows);
+    sort_spill_finish(executor->spill);
+    executor->sorted = (char *)malloc((size_t)BATCH_MAX_ROWS * row_size);
+    return !executor->spill->failed;
+  }
+  entries = (SortEntry *)malloc(((size_t)num_rows + 1) * sizeof(SortEntry));
+  sort_entries(statement, rows, num_rows, entries);
+  executor->sorted = (char *)malloc(((size_t)num_rows + 1) * row_size);
+  for (uint32_t i = 0; i < num_rows; i++)
+  {
+    memcpy(executor->sorted + (size_t)i * row_size, rows + (size_t)entries[i].row * row_size, row_size);
+  }
+  executor->num_sorted = num_rows;
+  executor->next_sorted = 0;
+  free(entries);
+  free(rows);
+  return true;
+}
+
+// Sort: takes in all of its input on the first call, then hands the rows
+// on in order a batch at a time, from memory or from the merge.
+bool sort_next(Operator *op, Batch *batch)
+{
+  Executor *executor = op->statement->executor;
+  if (executor->sorted == NULL && !sort_rows(op, batch))
+  {
+    executor->failed = true;
+    return false;
+  }
+  if (executor->spill != NULL)
+  {
+    uint32_t row_size = op->statement->table->schema.row_size;
+    uint32_t count = 0;
+    while (count < BATCH_MAX_ROWS && sort_merge_next(executor->spill, executor->sorted + (size_t)count * row_size))
+    {
+      count++;
+    }
+    if (executor->spill->failed)
+    {
+      executor->failed = true;
+      return false;
+    }
+    batch->records = executor->sorted;
+    batch->num_rows = count;
+    return count > 0;
+  }
+  uint32_t count = executor->num_sorted - executor->next_sorted;
+  if (count == 0)
+  {
+    return false;
+  }
+  if (count > BATCH_MAX_ROWS)
+  {
+    count = BATCH_MAX_ROWS;
+  }
+  batch->records = executor->sorted + (size_t)executor->next_sorted * op->statement->table->schema.row_size;
+  batch->num_rows = count;
+  executor->next_sorted += count;
+  return true;
+}
+
+// Leave out the first count rows of a batch.
+void batch_drop(const Statement *statement, Batch *batch, uint32_t count)
+{
+  if (batch->records != NULL)
+  {
+    batch->records += (size_t)count * statement->table->schema.row_size;
+  }
+  else
+  {
+    memmove(batch->cells, batch->cells + count, (batch->num_rows - count) * sizeof(uint16_t));
+  }
+  batch->num_rows -= count;
+}
+
+// Offset: drops rows from the front until it has dropped enough.
+bool offset_next(Operator *op, Batch *batch)
+{
+  Executor *executor = op->statement->executor;
+  while (op->input->next(op->input, batch))
+  {
+    if (executor->skip < batch->num_rows)
+    {
+      batch_drop(op->statement, batch, executor->skip);
+      executor->skip = 0;
+      return true;
+    }
+    executor->skip -= batch->num_rows;
+    batch_release(batch);
+  }
+  return false;
+}
+
+// Limit: lets rows through until it reaches the limit, and then ends
+// without pulling any more.
+bool limit_next(Operator *op, Batch *batch)
+{
+  Executor *executor = op->statement->executor;
+  if (executor->remaining == 0 || !op->input->next(op->input, batch))
+  {
+    return false;
+  }
+  if (batch->num_rows > executor->remaining)
+  {
+    batch->num_rows = executor->remaining;
+  }
+  executor->remaining -= batch->num_rows;
+  return true;
+}
+
+Operator *operator_push(Operator *op, OperatorNext next, Operator *input)
+{
+  op->next = next;
+  op->input = input;
+  op->statement = input->statement;
+  return op;
+}
+
+// Put the select's operators together from the source up.
+void executor_open(Statement *statement)
+{
+  Executor *executor = (Executor *)malloc(sizeof(Executor));
+  executor->batch.pinned = false;
+  executor->batch.records = NULL;
+  executor->batch.num_rows = 0;
+  executor->next_row = 0;
+  executor->skip = statement->offset;
+  executor->scan_skip = 0;
+  executor->remaining = statement->limit;
+  executor->sorted = NULL;
+  executor->num_sorted = 0;
+  executor->next_sorted = 0;
+  executor->spill = NULL;
+  executor->failed = false;
+  executor->leaves = NULL;
+  executor->num_leaves = 0;
+  executor->scan_leaf = 0;
+  executor->prefetched = 0;
+  executor->back_cell = SCAN_NEW_LEAF;
+
+  Operator *top = &executor->source;
+  top->statement = statement;
+  top->input = NULL;
+  top->next = statement->parallel != NULL      ? parallel_next
+              : statement->lookup.active       ? index_next
+              : select_scans_backwards(statement) ? scan_backwards_next
+                                                  : scan_next;
+  // Parallel workers have already run the where clause.
+  bool filtered = statement->where_is_range || statement->parallel != NULL ||
+                  (statement->lookup.active && statement->lookup.exact);
+  if (!filtered)
+  {
+    top = operator_push(&executor->filter, filter_next, top);
+  }
+  // An aggregate's one row is neither sorted nor cut short here.
+  if (statement->aggregate == AGGREGATE_NONE)
+  {
+    if (select_needs_sort(statement))
+    {
+      top = operator_push(&executor->sort, sort_next, top);
+    }
+    if (top->next == scan_next)
+    {
+      executor->scan_skip = statement->offset;
+    }
+    else if (statement->offset > 0)
+    {
+      top = operator_push(&executor->offset, offset_next, top);
+    }
+    if (statement->has_limit)
+    {
+      top = operator_push(&executor->limit, limit_next, top);
+    }
+  }
+  executor->top = top;
+  statement->executor = executor;
+
+  uint32_t low, high;
+  if (executor->source.next == scan_next && !select_stops_early(statement) && !aggregate_from_keys(statement) &&
+      !statement->cursor->end_of_table && key_bounds(&statement->range, &low, &high))
+  {
+    executor->num_leaves = table_leaves(statement->table->table, low, high, &executor->leaves);
+    scan_read_ahead(statement);
+  }
+  else if (executor->source.next == scan_backwards_next && !statement->cursor->end_of_table &&
+           key_bounds(&statement->range, &low, &high))
+  {
+    uint32_t *leaves;
+    uint32_t num_leaves = table_leaves(statement->table->table, low, high, &leaves);
+    executor->leaves = (uint32_t *)malloc(((size_t)num_leaves + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < num_leaves; i++)
+    {
+      executor->leaves[i] = leaves[num_leaves - 1 - i];
+    }
+    free(leaves);
+    executor->num_leaves = num_leaves;
+    // One that stops early has no use for leaves far ahead.
+    if (select_stops_early(statement))
+    {
+      executor->prefetched = num_leaves;
+    }
+    scan_read_ahead(statement);
+  }
+}
+
+// Position the cursor at the start of the range, before any row is read,
+// and set up the operators that read from it.
+void select_open(Statement *statement, Table *table)
+{
+  // Parameters may have changed the bounds since the last run.
+  KeyRange *range = &(statement->range);
+  memset(range, 0, sizeof(KeyRange));
+  statement->where_is_range = statement->where == EXPR_NONE ||
+                              extract_key_range(statement, statement->where, range);
+  // On a reader, the select sees one commit until statement_stop.
+  pager_begin_read(table->pager);
+  // An index is used unless the key range already comes down to one row.
+  IndexLookup *lookup = &(statement->lookup);
+  bool single_key = range->has_lower && range->has_upper && range->lower == range->upper &&
+                    range->lower_inclusive && range->upper_inclusive;
+  lookup->active = !statement->where_is_range && !single_key &&
+                   find_index_lookup(statement, statement->where, lookup);
+  if (lookup->active)
+  {
+    // A longer value than the column holds matches nothing.
+    lookup->cursor.end_of_index = lookup->length > lookup->index->value_size;
+    if (!lookup->cursor.end_of_index)
+    {
+      index_seek(lookup->index, lookup->text, lookup->length, &lookup->cursor);
+    }
+  }
+  bool full_scan = !lookup->active && !range->has_lower && !range->has_upper;
+  pager_advise(table->pager, full_scan ? PAGER_ACCESS_SEQUENTIAL : PAGER_ACCESS_RANDOM);
+  Cursor *cursor = range->has_lower ? table_find(table, range->lower) : table_start(table);
+  if (range->has_lower && !range->lower_inclusive && !cursor->end_of_table &&
+      cursor_key(cursor) == range->lower)
+  {
+    cursor_advance(cursor);
+  }
+  statement->cursor = cursor;
+
+  KernelFilter *filter = &(statement->kernel_filter);
+  filter->active = !lookup->active && table->layout.format == RECORD_COLUMNAR && !statement->where_is_range &&
+                   find_kernel_filter(statement, statement->where, filter);
+  parallel_scan_start(statement, table);
+  executor_open(statement);
+}
+
+// Move to the next row the select produces. Returns false after the last.
+bool select_step(Statement *statement)
+{
+  Executor *executor = statement->executor;
+  while (executor->next_row == executor->batch.num_rows)
+  {
+    batch_release(&executor->batch);
+    executor->next_row = 0;
+    if (!executor->top->next(executor->top, &executor->batch))
+    {
+      return false;
+    }
+  }
+  statement->row = batch_row(statement, &executor->batch, executor->next_row++);
+  return true;
+}
+
+// Fold a batch's rows into partial, in one pass over them.
+void aggregate_batch(const Statement *statement, const Batch *batch, AggregatePartial *partial)
+{
+  if (statement->aggregate == AGGREGATE_COUNT)
+  {
+    partial_add(partial, batch->num_rows, 0, 0, 0);
+    return;
+  }
+  const TableSchema *schema = &statement->table->schema;
+  uint32_t min = UINT32_MAX, max = 0;
+  uint64_t sum = 0;
+  for (uint32_t i = 0; i < batch->num_rows; i++)
+  {
+    uint32_t value = row_read_int(schema, batch_row(statement, batch, i), statement->aggregate_column);
+    min = value < min ? value : min;
+    max = value > max ? value : max;
+    sum += value;
+  }
+  partial_add(partial, batch->num_rows, min, max, sum);
+}
+
+/*
+Aggregate over a columnar table whose where clause is only a key range.
+Keys are sorted within a leaf, so the rows in range are a run of cells
+counted by one kernel call, and min and max are taken over the same run
+of the column's array.
+*/
+void aggregate_key_range(Statement *statement, AggregatePartial *total)
+{
+  Cursor *cursor = statement->cursor;
+  uint32_t low, high;
+  if (!key_bounds(&statement->range, &low, &high))
+  {
+    return;
+  }
+  while (!cursor->end_of_table)
+  {
+    uint32_t first = cursor->cell_num;
+    uint32_t cells = cursor_leaf_cells(cursor) - first;
+    const uint32_t *keys = (const uint32_t *)cursor_leaf_column(cursor, 0) + first;
+    uint32_t in_range = kernel_count_range(keys, cells, 0, high);
+    stats_count(STAT_ROWS_SCANNED, in_range);
+    if (in_range > 0 && statement->aggregate != AGGREGATE_COUNT)
+    {
+      const uint32_t *values = (const uint32_t *)cursor_leaf_column(cursor, statement->aggregate_column) + first;
+      partial_add_array(statement, total, values, in_range);
+    }
+    else
+    {
+      partial_add(total, in_range, 0, 0, 0);
+    }
+    if (in_range < cells)
+    {
+      break;
+    }
+    scan_next_leaf(statement);
+  }
+}
+
+// Compute an aggregate in a single step. Returns false when it has no
+// value: min or max of no rows.
+bool execute_aggregate(Statement *statement, Table *table)
+{
+  select_open(statement, table);
+  AggregatePartial total;
+  memset(&total, 0, sizeof(total));
+  if (aggregate_from_keys(statement))
+  {
+    aggregate_keys(statement, table, &total);
+  }
+  else if (statement->parallel != NULL)
+  {
+    for (uint32_t i = 0; i < scan_pool_workers(statement->db->scan_pool); i++)
+    {
+      const AggregatePartial *partial = &statement->parallel->partials[i];
+      partial_add(&total, partial->count, partial->min, partial->max, partial->sum);
+    }
+  }
+  else if (table->layout.format == RECORD_COLUMNAR && statement->where_is_range)
+  {
+    aggregate_key_range(statement, &total);
+  }
+  else
+  {
+    Executor *executor = statement->executor;
+    while (executor->top->next(executor->top, &executor->batch))
+    {
+      aggregate_batch(statement, &executor->batch, &total);
+      batch_release(&executor->batch);
+    }
+  }
+  statement_stop(statement);
+  switch (statement->aggregate)
+  {
+  case (AGGREGATE_MIN):
+    statement->aggregate_value = total.min;
+    return total.count > 0;
+  case (AGGREGATE_MAX):
+    statement->aggregate_value = total.max;
+    return total.count > 0;
+  case (AGGREGATE_SUM):
+    statement->aggregate_value = total.sum;
+    return total.count > 0;
+  default:
+    statement->aggregate_value = total.count;
+    return true;
+  }
+}
+
+ExecuteResult execute_select_step(Statement *statement, Table *table)
+{
+  if (statement->aggregate != AGGREGATE_NONE)
+  {
+    bool has_value = execute_aggregate(statement, table);
+    statement->done = true;
+    // The offset and limit apply to the one row the aggregate produces.
+    bool kept = statement->offset == 0 && !(statement->has_limit && statement->limit == 0);
+    return has_value && kept ? EXECUTE_ROW : EXECUTE_SUCCESS;
+  }
+  if (statement->cursor == NULL)
+  {
+    select_open(statement, table);
+  }
+  if (!select_step(statement))
+  {
+    // Stopping releases a failed sort's memory and its file.
+    bool failed = statement->executor->failed;
+    statement_stop(statement);
+    statement->done = true;
+    return failed ? EXECUTE_FAILED : EXECUTE_SUCCESS;
+  }
+  return EXECUTE_ROW;
+}
+
+/*
+Catalog
+
+Tables made with CREATE TABLE and indexes made with CREATE INDEX are
+listed in "<db>-catalog" beside the database file: CATALOG_MAGIC, the
+number of tables and of indexes, whether the database was closed cleanly
+and how many pages it had then, one CatalogRecord per table, one
+IndexRecord per index, and then the row count of every table, users
+first. A table's tree records its own format; the catalog's copy is for a
+table whose root page never reached the log. Catalogs from before indexes
+have the oldest magic and only the table count, and those from before
+row counts stop after the index count and the indexes.
+It is rewritten whole through a temporary file and a rename, after the
+new tree has been committed, so a crash leaves either the old list or the
+new one.
+
+A clean close writes it last, once the log has gone into the database
+file, so an open that finds it clean, with the file still the size it
+says, takes the row counts as they are and leaves count(*) nothing to
+read. The first change after such an open writes it again unclean before
+touching a page, so it never vouches for counts a crash may have left
+out. When it is not clean the counts are only taken again once something
+counts the rows.
+*/
+#define CATALOG_MAGIC 0x43415434 // "CAT4"
+#define CATALOG_MAGIC_NO_COUNTS 0x43415433 // "CAT3"
+#define CATALOG_MAGIC_TABLES_ONLY 0x43415432 // "CAT2"
+
+typedef struct
+{
+  TableSchema schema;
+  uint32_t root_page_num;
+  uint32_t format; // RecordFormat
+} CatalogRecord;
+
+typedef struct
+{
+  char name[SCHEMA_NAME_SIZE + 1];
+  uint32_t table; // 0 is users
+  uint32_t column;
+  uint32_t root_page_num;
+} IndexRecord;
+
+// Returns false if the catalog is there but cannot be read; the tables
+// and indexes listed before the fault stay open in db.
+bool catalog_load(Database *db, Pager *pager)
+{
+  FILE *file = fopen(db->catalog_path, "rb");
+  if (file == NULL)
+  {
+    return true;
+  }
+  uint32_t header[2];
+  uint32_t num_indexes = 0;
+  // Whether it was closed cleanly, and the number of pages then.
+  uint32_t shutdown[2] = {0, 0};
+  if (fread(header, sizeof(header), 1, file) != 1 ||
+      (header[0] != CATALOG_MAGIC && header[0] != CATALOG_MAGIC_NO_COUNTS &&
+       header[0] != CATALOG_MAGIC_TABLES_ONLY) ||
+      (header[0] != CATALOG_MAGIC_TABLES_ONLY && fread(&num_indexes, sizeof(num_indexes), 1, file) != 1) ||
+      (header[0] == CATALOG_MAGIC && fread(shutdown, sizeof(shutdown), 1, file) != 1) ||
+      header[1] > CATALOG_MAX_TABLES - 1 || num_indexes > CATALOG_MAX_INDEXES)
+  {
+    fclose(file);
+    return false;
+  }
+  for (uint32_t i = 0; i < header[1]; i++)
+  {
+    CatalogRecord record;
+    if (fread(&record, sizeof(record), 1, file) != 1)
+    {
+      fclose(file);
+      return false;
+    }
+    CatalogTable *entry = &db->tables[db->num_tables++];
+    entry->schema = record.schema;
+    entry->table = table_open(pager, record.root_page_num, &entry->schema, (RecordFormat)record.format);
+  }
+  for (uint32_t i = 0; i < num_indexes; i++)
+  {
+    IndexRecord record;
+    if (fread(&record, sizeof(record), 1, file) != 1 || record.table >= db->num_tables ||
+        record.column >= db->tables[record.table].schema.num_columns)
+    {
+      fclose(file);
+      return false;
+    }
+    CatalogIndex *entry = &db->indexes[db->num_indexes++];
+    memcpy(entry->name, record.name, sizeof(entry->name));
+    entry->table = record.table;
+    entry->column = record.column;
+    uint32_t width = db->tables[record.table].schema.columns[record.column].size;
+    entry->index = index_open(pager, record.root_page_num, width);
+  }
+  if (header[0] == CATALOG_MAGIC)
+  {
+    uint32_t num_rows[CATALOG_MAX_TABLES];
+    if (fread(num_rows, sizeof(uint32_t), db->num_tables, file) != db->num_tables)
+    {
+      fclose(file);
+      return false;
+    }
+    db->clean = shutdown[0] != 0 && shutdown[1] == pager_num_pages(pager);
+    for (uint32_t i = 0; i < db->num_tables && db->clean; i++)
+    {
+      db->tables[i].table->num_rows = num_rows[i];
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+// num_pages is the size of the database file, for a clean catalog.
+// Returns false, leaving the catalog on disk as it was, if the new one
+// cannot be written.
+bool catalog_save(Database *db, uint32_t num_pages)
+{
+  size_t length = strlen(db->catalog_path);
+  char *temp_path = (char *)malloc(length + 5);
+  memcpy(temp_path, db->catalog_path, length);
+  memcpy(temp_path + length, ".tmp", 5);
+
+  FILE *file = fopen(temp_path, "wb");
+  if (file == NULL)
+  {
+    free(temp_path);
+    return false;
+  }
+  uint32_t header[5] = {CATALOG_MAGIC, db->num_tables - 1, db->num_indexes, db->clean, db->clean ? num_pages : 0};
+  fwrite(header, sizeof(header), 1, file);
+  for (uint32_t i = 1; i < db->num_tables; i++)
+  {
+    CatalogRecord record;
+    memset(&record, 0, sizeof(record));
+    record.schema = db->tables[i].schema;
+    record.root_page_num = db->tables[i].table->root_page_num;
+    record.format = db->tables[i].table->layout.format;
+    fwrite(&record, sizeof(record), 1, file);
+  }
+  for (uint32_t i = 0; i < db->num_indexes; i++)
+  {
+    IndexRecord record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.name, db->indexes[i].name, sizeof(record.name));
+    record.table = db->indexes[i].table;
+    record.column = db->indexes[i].column;
+    record.root_page_num = db->indexes[i].index->root_page_num;
+    fwrite(&record, sizeof(record), 1, file);
+  }
+  for (uint32_t i = 0; i < db->num_tables; i++)
+  {
+    fwrite(&db->tables[i].table->num_rows, sizeof(uint32_t), 1, file);
+  }
+  bool written = !ferror(file) && fflush(file) == 0 && fsync(fileno(file)) == 0;
+  if (fclose(file) != 0 || !written || rename(temp_path, db->catalog_path) == -1)
+  {
+    unlink(temp_path);
+    free(temp_path);
+    return false;
+  }
+  free(temp_path);
+  return true;
+}
+
+// Returns false, and the change must not go ahead, if the catalog could
+// not be written unclean.
+bool catalog_mark_changed(Database *db)
+{
+  if (db->clean)
+  {
+    db->clean = false;
+    if (!catalog_save(db, 0))
+    {
+      db->clean = true;
+      return false;
+    }
+  }
+  return true;
+}
+
+ExecuteResult execute_create_table(Statement *statement)
+{
+  Database *db = statement->db;
+  const TableSchema *schema = &statement->create_schema;
+  if (find_table(db, schema->name, strlen(schema->name)) != NULL)
+  {
+    return EXECUTE_TABLE_EXISTS;
+  }
+  if (db->num_tables == CATALOG_MAX_TABLES || !catalog_mark_changed(db))
+  {
+    return EXECUTE_FAILED;
+  }
+  // The tree keeps a pointer to the schema, so it lives in the entry.
+  CatalogTable *entry = &db->tables[db->num_tables];
+  entry->schema = *schema;
+  Pager *pager = db->tables[0].table->pager;
+  entry->table = table_create(pager, &entry->schema, statement->create_format);
+  if (entry->table == NULL)
+  {
+    return EXECUTE_TABLE_FULL;
+  }
+  if (db->hash_keys)
+  {
+    table_hash_keys(entry->table);
+  }
+  pager_commit(pager);
+  db->num_tables++;
+  // Unlisted, the new tree's pages go unused.
+  if (!catalog_save(db, 0))
+  {
+    table_close(entry->table);
+    db->num_tables--;
+    return EXECUTE_FAILED;
+  }
+  return EXECUTE_SUCCESS;
+}
+
+CatalogIndex *find_index(Database *db, const char *name)
+{
+  for (uint32_t i = 0; i < db->num_indexes; i++)
+  {
+    if (strcasecmp(db->indexes[i].name, name) == 0)
+    {
+      return &db->indexes[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+Build the index from the rows already in the table, then list it. Rows
+are read in place, so each value is copied out before its entry is added
+and other pages are read.
+*/
+ExecuteResult execute_create_index(Statement *statement)
+{
+  Database *db = statement->db;
+  if (find_index(db, statement->create_index_name) != NULL)
+  {
+    return EXECUTE_INDEX_EXISTS;
+  }
+  if (db->num_indexes == CATALOG_MAX_INDEXES || !catalog_mark_changed(db))
+  {
+    return EXECUTE_FAILED;
+  }
+  CatalogTable *table = statement->table;
+  uint32_t column = statement->create_index_column;
+  Pager *pager = table->table->pager;
+  Index *index = index_create(pager, table->schema.columns[column].size);
+  if (index == NULL)
+  {
+    return EXECUTE_TABLE_FULL;
+  }
+
+  ExecuteResult result = EXECUTE_SUCCESS;
+  char value[SCHEMA_MAX_TEXT_SIZE];
+  Cursor *cursor = table_start(table->table);
+  while (!cursor->end_of_table && result == EXECUTE_SUCCESS)
+  {
+    uint32_t length;
+    const char *text = row_read_text(&table->schema, cursor_row(cursor), column, &length);
+    memcpy(value, text, length);
+    result = index_insert(index, value, length, cursor_key(cursor));
+    cursor_advance(cursor);
+  }
+  free(cursor);
+  pager_commit(pager);
+  if (result != EXECUTE_SUCCESS)
+  {
+    index_close(index);
+    return result;
+  }
+
+  CatalogIndex *entry = &db->indexes[db->num_indexes++];
+  memcpy(entry->name, statement->create_index_name, sizeof(entry->name));
+  entry->table = (uint32_t)(table - db->tables);
+  entry->column = column;
+  entry->index = index;
+  if (!catalog_save(db, 0))
+  {
+    index_close(index);
+    db->num_indexes--;
+    return EXECUTE_FAILED;
+  }
+  return EXECUTE_SUCCESS;
+}
+
+/*
+Public API
+*/
+Database *sqlite_open(const char *filename, uint32_t flags)
+{
+  Database *db = (Database *)malloc(sizeof(Database));
+  WalSyncMode sync_mode = (flags & SQLITE_OPEN_SYNC_FULL) ? WAL_SYNC_FULL : WAL_SYNC_NORMAL;
+  RecordFormat format = RECORD_VARIABLE;
+  if (flags & SQLITE_OPEN_FIXED_ROWS)
+    format = RECORD_FIXED;
+  else if (flags & SQLITE_OPEN_COLUMNAR_ROWS)
+    format = RECORD_COLUMNAR;
+  uint32_t page_shift = (flags & SQLITE_OPEN_PAGE_SIZE_MASK) >> SQLITE_OPEN_PAGE_SIZE_SHIFT;
+  uint32_t page_size = page_shift != 0 && page_size_valid(1u << page_shift) ? 1u << page_shift : DEFAULT_PAGE_SIZE;
+  Table *users = db_open(filename, (flags & SQLITE_OPEN_MMAP) != 0, sync_mode, format, page_size);
+  db->tables[0].schema = *users_schema();
+  db->tables[0].table = users;
+  db->num_tables = 1;
+  db->num_indexes = 0;
+
+  size_t length = strlen(filename);
+  db->catalog_path = (char *)malloc(length + sizeof("-catalog"));
+  memcpy(db->catalog_path, filename, length);
+  memcpy(db->catalog_path + length, "-catalog", sizeof("-catalog"));
+  db->clean = false;
+  if (!catalog_load(db, users->pager))
+  {
+    for (uint32_t i = 0; i < db->num_indexes; i++)
+    {
+      index_close(db->indexes[i].index);
+    }
+    for (uint32_t i = 1; i < db->num_tables; i++)
+    {
+      table_close(db->tables[i].table);
+    }
+    db_close(users);
+    free(db->catalog_path);
+    free(db);
+    return NULL;
+  }
+  if (flags & SQLITE_OPEN_COMPRESS)
+  {
+    pager_compress_pages(users->pager);
+  }
+  db->hash_keys = (flags & SQLITE_OPEN_HASH_KEYS) != 0;
+  db->in_transaction = false;
+  for (uint32_t i = 0; i < db->num_tables && db->hash_keys; i++)
+  {
+    table_hash_keys(db->tables[i].table);
+  }
+
+  db->plan_cache = new_plan_cache();
+  db->scratch_in_use = false;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  db->scan_threads = cpus < 1 ? 1 : cpus > SCAN_MAX_WORKERS ? SCAN_MAX_WORKERS : (uint32_t)cpus;
+  db->sort_memory = SORT_DEFAULT_MEMORY;
+  db->scan_pool = NULL;
+  db->reader = NULL;
+  return db;
+}
+
+Database *sqlite_open_reader(Database *db)
+{
+  // The reader's first snapshot must already hold every table's root.
+  pager_commit(db->tables[0].table->pager);
+  Pager *pager = pager_open_reader(db->tables[0].table->pager);
+  if (pager == NULL)
+  {
+    return NULL;
+  }
+  Database *reader = (Database *)malloc(sizeof(Database));
+  for (uint32_t i = 0; i < db->num_tables; i++)
+  {
+    reader->tables[i].schema = db->tables[i].schema;
+    reader->tables[i].table = table_view(pager, db->tables[i].table, &reader->tables[i].schema);
+  }
+  reader->num_tables = db->num_tables;
+  for (uint32_t i = 0; i < db->num_indexes; i++)
+  {
+    reader->indexes[i] = db->indexes[i];
+    reader->indexes[i].index = index_view(pager, db->indexes[i].index);
+  }
+  reader->num_indexes = db->num_indexes;
+  reader->catalog_path = NULL;
+  reader->clean = false;
+  reader->plan_cache = new_plan_cache();
+  reader->scratch_in_use = false;
+  reader->scan_threads = db->scan_threads;
+  reader->sort_memory = db->sort_memory;
+  reader->scan_pool = NULL;
+  reader->hash_keys = false;
+  reader->in_transaction = false;
+  reader->reader = pager;
+  return reader;
+}
+
+void sqlite_close(Database *db)
+{
+  if (db->scratch_in_use)
+  {
+    statement_release(&db->scratch);
+  }
+  free_plan_cache(db->plan_cache);
+  if (db->scan_pool != NULL)
+  {
+    scan_pool_close(db->scan_pool);
+  }
+  if (db->reader != NULL)
+  {
+    pager_close(db->reader);
+  }
+  else
+  {
+    // Closing the pager moves the log into the database file; only then
+    // can the catalog say it was closed cleanly.
+    Pager *pager = db->tables[0].table->pager;
+    uint32_t num_pages = pager_num_pages(pager);
+    pager_close(pager);
+    // A catalog that cannot be written clean stays unclean, which only
+    // costs the next open its row counts.
+    if (!db->clean)
+    {
+      db->clean = true;
+      catalog_save(db, num_pages);
+    }
+  }
+  for (uint32_t i = 0; i < db->num_indexes; i++)
+  {
+    index_close(db->indexes[i].index);
+  }
+  for (uint32_t i = 0; i < db->num_tables; i++)
+  {
+    table_close(db->tables[i].table);
+  }
+  free(db->catalog_path);
+  free(db);
+}
+
+void sqlite_set_scan_threads(Database *db, uint32_t threads)
+{
+  if (db->scan_pool != NULL)
+  {
+    scan_pool_close(db->scan_pool);
+    db->scan_pool = NULL;
+  }
+  db->scan_threads = threads < 1 ? 1 : threads > SCAN_MAX_WORKERS ? SCAN_MAX_WORKERS : threads;
+}
+
+void sqlite_set_sort_memory(Database *db, size_t bytes)
+{
+  db->sort_memory = bytes < SORT_MIN_MEMORY ? SORT_MIN_MEMORY : bytes;
+}
+
+bool sqlite_set_cache_pages(Database *db, uint32_t pages)
+{
+  return db->reader == NULL && pager_set_cache_size(db->tables[0].table->pager, pages);
+}
+
+void sqlite_begin(Database *db)
+{
+  db->in_transaction = true;
+}
+
+void sqlite_commit(Database *db)
+{
+  db->in_transaction = false;
+  pager_commit(db->tables[0].table->pager);
+}
+
+PrepareResult sqlite_prepare(Database *db, const char *sql, Statement **out)
+{
+  Statement *statement = (Statement *)malloc(sizeof(Statement));
+  PrepareResult result = prepare_copy(db, sql, statement, false);
+  if (result != PREPARE_SUCCESS)
+  {
+    free(statement);
+    *out = NULL;
+    return result;
+  }
+  statement->db = db;
+  statement->owner = STATEMENT_OWNED;
+  *out = statement;
+  return PREPARE_SUCCESS;
+}
+
+PrepareResult sqlite_prepare_cached(Database *db, const char *sql, Statement **out)
+{
+  Statement *scratch = &db->scratch;
+  if (db->scratch_in_use)
+  {
+    if (statement_in_use(scratch))
+    {
+      scratch = NULL;
+    }
+    else
+    {
+      statement_release(scratch);
+      db->scratch_in_use = false;
+    }
+  }
+  Statement *statement;
+  PrepareResult result = plan_cache_prepare(db, db->plan_cache, sql, scratch, &statement);
+  if (statement == NULL)
+  {
+    *out = NULL;
+    return result;
+  }
+  if (statement == &db->scratch)
+  {
+    if (result != PREPARE_SUCCESS)
+    {
+      *out = NULL;
+      return result;
+    }
+    statement->owner = STATEMENT_SCRATCH;
+    db->scratch_in_use = true;
+  }
+  statement->db = db;
+  *out = result == PREPARE_SUCCESS ? statement : NULL;
+  return result;
+}
+
+// Count the statement as one execution, from its first step to now, and
+// add the rows it returned, however it came to stop: finished, or
+// abandoned part way through.
+void statement_record_execute(Statement *statement)
+{
+  if (statement->execute_start != 0)
+  {
+    stats_time(STAT_EXECUTE, statement->execute_start);
+    statement->execute_start = 0;
+  }
+  if (statement->rows_returned > 0)
+  {
+    stats_count(STAT_ROWS_RETURNED, statement->rows_returned);
+    statement->rows_returned = 0;
+  }
+}
+
+BindResult sqlite_bind_int(Statement *statement, uint32_t index, uint32_t value)
+{
+  statement_record_execute(statement);
+  statement_stop(statement);
+  return statement_bind_int(statement, index, value);
+}
+
+BindResult sqlite_bind_text(Statement *statement, uint32_t index, const char *text, uint32_t length)
+{
+  statement_record_execute(statement);
+  statement_stop(statement);
+  return bind_text(statement, index, text, length, false);
+}
+
+ExecuteResult statement_step(Statement *statement)
+{
+  if (statement->done)
+  {
+    return EXECUTE_SUCCESS;
+  }
+  if (!statement_is_bound(statement))
+  {
+    return EXECUTE_UNBOUND_PARAMETER;
+  }
+  switch (statement->type)
+  {
+  case (STATEMENT_INSERT):
+    statement->done = true;
+    if (statement->db->reader != NULL)
+    {
+      return EXECUTE_READ_ONLY;
+    }
+    return execute_insert(statement, statement->table->table);
+  case (STATEMENT_SELECT):
+    return execute_select_step(statement, statement->table->table);
+  case (STATEMENT_CREATE_TABLE):
+    statement->done = true;
+    if (statement->db->reader != NULL)
+    {
+      return EXECUTE_READ_ONLY;
+    }
+    return execute_create_table(statement);
+  case (STATEMENT_CREATE_INDEX):
+    statement->done = true;
+    if (statement->db->reader != NULL)
+    {
+      return EXECUTE_READ_ONLY;
+    }
+    return execute_create_index(statement);
+  }
+  return EXECUTE_FAILED;
+}
+
+ExecuteResult sqlite_step(Statement *statement)
+{
+  if (statement->done)
+  {
+    return EXECUTE_SUCCESS;
+  }
+  if (statement->execute_start == 0)
+  {
+    statement->execute_start = stats_clock();
+  }
+  ExecuteResult result = statement_step(statement);
+  if (result == EXECUTE_ROW)
+  {
+    statement->rows_returned++;
+  }
+  else
+  {
+    statement_record_execute(statement);
+  }
+  return result;
+}
+
+uint32_t sqlite_column_count(Statement *statement)
+{
+  return statement->type == STATEMENT_SELECT ? statement->num_columns : 0;
+}
+
+ColumnType sqlite_column_type(Statement *statement, uint32_t column)
+{
+  if (statement->aggregate != AGGREGATE_NONE)
+  {
+    return COLUMN_TYPE_INTEGER64;
+  }
+  return statement->table->schema.columns[statement->columns[column]].type;
+}
+
+uint32_t sqlite_column_int(Statement *statement, uint32_t column)
+{
+  if (statement->aggregate != AGGREGATE_NONE)
+  {
+    return (uint32_t)statement->aggregate_value;
+  }
+  return row_read_int(&statement->table->schema, statement->row, statement->columns[column]);
+}
+
+uint64_t sqlite_column_int64(Statement *statement, uint32_t column)
+{
+  if (statement->aggregate != AGGREGATE_NONE)
+  {
+    return statement->aggregate_value;
+  }
+  return row_read_int(&statement->table->schema, statement->row, statement->columns[column]);
+}
+
+const char *sqlite_column_text(Statement *statement, uint32_t column, uint32_t *length)
+{
+  return row_read_text(&statement->table->schema, statement->row, statement->columns[column], length);
+}
+
+void sqlite_reset(Statement *statement)
+{
+  statement_record_execute(statement);
+  statement_reset(statement);
+}
+
+void sqlite_finalize(Statement *statement)
+{
+  statement_record_execute(statement);
+  switch (statement->owner)
+  {
+  case (STATEMENT_OWNED):
+    statement_finalize(statement);
+    break;
+  case (STATEMENT_CACHED):
+    statement_reset(statement);
+    break;
+  case (STATEMENT_SCRATCH):
+    statement_release(statement);
+    statement->db->scratch_in_use = false;
+    break;
+  }
+}
+
+ImportResult sqlite_import_csv(Database *db, const char *path, ImportStatus *status)
+{
+  if (db->reader != NULL)
+  {
+    status->rows_imported = 0;
+    status->line = 0;
+    status->insert = EXECUTE_READ_ONLY;
+    return IMPORT_INSERT_FAILED;
+  }
+  return import_csv(db, path, status);
+}
+
+size_t sqlite_format_stats(char *buffer, size_t size, bool json)
+{
+  Stats stats;
+  stats_read(&stats);
+  return stats_format(&stats, json, buffer, size);
+}
+
+void sqlite_reset_stats()
+{
+  stats_reset();
+}
+
+void sqlite_print_tree(Database *db)
+{
+  print_tree(db->tables[0].table, db->tables[0].table->root_page_num, 0);
+}
+
+void sqlite_print_constants(Database *db)
+{
+  print_constants(pager_page_size(db->tables[0].table->pager));
+}
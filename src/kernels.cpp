@@ -0,0 +1,321 @@
+#include "kernels.h"
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define KERNEL_AVX2 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define KERNEL_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define KERNEL_NEON 1
+#endif
+
+#if defined(KERNEL_AVX2)
+#include <emmintrin.h>
+#endif
+
+/*
+v is in [low, high] exactly when v - low <= high - low in unsigned
+arithmetic, which turns the range test into one subtract and one compare.
+x86 before AVX2 only compares signed lanes, so both sides are shifted by
+the sign bit first.
+*/
+
+const char *kernel_isa()
+{
+#if defined(KERNEL_AVX2)
+  return "avx2";
+#elif defined(KERNEL_SSE2)
+  return "sse2";
+#elif defined(KERNEL_NEON)
+  return "neon";
+#else
+  return "scalar";
+#endif
+}
+
+uint32_t kernel_count_range(const uint32_t *values, uint32_t count, uint32_t low, uint32_t high)
+{
+  if (low > high)
+  {
+    return 0;
+  }
+  uint32_t span = high - low;
+  uint32_t matches = 0;
+  uint32_t i = 0;
+#if defined(KERNEL_AVX2)
+  __m256i low8 = _mm256_set1_epi32((int)low);
+  __m256i span8 = _mm256_set1_epi32((int)span);
+  __m256i total = _mm256_setzero_si256();
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256i offset = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(values + i)), low8);
+    // All ones in the lanes that are in range, so subtracting counts them.
+    __m256i in_range = _mm256_cmpeq_epi32(_mm256_min_epu32(offset, span8), offset);
+    total = _mm256_sub_epi32(total, in_range);
+  }
+  uint32_t lanes[8];
+  _mm256_storeu_si256((__m256i *)lanes, total);
+  for (uint32_t lane = 0; lane < 8; lane++)
+  {
+    matches += lanes[lane];
+  }
+#elif defined(KERNEL_SSE2)
+  __m128i sign = _mm_set1_epi32((int)0x80000000u);
+  __m128i low4 = _mm_set1_epi32((int)low);
+  __m128i span4 = _mm_xor_si128(_mm_set1_epi32((int)span), sign);
+  __m128i total = _mm_setzero_si128();
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128i offset = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(values + i)), low4);
+    __m128i above = _mm_cmpgt_epi32(_mm_xor_si128(offset, sign), span4);
+    total = _mm_add_epi32(total, _mm_andnot_si128(above, _mm_set1_epi32(1)));
+  }
+  uint32_t lanes[4];
+  _mm_storeu_si128((__m128i *)lanes, total);
+  matches = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(KERNEL_NEON)
+  uint32x4_t low4 = vdupq_n_u32(low);
+  uint32x4_t span4 = vdupq_n_u32(span);
+  uint32x4_t total = vdupq_n_u32(0);
+  for (; i + 4 <= count; i += 4)
+  {
+    uint32x4_t offset = vsubq_u32(vld1q_u32(values + i), low4);
+    total = vsubq_u32(total, vcleq_u32(offset, span4));
+  }
+  matches = vaddvq_u32(total);
+#endif
+  for (; i < count; i++)
+  {
+    matches += values[i] - low <= span;
+  }
+  return matches;
+}
+
+uint32_t kernel_select_range(const uint32_t *values, uint32_t count, uint32_t low, uint32_t high,
+                             uint16_t *selected)
+{
+  if (low > high)
+  {
+    return 0;
+  }
+  uint32_t span = high - low;
+  uint32_t matches = 0;
+  uint32_t i = 0;
+#if defined(KERNEL_AVX2)
+  __m256i low8 = _mm256_set1_epi32((int)low);
+  __m256i span8 = _mm256_set1_epi32((int)span);
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256i offset = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(values + i)), low8);
+    __m256i in_range = _mm256_cmpeq_epi32(_mm256_min_epu32(offset, span8), offset);
+    uint32_t bits = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(in_range));
+    while (bits != 0)
+    {
+      selected[matches++] = (uint16_t)(i + __builtin_ctz(bits));
+      bits &= bits - 1;
+    }
+  }
+#elif defined(KERNEL_SSE2)
+  __m128i sign = _mm_set1_epi32((int)0x80000000u);
+  __m128i low4 = _mm_set1_epi32((int)low);
+  __m128i span4 = _mm_xor_si128(_mm_set1_epi32((int)span), sign);
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128i offset = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(values + i)), low4);
+    __m128i above = _mm_cmpgt_epi32(_mm_xor_si128(offset, sign), span4);
+    uint32_t bits = ~(uint32_t)_mm_movemask_ps(_mm_castsi128_ps(above)) & 0xf;
+    while (bits != 0)
+    {
+      selected[matches++] = (uint16_t)(i + __builtin_ctz(bits));
+      bits &= bits - 1;
+    }
+  }
+#elif defined(KERNEL_NEON)
+  uint32x4_t low4 = vdupq_n_u32(low);
+  uint32x4_t span4 = vdupq_n_u32(span);
+  for (; i + 4 <= count; i += 4)
+  {
+    uint32x4_t in_range = vcleq_u32(vsubq_u32(vld1q_u32(values + i), low4), span4);
+    // Most blocks of a selective filter match nothing.
+    if (vmaxvq_u32(in_range) == 0)
+    {
+      continue;
+    }
+    uint32_t lanes[4];
+    vst1q_u32(lanes, in_range);
+    for (uint32_t lane = 0; lane < 4; lane++)
+    {
+      if (lanes[lane] != 0)
+      {
+        selected[matches++] = (uint16_t)(i + lane);
+      }
+    }
+  }
+#endif
+  for (; i < count; i++)
+  {
+    if (values[i] - low <= span)
+    {
+      selected[matches++] = (uint16_t)i;
+    }
+  }
+  return matches;
+}
+
+void kernel_min_max(const uint32_t *values, uint32_t count, uint32_t *min, uint32_t *max)
+{
+  uint32_t low = values[0];
+  uint32_t high = values[0];
+  uint32_t i = 0;
+#if defined(KERNEL_AVX2)
+  if (count >= 8)
+  {
+    __m256i low8 = _mm256_loadu_si256((const __m256i *)values);
+    __m256i high8 = low8;
+    for (i = 8; i + 8 <= count; i += 8)
+    {
+      __m256i block = _mm256_loadu_si256((const __m256i *)(values + i));
+      low8 = _mm256_min_epu32(low8, block);
+      high8 = _mm256_max_epu32(high8, block);
+    }
+    uint32_t lows[8], highs[8];
+    _mm256_storeu_si256((__m256i *)lows, low8);
+    _mm256_storeu_si256((__m256i *)highs, high8);
+    for (uint32_t lane = 0; lane < 8; lane++)
+    {
+      low = lows[lane] < low ? lows[lane] : low;
+      high = highs[lane] > high ? highs[lane] : high;
+    }
+  }
+#elif defined(KERNEL_SSE2)
+  if (count >= 4)
+  {
+    // Kept sign-flipped so signed compares order them as unsigned.
+    __m128i sign = _mm_set1_epi32((int)0x80000000u);
+    __m128i low4 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)values), sign);
+    __m128i high4 = low4;
+    for (i = 4; i + 4 <= count; i += 4)
+    {
+      __m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(values + i)), sign);
+      __m128i less = _mm_cmplt_epi32(block, low4);
+      low4 = _mm_or_si128(_mm_and_si128(less, block), _mm_andnot_si128(less, low4));
+      __m128i greater = _mm_cmpgt_epi32(block, high4);
+      high4 = _mm_or_si128(_mm_and_si128(greater, block), _mm_andnot_si128(greater, high4));
+    }
+    uint32_t lows[4], highs[4];
+    _mm_storeu_si128((__m128i *)lows, _mm_xor_si128(low4, sign));
+    _mm_storeu_si128((__m128i *)highs, _mm_xor_si128(high4, sign));
+    for (uint32_t lane = 0; lane < 4; lane++)
+    {
+      low = lows[lane] < low ? lows[lane] : low;
+      high = highs[lane] > high ? highs[lane] : high;
+    }
+  }
+#elif defined(KERNEL_NEON)
+  if (count >= 4)
+  {
+    uint32x4_t low4 = vld1q_u32(values);
+    uint32x4_t high4 = low4;
+    for (i = 4; i + 4 <= count; i += 4)
+    {
+      uint32x4_t block = vld1q_u32(values + i);
+      low4 = vminq_u32(low4, block);
+      high4 = vmaxq_u32(high4, block);
+    }
+    low = vminvq_u32(low4);
+    high = vmaxvq_u32(high4);
+  }
+#endif
+  for (; i < count; i++)
+  {
+    low = values[i] < low ? values[i] : low;
+    high = values[i] > high ? values[i] : high;
+  }
+  *min = low;
+  *max = high;
+}
+
+// Values are widened to 64-bit lanes before adding, so no lane can wrap.
+uint64_t kernel_sum(const uint32_t *values, uint32_t count)
+{
+  uint64_t total = 0;
+  uint32_t i = 0;
+#if defined(KERNEL_AVX2)
+  __m256i sum4 = _mm256_setzero_si256();
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(values + i));
+    sum4 = _mm256_add_epi64(sum4, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(block)));
+    sum4 = _mm256_add_epi64(sum4, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(block, 1)));
+  }
+  uint64_t sums[4];
+  _mm256_storeu_si256((__m256i *)sums, sum4);
+  total = sums[0] + sums[1] + sums[2] + sums[3];
+#elif defined(KERNEL_SSE2)
+  __m128i zero = _mm_setzero_si128();
+  __m128i sum2 = zero;
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128i block = _mm_loadu_si128((const __m128i *)(values + i));
+    sum2 = _mm_add_epi64(sum2, _mm_unpacklo_epi32(block, zero));
+    sum2 = _mm_add_epi64(sum2, _mm_unpackhi_epi32(block, zero));
+  }
+  uint64_t sums[2];
+  _mm_storeu_si128((__m128i *)sums, sum2);
+  total = sums[0] + sums[1];
+#elif defined(KERNEL_NEON)
+  uint64x2_t sum2 = vdupq_n_u64(0);
+  for (; i + 4 <= count; i += 4)
+  {
+    sum2 = vpadalq_u32(sum2, vld1q_u32(values + i));
+  }
+  total = vaddvq_u64(sum2);
+#endif
+  for (; i < count; i++)
+  {
+    total += values[i];
+  }
+  return total;
+}
+
+/*
+Whole 16-byte blocks of the prefix are compared with one vector compare
+per value; the remaining bytes, and builds without vectors, use memcmp.
+Loads never reach past the first length bytes of a value.
+*/
+uint32_t kernel_select_prefix(const char *values, uint32_t width, uint32_t count, const char *prefix,
+                              uint32_t length, uint16_t *selected)
+{
+  uint32_t matches = 0;
+  uint32_t blocks = 0;
+#if defined(KERNEL_AVX2) || defined(KERNEL_SSE2) || defined(KERNEL_NEON)
+  blocks = length / 16;
+#endif
+  uint32_t tail = blocks * 16;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    const char *value = values + (size_t)i * width;
+    bool equal = true;
+    for (uint32_t block = 0; block < blocks && equal; block++)
+    {
+#if defined(KERNEL_AVX2) || defined(KERNEL_SSE2)
+      __m128i a = _mm_loadu_si128((const __m128i *)(value + block * 16));
+      __m128i b = _mm_loadu_si128((const __m128i *)(prefix + block * 16));
+      equal = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xffff;
+#elif defined(KERNEL_NEON)
+      uint8x16_t a = vld1q_u8((const uint8_t *)(value + block * 16));
+      uint8x16_t b = vld1q_u8((const uint8_t *)(prefix + block * 16));
+      equal = vminvq_u8(vceqq_u8(a, b)) == 0xff;
+#endif
+    }
+    if (equal && memcmp(value + tail, prefix + tail, length - tail) == 0)
+    {
+      selected[matches++] = (uint16_t)i;
+    }
+  }
+  return matches;
+}
@@ -0,0 +1,237 @@
+#include "keyhash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KEY_HASH_SLOTS 7
+// Buckets per segment, and in the table before its first split.
+#define KEY_HASH_SEGMENT_BUCKETS 256
+#define KEY_HASH_INITIAL_BUCKETS 64
+// A put splits a bucket while the table averages more entries per bucket
+// than this, which keeps most chains to their first cache line.
+#define KEY_HASH_MAX_LOAD 5
+
+// Slots fill from the front, so the first empty one ends the chain.
+typedef struct KeyHashBucket
+{
+  uint32_t keys[KEY_HASH_SLOTS];
+  uint32_t values[KEY_HASH_SLOTS];
+  struct KeyHashBucket *overflow;
+} KeyHashBucket;
+
+static_assert(sizeof(KeyHashBucket) <= 64, "a bucket is one cache line");
+
+/*
+Buckets [0, round) address keys by hash & (round - 1). Those below split
+have already been split this round, into themselves and bucket + round,
+so they and the new buckets use hash & (2 * round - 1). Once every bucket
+of the round has split, the table is twice round and the next begins.
+*/
+struct KeyHash
+{
+  KeyHashBucket **segments;
+  uint32_t num_segments;
+  uint32_t segments_capacity;
+  uint32_t num_buckets;
+  uint32_t round;
+  uint32_t split;
+  uint32_t count;
+};
+
+KeyHashBucket *key_hash_allocate(uint32_t num_buckets)
+{
+  void *memory;
+  if (posix_memalign(&memory, 64, num_buckets * sizeof(KeyHashBucket)) != 0)
+  {
+    printf("Unable to allocate key hash\n");
+    exit(EXIT_FAILURE);
+  }
+  KeyHashBucket *buckets = (KeyHashBucket *)memory;
+  for (uint32_t i = 0; i < num_buckets; i++)
+  {
+    memset(buckets[i].values, 0xff, sizeof(buckets[i].values));
+    buckets[i].overflow = NULL;
+  }
+  return buckets;
+}
+
+// Murmur3's finalizer, so neighbouring keys land in unrelated buckets.
+uint32_t key_hash_mix(uint32_t key)
+{
+  key ^= key >> 16;
+  key *= 0x85ebca6b;
+  key ^= key >> 13;
+  key *= 0xc2b2ae35;
+  key ^= key >> 16;
+  return key;
+}
+
+KeyHashBucket *key_hash_bucket(const KeyHash *hash, uint32_t bucket)
+{
+  return &hash->segments[bucket / KEY_HASH_SEGMENT_BUCKETS][bucket % KEY_HASH_SEGMENT_BUCKETS];
+}
+
+uint32_t key_hash_address(const KeyHash *hash, uint32_t key)
+{
+  uint32_t mixed = key_hash_mix(key);
+  uint32_t bucket = mixed & (hash->round - 1);
+  return bucket < hash->split ? mixed & (2 * hash->round - 1) : bucket;
+}
+
+// Add an entry after the last one in the chain, which must not hold key.
+void key_hash_append(KeyHashBucket *bucket, uint32_t key, uint32_t value)
+{
+  while (true)
+  {
+    for (uint32_t i = 0; i < KEY_HASH_SLOTS; i++)
+    {
+      if (bucket->values[i] == KEY_HASH_MISSING)
+      {
+        bucket->keys[i] = key;
+        bucket->values[i] = value;
+        return;
+      }
+    }
+    if (bucket->overflow == NULL)
+    {
+      bucket->overflow = key_hash_allocate(1);
+    }
+    bucket = bucket->overflow;
+  }
+}
+
+// Split the next bucket of the round between itself and a new bucket.
+void key_hash_split(KeyHash *hash)
+{
+  uint32_t new_bucket = hash->round + hash->split;
+  if (new_bucket == hash->num_segments * KEY_HASH_SEGMENT_BUCKETS)
+  {
+    if (hash->num_segments == hash->segments_capacity)
+    {
+      hash->segments_capacity *= 2;
+      hash->segments =
+          (KeyHashBucket **)realloc(hash->segments, hash->segments_capacity * sizeof(KeyHashBucket *));
+    }
+    hash->segments[hash->num_segments++] = key_hash_allocate(KEY_HASH_SEGMENT_BUCKETS);
+  }
+  hash->num_buckets++;
+
+  // Take the old chain out and deal its entries back over the two.
+  KeyHashBucket *bucket = key_hash_bucket(hash, hash->split);
+  KeyHashBucket old = *bucket;
+  memset(bucket->values, 0xff, sizeof(bucket->values));
+  bucket->overflow = NULL;
+  uint32_t mask = 2 * hash->round - 1;
+  KeyHashBucket *destinations[2] = {bucket, key_hash_bucket(hash, new_bucket)};
+  for (KeyHashBucket *source = &old; source != NULL;)
+  {
+    for (uint32_t i = 0; i < KEY_HASH_SLOTS && source->values[i] != KEY_HASH_MISSING; i++)
+    {
+      uint32_t key = source->keys[i];
+      key_hash_append(destinations[(key_hash_mix(key) & mask) != hash->split], key, source->values[i]);
+    }
+    KeyHashBucket *next = source->overflow;
+    if (source != &old)
+    {
+      free(source);
+    }
+    source = next;
+  }
+
+  if (++hash->split == hash->round)
+  {
+    hash->round *= 2;
+    hash->split = 0;
+  }
+}
+
+KeyHash *key_hash_open()
+{
+  KeyHash *hash = (KeyHash *)malloc(sizeof(KeyHash));
+  hash->segments_capacity = 4;
+  hash->segments = (KeyHashBucket **)malloc(hash->segments_capacity * sizeof(KeyHashBucket *));
+  hash->segments[0] = key_hash_allocate(KEY_HASH_SEGMENT_BUCKETS);
+  hash->num_segments = 1;
+  hash->num_buckets = KEY_HASH_INITIAL_BUCKETS;
+  hash->round = KEY_HASH_INITIAL_BUCKETS;
+  hash->split = 0;
+  hash->count = 0;
+  return hash;
+}
+
+void key_hash_close(KeyHash *hash)
+{
+  for (uint32_t i = 0; i < hash->num_buckets; i++)
+  {
+    KeyHashBucket *overflow = key_hash_bucket(hash, i)->overflow;
+    while (overflow != NULL)
+    {
+      KeyHashBucket *next = overflow->overflow;
+      free(overflow);
+      overflow = next;
+    }
+  }
+  for (uint32_t i = 0; i < hash->num_segments; i++)
+  {
+    free(hash->segments[i]);
+  }
+  free(hash->segments);
+  free(hash);
+}
+
+void key_hash_put(KeyHash *hash, uint32_t key, uint32_t value)
+{
+  for (KeyHashBucket *bucket = key_hash_bucket(hash, key_hash_address(hash, key)); bucket != NULL;
+       bucket = bucket->overflow)
+  {
+    for (uint32_t i = 0; i < KEY_HASH_SLOTS; i++)
+    {
+      if (bucket->values[i] == KEY_HASH_MISSING)
+      {
+        bucket->keys[i] = key;
+        bucket->values[i] = value;
+        hash->count++;
+        if (hash->count > hash->num_buckets * KEY_HASH_MAX_LOAD)
+        {
+          key_hash_split(hash);
+        }
+        return;
+      }
+      if (bucket->keys[i] == key)
+      {
+        bucket->values[i] = value;
+        return;
+      }
+    }
+    if (bucket->overflow == NULL)
+    {
+      bucket->overflow = key_hash_allocate(1);
+    }
+  }
+}
+
+uint32_t key_hash_get(const KeyHash *hash, uint32_t key)
+{
+  for (const KeyHashBucket *bucket = key_hash_bucket(hash, key_hash_address(hash, key)); bucket != NULL;
+       bucket = bucket->overflow)
+  {
+    for (uint32_t i = 0; i < KEY_HASH_SLOTS; i++)
+    {
+      if (bucket->values[i] == KEY_HASH_MISSING)
+      {
+        return KEY_HASH_MISSING;
+      }
+      if (bucket->keys[i] == key)
+      {
+        return bucket->values[i];
+      }
+    }
+  }
+  return KEY_HASH_MISSING;
+}
+
+uint32_t key_hash_count(const KeyHash *hash)
+{
+  return hash->count;
+}
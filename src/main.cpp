@@ -1,16 +1,42 @@
+#include "sqlite.h"
+#ifdef SQLITE_SERVER
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+/*
+Interactive input is read a line at a time with getline. Batch input, for
+scripts piped in, is read in large chunks into the same buffer and split
+into lines where it lies: [next, filled) of it is still to run, and a line
+cut off by the end of a chunk is moved to the front before the next read.
+Either way line is the current statement, NUL terminated.
+*/
+#define BATCH_CHUNK_SIZE (1024 * 1024)
+// A batch commits after this many statements, so one long script does
+// not grow the log without bound.
+#define BATCH_COMMIT_STATEMENTS 10000
 
-#define size_of_attribute(Struct, Attribute) sizeof(((Struct *)0)->Attribute)
 typedef struct
 {
   char *buffer;
   size_t buffer_length;
   ssize_t input_length;
+  char *line;
+  bool batch;
+  size_t filled;
+  size_t next;
+  bool at_eof;
 } InputBuffer;
 
 typedef enum
@@ -21,114 +47,240 @@ typedef enum
 
 typedef enum
 {
-  PREPARE_SUCCESS,
-  PREPARE_UNRECOGNIZED_STATEMENT,
-  PREPARE_SYNTAX_ERROR
-} PrepareResult;
+  OUTPUT_FORMAT_HUMAN,  // (id, username, email)
+  OUTPUT_FORMAT_CSV,    // id,username,email with RFC 4180 quoting
+  OUTPUT_FORMAT_BINARY, // u32 per integer column (u64 for an aggregate), u16 length + bytes per string column
+} OutputFormat;
 
-typedef enum
+// Results are formatted into one reusable buffer and handed to stdio a whole
+// buffer at a time rather than once per row.
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+// Room for .stats, either way it is written.
+#define STATS_BUFFER_SIZE 4096
+
+typedef struct OutputSink OutputSink;
+typedef void (*RowWriter)(OutputSink *sink, Statement *statement);
+
+struct OutputSink
 {
-  EXECUTE_SUCCESS,
-  EXECUTE_TABLE_FULL,
-  EXECUTE_FAILED,
-} ExecuteResult;
+  FILE *stream;
+  OutputFormat format;
+  RowWriter write_row;
+  char *buffer;
+  size_t used;
+};
 
-typedef enum
+void sink_flush(OutputSink *sink)
 {
-  STATEMENT_INSERT,
-  STATEMENT_SELECT
-} StatementType;
+  if (sink->used > 0)
+  {
+    fwrite(sink->buffer, 1, sink->used, sink->stream);
+    sink->used = 0;
+  }
+}
 
-#define COLUMN_USERNAME_SIZE 32
-#define COLUMN_EMAIL_SIZE 255
-typedef struct
+// Make room for length more bytes and return where they go.
+char *sink_reserve(OutputSink *sink, size_t length)
 {
-  uint32_t id;
-  char username[COLUMN_USERNAME_SIZE];
-  char email[COLUMN_EMAIL_SIZE];
-} Row;
-typedef struct
+  if (sink->used + length > OUTPUT_BUFFER_SIZE)
+  {
+    sink_flush(sink);
+  }
+  return sink->buffer + sink->used;
+}
+
+void sink_write(OutputSink *sink, const char *data, size_t length)
 {
-  StatementType type;
-  Row row_to_insert;
-} Statement;
-
-const uint32_t ID_SIZE = size_of_attribute(Row, id);
-const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
-const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
-const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
-
-void serialize_row(Row *source, void *destination)
+  if (length > OUTPUT_BUFFER_SIZE)
+  {
+    sink_flush(sink);
+    fwrite(data, 1, length, sink->stream);
+    return;
+  }
+  memcpy(sink_reserve(sink, length), data, length);
+  sink->used += length;
+}
+
+void sink_write_char(OutputSink *sink, char c)
 {
-  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-  memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-  memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+  *sink_reserve(sink, 1) = c;
+  sink->used += 1;
 }
 
-void deserialize_row(void *source, Row *destination)
+void sink_write_uint(OutputSink *sink, uint64_t value)
 {
-  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-  memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-  memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+  char digits[20];
+  uint32_t n = 0;
+  do
+  {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+
+  char *out = sink_reserve(sink, n);
+  for (uint32_t i = 0; i < n; i++)
+  {
+    out[i] = digits[n - 1 - i];
+  }
+  sink->used += n;
 }
 
-const uint32_t PAGE_SIZE = 4096;
-#define TABLE_MAX_PAGES 100
-const uint32_t ROWS_PER_PAGE = PAGE_SIZE / ROW_SIZE;
-const uint32_t TABLE_MAX_ROWS = ROWS_PER_PAGE * TABLE_MAX_PAGES;
+void sink_write_message(OutputSink *sink, const char *message)
+{
+  sink_write(sink, message, strlen(message));
+}
 
-typedef struct
+void write_row_human(OutputSink *sink, Statement *statement)
 {
-  uint32_t num_rows;
-  void *pages[TABLE_MAX_PAGES];
-} Table;
+  sink_write_char(sink, '(');
+  uint32_t num_columns = sqlite_column_count(statement);
+  for (uint32_t i = 0; i < num_columns; i++)
+  {
+    if (i > 0)
+    {
+      sink_write(sink, ", ", 2);
+    }
+    if (sqlite_column_type(statement, i) != COLUMN_TYPE_TEXT)
+    {
+      sink_write_uint(sink, sqlite_column_int64(statement, i));
+    }
+    else
+    {
+      uint32_t length;
+      const char *text = sqlite_column_text(statement, i, &length);
+      sink_write(sink, text, length);
+    }
+  }
+  sink_write(sink, ")\n", 2);
+}
 
-void print_row(Row *row_to_insert)
+bool csv_needs_quotes(const char *value, uint32_t length)
 {
-  printf("(%d, %s, %s)\n", row_to_insert->id, row_to_insert->username, row_to_insert->email);
+  for (uint32_t i = 0; i < length; i++)
+  {
+    char c = value[i];
+    if (c == ',' || c == '"' || c == '\r' || c == '\n')
+    {
+      return true;
+    }
+  }
+  return false;
 }
 
-void *row_slot(Table *table, uint32_t row_num)
+void write_csv_field(OutputSink *sink, const char *value, uint32_t length)
 {
-  uint32_t page_num = row_num / ROWS_PER_PAGE;
-  void *page = table->pages[page_num];
-  if (page == NULL)
+  if (!csv_needs_quotes(value, length))
   {
-    page = table->pages[page_num] = malloc(PAGE_SIZE);
+    sink_write(sink, value, length);
+    return;
   }
-  uint32_t row_offset = row_num % ROWS_PER_PAGE;
-  uint32_t byte_offset = row_offset * ROW_SIZE;
-  return (char*)page + byte_offset;
+  sink_write_char(sink, '"');
+  for (uint32_t i = 0; i < length; i++)
+  {
+    if (value[i] == '"')
+    {
+      sink_write_char(sink, '"');
+    }
+    sink_write_char(sink, value[i]);
+  }
+  sink_write_char(sink, '"');
 }
-Table *new_table()
+
+void write_row_csv(OutputSink *sink, Statement *statement)
 {
-  Table *table = (Table *)malloc(sizeof(Table));
-  table->num_rows = 0;
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
+  uint32_t num_columns = sqlite_column_count(statement);
+  for (uint32_t i = 0; i < num_columns; i++)
   {
-    table->pages[i] = NULL;
+    if (i > 0)
+    {
+      sink_write_char(sink, ',');
+    }
+    if (sqlite_column_type(statement, i) != COLUMN_TYPE_TEXT)
+    {
+      sink_write_uint(sink, sqlite_column_int64(statement, i));
+    }
+    else
+    {
+      uint32_t length;
+      const char *text = sqlite_column_text(statement, i, &length);
+      write_csv_field(sink, text, length);
+    }
   }
-  return table;
+  sink_write_char(sink, '\n');
+}
+
+void write_binary_field(OutputSink *sink, const char *value, uint16_t length)
+{
+  sink_write(sink, (const char *)&length, sizeof(length));
+  sink_write(sink, value, length);
 }
 
-void free_table(Table *table)
+void write_row_binary(OutputSink *sink, Statement *statement)
 {
-  for (int i = 0; table->pages[i]; i++)
+  uint32_t num_columns = sqlite_column_count(statement);
+  for (uint32_t i = 0; i < num_columns; i++)
   {
-    free(table->pages[i]);
+    ColumnType type = sqlite_column_type(statement, i);
+    if (type == COLUMN_TYPE_INTEGER)
+    {
+      uint32_t value = sqlite_column_int(statement, i);
+      sink_write(sink, (const char *)&value, sizeof(value));
+    }
+    else if (type == COLUMN_TYPE_INTEGER64)
+    {
+      uint64_t value = sqlite_column_int64(statement, i);
+      sink_write(sink, (const char *)&value, sizeof(value));
+    }
+    else
+    {
+      uint32_t length;
+      const char *text = sqlite_column_text(statement, i, &length);
+      write_binary_field(sink, text, length);
+    }
   }
-  free(table);
 }
 
-InputBuffer *new_input_buffer()
+const RowWriter ROW_WRITERS[] = {write_row_human, write_row_csv, write_row_binary};
+
+void sink_set_format(OutputSink *sink, OutputFormat format)
+{
+  sink->format = format;
+  sink->write_row = ROW_WRITERS[format];
+}
+
+OutputSink *new_output_sink(FILE *stream, OutputFormat format)
+{
+  OutputSink *sink = (OutputSink *)malloc(sizeof(OutputSink));
+  sink->stream = stream;
+  sink->buffer = (char *)malloc(OUTPUT_BUFFER_SIZE);
+  sink->used = 0;
+  sink_set_format(sink, format);
+  return sink;
+}
+
+void close_output_sink(OutputSink *sink)
+{
+  sink_flush(sink);
+  free(sink->buffer);
+  free(sink);
+}
+
+InputBuffer *new_input_buffer(bool batch)
 {
   InputBuffer *input_buffer = (InputBuffer *)malloc(sizeof(InputBuffer));
   input_buffer->buffer = NULL;
   input_buffer->buffer_length = 0;
   input_buffer->input_length = 0;
+  input_buffer->line = NULL;
+  input_buffer->batch = batch;
+  input_buffer->filled = 0;
+  input_buffer->next = 0;
+  input_buffer->at_eof = false;
+  if (batch)
+  {
+    input_buffer->buffer_length = BATCH_CHUNK_SIZE;
+    input_buffer->buffer = (char *)malloc(input_buffer->buffer_length);
+  }
 
   return input_buffer;
 }
@@ -139,76 +291,105 @@ void close_input_buffer(InputBuffer *input_buffer)
   free(input_buffer);
 }
 
-MetaCommandRresult do_meta_command(InputBuffer *input_buffer, Table *table)
+MetaCommandRresult do_meta_command(InputBuffer *input_buffer, Database *db, OutputSink *sink)
 {
-  if (strcmp(input_buffer->buffer, ".exit") == 0)
+  if (strcmp(input_buffer->line, ".exit") == 0)
   {
+    // Closing commits whatever a batch has not.
+    close_output_sink(sink);
     close_input_buffer(input_buffer);
-    free_table(table);
+    sqlite_close(db);
     exit(EXIT_SUCCESS);
   }
-  else
+  else if (strcmp(input_buffer->line, ".btree") == 0)
   {
-    return META_COMMAND_UNRECOGNIZED_COMMAND;
+    printf("Tree:\n");
+    sqlite_print_tree(db);
+    return META_COMMAND_SUCCESS;
   }
-}
-
-PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement)
-{
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0)
+  else if (strncmp(input_buffer->line, ".mode ", 6) == 0)
   {
-    statement->type = STATEMENT_INSERT;
-    int args_assigned = sscanf(input_buffer->buffer, "insert %d %s %s", &(statement->row_to_insert.id), statement->row_to_insert.username, statement->row_to_insert.email);
-    if (args_assigned < 3)
+    const char *mode = input_buffer->line + 6;
+    if (strcmp(mode, "human") == 0)
+      sink_set_format(sink, OUTPUT_FORMAT_HUMAN);
+    else if (strcmp(mode, "csv") == 0)
+      sink_set_format(sink, OUTPUT_FORMAT_CSV);
+    else if (strcmp(mode, "binary") == 0)
+      sink_set_format(sink, OUTPUT_FORMAT_BINARY);
+    else
+      return META_COMMAND_UNRECOGNIZED_COMMAND;
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strncmp(input_buffer->line, ".import ", 8) == 0)
+  {
+    ImportStatus status;
+    ImportResult result = sqlite_import_csv(db, input_buffer->line + 8, &status);
+    switch (result)
     {
-      return PREPARE_SYNTAX_ERROR;
+    case (IMPORT_SUCCESS):
+      printf("Imported %u rows.\n", status.rows_imported);
+      break;
+    case (IMPORT_OPEN_FAILED):
+      printf("Unable to open file '%s'.\n", input_buffer->line + 8);
+      break;
+    case (IMPORT_BAD_RECORD):
+      printf("Error: Bad record on line %u.\n", status.line);
+      break;
+    case (IMPORT_STRING_TOO_LONG):
+      printf("Error: String is too long on line %u.\n", status.line);
+      break;
+    case (IMPORT_INSERT_FAILED):
+    {
+      const char *reason;
+      switch (status.insert)
+      {
+      case (EXECUTE_DUPLICATE_KEY):
+        reason = "Duplicate key";
+        break;
+      case (EXECUTE_TABLE_FULL):
+        reason = "Table full";
+        break;
+      case (EXECUTE_READ_ONLY):
+        reason = "Read-only connection";
+        break;
+      case (EXECUTE_FAILED):
+      default:
+        reason = "Failed to insert";
+        break;
+      }
+      printf("Error: %s in the chunk ending on line %u.\n", reason, status.line);
+      break;
     }
-    return PREPARE_SUCCESS;
+    }
+    if (result != IMPORT_SUCCESS && status.rows_imported > 0)
+    {
+      printf("Imported %u rows before the error.\n", status.rows_imported);
+    }
+    return META_COMMAND_SUCCESS;
   }
-  if (strncmp(input_buffer->buffer, "select", 6) == 0)
+  else if (strcmp(input_buffer->line, ".stats") == 0 || strcmp(input_buffer->line, ".stats json") == 0)
   {
-    statement->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+    bool json = input_buffer->line[6] != '\0';
+    char buffer[STATS_BUFFER_SIZE];
+    sqlite_format_stats(buffer, sizeof(buffer), json);
+    fputs(buffer, stdout);
+    return META_COMMAND_SUCCESS;
   }
-
-  return PREPARE_UNRECOGNIZED_STATEMENT;
-}
-
-ExecuteResult execute_insert(Statement *statement, Table *table)
-{
-  if (table->num_rows >= TABLE_MAX_ROWS)
+  else if (strcmp(input_buffer->line, ".stats reset") == 0)
   {
-    return EXECUTE_TABLE_FULL;
+    sqlite_reset_stats();
+    return META_COMMAND_SUCCESS;
   }
-
-  Row *row_to_insert = &(statement->row_to_insert);
-  serialize_row(row_to_insert, row_slot(table, table->num_rows));
-  table->num_rows += 1;
-
-  return EXECUTE_SUCCESS;
-}
-
-ExecuteResult execute_select(Statement *statement, Table *table)
-{
-  Row row_to_insert;
-  for (uint32_t i = 0; i < table->num_rows; i++)
+  else if (strcmp(input_buffer->line, ".constants") == 0)
   {
-    deserialize_row(row_slot(table, i), &row_to_insert);
-    print_row(&row_to_insert);
+    printf("Constants:\n");
+    sqlite_print_constants(db);
+    return META_COMMAND_SUCCESS;
   }
-  return EXECUTE_SUCCESS;
-}
-
-ExecuteResult execute_statement(Statement *statement, Table *table)
-{
-  switch (statement->type)
+  else
   {
-  case (STATEMENT_INSERT):
-    return execute_insert(statement, table);
-  case (STATEMENT_SELECT):
-    return execute_select(statement, table);
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
   }
-  return EXECUTE_FAILED;
 }
 
 void print_prompt()
@@ -230,53 +411,335 @@ void read_input(InputBuffer *input_buffer)
   // Ignore trailing newline
   input_buffer->input_length = bytes_read - 1;
   input_buffer->buffer[bytes_read - 1] = 0;
+  input_buffer->line = input_buffer->buffer;
+}
+
+// Move to the next line of batch input. Returns false at the end of it.
+bool read_batch_line(InputBuffer *input_buffer)
+{
+  while (true)
+  {
+    char *start = input_buffer->buffer + input_buffer->next;
+    size_t available = input_buffer->filled - input_buffer->next;
+    char *end = (char *)memchr(start, '\n', available);
+    if (end == NULL && input_buffer->at_eof)
+    {
+      if (available == 0)
+      {
+        return false;
+      }
+      // The last line need not end in a newline; the buffer always keeps
+      // a byte spare for its NUL.
+      end = start + available;
+    }
+    if (end != NULL)
+    {
+      *end = 0;
+      input_buffer->line = start;
+      input_buffer->input_length = end - start;
+      input_buffer->next += (end - start) + (end < input_buffer->buffer + input_buffer->filled ? 1 : 0);
+      return true;
+    }
+
+    memmove(input_buffer->buffer, start, available);
+    input_buffer->filled = available;
+    input_buffer->next = 0;
+    if (input_buffer->filled + 1 >= input_buffer->buffer_length)
+    {
+      input_buffer->buffer_length *= 2;
+      input_buffer->buffer = (char *)realloc(input_buffer->buffer, input_buffer->buffer_length);
+    }
+    ssize_t bytes_read = read(STDIN_FILENO, input_buffer->buffer + input_buffer->filled,
+                              input_buffer->buffer_length - 1 - input_buffer->filled);
+    if (bytes_read < 0 && errno != EINTR)
+    {
+      printf("Error reading input\n");
+      exit(EXIT_FAILURE);
+    }
+    if (bytes_read == 0)
+    {
+      input_buffer->at_eof = true;
+    }
+    else if (bytes_read > 0)
+    {
+      input_buffer->filled += bytes_read;
+    }
+  }
 }
 
+#ifdef SQLITE_SERVER
+// [IPv4 address:]port, on the loopback address unless given another.
+bool parse_listen_address(const char *text, ServerOptions *options)
+{
+  const char *colon = strrchr(text, ':');
+  const char *port_text = colon != NULL ? colon + 1 : text;
+  char *end;
+  unsigned long port = strtoul(port_text, &end, 10);
+  if (end == port_text || *end != '\0' || port == 0 || port > 65535)
+  {
+    return false;
+  }
+  options->tcp_address = INADDR_LOOPBACK;
+  options->tcp_port = (uint16_t)port;
+  if (colon == NULL)
+  {
+    return true;
+  }
+  char host[INET_ADDRSTRLEN];
+  size_t length = colon - text;
+  if (length >= sizeof(host))
+  {
+    return false;
+  }
+  memcpy(host, text, length);
+  host[length] = '\0';
+  struct in_addr address;
+  if (inet_pton(AF_INET, host, &address) != 1)
+  {
+    return false;
+  }
+  options->tcp_address = ntohl(address.s_addr);
+  return true;
+}
+#endif
+
 int main(int argc, char *argv[])
 {
-  Table *table = new_table();
-  InputBuffer *input_buffer = new_input_buffer();
+  const char *filename = NULL;
+  uint32_t flags = 0;
+  uint32_t scan_threads = 0;
+  size_t sort_memory = 0;
+  uint32_t cache_pages = 0;
+  // Input that is not a terminal is taken to be a script.
+  bool batch = !isatty(STDIN_FILENO);
+#ifdef SQLITE_SERVER
+  ServerOptions server_options = {INADDR_LOOPBACK, 0, NULL};
+#endif
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--mmap") == 0)
+    {
+      flags |= SQLITE_OPEN_MMAP;
+    }
+    else if (strcmp(argv[i], "--fixed-rows") == 0)
+    {
+      flags |= SQLITE_OPEN_FIXED_ROWS;
+    }
+    else if (strcmp(argv[i], "--columnar-rows") == 0)
+    {
+      flags |= SQLITE_OPEN_COLUMNAR_ROWS;
+    }
+    else if (strcmp(argv[i], "--hash-keys") == 0)
+    {
+      flags |= SQLITE_OPEN_HASH_KEYS;
+    }
+    else if (strcmp(argv[i], "--compress") == 0)
+    {
+      flags |= SQLITE_OPEN_COMPRESS;
+    }
+    else if (strcmp(argv[i], "--batch") == 0)
+    {
+      batch = true;
+    }
+    else if (strcmp(argv[i], "--interactive") == 0)
+    {
+      batch = false;
+    }
+#ifdef SQLITE_SERVER
+    else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc)
+    {
+      if (!parse_listen_address(argv[++i], &server_options))
+      {
+        printf("Bad listen address '%s'.\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+    {
+      server_options.unix_path = argv[++i];
+    }
+#endif
+    else if (strcmp(argv[i], "--sync") == 0 && i + 1 < argc)
+    {
+      const char *mode = argv[++i];
+      if (strcmp(mode, "full") == 0)
+        flags |= SQLITE_OPEN_SYNC_FULL;
+      else if (strcmp(mode, "normal") == 0)
+        flags &= ~SQLITE_OPEN_SYNC_FULL;
+      else
+      {
+        printf("Unknown sync mode '%s'.\n", mode);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "--scan-threads") == 0 && i + 1 < argc)
+    {
+      scan_threads = (uint32_t)strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--sort-memory") == 0 && i + 1 < argc)
+    {
+      sort_memory = (size_t)strtoull(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--cache-pages") == 0 && i + 1 < argc)
+    {
+      cache_pages = (uint32_t)strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc)
+    {
+      unsigned long page_size = strtoul(argv[++i], NULL, 10);
+      if (page_size < 4096 || page_size > 65536 || (page_size & (page_size - 1)) != 0)
+      {
+        printf("Page size must be a power of two from 4096 to 65536.\n");
+        exit(EXIT_FAILURE);
+      }
+      flags = (flags & ~SQLITE_OPEN_PAGE_SIZE_MASK) | SQLITE_OPEN_PAGE_SIZE(page_size);
+    }
+    else
+    {
+      filename = argv[i];
+    }
+  }
+  if (filename == NULL)
+  {
+    printf("Must supply a database filename.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  Database *db = sqlite_open(filename, flags);
+  if (db == NULL)
+  {
+    printf("Catalog file '%s-catalog' is corrupt.\n", filename);
+    exit(EXIT_FAILURE);
+  }
+  if (scan_threads > 0)
+  {
+    sqlite_set_scan_threads(db, scan_threads);
+  }
+  if (sort_memory > 0)
+  {
+    sqlite_set_sort_memory(db, sort_memory);
+  }
+  if (cache_pages > 0 && !sqlite_set_cache_pages(db, cache_pages))
+  {
+    printf("The cache size cannot be set on a memory-mapped database, a reader, or while a reader is open.\n");
+  }
+#ifdef SQLITE_SERVER
+  if (server_options.tcp_port != 0 || server_options.unix_path != NULL)
+  {
+    bool served = server_run(db, &server_options);
+    sqlite_close(db);
+    return served ? 0 : EXIT_FAILURE;
+  }
+#endif
+  InputBuffer *input_buffer = new_input_buffer(batch);
+  OutputSink *sink = new_output_sink(stdout, OUTPUT_FORMAT_HUMAN);
+  // A batch prints no prompts and no "Executed.", only rows and errors,
+  // and its output goes out a whole stdio buffer at a time.
+  uint32_t uncommitted = 0;
+  if (batch)
+  {
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    sqlite_begin(db);
+  }
   while (true)
   {
-    print_prompt();
-    read_input(input_buffer);
+    if (!batch)
+    {
+      print_prompt();
+      read_input(input_buffer);
+    }
+    else if (!read_batch_line(input_buffer))
+    {
+      break;
+    }
+    else if (++uncommitted == BATCH_COMMIT_STATEMENTS)
+    {
+      sqlite_commit(db);
+      sqlite_begin(db);
+      uncommitted = 0;
+    }
 
-    if (input_buffer->buffer[0] == '.')
+    if (input_buffer->line[0] == '.')
     {
-      switch (do_meta_command(input_buffer, table))
+      switch (do_meta_command(input_buffer, db, sink))
       {
       case (META_COMMAND_SUCCESS):
         continue;
       case (META_COMMAND_UNRECOGNIZED_COMMAND):
-        printf("Unrecognized Command '%s'\n", input_buffer->buffer);
+        printf("Unrecognized Command '%s'\n", input_buffer->line);
         continue;
       }
     }
-    Statement statement;
-    switch (prepare_statement(input_buffer, &statement))
+    Statement *statement;
+    switch (sqlite_prepare_cached(db, input_buffer->line, &statement))
     {
     case PREPARE_SUCCESS:
       break;
+    case PREPARE_NEGATIVE_ID:
+      printf("ID must be positive.\n");
+      continue;
+    case PREPARE_STRING_TOO_LONG:
+      printf("String is too long.\n");
+      continue;
+    case PREPARE_UNKNOWN_TABLE:
+      printf("Unknown table.\n");
+      continue;
     case PREPARE_SYNTAX_ERROR:
       printf("Syntax Error. Could not parse statement.\n");
       continue;
+    case PREPARE_ROW_TOO_LARGE:
+      printf("Row is too large.\n");
+      continue;
     case PREPARE_UNRECOGNIZED_STATEMENT:
-      printf("Unrecognized Command at start of '%s'.\n", input_buffer->buffer);
+      printf("Unrecognized Command at start of '%s'.\n", input_buffer->line);
       continue;
     }
 
-    switch (execute_statement(&statement, table))
+    ExecuteResult result;
+    while ((result = sqlite_step(statement)) == EXECUTE_ROW)
+    {
+      sink->write_row(sink, statement);
+    }
+    sqlite_finalize(statement);
+    // Status lines would corrupt machine-readable output, so only the
+    // human format gets them on success.
+    if (result == EXECUTE_SUCCESS && sink->format == OUTPUT_FORMAT_HUMAN && !batch)
+    {
+      sink_write_message(sink, "Executed.\n");
+    }
+    sink_flush(sink);
+    switch (result)
     {
     case (EXECUTE_SUCCESS):
-      printf("Executed.\n");
+    case (EXECUTE_ROW):
+      break;
+    case (EXECUTE_DUPLICATE_KEY):
+      printf("Error: Duplicate key.\n");
+      break;
+    case (EXECUTE_UNBOUND_PARAMETER):
+      printf("Error: Unbound parameter.\n");
       break;
     case (EXECUTE_TABLE_FULL):
       printf("Error: Table full.\n");
       break;
+    case (EXECUTE_TABLE_EXISTS):
+      printf("Error: Table already exists.\n");
+      break;
+    case (EXECUTE_INDEX_EXISTS):
+      printf("Error: Index already exists.\n");
+      break;
+    case (EXECUTE_READ_ONLY):
+      printf("Error: Read-only connection.\n");
+      break;
     case (EXECUTE_FAILED):
       printf("ERROR : Failed to execute.\n");
       break;
     }
   }
+  // The end of a batch's input.
+  close_output_sink(sink);
+  close_input_buffer(input_buffer);
+  sqlite_close(db);
   return 0;
 }
+
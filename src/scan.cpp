@@ -0,0 +1,245 @@
+#include "scan.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// A worker's share of the items, [next, end). The owner takes from the
+// front and thieves cut off the back, both under the share's lock. Padded
+// so neighbouring shares do not sit on one cache line.
+typedef struct
+{
+  pthread_mutex_t lock;
+  uint32_t next;
+  uint32_t end;
+  char padding[64];
+} ScanShare;
+
+struct ScanPool
+{
+  uint32_t num_workers;
+  pthread_t *threads;
+  ScanShare shares[SCAN_MAX_WORKERS];
+  // The job in progress. Workers wait on start for generation to move on
+  // and the caller waits on finished for running to drop to zero.
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t finished;
+  uint64_t generation;
+  uint32_t running;
+  bool stopping;
+  ScanTask task;
+  void *context;
+};
+
+typedef struct
+{
+  ScanPool *pool;
+  uint32_t worker;
+} ScanThread;
+
+bool share_take(ScanShare *share, uint32_t *item)
+{
+  pthread_mutex_lock(&share->lock);
+  bool taken = share->next < share->end;
+  if (taken)
+  {
+    *item = share->next++;
+  }
+  pthread_mutex_unlock(&share->lock);
+  return taken;
+}
+
+uint32_t share_left(ScanShare *share)
+{
+  pthread_mutex_lock(&share->lock);
+  uint32_t left = share->end - share->next;
+  pthread_mutex_unlock(&share->lock);
+  return left;
+}
+
+// Move the upper half of the largest other share into worker's own. The
+// victim may shrink between being picked and being locked, so it is
+// checked again. Returns false once every share is empty.
+bool share_steal(ScanPool *pool, uint32_t worker)
+{
+  while (true)
+  {
+    uint32_t victim = worker;
+    uint32_t most = 0;
+    for (uint32_t i = 0; i < pool->num_workers; i++)
+    {
+      uint32_t left = i == worker ? 0 : share_left(&pool->shares[i]);
+      if (left > most)
+      {
+        victim = i;
+        most = left;
+      }
+    }
+    if (victim == worker)
+    {
+      return false;
+    }
+
+    ScanShare *share = &pool->shares[victim];
+    pthread_mutex_lock(&share->lock);
+    uint32_t next = share->next, end = share->end;
+    if (next >= end)
+    {
+      pthread_mutex_unlock(&share->lock);
+      continue;
+    }
+    // A lone item goes to the thief, which is idle, rather than waiting.
+    uint32_t middle = next + (end - next) / 2;
+    share->end = middle;
+    pthread_mutex_unlock(&share->lock);
+
+    ScanShare *own = &pool->shares[worker];
+    pthread_mutex_lock(&own->lock);
+    own->next = middle;
+    own->end = end;
+    pthread_mutex_unlock(&own->lock);
+    return true;
+  }
+}
+
+void scan_work(ScanPool *pool, uint32_t worker)
+{
+  uint32_t item;
+  do
+  {
+    while (share_take(&pool->shares[worker], &item))
+    {
+      pool->task(pool->context, worker, item);
+    }
+  } while (share_steal(pool, worker));
+}
+
+void *scan_thread_main(void *arg)
+{
+  ScanThread *thread = (ScanThread *)arg;
+  ScanPool *pool = thread->pool;
+  uint32_t worker = thread->worker;
+  free(thread);
+
+  uint64_t seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  while (true)
+  {
+    while (!pool->stopping && pool->generation == seen)
+    {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    if (pool->stopping)
+    {
+      break;
+    }
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    scan_work(pool, worker);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0)
+    {
+      pthread_cond_signal(&pool->finished);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+ScanPool *scan_pool_open(uint32_t num_workers)
+{
+  if (num_workers < 1)
+    num_workers = 1;
+  else if (num_workers > SCAN_MAX_WORKERS)
+    num_workers = SCAN_MAX_WORKERS;
+
+  ScanPool *pool = (ScanPool *)malloc(sizeof(ScanPool));
+  pool->num_workers = num_workers;
+  pool->threads = (pthread_t *)malloc(num_workers * sizeof(pthread_t));
+  for (uint32_t i = 0; i < SCAN_MAX_WORKERS; i++)
+  {
+    pthread_mutex_init(&pool->shares[i].lock, NULL);
+    pool->shares[i].next = 0;
+    pool->shares[i].end = 0;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+  pool->generation = 0;
+  pool->running = 0;
+  pool->stopping = false;
+
+  for (uint32_t i = 1; i < num_workers; i++)
+  {
+    ScanThread *thread = (ScanThread *)malloc(sizeof(ScanThread));
+    thread->pool = pool;
+    thread->worker = i;
+    if (pthread_create(&pool->threads[i], NULL, scan_thread_main, thread) != 0)
+    {
+      printf("Unable to start scan worker\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return pool;
+}
+
+void scan_pool_close(ScanPool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (uint32_t i = 1; i < pool->num_workers; i++)
+  {
+    pthread_join(pool->threads[i], NULL);
+  }
+  for (uint32_t i = 0; i < SCAN_MAX_WORKERS; i++)
+  {
+    pthread_mutex_destroy(&pool->shares[i].lock);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->finished);
+  free(pool->threads);
+  free(pool);
+}
+
+uint32_t scan_pool_workers(const ScanPool *pool)
+{
+  return pool->num_workers;
+}
+
+void scan_pool_run(ScanPool *pool, uint32_t num_items, ScanTask task, void *context)
+{
+  uint32_t workers = pool->num_workers;
+  for (uint32_t i = 0; i < workers; i++)
+  {
+    pool->shares[i].next = (uint32_t)((uint64_t)num_items * i / workers);
+    pool->shares[i].end = (uint32_t)((uint64_t)num_items * (i + 1) / workers);
+  }
+  pool->task = task;
+  pool->context = context;
+  if (workers == 1)
+  {
+    scan_work(pool, 0);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->running = workers - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  scan_work(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running > 0)
+  {
+    pthread_cond_wait(&pool->finished, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
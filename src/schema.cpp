@@ -0,0 +1,92 @@
+#include "schema.h"
+
+#include <strings.h>
+
+bool schema_init(TableSchema *schema, const char *name, uint32_t length)
+{
+  memset(schema, 0, sizeof(TableSchema));
+  if (length == 0 || length > SCHEMA_NAME_SIZE)
+  {
+    return false;
+  }
+  memcpy(schema->name, name, length);
+  return true;
+}
+
+int32_t schema_find_column(const TableSchema *schema, const char *name, uint32_t length)
+{
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    const char *column = schema->columns[i].name;
+    if (strlen(column) == length && strncasecmp(column, name, length) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool schema_add_column(TableSchema *schema, const char *name, uint32_t length, ColumnType type, uint32_t size)
+{
+  if (length == 0 || length > SCHEMA_NAME_SIZE || schema->num_columns == SCHEMA_MAX_COLUMNS ||
+      schema_find_column(schema, name, length) >= 0)
+  {
+    return false;
+  }
+  // The key column comes first.
+  if (schema->num_columns == 0 && type != COLUMN_TYPE_INTEGER)
+  {
+    return false;
+  }
+  if (type == COLUMN_TYPE_INTEGER ? size != sizeof(uint32_t) : size == 0 || size > SCHEMA_MAX_TEXT_SIZE)
+  {
+    return false;
+  }
+  if (schema->row_size + size > SCHEMA_MAX_ROW_SIZE)
+  {
+    return false;
+  }
+
+  ColumnDef *column = &schema->columns[schema->num_columns++];
+  memset(column, 0, sizeof(ColumnDef));
+  memcpy(column->name, name, length);
+  column->type = type;
+  column->size = size;
+  column->offset = schema->row_size;
+  schema->row_size += size;
+  return true;
+}
+
+uint32_t record_encoded_size(const TableSchema *schema, const char *row)
+{
+  uint32_t size = 0;
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    const ColumnDef *column = &schema->columns[i];
+    size += column->type == COLUMN_TYPE_INTEGER ? sizeof(uint32_t) : 1 + strnlen(row + column->offset, column->size);
+  }
+  return size;
+}
+
+uint32_t record_encode(const TableSchema *schema, const char *row, char *record)
+{
+  char *position = record;
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    const ColumnDef *column = &schema->columns[i];
+    if (column->type == COLUMN_TYPE_INTEGER)
+    {
+      memcpy(position, row + column->offset, sizeof(uint32_t));
+      position += sizeof(uint32_t);
+    }
+    else
+    {
+      // Text is at most SCHEMA_MAX_TEXT_SIZE, so its length fits the byte.
+      uint32_t length = strnlen(row + column->offset, column->size);
+      *position++ = (char)length;
+      memcpy(position, row + column->offset, length);
+      position += length;
+    }
+  }
+  return position - record;
+}
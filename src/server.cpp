@@ -0,0 +1,904 @@
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SERVER_MAX_EVENTS 256
+#define SERVER_MAX_STATEMENTS 64
+// A request line may be at most this long.
+#define SERVER_MAX_LINE (1024 * 1024)
+// Past this many unsent reply bytes a connection's requests wait, and past
+// twice the longest line of unread requests it is not read from.
+#define SERVER_OUTPUT_HIGH_WATER (1024 * 1024)
+#define SERVER_INPUT_LIMIT (2 * SERVER_MAX_LINE)
+#define SERVER_READ_SIZE (64 * 1024)
+// Room for the statistics as JSON, with every count at its widest.
+#define SERVER_STATS_SIZE 4096
+
+typedef struct
+{
+  char *data;
+  size_t used;
+  size_t capacity;
+} ByteBuffer;
+
+typedef struct Connection Connection;
+
+struct Connection
+{
+  int fd;
+  bool listener;
+  // Requests received and not yet run are input[input_start, input.used),
+  // replies not yet sent output[output_sent, output.used).
+  ByteBuffer input;
+  size_t input_start;
+  ByteBuffer output;
+  size_t output_sent;
+  // Interest registered with epoll.
+  uint32_t events;
+  // The peer has closed its side, sent .quit, or broken the protocol; the
+  // connection closes once its replies are sent.
+  bool reading_done;
+  // On this turn's list of connections to run and send for.
+  bool listed;
+  // A select whose replies reached the high-water mark, stepped on as they
+  // drain; the connection's later requests wait for it. A plain SQL line's
+  // statement is finalized at its end, a .run's kept in its slot.
+  Statement *streaming;
+  bool streaming_finalize;
+  Statement *statements[SERVER_MAX_STATEMENTS];
+  Connection *prev;
+  Connection *next;
+};
+
+typedef struct
+{
+  Database *db;
+  int epoll_fd;
+  Connection *listeners[2];
+  uint32_t num_listeners;
+  // Every client connection, for shutdown.
+  Connection *connections;
+  // Connections with requests to run or replies to send this turn.
+  Connection **listed;
+  uint32_t num_listed;
+  uint32_t listed_capacity;
+  // Connections with a select part way through its rows.
+  uint32_t num_streaming;
+  // Held open to be given up when the server runs out of descriptors, so
+  // it can accept and close the connection waiting on a listener; -1 once
+  // used up. Listeners then go unwatched until a connection closes.
+  int spare_fd;
+  bool accepting_paused;
+} Server;
+
+static volatile sig_atomic_t server_stopping = 0;
+
+void server_handle_signal(int signal_number)
+{
+  (void)signal_number;
+  server_stopping = 1;
+}
+
+void buffer_reserve(ByteBuffer *buffer, size_t more)
+{
+  if (buffer->used + more <= buffer->capacity)
+  {
+    return;
+  }
+  size_t capacity = buffer->capacity == 0 ? SERVER_READ_SIZE : buffer->capacity;
+  while (capacity < buffer->used + more)
+  {
+    capacity *= 2;
+  }
+  buffer->data = (char *)realloc(buffer->data, capacity);
+  buffer->capacity = capacity;
+}
+
+void buffer_append(ByteBuffer *buffer, const char *data, size_t length)
+{
+  buffer_reserve(buffer, length);
+  memcpy(buffer->data + buffer->used, data, length);
+  buffer->used += length;
+}
+
+void buffer_append_char(ByteBuffer *buffer, char c)
+{
+  buffer_reserve(buffer, 1);
+  buffer->data[buffer->used++] = c;
+}
+
+void buffer_append_uint(ByteBuffer *buffer, uint64_t value)
+{
+  char digits[20];
+  uint32_t n = 0;
+  do
+  {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+
+  buffer_reserve(buffer, n);
+  for (uint32_t i = 0; i < n; i++)
+  {
+    buffer->data[buffer->used + i] = digits[n - 1 - i];
+  }
+  buffer->used += n;
+}
+
+// A CSV field, quoted only when it holds a comma, a quote or a line break.
+void buffer_append_csv_field(ByteBuffer *buffer, const char *value, uint32_t length)
+{
+  bool quoted = false;
+  for (uint32_t i = 0; i < length && !quoted; i++)
+  {
+    quoted = value[i] == ',' || value[i] == '"' || value[i] == '\r' || value[i] == '\n';
+  }
+  if (!quoted)
+  {
+    buffer_append(buffer, value, length);
+    return;
+  }
+  buffer_append_char(buffer, '"');
+  for (uint32_t i = 0; i < length; i++)
+  {
+    if (value[i] == '"')
+    {
+      buffer_append_char(buffer, '"');
+    }
+    buffer_append_char(buffer, value[i]);
+  }
+  buffer_append_char(buffer, '"');
+}
+
+void reply_error(Connection *connection, const char *message)
+{
+  buffer_append_char(&connection->output, '!');
+  buffer_append(&connection->output, message, strlen(message));
+  buffer_append_char(&connection->output, '\n');
+}
+
+void reply_done(Connection *connection)
+{
+  buffer_append(&connection->output, ".\n", 2);
+}
+
+const char *prepare_message(PrepareResult result)
+{
+  switch (result)
+  {
+  case (PREPARE_NEGATIVE_ID):
+    return "ID must be positive.";
+  case (PREPARE_STRING_TOO_LONG):
+    return "String is too long.";
+  case (PREPARE_UNKNOWN_TABLE):
+    return "Unknown table.";
+  case (PREPARE_UNRECOGNIZED_STATEMENT):
+    return "Unrecognized statement.";
+  case (PREPARE_ROW_TOO_LARGE):
+    return "Row is too large.";
+  default:
+    return "Syntax error.";
+  }
+}
+
+const char *execute_message(ExecuteResult result)
+{
+  switch (result)
+  {
+  case (EXECUTE_DUPLICATE_KEY):
+    return "Duplicate key.";
+  case (EXECUTE_TABLE_FULL):
+    return "Table full.";
+  case (EXECUTE_UNBOUND_PARAMETER):
+    return "Unbound parameter.";
+  case (EXECUTE_TABLE_EXISTS):
+    return "Table already exists.";
+  case (EXECUTE_INDEX_EXISTS):
+    return "Index already exists.";
+  case (EXECUTE_READ_ONLY):
+    return "Read-only connection.";
+  default:
+    return "Failed to execute.";
+  }
+}
+
+bool output_backlogged(const Connection *connection)
+{
+  return connection->output.used - connection->output_sent >= SERVER_OUTPUT_HIGH_WATER;
+}
+
+// Step the connection's streaming statement, replying with its rows and
+// then its outcome. Unless finish is set, stops once replies back up and
+// leaves the statement to go on from there.
+void stream_rows(Server *server, Connection *connection, bool finish)
+{
+  Statement *statement = connection->streaming;
+  ByteBuffer *output = &connection->output;
+  ExecuteResult result;
+  while (true)
+  {
+    if (!finish && output_backlogged(connection))
+    {
+      return;
+    }
+    if ((result = sqlite_step(statement)) != EXECUTE_ROW)
+    {
+      break;
+    }
+    buffer_append_char(output, '+');
+    uint32_t num_columns = sqlite_column_count(statement);
+    for (uint32_t i = 0; i < num_columns; i++)
+    {
+      if (i > 0)
+      {
+        buffer_append_char(output, ',');
+      }
+      if (sqlite_column_type(statement, i) != COLUMN_TYPE_TEXT)
+      {
+        buffer_append_uint(output, sqlite_column_int64(statement, i));
+      }
+      else
+      {
+        uint32_t length;
+        const char *text = sqlite_column_text(statement, i, &length);
+        buffer_append_csv_field(output, text, length);
+      }
+    }
+    buffer_append_char(output, '\n');
+  }
+  if (result == EXECUTE_SUCCESS)
+  {
+    reply_done(connection);
+  }
+  else
+  {
+    reply_error(connection, execute_message(result));
+  }
+  if (connection->streaming_finalize)
+  {
+    sqlite_finalize(statement);
+  }
+  connection->streaming = NULL;
+  server->num_streaming--;
+}
+
+/*
+Run the statement, replying with its rows and then its outcome. A select
+goes only as far as the high-water mark and is stepped on from there as
+its replies drain. Changes must not reach a select part way through its
+rows, so a statement that makes them first finishes every such select,
+into its connection's replies.
+*/
+void reply_rows(Server *server, Connection *connection, Statement *statement, bool finalize)
+{
+  if (sqlite_column_count(statement) == 0 && server->num_streaming > 0)
+  {
+    for (Connection *other = server->connections; other != NULL; other = other->next)
+    {
+      if (other->streaming != NULL)
+      {
+        stream_rows(server, other, true);
+      }
+    }
+  }
+  connection->streaming = statement;
+  connection->streaming_finalize = finalize;
+  server->num_streaming++;
+  stream_rows(server, connection, false);
+}
+
+// The statement slot number at *cursor, which is moved past it and the
+// spaces after. Returns -1 if there is none.
+int32_t parse_slot(char **cursor)
+{
+  char *end;
+  unsigned long slot = strtoul(*cursor, &end, 10);
+  if (end == *cursor || slot >= SERVER_MAX_STATEMENTS || (*end != ' ' && *end != '\0'))
+  {
+    return -1;
+  }
+  while (*end == ' ')
+  {
+    end++;
+  }
+  *cursor = end;
+  return (int32_t)slot;
+}
+
+// Bind the values of a .run, in order. Quoted text is unescaped where it
+// lies in the line, which outlives the run.
+bool bind_values(Connection *connection, Statement *statement, char *cursor)
+{
+  uint32_t index = 0;
+  while (*cursor != '\0')
+  {
+    BindResult result;
+    if (*cursor == '\'')
+    {
+      char *text = ++cursor;
+      char *out = text;
+      while (*cursor != '\0' && !(*cursor == '\'' && cursor[1] != '\''))
+      {
+        if (*cursor == '\'')
+        {
+          cursor++;
+        }
+        *out++ = *cursor++;
+      }
+      if (*cursor != '\'')
+      {
+        reply_error(connection, "Unterminated text value.");
+        return false;
+      }
+      cursor++;
+      result = sqlite_bind_text(statement, index, text, (uint32_t)(out - text));
+    }
+    else
+    {
+      char *end;
+      unsigned long value = strtoul(cursor, &end, 10);
+      if (end == cursor || value > UINT32_MAX || (*end != ' ' && *end != '\0'))
+      {
+        reply_error(connection, "Bad value.");
+        return false;
+      }
+      cursor = end;
+      result = sqlite_bind_int(statement, index, (uint32_t)value);
+    }
+    switch (result)
+    {
+    case (BIND_SUCCESS):
+      break;
+    case (BIND_RANGE_ERROR):
+      reply_error(connection, "Too many values.");
+      return false;
+    case (BIND_TYPE_MISMATCH):
+      reply_error(connection, "Value of the wrong type.");
+      return false;
+    case (BIND_STRING_TOO_LONG):
+      reply_error(connection, "String is too long.");
+      return false;
+    }
+    index++;
+    while (*cursor == ' ')
+    {
+      cursor++;
+    }
+  }
+  return true;
+}
+
+void run_command(Server *server, Connection *connection, char *line)
+{
+  if (strcmp(line, ".quit") == 0)
+  {
+    connection->reading_done = true;
+    connection->input_start = connection->input.used;
+    reply_done(connection);
+    return;
+  }
+  if (strcmp(line, ".stats") == 0)
+  {
+    char stats[SERVER_STATS_SIZE];
+    size_t length = sqlite_format_stats(stats, sizeof(stats), true);
+    buffer_append_char(&connection->output, '+');
+    // The JSON ends in a newline, which ends the row.
+    buffer_append(&connection->output, stats, length < sizeof(stats) ? length : sizeof(stats) - 1);
+    reply_done(connection);
+    return;
+  }
+  if (strcmp(line, ".stats reset") == 0)
+  {
+    sqlite_reset_stats();
+    reply_done(connection);
+    return;
+  }
+  bool prepare = strncmp(line, ".prepare ", 9) == 0;
+  bool run = strncmp(line, ".run ", 5) == 0;
+  bool finalize = strncmp(line, ".finalize ", 10) == 0;
+  if (!prepare && !run && !finalize)
+  {
+    reply_error(connection, "Unrecognized command.");
+    return;
+  }
+  char *cursor = strchr(line, ' ') + 1;
+  int32_t slot = parse_slot(&cursor);
+  if (slot < 0)
+  {
+    reply_error(connection, "Bad statement number.");
+    return;
+  }
+  Statement **statement = &connection->statements[slot];
+
+  if (prepare)
+  {
+    if (*statement != NULL)
+    {
+      sqlite_finalize(*statement);
+      *statement = NULL;
+    }
+    PrepareResult result = sqlite_prepare(server->db, cursor, statement);
+    if (result == PREPARE_SUCCESS)
+    {
+      reply_done(connection);
+    }
+    else
+    {
+      *statement = NULL;
+      reply_error(connection, prepare_message(result));
+    }
+  }
+  else if (run)
+  {
+    if (*statement == NULL)
+    {
+      reply_error(connection, "No such statement.");
+      return;
+    }
+    sqlite_reset(*statement);
+    if (bind_values(connection, *statement, cursor))
+    {
+      reply_rows(server, connection, *statement, false);
+    }
+  }
+  else
+  {
+    if (*statement != NULL)
+    {
+      sqlite_finalize(*statement);
+      *statement = NULL;
+    }
+    reply_done(connection);
+  }
+}
+
+void run_line(Server *server, Connection *connection, char *line)
+{
+  if (line[0] == '.')
+  {
+    run_command(server, connection, line);
+    return;
+  }
+  Statement *statement;
+  PrepareResult result = sqlite_prepare_cached(server->db, line, &statement);
+  if (result != PREPARE_SUCCESS)
+  {
+    reply_error(connection, prepare_message(result));
+    return;
+  }
+  reply_rows(server, connection, statement, true);
+}
+
+// The next complete request line, NUL terminated in place, or NULL.
+char *next_line(Connection *connection)
+{
+  char *start = connection->input.data + connection->input_start;
+  size_t available = connection->input.used - connection->input_start;
+  char *end = (char *)memchr(start, '\n', available);
+  if (end == NULL)
+  {
+    if (available > SERVER_MAX_LINE && !connection->reading_done)
+    {
+      reply_error(connection, "Line too long.");
+      connection->reading_done = true;
+      connection->input_start = connection->input.used;
+    }
+    return NULL;
+  }
+  connection->input_start += end - start + 1;
+  if (end > start && end[-1] == '\r')
+  {
+    end--;
+  }
+  *end = '\0';
+  return start;
+}
+
+// Go on with a streaming select, then run the requests received so far,
+// until replies back up.
+void connection_run(Server *server, Connection *connection)
+{
+  if (connection->streaming != NULL)
+  {
+    stream_rows(server, connection, false);
+  }
+  char *line;
+  while (connection->streaming == NULL && !output_backlogged(connection) && (line = next_line(connection)) != NULL)
+  {
+    if (line[0] != '\0')
+    {
+      run_line(server, connection, line);
+    }
+  }
+}
+
+bool has_line(const Connection *connection)
+{
+  return memchr(connection->input.data + connection->input_start, '\n',
+                connection->input.used - connection->input_start) != NULL;
+}
+
+void server_list(Server *server, Connection *connection)
+{
+  if (connection->listed)
+  {
+    return;
+  }
+  if (server->num_listed == server->listed_capacity)
+  {
+    server->listed_capacity = server->listed_capacity == 0 ? 64 : server->listed_capacity * 2;
+    server->listed = (Connection **)realloc(server->listed, server->listed_capacity * sizeof(Connection *));
+  }
+  server->listed[server->num_listed++] = connection;
+  connection->listed = true;
+}
+
+// Read whatever has arrived, up to the input limit.
+void connection_receive(Connection *connection)
+{
+  ByteBuffer *input = &connection->input;
+  if (connection->input_start > 0)
+  {
+    memmove(input->data, input->data + connection->input_start, input->used - connection->input_start);
+    input->used -= connection->input_start;
+    connection->input_start = 0;
+  }
+  while (!connection->reading_done && input->used < SERVER_INPUT_LIMIT)
+  {
+    buffer_reserve(input, SERVER_READ_SIZE);
+    ssize_t received = recv(connection->fd, input->data + input->used, input->capacity - input->used, 0);
+    if (received > 0)
+    {
+      input->used += received;
+    }
+    else if (received < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    else
+    {
+      // A closed or failed peer still gets the replies it is owed, as far
+      // as they can be sent.
+      connection->reading_done = received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+      break;
+    }
+  }
+}
+
+// Send what the socket takes. Returns false if the peer has gone.
+bool connection_send(Connection *connection)
+{
+  ByteBuffer *output = &connection->output;
+  while (connection->output_sent < output->used)
+  {
+    ssize_t sent = send(connection->fd, output->data + connection->output_sent,
+                        output->used - connection->output_sent, MSG_NOSIGNAL);
+    if (sent > 0)
+    {
+      connection->output_sent += sent;
+    }
+    else if (sent < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    else
+    {
+      return sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+  }
+  output->used = 0;
+  connection->output_sent = 0;
+  return true;
+}
+
+void connection_watch(Server *server, Connection *connection, uint32_t events)
+{
+  if (events == connection->events)
+  {
+    return;
+  }
+  struct epoll_event event;
+  event.events = events;
+  event.data.ptr = connection;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+  connection->events = events;
+}
+
+void connection_close(Server *server, Connection *connection)
+{
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  if (connection->streaming != NULL)
+  {
+    if (connection->streaming_finalize)
+    {
+      sqlite_finalize(connection->streaming);
+    }
+    server->num_streaming--;
+  }
+  for (uint32_t i = 0; i < SERVER_MAX_STATEMENTS; i++)
+  {
+    if (connection->statements[i] != NULL)
+    {
+      sqlite_finalize(connection->statements[i]);
+    }
+  }
+  if (connection->prev != NULL)
+    connection->prev->next = connection->next;
+  else
+    server->connections = connection->next;
+  if (connection->next != NULL)
+  {
+    connection->next->prev = connection->prev;
+  }
+  free(connection->input.data);
+  free(connection->output.data);
+  free(connection);
+  if (server->accepting_paused)
+  {
+    if (server->spare_fd < 0)
+    {
+      server->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    for (uint32_t i = 0; i < server->num_listeners; i++)
+    {
+      connection_watch(server, server->listeners[i], EPOLLIN);
+    }
+    server->accepting_paused = false;
+  }
+}
+
+Connection *connection_open(Server *server, int fd, bool listener)
+{
+  Connection *connection = (Connection *)calloc(1, sizeof(Connection));
+  connection->fd = fd;
+  connection->listener = listener;
+  connection->events = EPOLLIN;
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = connection;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  if (!listener)
+  {
+    connection->next = server->connections;
+    if (server->connections != NULL)
+    {
+      server->connections->prev = connection;
+    }
+    server->connections = connection;
+  }
+  return connection;
+}
+
+void server_accept(Server *server, Connection *listener)
+{
+  while (true)
+  {
+    int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+      // EAGAIN once the backlog is empty; anything else is the client's
+      // loss, not the server's.
+      if (errno == EINTR || errno == ECONNABORTED)
+      {
+        continue;
+      }
+      if (errno == EMFILE || errno == ENFILE)
+      {
+        // A waiting connection would keep the listener ready and spin the
+        // loop, so turn it away with the spare descriptor. The error does
+        // not say one is waiting; only the accept with the spare does.
+        if (server->spare_fd >= 0)
+        {
+          close(server->spare_fd);
+          int rejected = accept4(listener->fd, NULL, NULL, SOCK_CLOEXEC);
+          if (rejected >= 0)
+          {
+            close(rejected);
+          }
+          server->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+          if (rejected >= 0 && server->spare_fd >= 0)
+          {
+            continue;
+          }
+          if (server->spare_fd >= 0)
+          {
+            return;
+          }
+        }
+        for (uint32_t i = 0; i < server->num_listeners; i++)
+        {
+          connection_watch(server, server->listeners[i], 0);
+        }
+        server->accepting_paused = true;
+      }
+      return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    connection_open(server, fd, false);
+  }
+}
+
+/*
+After the commit: send each listed connection's replies, then decide what
+it waits for. Requests and selects held back by a backlog that has now
+drained stay listed, to run on the next turn.
+*/
+void server_send(Server *server)
+{
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < server->num_listed; i++)
+  {
+    Connection *connection = server->listed[i];
+    if (!connection_send(connection))
+    {
+      connection_close(server, connection);
+      continue;
+    }
+    bool unsent = connection->output_sent < connection->output.used;
+    bool runnable = !output_backlogged(connection) && (connection->streaming != NULL || has_line(connection));
+    if (connection->reading_done && !unsent && !runnable)
+    {
+      connection_close(server, connection);
+      continue;
+    }
+    bool readable = !connection->reading_done && !output_backlogged(connection) &&
+                    connection->input.used - connection->input_start < SERVER_INPUT_LIMIT;
+    uint32_t events = (readable ? (uint32_t)EPOLLIN : 0) | (unsent ? (uint32_t)EPOLLOUT : 0);
+    connection_watch(server, connection, events);
+    connection->listed = runnable;
+    if (runnable)
+    {
+      server->listed[kept++] = connection;
+    }
+  }
+  server->num_listed = kept;
+}
+
+int listen_on(int domain, const struct sockaddr *address, socklen_t length)
+{
+  int fd = socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, address, length) < 0 || listen(fd, SOMAXCONN) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool server_listen(Server *server, const ServerOptions *options)
+{
+  if (options->tcp_port != 0)
+  {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(options->tcp_address);
+    address.sin_port = htons(options->tcp_port);
+    int fd = listen_on(AF_INET, (const struct sockaddr *)&address, sizeof(address));
+    if (fd < 0)
+    {
+      printf("Unable to listen on port %u: %s\n", options->tcp_port, strerror(errno));
+      return false;
+    }
+    server->listeners[server->num_listeners++] = connection_open(server, fd, true);
+  }
+  if (options->unix_path != NULL)
+  {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(options->unix_path) >= sizeof(address.sun_path))
+    {
+      printf("Socket path '%s' is too long.\n", options->unix_path);
+      return false;
+    }
+    strcpy(address.sun_path, options->unix_path);
+    unlink(options->unix_path);
+    int fd = listen_on(AF_UNIX, (const struct sockaddr *)&address, sizeof(address));
+    if (fd < 0)
+    {
+      printf("Unable to listen on '%s': %s\n", options->unix_path, strerror(errno));
+      return false;
+    }
+    server->listeners[server->num_listeners++] = connection_open(server, fd, true);
+  }
+  return true;
+}
+
+bool server_run(Database *db, const ServerOptions *options)
+{
+  Server server;
+  memset(&server, 0, sizeof(server));
+  server.db = db;
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (server.epoll_fd < 0)
+  {
+    printf("Unable to create the event loop: %s\n", strerror(errno));
+    return false;
+  }
+  server.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  bool listening = server_listen(&server, options);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = server_handle_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  sqlite_begin(db);
+  while (listening && !server_stopping)
+  {
+    // Requests left over from last turn run without waiting for more.
+    int ready = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, server.num_listed > 0 ? 0 : -1);
+    if (ready < 0 && errno != EINTR)
+    {
+      printf("Error waiting for events: %s\n", strerror(errno));
+      break;
+    }
+    for (int i = 0; i < ready; i++)
+    {
+      Connection *connection = (Connection *)events[i].data.ptr;
+      if (connection->listener)
+      {
+        server_accept(&server, connection);
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      {
+        connection_receive(connection);
+      }
+      server_list(&server, connection);
+    }
+    for (uint32_t i = 0; i < server.num_listed; i++)
+    {
+      connection_run(&server, server.listed[i]);
+    }
+    sqlite_commit(db);
+    sqlite_begin(db);
+    server_send(&server);
+  }
+  sqlite_commit(db);
+
+  while (server.connections != NULL)
+  {
+    connection_close(&server, server.connections);
+  }
+  for (uint32_t i = 0; i < server.num_listeners; i++)
+  {
+    close(server.listeners[i]->fd);
+    free(server.listeners[i]);
+  }
+  if (options->unix_path != NULL && listening)
+  {
+    unlink(options->unix_path);
+  }
+  close(server.epoll_fd);
+  if (server.spare_fd >= 0)
+  {
+    close(server.spare_fd);
+  }
+  free(server.listed);
+  return listening;
+}
@@ -0,0 +1,260 @@
+#include "stats.h"
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef struct StatsBlock
+{
+  Stats stats;
+  struct StatsBlock *next;
+} StatsBlock;
+
+// The blocks of live threads, those of threads gone, and the sums at the
+// last reset, all guarded by stats_lock. Only a block's own thread writes
+// it; readers load its fields atomically, so they see whole values.
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+StatsBlock *stats_blocks = NULL;
+Stats stats_exited;
+Stats stats_zero;
+pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+// Only there for its destructor, which runs as a thread exits.
+pthread_key_t stats_key;
+__thread StatsBlock *stats_block = NULL;
+
+const char *const stats_counter_names[STAT_NUM_COUNTERS] = {"cache_hits", "cache_misses", "pages_allocated",
+                                                            "rows_scanned", "rows_returned"};
+const char *const stats_timer_names[STAT_NUM_TIMERS] = {"parse", "execute", "sync"};
+
+void stats_add_all(Stats *total, const Stats *stats)
+{
+  const uint64_t *from = (const uint64_t *)stats;
+  uint64_t *to = (uint64_t *)total;
+  for (size_t i = 0; i < sizeof(Stats) / sizeof(uint64_t); i++)
+  {
+    to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+  }
+}
+
+void stats_thread_exit(void *arg)
+{
+  StatsBlock *block = (StatsBlock *)arg;
+  pthread_mutex_lock(&stats_lock);
+  StatsBlock **link = &stats_blocks;
+  while (*link != block)
+  {
+    link = &(*link)->next;
+  }
+  *link = block->next;
+  stats_add_all(&stats_exited, &block->stats);
+  pthread_mutex_unlock(&stats_lock);
+  free(block);
+}
+
+void stats_make_key()
+{
+  pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+Stats *stats_thread()
+{
+  if (stats_block == NULL)
+  {
+    pthread_once(&stats_once, stats_make_key);
+    StatsBlock *block = (StatsBlock *)calloc(1, sizeof(StatsBlock));
+    if (block == NULL)
+    {
+      printf("Unable to allocate statistics\n");
+      exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&stats_lock);
+    block->next = stats_blocks;
+    stats_blocks = block;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(stats_key, block);
+    stats_block = block;
+  }
+  return &stats_block->stats;
+}
+
+// No other thread writes the field, so this needs no locked add.
+void stats_add(uint64_t *field, uint64_t amount)
+{
+  __atomic_store_n(field, __atomic_load_n(field, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+void stats_count(StatCounter counter, uint64_t amount)
+{
+  stats_add(&stats_thread()->counters[counter], amount);
+}
+
+uint64_t stats_clock()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void stats_time_ns(StatTimer timer, uint64_t ns)
+{
+  uint32_t bucket = 63 - __builtin_clzll(ns | 1);
+  if (bucket >= STAT_HISTOGRAM_BUCKETS)
+  {
+    bucket = STAT_HISTOGRAM_BUCKETS - 1;
+  }
+  Stats *stats = stats_thread();
+  stats_add(&stats->total_ns[timer], ns);
+  stats_add(&stats->buckets[timer][bucket], 1);
+}
+
+void stats_time(StatTimer timer, uint64_t start)
+{
+  stats_time_ns(timer, stats_clock() - start);
+}
+
+// Every count there has been, unreset.
+void stats_sum(Stats *total)
+{
+  memset(total, 0, sizeof(Stats));
+  stats_add_all(total, &stats_exited);
+  for (StatsBlock *block = stats_blocks; block != NULL; block = block->next)
+  {
+    stats_add_all(total, &block->stats);
+  }
+}
+
+void stats_read(Stats *stats)
+{
+  pthread_mutex_lock(&stats_lock);
+  stats_sum(stats);
+  uint64_t *to = (uint64_t *)stats;
+  const uint64_t *zero = (const uint64_t *)&stats_zero;
+  for (size_t i = 0; i < sizeof(Stats) / sizeof(uint64_t); i++)
+  {
+    to[i] -= zero[i];
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_reset()
+{
+  pthread_mutex_lock(&stats_lock);
+  stats_sum(&stats_zero);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+uint64_t stats_timer_count(const Stats *stats, StatTimer timer)
+{
+  uint64_t count = 0;
+  for (uint32_t i = 0; i < STAT_HISTOGRAM_BUCKETS; i++)
+  {
+    count += stats->buckets[timer][i];
+  }
+  return count;
+}
+
+// The time below which the given fraction of times fall, in nanoseconds;
+// 0 if there are none. The times in the bucket holding it are taken to be
+// spread evenly across it, each at the middle of its share, rather than
+// all at the bucket's top, which could overstate them up to twice.
+uint64_t stats_percentile(const Stats *stats, StatTimer timer, double fraction)
+{
+  uint64_t count = stats_timer_count(stats, timer);
+  if (count == 0)
+  {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)ceil(fraction * count);
+  rank = rank < 1 ? 1 : rank > count ? count : rank;
+  uint64_t seen = 0;
+  uint32_t bucket = 0;
+  for (; bucket < STAT_HISTOGRAM_BUCKETS - 1; bucket++)
+  {
+    if (seen + stats->buckets[timer][bucket] >= rank)
+    {
+      break;
+    }
+    seen += stats->buckets[timer][bucket];
+  }
+  uint64_t low = bucket == 0 ? 0 : (uint64_t)1 << bucket;
+  uint64_t high = (uint64_t)2 << bucket;
+  // The loop stops at a bucket holding the rank, so it is never empty.
+  uint64_t in_bucket = stats->buckets[timer][bucket];
+  return low + (uint64_t)((double)(high - low) * (rank - seen - 0.5) / in_bucket);
+}
+
+typedef struct
+{
+  char *buffer;
+  size_t size;
+  size_t length;
+} StatsWriter;
+
+void stats_write(StatsWriter *writer, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  size_t room = writer->length < writer->size ? writer->size - writer->length : 0;
+  int written = vsnprintf(room > 0 ? writer->buffer + writer->length : NULL, room, format, args);
+  va_end(args);
+  if (written > 0)
+  {
+    writer->length += written;
+  }
+}
+
+size_t stats_format(const Stats *stats, bool json, char *buffer, size_t size)
+{
+  StatsWriter writer = {buffer, size, 0};
+  if (size > 0)
+  {
+    buffer[0] = '\0';
+  }
+  if (json)
+  {
+    stats_write(&writer, "{");
+    for (uint32_t i = 0; i < STAT_NUM_COUNTERS; i++)
+    {
+      stats_write(&writer, "\"%s\":%llu,", stats_counter_names[i], (unsigned long long)stats->counters[i]);
+    }
+    for (uint32_t i = 0; i < STAT_NUM_TIMERS; i++)
+    {
+      StatTimer timer = (StatTimer)i;
+      stats_write(&writer, "%s\"%s\":{\"count\":%llu,\"total_ns\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"buckets\":[",
+                  i > 0 ? "," : "", stats_timer_names[i], (unsigned long long)stats_timer_count(stats, timer),
+                  (unsigned long long)stats->total_ns[i], (unsigned long long)stats_percentile(stats, timer, 0.50),
+                  (unsigned long long)stats_percentile(stats, timer, 0.99));
+      for (uint32_t bucket = 0; bucket < STAT_HISTOGRAM_BUCKETS; bucket++)
+      {
+        stats_write(&writer, "%s%llu", bucket > 0 ? "," : "", (unsigned long long)stats->buckets[i][bucket]);
+      }
+      stats_write(&writer, "]}");
+    }
+    stats_write(&writer, "}\n");
+    return writer.length;
+  }
+
+  for (uint32_t i = 0; i < STAT_NUM_COUNTERS; i++)
+  {
+    stats_write(&writer, "%-16s %12llu\n", stats_counter_names[i], (unsigned long long)stats->counters[i]);
+  }
+  uint64_t lookups = stats->counters[STAT_CACHE_HITS] + stats->counters[STAT_CACHE_MISSES];
+  if (lookups > 0)
+  {
+    stats_write(&writer, "%-16s %11.2f%%\n", "cache_hit_rate", 100.0 * stats->counters[STAT_CACHE_HITS] / lookups);
+  }
+  stats_write(&writer, "%-16s %12s %12s %12s %12s\n", "latency (us)", "count", "mean", "p50", "p99");
+  for (uint32_t i = 0; i < STAT_NUM_TIMERS; i++)
+  {
+    StatTimer timer = (StatTimer)i;
+    uint64_t count = stats_timer_count(stats, timer);
+    double mean = count > 0 ? stats->total_ns[i] / 1000.0 / count : 0;
+    stats_write(&writer, "%-16s %12llu %12.1f %12.1f %12.1f\n", stats_timer_names[i], (unsigned long long)count,
+                mean, stats_percentile(stats, timer, 0.50) / 1000.0, stats_percentile(stats, timer, 0.99) / 1000.0);
+  }
+  return writer.length;
+}
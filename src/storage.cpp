@@ -0,0 +1,3830 @@
+#include "storage.h"
+#include "compress.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void serialize_row(Row *source, void *destination)
+{
+  UsersSchema::serialize(*source, destination);
+}
+
+void deserialize_row(void *source, Row *destination)
+{
+  UsersSchema::deserialize(source, *destination);
+}
+
+TableSchema describe_users()
+{
+  static const char *const names[] = {"id", "username", "email"};
+  TableSchema schema;
+  UsersSchema::describe(&schema, "users", names);
+  return schema;
+}
+
+const TableSchema *users_schema()
+{
+  static const TableSchema schema = describe_users();
+  return &schema;
+}
+
+typedef struct
+{
+  uint32_t page_num;
+  uint32_t pin_count;
+  bool in_use;
+  bool dirty;
+  int32_t lru_prev;
+  int32_t lru_next;
+  char *data; // from the pager's arena, on the frame's first use
+} PageFrame;
+
+/*
+Write-ahead log
+
+In the buffered pager, changed pages are appended to <db>-wal as frames
+instead of being written over the database file. A commit is a run of
+frames whose last one records the database size in pages, so recovery can
+tell committed work from a torn tail. The database file only changes in
+checkpoints, which copy the newest committed version of each page back;
+they run on a background thread once the log grows, and the log starts
+over from the top once everything in it has been copied.
+
+Commits are written straight away and fsynced by a syncer thread, so all
+commits that arrive while one sync is in flight share the next. In NORMAL
+mode a commit returns without waiting for its sync; in FULL mode it waits.
+
+The log also keeps old versions of pages for snapshot readers. Frames are
+never written over until a restart, so a reader that noted how many frames
+were committed when it began (its read mark) sees that commit by reading
+each page's newest frame below the mark, or the database file if there is
+none. Checkpoints copy nothing past the oldest read mark, which keeps the
+database file holding what such readers expect of it, and the log only
+restarts once every reader is reading the latest commit. Those readers
+then read the database file alone, with a mark of 0.
+*/
+#define WAL_MAGIC 0x57414c31
+#define WAL_VERSION 1
+#define WAL_HEADER_SIZE 32
+#define WAL_FRAME_HEADER_SIZE 24
+#define WAL_NO_FRAME -1
+// A background checkpoint starts once this many frames wait to be copied.
+#define WAL_CHECKPOINT_FRAMES 1000
+// Most consecutive pages a checkpoint writes back at once.
+#define WAL_CHECKPOINT_RUN_PAGES 64
+// Past this many frames a new transaction waits for a full checkpoint so
+// the log can restart instead of growing.
+#define WAL_MAX_FRAMES 8000
+// How long the NORMAL mode syncer lets commits pile up before an fsync.
+#define WAL_GROUP_COMMIT_US 10000
+#define WAL_MAX_READERS 64
+#define WAL_NO_READER -1
+
+struct Wal
+{
+  int file_descriptor;
+  int db_file_descriptor;
+  char *path;
+  WalSyncMode sync_mode;
+  uint32_t page_size;
+  uint32_t checkpoint_seq;
+  uint32_t salt[2];
+  // Running checksum, chained through the header and every frame.
+  uint32_t checksum[2];
+  // Newest frame of each page, read in place of the database file. Pages
+  // past pages_capacity have none.
+  int32_t *page_frames;
+  uint32_t pages_capacity;
+  // Frames queued by wal_append and not yet written.
+  char *pending;
+  uint32_t num_pending;
+  uint32_t pending_capacity;
+
+  // Everything below is shared with the background threads and guarded by
+  // lock. Only the main thread writes frames, so it may read num_frames and
+  // committed without taking it.
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  uint32_t *frame_pages; // page number held by each frame
+  int32_t *frame_prev;   // the same page's previous frame, or WAL_NO_FRAME
+  uint32_t frames_capacity;
+  uint32_t num_frames;
+  uint32_t committed;  // frames up to and including the last commit frame
+  uint32_t synced;     // committed frames known to be on disk
+  uint32_t backfilled; // frames copied into the database file
+  uint32_t generation; // bumped on restart so a stale sync is not counted
+  bool checkpoint_requested;
+  bool checkpoint_running;
+  bool compress; // checkpoints write pages compressed; see page_encode
+  bool stopping;
+  bool threads_started;
+  pthread_t syncer;
+  pthread_t checkpointer;
+  // Snapshot readers: which slots are taken and, for each reader in the
+  // middle of a read, its read mark. WAL_NO_FRAME when it is not reading.
+  bool reader_open[WAL_MAX_READERS];
+  int32_t read_marks[WAL_MAX_READERS];
+};
+
+/*
+Page arena. Every cache frame of a database, its writer's and those of
+all its snapshot readers, is a page of one anonymous mapping made when
+the writer opens, so cache memory is capped at the arena's size however
+many readers come and go. The mapping is page-aligned and, where the
+kernel has huge pages to spare, backed by them to save TLB entries.
+Frames take a page the first time they are used and keep it until their
+pager closes, so the free list's lock is only taken while caches warm up.
+*/
+#define PAGE_ARENA_HUGE_PAGE (2u << 20)
+#define PAGE_ARENA_NO_PAGE -1
+
+typedef struct
+{
+  char *base;
+  size_t length;
+  uint32_t page_size;
+  uint32_t num_pages;
+  pthread_mutex_t lock;
+  // Free pages, linked through next_free from free_head.
+  int32_t *next_free;
+  int32_t free_head;
+} PageArena;
+
+PageArena *page_arena_open(uint32_t num_pages, uint32_t page_size)
+{
+  PageArena *arena = (PageArena *)malloc(sizeof(PageArena));
+  size_t length = (size_t)num_pages * page_size;
+  arena->length = (length + PAGE_ARENA_HUGE_PAGE - 1) & ~(size_t)(PAGE_ARENA_HUGE_PAGE - 1);
+  void *base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  // Explicit huge pages if any are reserved, and ordinary pages otherwise.
+  base = mmap(NULL, arena->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1,
+              0);
+#endif
+  if (base == MAP_FAILED)
+  {
+    base = mmap(NULL, arena->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                -1, 0);
+    if (base == MAP_FAILED)
+    {
+      printf("Unable to allocate page cache\n");
+      exit(EXIT_FAILURE);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(base, arena->length, MADV_HUGEPAGE);
+#endif
+  }
+  arena->base = (char *)base;
+  arena->page_size = page_size;
+  arena->num_pages = num_pages;
+  pthread_mutex_init(&arena->lock, NULL);
+  arena->next_free = (int32_t *)malloc(num_pages * sizeof(int32_t));
+  // In address order, so a lone pager's frames end up side by side.
+  for (uint32_t i = 0; i < num_pages; i++)
+  {
+    arena->next_free[i] = i + 1 < num_pages ? (int32_t)(i + 1) : PAGE_ARENA_NO_PAGE;
+  }
+  arena->free_head = num_pages > 0 ? 0 : PAGE_ARENA_NO_PAGE;
+  return arena;
+}
+
+// Every page must have been given back.
+void page_arena_close(PageArena *arena)
+{
+  munmap(arena->base, arena->length);
+  pthread_mutex_destroy(&arena->lock);
+  free(arena->next_free);
+  free(arena);
+}
+
+char *page_arena_take(PageArena *arena)
+{
+  pthread_mutex_lock(&arena->lock);
+  int32_t page = arena->free_head;
+  if (page != PAGE_ARENA_NO_PAGE)
+  {
+    arena->free_head = arena->next_free[page];
+  }
+  pthread_mutex_unlock(&arena->lock);
+  if (page == PAGE_ARENA_NO_PAGE)
+  {
+    printf("Error: page cache arena is exhausted.\n");
+    exit(EXIT_FAILURE);
+  }
+  return arena->base + (size_t)page * arena->page_size;
+}
+
+void page_arena_give(PageArena *arena, char *data)
+{
+  int32_t page = (int32_t)((data - arena->base) / arena->page_size);
+  pthread_mutex_lock(&arena->lock);
+  arena->next_free[page] = arena->free_head;
+  arena->free_head = page;
+  pthread_mutex_unlock(&arena->lock);
+}
+
+struct Pager
+{
+  int file_descriptor;
+  uint32_t page_size;
+  off_t file_length;
+  uint32_t num_pages;
+  // Buffered pages are written through the log; NULL in mmap mode.
+  Wal *wal;
+  // mmap mode serves pages straight out of a shared mapping of the file
+  // instead of copying them into cache frames.
+  bool use_mmap;
+  char *map_base;
+  uint32_t map_pages;
+  uint32_t map_capacity; // pages the reserved address space can hold
+  uint32_t cache_size;
+  // Shared with the writer's snapshot readers; NULL in mmap mode.
+  PageArena *arena;
+  PageFrame *frames;
+  // Frames from 0 up to this one have been claimed; the rest never have.
+  uint32_t frames_used;
+  // The cached frame of each page; pages past pages_capacity have none.
+  int32_t *page_frames;
+  uint32_t pages_capacity;
+  // Most recently used frame is at the head, the eviction candidate at the tail.
+  int32_t lru_head;
+  int32_t lru_tail;
+  // Serializes page fetches from parallel scan workers (see leaf_acquire).
+  pthread_mutex_t latch;
+  // A snapshot pager reads through its slot in the writer's log and keeps
+  // its cache for as long as it sees the same commit.
+  int32_t read_slot;
+  bool has_snapshot;
+  uint32_t snapshot_generation;
+  uint32_t snapshot_frames;
+};
+
+// Fletcher-style checksum over 32-bit words, continued from checksum.
+void wal_checksum(const void *data, uint32_t length, uint32_t *checksum)
+{
+  const uint32_t *words = (const uint32_t *)data;
+  uint32_t s1 = checksum[0], s2 = checksum[1];
+  for (uint32_t i = 0; i < length / 4; i += 2)
+  {
+    s1 += words[i] + s2;
+    s2 += words[i + 1] + s1;
+  }
+  checksum[0] = s1;
+  checksum[1] = s2;
+}
+
+void wal_sync(int file_descriptor)
+{
+  uint64_t start = stats_clock();
+  if (fdatasync(file_descriptor) == -1)
+  {
+    printf("Error syncing file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  stats_time(STAT_SYNC, start);
+}
+
+/*
+Page directories map page numbers to cache or log frames. They start
+empty and double as the file grows, new entries set to empty.
+*/
+void page_directory_reserve(int32_t **directory, uint32_t *capacity, uint32_t page_num, int32_t empty)
+{
+  if (page_num < *capacity)
+  {
+    return;
+  }
+  uint64_t new_capacity = *capacity == 0 ? 128 : *capacity;
+  while (new_capacity <= page_num)
+  {
+    new_capacity *= 2;
+  }
+  *directory = (int32_t *)realloc(*directory, new_capacity * sizeof(int32_t));
+  if (*directory == NULL)
+  {
+    printf("Unable to grow page directory\n");
+    exit(EXIT_FAILURE);
+  }
+  for (uint64_t i = *capacity; i < new_capacity; i++)
+  {
+    (*directory)[i] = empty;
+  }
+  *capacity = (uint32_t)new_capacity;
+}
+
+int32_t wal_page_frame(const Wal *wal, uint32_t page_num)
+{
+  return page_num < wal->pages_capacity ? wal->page_frames[page_num] : WAL_NO_FRAME;
+}
+
+uint32_t wal_frame_size(const Wal *wal)
+{
+  return WAL_FRAME_HEADER_SIZE + wal->page_size;
+}
+
+// Record the next frame as page_num's newest version.
+void wal_add_frame(Wal *wal, uint32_t page_num)
+{
+  page_directory_reserve(&wal->page_frames, &wal->pages_capacity, page_num, WAL_NO_FRAME);
+  if (wal->num_frames == wal->frames_capacity)
+  {
+    wal->frames_capacity = wal->frames_capacity == 0 ? 1024 : wal->frames_capacity * 2;
+    wal->frame_pages = (uint32_t *)realloc(wal->frame_pages, wal->frames_capacity * sizeof(uint32_t));
+    wal->frame_prev = (int32_t *)realloc(wal->frame_prev, wal->frames_capacity * sizeof(int32_t));
+  }
+  wal->frame_pages[wal->num_frames] = page_num;
+  wal->frame_prev[wal->num_frames] = wal->page_frames[page_num];
+  wal->page_frames[page_num] = wal->num_frames++;
+}
+
+// The frames up to which a checkpoint may copy: synced, and visible to
+// every reader. Caller holds the lock.
+uint32_t wal_checkpoint_limit(Wal *wal)
+{
+  uint32_t limit = wal->synced;
+  for (uint32_t i = 0; i < WAL_MAX_READERS; i++)
+  {
+    if (wal->read_marks[i] != WAL_NO_FRAME && (uint32_t)wal->read_marks[i] < limit)
+    {
+      limit = wal->read_marks[i];
+    }
+  }
+  return limit;
+}
+
+// Whether the log may restart: everything is copied back and no reader
+// needs a frame older than the last. Readers move to a mark of 0. Caller
+// holds the lock.
+bool wal_can_restart(Wal *wal)
+{
+  if (wal->num_frames == 0 || wal->backfilled != wal->num_frames || wal->checkpoint_running)
+  {
+    return false;
+  }
+  for (uint32_t i = 0; i < WAL_MAX_READERS; i++)
+  {
+    if (wal->read_marks[i] != WAL_NO_FRAME && (uint32_t)wal->read_marks[i] != wal->num_frames)
+    {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < WAL_MAX_READERS; i++)
+  {
+    if (wal->read_marks[i] != WAL_NO_FRAME)
+    {
+      wal->read_marks[i] = 0;
+    }
+  }
+  return true;
+}
+
+off_t wal_frame_offset(const Wal *wal, uint32_t frame)
+{
+  return WAL_HEADER_SIZE + (off_t)frame * wal_frame_size(wal);
+}
+
+// Start the log over with a fresh salt, which invalidates every old frame
+// still in the file. Caller holds the lock.
+void wal_restart(Wal *wal)
+{
+  wal->checkpoint_seq++;
+  wal->salt[0]++;
+  wal->salt[1] = (uint32_t)getpid() ^ (wal->salt[1] * 2654435761u);
+  uint32_t header[WAL_HEADER_SIZE / 4] = {WAL_MAGIC, WAL_VERSION, wal->page_size, wal->checkpoint_seq,
+                                          wal->salt[0], wal->salt[1], 0, 0};
+  wal->checksum[0] = 0;
+  wal->checksum[1] = 0;
+  wal_checksum(header, WAL_HEADER_SIZE - 8, wal->checksum);
+  header[6] = wal->checksum[0];
+  header[7] = wal->checksum[1];
+  if (pwrite(wal->file_descriptor, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE)
+  {
+    printf("Error writing log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  wal->num_frames = 0;
+  wal->committed = 0;
+  wal->synced = 0;
+  wal->backfilled = 0;
+  wal->generation++;
+  for (uint32_t i = 0; i < wal->pages_capacity; i++)
+  {
+    wal->page_frames[i] = WAL_NO_FRAME;
+  }
+}
+
+// Rebuild the frame list from a log left behind by a crash, keeping frames
+// up to the last intact commit and dropping any torn or uncommitted tail.
+void wal_recover(Wal *wal)
+{
+  uint32_t header[WAL_HEADER_SIZE / 4];
+  if (pread(wal->file_descriptor, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE ||
+      header[0] != WAL_MAGIC || header[1] != WAL_VERSION || header[2] != wal->page_size)
+  {
+    return;
+  }
+  uint32_t checksum[2] = {0, 0};
+  wal_checksum(header, WAL_HEADER_SIZE - 8, checksum);
+  if (checksum[0] != header[6] || checksum[1] != header[7])
+  {
+    return;
+  }
+  wal->checkpoint_seq = header[3];
+  wal->salt[0] = header[4];
+  wal->salt[1] = header[5];
+
+  uint32_t frame_size = wal_frame_size(wal);
+  char *frame = (char *)malloc(frame_size);
+  uint32_t *frame_header = (uint32_t *)frame;
+  while (pread(wal->file_descriptor, frame, frame_size, wal_frame_offset(wal, wal->num_frames)) ==
+         (ssize_t)frame_size)
+  {
+    if (frame_header[0] >= PAGER_MAX_PAGES || frame_header[2] != wal->salt[0] || frame_header[3] != wal->salt[1])
+    {
+      break;
+    }
+    wal_checksum(frame, 8, checksum);
+    wal_checksum(frame + WAL_FRAME_HEADER_SIZE, wal->page_size, checksum);
+    if (checksum[0] != frame_header[4] || checksum[1] != frame_header[5])
+    {
+      break;
+    }
+    wal_add_frame(wal, frame_header[0]);
+    if (frame_header[1] != 0)
+    {
+      wal->committed = wal->num_frames;
+    }
+  }
+  free(frame);
+  wal->num_frames = wal->committed;
+  wal->synced = wal->committed;
+}
+
+/*
+Compressed pages. A checkpoint may store a page of the database file
+compressed at the front of its slot, behind a header whose first byte,
+where a node keeps its type, is PAGE_COMPRESSED, and free the rest of the
+slot by punching it out of the file. The saving is in whole filesystem
+blocks, so only pages of two blocks or more are worth it, and a page is
+only stored compressed if that frees at least one. Page 0, the file
+header, never is. Reads inflate a page as it comes in from the database
+file, so the page cache and everything above it only see plain pages, and
+a file of mixed pages reads the same whether compression is on or not.
+*/
+#define PAGE_COMPRESSED 0xc5
+#define PAGE_COMPRESSED_LENGTH_OFFSET 4
+#define PAGE_COMPRESSED_HEADER_SIZE 8
+#define PAGE_COMPRESS_BLOCK 4096
+
+// Compress page into slot, padded to whole blocks. Returns the bytes of
+// slot to write, or 0 if the page is to be written as it is.
+uint32_t page_encode(const char *page, uint32_t page_size, char *slot)
+{
+  if (page_size < 2 * PAGE_COMPRESS_BLOCK)
+  {
+    return 0;
+  }
+  uint32_t capacity = page_size - PAGE_COMPRESS_BLOCK - PAGE_COMPRESSED_HEADER_SIZE;
+  uint32_t length = page_compress(page, page_size, slot + PAGE_COMPRESSED_HEADER_SIZE, capacity);
+  if (length == 0)
+  {
+    return 0;
+  }
+  memset(slot, 0, PAGE_COMPRESSED_HEADER_SIZE);
+  slot[0] = (char)PAGE_COMPRESSED;
+  memcpy(slot + PAGE_COMPRESSED_LENGTH_OFFSET, &length, sizeof(length));
+  uint32_t used = PAGE_COMPRESSED_HEADER_SIZE + length;
+  uint32_t padded = (used + PAGE_COMPRESS_BLOCK - 1) & ~(PAGE_COMPRESS_BLOCK - 1);
+  memset(slot + used, 0, padded - used);
+  return padded;
+}
+
+// Inflate page in place if it was stored compressed.
+void page_decode(char *page, uint32_t page_size)
+{
+  if ((uint8_t)page[0] != PAGE_COMPRESSED)
+  {
+    return;
+  }
+  uint32_t length;
+  memcpy(&length, page + PAGE_COMPRESSED_LENGTH_OFFSET, sizeof(length));
+  bool valid = length <= page_size - PAGE_COMPRESSED_HEADER_SIZE;
+  if (valid)
+  {
+    char *compressed = (char *)malloc(length);
+    memcpy(compressed, page + PAGE_COMPRESSED_HEADER_SIZE, length);
+    valid = page_decompress(compressed, length, page, page_size);
+    free(compressed);
+  }
+  if (!valid)
+  {
+    printf("Corrupt compressed page\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Free length bytes of the file at offset without changing its size.
+bool wal_punch_hole(int fd, off_t offset, off_t length)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+  return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0;
+#else
+  (void)fd;
+  (void)offset;
+  (void)length;
+  return false;
+#endif
+}
+
+void wal_write_db_file(Wal *wal, const char *data, size_t length, off_t offset)
+{
+  if (pwrite(wal->db_file_descriptor, data, length, offset) != (ssize_t)length)
+  {
+    printf("Error checkpointing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+Write num_pages consecutive pages over the database file, with one write
+unless slot, a page of scratch space, is given to compress them in. Then
+each page goes in a write of its own with any slot it frees punched out
+after it. Returns false if the file system cannot punch holes, in which
+case the pages are written whole and compressing is no use.
+*/
+bool wal_checkpoint_run(Wal *wal, const char *pages, uint32_t first_page, uint32_t num_pages, char *slot)
+{
+  uint32_t page_size = wal->page_size;
+  if (slot == NULL)
+  {
+    wal_write_db_file(wal, pages, (size_t)num_pages * page_size, (off_t)first_page * page_size);
+    return true;
+  }
+  bool punched = true;
+  for (uint32_t i = 0; i < num_pages; i++)
+  {
+    const char *page = pages + (size_t)i * page_size;
+    uint32_t page_num = first_page + i;
+    off_t offset = (off_t)page_num * page_size;
+    uint32_t length = punched && page_num != 0 ? page_encode(page, page_size, slot) : 0;
+    if (length == 0)
+    {
+      wal_write_db_file(wal, page, page_size, offset);
+      continue;
+    }
+    wal_write_db_file(wal, slot, length, offset);
+    if (!wal_punch_hole(wal->db_file_descriptor, offset + length, page_size - length))
+    {
+      wal_write_db_file(wal, page, page_size, offset);
+      punched = false;
+    }
+  }
+  return punched;
+}
+
+/*
+Copy the newest version of every page written in the synced but not yet
+backfilled frames, up to the oldest read mark, into the database file,
+then sync it. Frames are only
+ever appended past the range being copied, so the main thread keeps
+writing while this runs.
+*/
+void wal_checkpoint(Wal *wal)
+{
+  pthread_mutex_lock(&wal->lock);
+  uint32_t start = wal->backfilled;
+  uint32_t end = wal_checkpoint_limit(wal);
+  // Every page in the frames is below pages_capacity.
+  uint32_t num_pages = wal->pages_capacity;
+  int32_t *newest = NULL;
+  if (start < end)
+  {
+    newest = (int32_t *)malloc(num_pages * sizeof(int32_t));
+    for (uint32_t i = 0; i < num_pages; i++)
+    {
+      newest[i] = WAL_NO_FRAME;
+    }
+    for (uint32_t i = start; i < end; i++)
+    {
+      newest[wal->frame_pages[i]] = i;
+    }
+  }
+  bool compress = wal->compress;
+  pthread_mutex_unlock(&wal->lock);
+  if (start == end)
+  {
+    return;
+  }
+
+  // Pages are gathered into runs of consecutive page numbers, each copied
+  // into the database file with one write.
+  uint32_t page_size = wal->page_size;
+  char *run = (char *)malloc((size_t)WAL_CHECKPOINT_RUN_PAGES * page_size);
+  char *slot = compress ? (char *)malloc(page_size) : NULL;
+  uint32_t run_start = 0, run_length = 0;
+  for (uint32_t page_num = 0; page_num <= num_pages; page_num++)
+  {
+    bool copied = page_num < num_pages && newest[page_num] != WAL_NO_FRAME;
+    if (run_length > 0 && (!copied || page_num != run_start + run_length || run_length == WAL_CHECKPOINT_RUN_PAGES))
+    {
+      if (!wal_checkpoint_run(wal, run, run_start, run_length, slot))
+      {
+        free(slot);
+        slot = NULL;
+        pthread_mutex_lock(&wal->lock);
+        wal->compress = false;
+        pthread_mutex_unlock(&wal->lock);
+      }
+      run_length = 0;
+    }
+    if (!copied)
+    {
+      continue;
+    }
+    if (run_length == 0)
+    {
+      run_start = page_num;
+    }
+    off_t offset = wal_frame_offset(wal, newest[page_num]) + WAL_FRAME_HEADER_SIZE;
+    if (pread(wal->file_descriptor, run + (size_t)run_length * page_size, page_size, offset) != (ssize_t)page_size)
+    {
+      printf("Error checkpointing: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    run_length++;
+  }
+  free(run);
+  free(slot);
+  free(newest);
+  wal_sync(wal->db_file_descriptor);
+
+  pthread_mutex_lock(&wal->lock);
+  wal->backfilled = end;
+  pthread_cond_broadcast(&wal->changed);
+  pthread_mutex_unlock(&wal->lock);
+}
+
+void *wal_syncer_main(void *arg)
+{
+  Wal *wal = (Wal *)arg;
+  pthread_mutex_lock(&wal->lock);
+  while (true)
+  {
+    while (!wal->stopping && wal->synced == wal->committed)
+    {
+      pthread_cond_wait(&wal->changed, &wal->lock);
+    }
+    if (wal->stopping)
+    {
+      break;
+    }
+    if (wal->sync_mode == WAL_SYNC_NORMAL)
+    {
+      // Nobody is waiting, so give more commits a chance to join this sync.
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += WAL_GROUP_COMMIT_US * 1000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      while (!wal->stopping && pthread_cond_timedwait(&wal->changed, &wal->lock, &deadline) == 0)
+      {
+      }
+    }
+    uint32_t target = wal->committed;
+    uint32_t generation = wal->generation;
+    pthread_mutex_unlock(&wal->lock);
+    wal_sync(wal->file_descriptor);
+    pthread_mutex_lock(&wal->lock);
+    if (generation == wal->generation && target > wal->synced)
+    {
+      wal->synced = target;
+      if (wal_checkpoint_limit(wal) - wal->backfilled >= WAL_CHECKPOINT_FRAMES)
+      {
+        wal->checkpoint_requested = true;
+      }
+    }
+    pthread_cond_broadcast(&wal->changed);
+  }
+  pthread_mutex_unlock(&wal->lock);
+  return NULL;
+}
+
+void *wal_checkpointer_main(void *arg)
+{
+  Wal *wal = (Wal *)arg;
+  pthread_mutex_lock(&wal->lock);
+  while (true)
+  {
+    while (!wal->stopping && !wal->checkpoint_requested)
+    {
+      pthread_cond_wait(&wal->changed, &wal->lock);
+    }
+    if (wal->stopping)
+    {
+      break;
+    }
+    wal->checkpoint_requested = false;
+    wal->checkpoint_running = true;
+    pthread_mutex_unlock(&wal->lock);
+    wal_checkpoint(wal);
+    pthread_mutex_lock(&wal->lock);
+    wal->checkpoint_running = false;
+    pthread_cond_broadcast(&wal->changed);
+  }
+  pthread_mutex_unlock(&wal->lock);
+  return NULL;
+}
+
+char *wal_path(const char *db_filename)
+{
+  size_t length = strlen(db_filename);
+  char *path = (char *)malloc(length + 5);
+  memcpy(path, db_filename, length);
+  memcpy(path + length, "-wal", 5);
+  return path;
+}
+
+// The page size in the header of the database's log, or 0 if it has no
+// valid log.
+uint32_t wal_file_page_size(const char *db_filename)
+{
+  char *path = wal_path(db_filename);
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if (fd == -1)
+  {
+    return 0;
+  }
+  uint32_t header[WAL_HEADER_SIZE / 4];
+  uint32_t page_size = 0;
+  if (pread(fd, header, WAL_HEADER_SIZE, 0) == WAL_HEADER_SIZE && header[0] == WAL_MAGIC &&
+      header[1] == WAL_VERSION && page_size_valid(header[2]))
+  {
+    page_size = header[2];
+  }
+  close(fd);
+  return page_size;
+}
+
+/*
+Open the log for the database open on db_file_descriptor, whose pages are
+page_size bytes. Whatever a crash left in it is replayed into the database
+file first, so the log always starts empty. The syncer and checkpointer
+threads only run when start_threads is set.
+*/
+Wal *wal_open(const char *db_filename, int db_file_descriptor, uint32_t page_size, WalSyncMode sync_mode,
+              bool start_threads)
+{
+  Wal *wal = (Wal *)malloc(sizeof(Wal));
+  memset(wal, 0, sizeof(Wal));
+  wal->path = wal_path(db_filename);
+  wal->page_size = page_size;
+  // A clean close removes the log, so without one there is nothing to
+  // recover.
+  wal->file_descriptor = open(wal->path, O_RDWR);
+  bool recover = wal->file_descriptor != -1;
+  if (!recover)
+  {
+    wal->file_descriptor = open(wal->path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  }
+  if (wal->file_descriptor == -1)
+  {
+    printf("Unable to open log file\n");
+    exit(EXIT_FAILURE);
+  }
+  wal->db_file_descriptor = db_file_descriptor;
+  wal->sync_mode = sync_mode;
+  pthread_mutex_init(&wal->lock, NULL);
+  pthread_cond_init(&wal->changed, NULL);
+  for (uint32_t i = 0; i < WAL_MAX_READERS; i++)
+  {
+    wal->read_marks[i] = WAL_NO_FRAME;
+  }
+
+  if (recover)
+  {
+    wal_recover(wal);
+    wal_checkpoint(wal);
+  }
+  wal_restart(wal);
+  wal_sync(wal->file_descriptor);
+
+  if (start_threads)
+  {
+    if (pthread_create(&wal->syncer, NULL, wal_syncer_main, wal) != 0 ||
+        pthread_create(&wal->checkpointer, NULL, wal_checkpointer_main, wal) != 0)
+    {
+      printf("Unable to start log threads\n");
+      exit(EXIT_FAILURE);
+    }
+    wal->threads_started = true;
+  }
+  return wal;
+}
+
+// Checkpoint everything and remove the log. Every frame must be committed.
+void wal_close(Wal *wal)
+{
+  if (wal->threads_started)
+  {
+    pthread_mutex_lock(&wal->lock);
+    wal->stopping = true;
+    pthread_cond_broadcast(&wal->changed);
+    pthread_mutex_unlock(&wal->lock);
+    pthread_join(wal->syncer, NULL);
+    pthread_join(wal->checkpointer, NULL);
+  }
+  if (wal->synced < wal->committed)
+  {
+    wal_sync(wal->file_descriptor);
+    wal->synced = wal->committed;
+  }
+  wal_checkpoint(wal);
+
+  close(wal->file_descriptor);
+  unlink(wal->path);
+  pthread_mutex_destroy(&wal->lock);
+  pthread_cond_destroy(&wal->changed);
+  free(wal->path);
+  free(wal->pending);
+  free(wal->page_frames);
+  free(wal->frame_pages);
+  free(wal->frame_prev);
+  free(wal);
+}
+
+// Queue a copy of a page to go out as the next frame.
+void wal_append(Wal *wal, uint32_t page_num, const void *page)
+{
+  if (wal->num_pending == wal->pending_capacity)
+  {
+    wal->pending_capacity = wal->pending_capacity == 0 ? 16 : wal->pending_capacity * 2;
+    wal->pending = (char *)realloc(wal->pending, (size_t)wal->pending_capacity * wal_frame_size(wal));
+  }
+  char *frame = wal->pending + (size_t)wal->num_pending++ * wal_frame_size(wal);
+  ((uint32_t *)frame)[0] = page_num;
+  memcpy(frame + WAL_FRAME_HEADER_SIZE, page, wal->page_size);
+}
+
+// Before writing: once the log is past its limit, wait for everything to
+// be checkpointed, then restart it if every frame has been copied back.
+// Readers holding back the checkpoint are waited out, not woken.
+void wal_prepare_write(Wal *wal)
+{
+  pthread_mutex_lock(&wal->lock);
+  if (wal->num_frames >= WAL_MAX_FRAMES && wal->committed == wal->num_frames && wal->threads_started)
+  {
+    while (wal->backfilled < wal->committed || wal->checkpoint_running || !wal_can_restart(wal))
+    {
+      if (!wal->checkpoint_running && !wal->checkpoint_requested &&
+          wal_checkpoint_limit(wal) > wal->backfilled)
+      {
+        wal->checkpoint_requested = true;
+        pthread_cond_broadcast(&wal->changed);
+      }
+      pthread_cond_wait(&wal->changed, &wal->lock);
+    }
+    wal_restart(wal);
+  }
+  else if (wal_can_restart(wal))
+  {
+    wal_restart(wal);
+  }
+  pthread_mutex_unlock(&wal->lock);
+}
+
+/*
+Write the queued frames with one pwrite. A non-zero db_pages makes the
+last of them a commit frame recording the database size; in FULL mode the
+call then returns only once the commit is on disk.
+*/
+void wal_write_pending(Wal *wal, uint32_t db_pages)
+{
+  if (wal->num_pending == 0)
+  {
+    return;
+  }
+  wal_prepare_write(wal);
+
+  uint32_t frame_size = wal_frame_size(wal);
+  for (uint32_t i = 0; i < wal->num_pending; i++)
+  {
+    char *frame = wal->pending + (size_t)i * frame_size;
+    uint32_t *frame_header = (uint32_t *)frame;
+    frame_header[1] = i + 1 == wal->num_pending ? db_pages : 0;
+    frame_header[2] = wal->salt[0];
+    frame_header[3] = wal->salt[1];
+    wal_checksum(frame, 8, wal->checksum);
+    wal_checksum(frame + WAL_FRAME_HEADER_SIZE, wal->page_size, wal->checksum);
+    frame_header[4] = wal->checksum[0];
+    frame_header[5] = wal->checksum[1];
+  }
+  size_t length = (size_t)wal->num_pending * frame_size;
+  if (pwrite(wal->file_descriptor, wal->pending, length, wal_frame_offset(wal, wal->num_frames)) !=
+      (ssize_t)length)
+  {
+    printf("Error writing log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_lock(&wal->lock);
+  for (uint32_t i = 0; i < wal->num_pending; i++)
+  {
+    wal_add_frame(wal, ((uint32_t *)(wal->pending + (size_t)i * frame_size))[0]);
+  }
+  wal->num_pending = 0;
+  if (db_pages != 0)
+  {
+    wal->committed = wal->num_frames;
+    pthread_cond_broadcast(&wal->changed);
+    if (wal->sync_mode == WAL_SYNC_FULL)
+    {
+      while (wal->synced < wal->committed)
+      {
+        pthread_cond_wait(&wal->changed, &wal->lock);
+      }
+    }
+  }
+  pthread_mutex_unlock(&wal->lock);
+}
+
+void wal_read_page(Wal *wal, uint32_t page_num, void *page)
+{
+  off_t offset = wal_frame_offset(wal, wal->page_frames[page_num]) + WAL_FRAME_HEADER_SIZE;
+  if (pread(wal->file_descriptor, page, wal->page_size, offset) != (ssize_t)wal->page_size)
+  {
+    printf("Error reading log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+Snapshot readers. wal_open_reader takes a slot, or returns WAL_NO_READER
+when every one is taken. From wal_begin_read to wal_end_read the reader's
+mark holds back checkpoints and restarts; the generation and frame count
+wal_begin_read returns together name the commit it sees.
+*/
+int32_t wal_open_reader(Wal *wal)
+{
+  int32_t slot = WAL_NO_READER;
+  pthread_mutex_lock(&wal->lock);
+  for (int32_t i = 0; i < WAL_MAX_READERS && slot == WAL_NO_READER; i++)
+  {
+    if (!wal->reader_open[i])
+    {
+      wal->reader_open[i] = true;
+      slot = i;
+    }
+  }
+  pthread_mutex_unlock(&wal->lock);
+  return slot;
+}
+
+bool wal_has_readers(Wal *wal)
+{
+  bool open = false;
+  pthread_mutex_lock(&wal->lock);
+  for (int32_t i = 0; i < WAL_MAX_READERS && !open; i++)
+  {
+    open = wal->reader_open[i];
+  }
+  pthread_mutex_unlock(&wal->lock);
+  return open;
+}
+
+void wal_close_reader(Wal *wal, int32_t slot)
+{
+  pthread_mutex_lock(&wal->lock);
+  wal->reader_open[slot] = false;
+  wal->read_marks[slot] = WAL_NO_FRAME;
+  pthread_cond_broadcast(&wal->changed);
+  pthread_mutex_unlock(&wal->lock);
+}
+
+void wal_begin_read(Wal *wal, int32_t slot, uint32_t *generation, uint32_t *frames)
+{
+  pthread_mutex_lock(&wal->lock);
+  wal->read_marks[slot] = wal->committed;
+  *generation = wal->generation;
+  *frames = wal->committed;
+  pthread_mutex_unlock(&wal->lock);
+}
+
+// A writer may be waiting for this reader to let the log restart.
+void wal_end_read(Wal *wal, int32_t slot)
+{
+  pthread_mutex_lock(&wal->lock);
+  wal->read_marks[slot] = WAL_NO_FRAME;
+  pthread_cond_broadcast(&wal->changed);
+  pthread_mutex_unlock(&wal->lock);
+}
+
+/*
+Read page_num as the reader's snapshot has it: the page's newest frame
+below the read mark, or else the database file, which no checkpoint
+changes under a page that has no such frame. A frame is read under the
+lock, since a restart could otherwise reuse it halfway through.
+*/
+void wal_read_snapshot_page(Wal *wal, int32_t slot, uint32_t page_num, void *page)
+{
+  pthread_mutex_lock(&wal->lock);
+  int32_t frame = wal_page_frame(wal, page_num);
+  while (frame != WAL_NO_FRAME && frame >= wal->read_marks[slot])
+  {
+    frame = wal->frame_prev[frame];
+  }
+  if (frame != WAL_NO_FRAME)
+  {
+    off_t offset = wal_frame_offset(wal, frame) + WAL_FRAME_HEADER_SIZE;
+    if (pread(wal->file_descriptor, page, wal->page_size, offset) != (ssize_t)wal->page_size)
+    {
+      printf("Error reading log: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return;
+  }
+  pthread_mutex_unlock(&wal->lock);
+  // Pages past the end of the file read as zeros.
+  if (pread(wal->db_file_descriptor, page, wal->page_size, (off_t)page_num * wal->page_size) == -1)
+  {
+    printf("Error reading file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  page_decode((char *)page, wal->page_size);
+}
+
+// An empty cache of cache_size frames, to be filled from arena; none in
+// mmap mode.
+void pager_init_cache(Pager *pager, uint32_t cache_size, PageArena *arena)
+{
+  pager->cache_size = cache_size;
+  pager->frames_used = 0;
+  pager->arena = arena;
+  pager->frames = (PageFrame *)malloc(cache_size * sizeof(PageFrame));
+  if (cache_size > 0 && pager->frames == NULL)
+  {
+    printf("Unable to allocate page cache\n");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < cache_size; i++)
+  {
+    pager->frames[i].in_use = false;
+    pager->frames[i].dirty = false;
+    pager->frames[i].pin_count = 0;
+    pager->frames[i].lru_prev = PAGER_NO_FRAME;
+    pager->frames[i].lru_next = PAGER_NO_FRAME;
+    pager->frames[i].data = NULL;
+  }
+  pager->page_frames = NULL;
+  pager->pages_capacity = 0;
+  pager->lru_head = PAGER_NO_FRAME;
+  pager->lru_tail = PAGER_NO_FRAME;
+  pthread_mutex_init(&pager->latch, NULL);
+  pager->read_slot = WAL_NO_READER;
+  pager->has_snapshot = false;
+}
+
+/*
+The page size is recorded in the header of every node (see the node
+layout below), so page 0 doubles as the file header: byte
+FILE_PAGE_SIZE_SHIFT_OFFSET holds its log2. Files from before page sizes
+were recorded leave it 0 and use the build's default size.
+*/
+#define FILE_PAGE_SIZE_SHIFT_OFFSET 3
+
+// The page size recorded in the database file, or 0 if it is empty.
+uint32_t db_file_page_size(int fd)
+{
+  uint8_t header[FILE_PAGE_SIZE_SHIFT_OFFSET + 1];
+  if (pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header))
+  {
+    return 0;
+  }
+  uint8_t shift = header[FILE_PAGE_SIZE_SHIFT_OFFSET];
+  if (shift == 0)
+  {
+    return DEFAULT_PAGE_SIZE;
+  }
+  if (shift >= 32 || !page_size_valid(1u << shift))
+  {
+    printf("Unsupported page size in db file.\n");
+    exit(EXIT_FAILURE);
+  }
+  return 1u << shift;
+}
+
+// Address space reserved for a mapped file, which caps its size in mmap mode.
+#define PAGER_MMAP_RESERVE (sizeof(void *) >= 8 ? (size_t)1 << 40 : (size_t)1 << 30)
+
+/*
+page_size is used for a new file. Otherwise the file's own is, or else
+that of a log left behind by a crash before page 0 first reached the file.
+*/
+Pager *pager_open(const char *filename, uint32_t cache_size, bool use_mmap, WalSyncMode sync_mode,
+                  uint32_t page_size)
+{
+  int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  if (fd == -1)
+  {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
+  }
+  uint32_t file_page_size = db_file_page_size(fd);
+  if (file_page_size == 0)
+  {
+    file_page_size = wal_file_page_size(filename);
+  }
+  if (file_page_size != 0)
+  {
+    page_size = file_page_size;
+  }
+
+  // Opening the log replays anything a crash left in it. Mapped pages are
+  // written back by the kernel and cannot go through it, so mmap mode only
+  // recovers an old log and then runs without one.
+  Wal *wal = wal_open(filename, fd, page_size, sync_mode, !use_mmap);
+  if (use_mmap)
+  {
+    wal_close(wal);
+    wal = NULL;
+  }
+
+  off_t file_length = lseek(fd, 0, SEEK_END);
+
+  Pager *pager = (Pager *)malloc(sizeof(Pager));
+  pager->file_descriptor = fd;
+  pager->page_size = page_size;
+  pager->wal = wal;
+  pager->file_length = file_length;
+  pager->num_pages = (uint32_t)((file_length + page_size - 1) / page_size);
+  pager->use_mmap = use_mmap;
+  pager->map_base = NULL;
+  pager->map_pages = 0;
+  pager->map_capacity = 0;
+  if (use_mmap)
+  {
+    // Reserve address space for the largest file up front so chunks can be
+    // mapped in place and page pointers never move.
+    void *reserved = mmap(NULL, PAGER_MMAP_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED)
+    {
+      printf("Unable to reserve mapping: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->map_base = (char *)reserved;
+    pager->map_capacity = (uint32_t)(PAGER_MMAP_RESERVE / page_size);
+    cache_size = 0;
+  }
+
+  // Room for this cache and for every reader's.
+  PageArena *arena =
+      cache_size > 0 ? page_arena_open(cache_size + WAL_MAX_READERS * PAGER_CACHE_PAGES, page_size) : NULL;
+  pager_init_cache(pager, cache_size, arena);
+  return pager;
+}
+
+Pager *pager_open_reader(Pager *writer)
+{
+  if (writer->use_mmap)
+  {
+    return NULL;
+  }
+  int32_t slot = wal_open_reader(writer->wal);
+  if (slot == WAL_NO_READER)
+  {
+    return NULL;
+  }
+  Pager *pager = (Pager *)malloc(sizeof(Pager));
+  pager->file_descriptor = writer->file_descriptor;
+  pager->page_size = writer->page_size;
+  pager->wal = writer->wal;
+  pager->file_length = 0;
+  pager->num_pages = 0;
+  pager->use_mmap = false;
+  pager->map_base = NULL;
+  pager->map_pages = 0;
+  pager->map_capacity = 0;
+  pager_init_cache(pager, PAGER_CACHE_PAGES, writer->arena);
+  pager->read_slot = slot;
+  return pager;
+}
+
+// Forget every cached page. None may be pinned.
+void pager_drop_cache(Pager *pager)
+{
+  for (uint32_t i = 0; i < pager->frames_used; i++)
+  {
+    if (pager->frames[i].in_use)
+    {
+      pager->page_frames[pager->frames[i].page_num] = PAGER_NO_FRAME;
+      pager->frames[i].in_use = false;
+    }
+    pager->frames[i].lru_prev = PAGER_NO_FRAME;
+    pager->frames[i].lru_next = PAGER_NO_FRAME;
+  }
+  pager->frames_used = 0;
+  pager->lru_head = PAGER_NO_FRAME;
+  pager->lru_tail = PAGER_NO_FRAME;
+}
+
+void pager_begin_read(Pager *pager)
+{
+  if (pager->read_slot == WAL_NO_READER)
+  {
+    return;
+  }
+  uint32_t generation, frames;
+  wal_begin_read(pager->wal, pager->read_slot, &generation, &frames);
+  if (!pager->has_snapshot || generation != pager->snapshot_generation || frames != pager->snapshot_frames)
+  {
+    pager_drop_cache(pager);
+  }
+  pager->has_snapshot = true;
+  pager->snapshot_generation = generation;
+  pager->snapshot_frames = frames;
+}
+
+void pager_end_read(Pager *pager)
+{
+  if (pager->read_slot != WAL_NO_READER)
+  {
+    wal_end_read(pager->wal, pager->read_slot);
+  }
+}
+
+void *frame_address(Pager *pager, int32_t frame)
+{
+  return pager->frames[frame].data;
+}
+
+void lru_unlink(Pager *pager, int32_t frame)
+{
+  PageFrame *f = &pager->frames[frame];
+  if (f->lru_prev != PAGER_NO_FRAME)
+    pager->frames[f->lru_prev].lru_next = f->lru_next;
+  else
+    pager->lru_head = f->lru_next;
+  if (f->lru_next != PAGER_NO_FRAME)
+    pager->frames[f->lru_next].lru_prev = f->lru_prev;
+  else
+    pager->lru_tail = f->lru_prev;
+  f->lru_prev = PAGER_NO_FRAME;
+  f->lru_next = PAGER_NO_FRAME;
+}
+
+void lru_push_front(Pager *pager, int32_t frame)
+{
+  PageFrame *f = &pager->frames[frame];
+  f->lru_prev = PAGER_NO_FRAME;
+  f->lru_next = pager->lru_head;
+  if (pager->lru_head != PAGER_NO_FRAME)
+    pager->frames[pager->lru_head].lru_prev = frame;
+  pager->lru_head = frame;
+  if (pager->lru_tail == PAGER_NO_FRAME)
+    pager->lru_tail = frame;
+}
+
+// Write out a dirty page evicted in the middle of a transaction. It goes
+// to the log uncommitted, and only counts once a later commit covers it.
+void pager_write_frame(Pager *pager, int32_t frame)
+{
+  PageFrame *f = &pager->frames[frame];
+  wal_append(pager->wal, f->page_num, frame_address(pager, frame));
+  wal_write_pending(pager->wal, 0);
+  f->dirty = false;
+}
+
+// Frames are claimed in order and only ever all given up together, so
+// every frame before frames_used is in use and a large cache needs no
+// search for a free one.
+int32_t pager_claim_frame(Pager *pager)
+{
+  if (pager->frames_used < pager->cache_size)
+  {
+    PageFrame *frame = &pager->frames[pager->frames_used];
+    if (frame->data == NULL)
+    {
+      frame->data = page_arena_take(pager->arena);
+    }
+    return (int32_t)pager->frames_used++;
+  }
+
+  int32_t victim = pager->lru_tail;
+  while (victim != PAGER_NO_FRAME && pager->frames[victim].pin_count > 0)
+  {
+    victim = pager->frames[victim].lru_prev;
+  }
+  if (victim == PAGER_NO_FRAME)
+  {
+    printf("Error: every page in the cache is pinned.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (pager->frames[victim].dirty)
+  {
+    pager_write_frame(pager, victim);
+  }
+  lru_unlink(pager, victim);
+  pager->page_frames[pager->frames[victim].page_num] = PAGER_NO_FRAME;
+  pager->frames[victim].in_use = false;
+  return victim;
+}
+
+int32_t pager_cached_frame(const Pager *pager, uint32_t page_num)
+{
+  return page_num < pager->pages_capacity ? pager->page_frames[page_num] : PAGER_NO_FRAME;
+}
+
+int32_t pager_frame_for(Pager *pager, uint32_t page_num)
+{
+  if (page_num >= PAGER_MAX_PAGES)
+  {
+    printf("Tried to fetch page number out of bounds. %u >= %u\n", page_num, PAGER_MAX_PAGES);
+    exit(EXIT_FAILURE);
+  }
+
+  int32_t frame = pager_cached_frame(pager, page_num);
+  if (frame != PAGER_NO_FRAME)
+  {
+    stats_count(STAT_CACHE_HITS, 1);
+    if (pager->lru_head != frame)
+    {
+      lru_unlink(pager, frame);
+      lru_push_front(pager, frame);
+    }
+    return frame;
+  }
+
+  // Cache miss. Load from file, or start from a zeroed page past the end.
+  stats_count(STAT_CACHE_MISSES, 1);
+  frame = pager_claim_frame(pager);
+  void *page = frame_address(pager, frame);
+  uint32_t page_size = pager->page_size;
+  memset(page, 0, page_size);
+  if (pager->read_slot != WAL_NO_READER)
+  {
+    wal_read_snapshot_page(pager->wal, pager->read_slot, page_num, page);
+  }
+  else if (wal_page_frame(pager->wal, page_num) != WAL_NO_FRAME)
+  {
+    wal_read_page(pager->wal, page_num, page);
+  }
+  else if (page_num < pager->num_pages)
+  {
+    ssize_t bytes_read = pread(pager->file_descriptor, page, page_size, (off_t)page_num * page_size);
+    if (bytes_read == -1)
+    {
+      printf("Error reading file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    page_decode((char *)page, page_size);
+  }
+  else
+  {
+    pager->num_pages = page_num + 1;
+    stats_count(STAT_PAGES_ALLOCATED, 1);
+  }
+
+  PageFrame *f = &pager->frames[frame];
+  f->page_num = page_num;
+  f->in_use = true;
+  f->dirty = false;
+  f->pin_count = 0;
+  page_directory_reserve(&pager->page_frames, &pager->pages_capacity, page_num, PAGER_NO_FRAME);
+  pager->page_frames[page_num] = frame;
+  lru_push_front(pager, frame);
+  return frame;
+}
+
+// Extend the file and map it far enough to cover page_num.
+void pager_grow_mapping(Pager *pager, uint32_t page_num)
+{
+  uint64_t new_map_pages = ((uint64_t)page_num / PAGER_MMAP_CHUNK_PAGES + 1) * PAGER_MMAP_CHUNK_PAGES;
+  if (new_map_pages > pager->map_capacity)
+  {
+    new_map_pages = pager->map_capacity;
+  }
+  off_t new_length = (off_t)new_map_pages * pager->page_size;
+  if (new_length > pager->file_length)
+  {
+    if (ftruncate(pager->file_descriptor, new_length) == -1)
+    {
+      printf("Error extending db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->file_length = new_length;
+  }
+
+  size_t offset = (size_t)pager->map_pages * pager->page_size;
+  void *mapped = mmap(pager->map_base + offset, new_length - offset, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED, pager->file_descriptor, offset);
+  if (mapped == MAP_FAILED)
+  {
+    printf("Error mapping db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->map_pages = (uint32_t)new_map_pages;
+}
+
+void *pager_mapped_page(Pager *pager, uint32_t page_num)
+{
+  if (page_num >= pager->map_capacity)
+  {
+    printf("Tried to fetch page number out of bounds. %u >= %u\n", page_num, pager->map_capacity);
+    exit(EXIT_FAILURE);
+  }
+  if (page_num >= pager->map_pages)
+  {
+    pager_grow_mapping(pager, page_num);
+  }
+  if (page_num >= pager->num_pages)
+  {
+    pager->num_pages = page_num + 1;
+    stats_count(STAT_PAGES_ALLOCATED, 1);
+  }
+  // A page a checkpoint stored compressed is inflated in the mapping, and
+  // so goes back to the file whole.
+  char *page = pager->map_base + (size_t)page_num * pager->page_size;
+  page_decode(page, pager->page_size);
+  return page;
+}
+
+// The returned pointer stays valid until the page is evicted, which can only
+// happen once it has become the least recently used unpinned frame. Callers
+// holding on to a page across many other page fetches should pin it.
+void *get_page(Pager *pager, uint32_t page_num)
+{
+  if (pager->use_mmap)
+  {
+    return pager_mapped_page(pager, page_num);
+  }
+  return frame_address(pager, pager_frame_for(pager, page_num));
+}
+
+// Mapped pages are written back by the kernel, so dirty tracking and pinning
+// only apply to cache frames.
+void pager_mark_dirty(Pager *pager, uint32_t page_num)
+{
+  if (pager->use_mmap)
+  {
+    return;
+  }
+  pager->frames[pager_frame_for(pager, page_num)].dirty = true;
+}
+
+void pager_pin(Pager *pager, uint32_t page_num)
+{
+  if (pager->use_mmap)
+  {
+    return;
+  }
+  pager->frames[pager_frame_for(pager, page_num)].pin_count++;
+}
+
+void pager_unpin(Pager *pager, uint32_t page_num)
+{
+  if (pager->use_mmap)
+  {
+    return;
+  }
+  int32_t frame = pager_cached_frame(pager, page_num);
+  if (frame != PAGER_NO_FRAME && pager->frames[frame].pin_count > 0)
+  {
+    pager->frames[frame].pin_count--;
+  }
+}
+
+// Tell the OS how the next stretch of page accesses will look so it can
+// read ahead for scans and skip read-ahead for point lookups.
+void pager_advise(Pager *pager, PagerAccessPattern pattern)
+{
+  if (pager->use_mmap)
+  {
+    if (pager->map_pages == 0)
+    {
+      return;
+    }
+    int advice = pattern == PAGER_ACCESS_SEQUENTIAL ? MADV_SEQUENTIAL
+                 : pattern == PAGER_ACCESS_RANDOM   ? MADV_RANDOM
+                                                    : MADV_NORMAL;
+    madvise(pager->map_base, (size_t)pager->map_pages * pager->page_size, advice);
+    return;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  int advice = pattern == PAGER_ACCESS_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL
+               : pattern == PAGER_ACCESS_RANDOM   ? POSIX_FADV_RANDOM
+                                                  : POSIX_FADV_NORMAL;
+  posix_fadvise(pager->file_descriptor, 0, 0, advice);
+#endif
+}
+
+void pager_compress_pages(Pager *pager)
+{
+  if (pager->wal == NULL || pager->read_slot != WAL_NO_READER)
+  {
+    return;
+  }
+  pthread_mutex_lock(&pager->wal->lock);
+  pager->wal->compress = true;
+  pthread_mutex_unlock(&pager->wal->lock);
+}
+
+// Ask the OS to start reading length bytes of fd from offset, or of the
+// mapping in mmap mode.
+void pager_read_ahead(Pager *pager, int fd, off_t offset, size_t length)
+{
+  if (length == 0)
+  {
+    return;
+  }
+  if (pager->use_mmap)
+  {
+    madvise(pager->map_base + offset, length, MADV_WILLNEED);
+    return;
+  }
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/*
+Pages that are neither cached nor past the end of the file are read ahead
+where they live: from the database file in runs of consecutive pages, one
+request per run, or from the page's newest frame in the log. A snapshot
+reader hints at the database file alone, since finding its frames would
+take the log's lock.
+*/
+void pager_prefetch(Pager *pager, const uint32_t *pages, uint32_t count)
+{
+  uint32_t page_size = pager->page_size;
+  uint32_t run_start = 0, run_length = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint32_t page_num = pages[i];
+    if (page_num >= (pager->use_mmap ? pager->map_pages : pager->num_pages))
+    {
+      continue;
+    }
+    if (!pager->use_mmap)
+    {
+      if (pager_cached_frame(pager, page_num) != PAGER_NO_FRAME)
+      {
+        continue;
+      }
+      int32_t frame = pager->read_slot == WAL_NO_READER ? wal_page_frame(pager->wal, page_num) : WAL_NO_FRAME;
+      if (frame != WAL_NO_FRAME)
+      {
+        pager_read_ahead(pager, pager->wal->file_descriptor,
+                         wal_frame_offset(pager->wal, frame) + WAL_FRAME_HEADER_SIZE, page_size);
+        continue;
+      }
+    }
+    if (run_length > 0 && page_num == run_start + run_length)
+    {
+      run_length++;
+      continue;
+    }
+    pager_read_ahead(pager, pager->file_descriptor, (off_t)run_start * page_size, (size_t)run_length * page_size);
+    run_start = page_num;
+    run_length = 1;
+  }
+  pager_read_ahead(pager, pager->file_descriptor, (off_t)run_start * page_size, (size_t)run_length * page_size);
+}
+
+/*
+Commit every change made since the last commit: the dirty pages go to the
+log together, the last one marked as the commit. Frames already written
+by evictions are covered by it too, so if nothing is dirty the root page
+is rewritten to carry the commit mark.
+*/
+void pager_commit(Pager *pager)
+{
+  if (pager->use_mmap)
+  {
+    return;
+  }
+  Wal *wal = pager->wal;
+  for (uint32_t i = 0; i < pager->frames_used; i++)
+  {
+    if (pager->frames[i].in_use && pager->frames[i].dirty)
+    {
+      wal_append(wal, pager->frames[i].page_num, frame_address(pager, i));
+      pager->frames[i].dirty = false;
+    }
+  }
+  if (wal->num_pending == 0)
+  {
+    if (wal->committed == wal->num_frames)
+    {
+      return;
+    }
+    wal_append(wal, 0, get_page(pager, 0));
+  }
+  wal_write_pending(wal, pager->num_pages);
+}
+
+uint32_t pager_page_size(const Pager *pager)
+{
+  return pager->page_size;
+}
+
+uint32_t pager_num_pages(const Pager *pager)
+{
+  return pager->num_pages;
+}
+
+// Pages the file may grow to: the mapping's reservation in mmap mode.
+uint32_t pager_max_pages(const Pager *pager)
+{
+  return pager->use_mmap ? pager->map_capacity : PAGER_MAX_PAGES;
+}
+
+// Make every change durable. In mmap mode this forces the mapping out to
+// the database file; otherwise it commits to the log.
+void pager_flush(Pager *pager)
+{
+  if (pager->use_mmap)
+  {
+    if (pager->map_pages > 0 &&
+        msync(pager->map_base, (size_t)pager->map_pages * pager->page_size, MS_SYNC) == -1)
+    {
+      printf("Error syncing db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+  pager_commit(pager);
+}
+
+// Give the cache's pages back to the arena.
+void pager_free_cache(Pager *pager)
+{
+  for (uint32_t i = 0; i < pager->cache_size; i++)
+  {
+    if (pager->frames[i].data != NULL)
+    {
+      page_arena_give(pager->arena, pager->frames[i].data);
+    }
+  }
+  pthread_mutex_destroy(&pager->latch);
+  free(pager->frames);
+  free(pager->page_frames);
+}
+
+bool pager_set_cache_size(Pager *pager, uint32_t cache_size)
+{
+  if (pager->use_mmap || pager->read_slot != WAL_NO_READER || wal_has_readers(pager->wal))
+  {
+    return false;
+  }
+  for (uint32_t i = 0; i < pager->frames_used; i++)
+  {
+    if (pager->frames[i].pin_count > 0)
+    {
+      return false;
+    }
+  }
+  cache_size = cache_size < PAGER_CACHE_PAGES       ? PAGER_CACHE_PAGES
+               : cache_size > PAGER_MAX_CACHE_PAGES ? PAGER_MAX_CACHE_PAGES
+                                                    : cache_size;
+  pager_commit(pager);
+  pager_free_cache(pager);
+  page_arena_close(pager->arena);
+  PageArena *arena = page_arena_open(cache_size + WAL_MAX_READERS * PAGER_CACHE_PAGES, pager->page_size);
+  pager_init_cache(pager, cache_size, arena);
+  return true;
+}
+
+void pager_close(Pager *pager)
+{
+  if (pager->read_slot != WAL_NO_READER)
+  {
+    // The file and the log belong to the writer.
+    wal_close_reader(pager->wal, pager->read_slot);
+    pager_free_cache(pager);
+    free(pager);
+    return;
+  }
+  pager_flush(pager);
+  if (pager->use_mmap)
+  {
+    munmap(pager->map_base, PAGER_MMAP_RESERVE);
+    // Drop the unused tail of the last mapped chunk.
+    if (ftruncate(pager->file_descriptor, (off_t)pager->num_pages * pager->page_size) == -1)
+    {
+      printf("Error truncating db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+  else
+  {
+    wal_close(pager->wal);
+  }
+  if (close(pager->file_descriptor) == -1)
+  {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
+  }
+  PageArena *arena = pager->arena;
+  pager_free_cache(pager);
+  if (arena != NULL)
+  {
+    page_arena_close(arena);
+  }
+  free(pager);
+}
+
+/*
+ * Common Node Header Layout
+ */
+typedef enum
+{
+  NODE_INTERNAL,
+  NODE_LEAF
+} NodeType;
+
+const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
+const uint32_t NODE_TYPE_OFFSET = 0;
+const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
+const uint32_t IS_ROOT_OFFSET = NODE_TYPE_OFFSET + NODE_TYPE_SIZE;
+// The RecordFormat of a leaf's cells. Internal nodes leave it 0, as do
+// files written before variable records, whose leaves are all fixed.
+const uint32_t LEAF_FORMAT_SIZE = sizeof(uint8_t);
+const uint32_t LEAF_FORMAT_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
+// log2 of the file's page size, which keeps the node-specific header
+// fields 4-byte aligned. Files from before it was recorded leave it 0.
+const uint32_t PAGE_SIZE_SHIFT_SIZE = sizeof(uint8_t);
+const uint32_t PAGE_SIZE_SHIFT_OFFSET = LEAF_FORMAT_OFFSET + LEAF_FORMAT_SIZE;
+const uint32_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + LEAF_FORMAT_SIZE + PAGE_SIZE_SHIFT_SIZE;
+static_assert(PAGE_SIZE_SHIFT_OFFSET == FILE_PAGE_SIZE_SHIFT_OFFSET, "the file header is page 0's node header");
+
+/*
+ * Leaf Node Header Layout
+ */
+const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+static_assert(COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE == LEAF_NODE_HEADER_SIZE,
+              "LEAF_NODE_HEADER_SIZE in storage.h is out of date");
+
+/*
+ * Leaf Node Body Layout
+ *
+ * Each cell is the key followed by the serialized row. The cell size, and
+ * so how many cells fit, depends on the table's row size and is kept in
+ * its LeafLayout; the constants below are the users table's.
+ */
+const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_KEY_OFFSET = 0;
+const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
+const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
+const uint32_t LEAF_NODE_CELL_SIZE = leaf_node_cell_size(ROW_SIZE);
+
+/*
+ * Slotted Leaf Layout (RECORD_VARIABLE)
+ *
+ * The leaf header is followed by the offset where cell content starts.
+ * After it comes a slot array, one {offset, length} pair of uint16s per
+ * cell in key order, while the cells are packed down from the end of the
+ * page. Each cell is a variable record, which starts with its key, padded
+ * to 4 bytes so the key stays aligned. Free space is the gap between the
+ * slot array and the content.
+ */
+const uint32_t SLOTTED_LEAF_CONTENT_START_SIZE = sizeof(uint32_t);
+const uint32_t SLOTTED_LEAF_CONTENT_START_OFFSET = LEAF_NODE_HEADER_SIZE;
+const uint32_t SLOTTED_LEAF_HEADER_SIZE = LEAF_NODE_HEADER_SIZE + SLOTTED_LEAF_CONTENT_START_SIZE;
+const uint32_t SLOTTED_LEAF_SLOT_SIZE = 2 * sizeof(uint16_t);
+
+constexpr uint32_t slotted_leaf_space(uint32_t page_size)
+{
+  return page_size - SLOTTED_LEAF_HEADER_SIZE;
+}
+
+// The smallest cell is a lone key.
+constexpr uint32_t slotted_leaf_max_cells(uint32_t page_size)
+{
+  return slotted_leaf_space(page_size) / (SLOTTED_LEAF_SLOT_SIZE + LEAF_NODE_KEY_SIZE);
+}
+
+constexpr uint32_t slotted_cell_size(uint32_t record_size)
+{
+  return (record_size + 3) & ~3u;
+}
+
+// Splitting a full leaf by bytes then leaves both halves room to spare.
+static_assert(2 * (SLOTTED_LEAF_SLOT_SIZE + slotted_cell_size(SCHEMA_MAX_RECORD_SIZE)) <=
+                  slotted_leaf_space(MIN_PAGE_SIZE),
+              "a slotted leaf must hold at least two of the largest records");
+
+/*
+ * Columnar Leaf Layout (RECORD_COLUMNAR)
+ *
+ * The leaf header, padded so the first array is 16-byte aligned, then one
+ * array per column holding that column of every cell, each at its full
+ * width and rounded up to 4 bytes. The first array is the keys. All
+ * leaves of a table have room for the same number of cells.
+ */
+const uint32_t COLUMNAR_LEAF_HEADER_SIZE = 16;
+
+LeafLayout leaf_layout(const TableSchema *schema, RecordFormat format, uint32_t page_size)
+{
+  LeafLayout layout;
+  memset(&layout, 0, sizeof(LeafLayout));
+  layout.format = format;
+  layout.page_size = page_size;
+  layout.row_size = schema->row_size;
+  layout.cell_size = leaf_node_cell_size(schema->row_size);
+  layout.max_cells = leaf_node_max_cells(schema->row_size, page_size);
+  if (format == RECORD_COLUMNAR)
+  {
+    // Leaves room to round every array up.
+    layout.max_cells = (page_size - COLUMNAR_LEAF_HEADER_SIZE - 3 * schema->num_columns) / schema->row_size;
+    uint32_t offset = COLUMNAR_LEAF_HEADER_SIZE;
+    for (uint32_t i = 0; i < schema->num_columns; i++)
+    {
+      layout.columns[i] = offset;
+      offset += (layout.max_cells * schema->columns[i].size + 3) & ~3u;
+    }
+  }
+  layout.right_split_count = (layout.max_cells + 1) / 2;
+  layout.left_split_count = (layout.max_cells + 1) - layout.right_split_count;
+  return layout;
+}
+
+/*
+ * Internal Node Header Layout
+ */
+const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE =
+    COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+
+/*
+ * Internal Node Body Layout
+ *
+ * Cell i points at a child whose largest key is key i. Keys greater than
+ * every stored key live under the right child.
+ */
+const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+
+constexpr uint32_t internal_node_max_keys(uint32_t page_size)
+{
+  return (page_size - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE;
+}
+
+NodeType get_node_type(void *node)
+{
+  uint8_t value = *((uint8_t *)node + NODE_TYPE_OFFSET);
+  return (NodeType)value;
+}
+
+void set_node_type(void *node, NodeType type)
+{
+  *((uint8_t *)node + NODE_TYPE_OFFSET) = (uint8_t)type;
+}
+
+bool is_node_root(void *node)
+{
+  return *((uint8_t *)node + IS_ROOT_OFFSET);
+}
+
+void set_node_root(void *node, bool is_root)
+{
+  *((uint8_t *)node + IS_ROOT_OFFSET) = (uint8_t)is_root;
+}
+
+void set_node_page_size(void *node, uint32_t page_size)
+{
+  *((uint8_t *)node + PAGE_SIZE_SHIFT_OFFSET) = (uint8_t)__builtin_ctz(page_size);
+}
+
+uint32_t *leaf_node_num_cells(void *node)
+{
+  return (uint32_t *)((char *)node + LEAF_NODE_NUM_CELLS_OFFSET);
+}
+
+uint32_t *leaf_node_next_leaf(void *node)
+{
+  return (uint32_t *)((char *)node + LEAF_NODE_NEXT_LEAF_OFFSET);
+}
+
+RecordFormat leaf_node_format(void *node)
+{
+  return (RecordFormat) * ((uint8_t *)node + LEAF_FORMAT_OFFSET);
+}
+
+uint32_t *slotted_leaf_content_start(void *node)
+{
+  return (uint32_t *)((char *)node + SLOTTED_LEAF_CONTENT_START_OFFSET);
+}
+
+// The {offset, length} pair of a cell.
+uint16_t *slotted_leaf_slot(void *node, uint32_t cell_num)
+{
+  return (uint16_t *)((char *)node + SLOTTED_LEAF_HEADER_SIZE + cell_num * SLOTTED_LEAF_SLOT_SIZE);
+}
+
+uint32_t slotted_leaf_free_space(void *node)
+{
+  return *slotted_leaf_content_start(node) - SLOTTED_LEAF_HEADER_SIZE -
+         *leaf_node_num_cells(node) * SLOTTED_LEAF_SLOT_SIZE;
+}
+
+// Fixed leaves only.
+void *leaf_node_cell(const LeafLayout *layout, void *node, uint32_t cell_num)
+{
+  return (char *)node + LEAF_NODE_HEADER_SIZE + cell_num * layout->cell_size;
+}
+
+void *leaf_node_value(const LeafLayout *layout, void *node, uint32_t cell_num)
+{
+  if (layout->format == RECORD_VARIABLE)
+  {
+    return (char *)node + slotted_leaf_slot(node, cell_num)[0];
+  }
+  return (char *)leaf_node_cell(layout, node, cell_num) + LEAF_NODE_VALUE_OFFSET;
+}
+
+// A variable record starts with its key, so slotted cells only store it
+// once. Columnar leaves keep the keys as their first array.
+uint32_t *leaf_node_key(const LeafLayout *layout, void *node, uint32_t cell_num)
+{
+  switch (layout->format)
+  {
+  case (RECORD_VARIABLE):
+    return (uint32_t *)leaf_node_value(layout, node, cell_num);
+  case (RECORD_COLUMNAR):
+    return (uint32_t *)((char *)node + layout->columns[0]) + cell_num;
+  default:
+    return (uint32_t *)leaf_node_cell(layout, node, cell_num);
+  }
+}
+
+// Column column of cell cell_num in a columnar leaf.
+char *columnar_leaf_value(const Table *table, void *node, uint32_t column, uint32_t cell_num)
+{
+  return (char *)node + table->layout.columns[column] + cell_num * table->schema->columns[column].size;
+}
+
+// Scatter a fixed-layout row across the column arrays, or gather it back.
+void columnar_leaf_write(const Table *table, void *node, uint32_t cell_num, const char *row)
+{
+  const TableSchema *schema = table->schema;
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    memcpy(columnar_leaf_value(table, node, i, cell_num), row + schema->columns[i].offset, schema->columns[i].size);
+  }
+}
+
+void columnar_leaf_read(const Table *table, void *node, uint32_t cell_num, char *row)
+{
+  const TableSchema *schema = table->schema;
+  for (uint32_t i = 0; i < schema->num_columns; i++)
+  {
+    memcpy(row + schema->columns[i].offset, columnar_leaf_value(table, node, i, cell_num), schema->columns[i].size);
+  }
+}
+
+// The key of a record is its first column.
+uint32_t record_key(const char *record)
+{
+  uint32_t key;
+  memcpy(&key, record, sizeof(key));
+  return key;
+}
+
+uint32_t *internal_node_num_keys(void *node)
+{
+  return (uint32_t *)((char *)node + INTERNAL_NODE_NUM_KEYS_OFFSET);
+}
+
+uint32_t *internal_node_right_child(void *node)
+{
+  return (uint32_t *)((char *)node + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+}
+
+uint32_t *internal_node_cell(void *node, uint32_t cell_num)
+{
+  return (uint32_t *)((char *)node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE);
+}
+
+uint32_t *internal_node_key(void *node, uint32_t key_num)
+{
+  return (uint32_t *)((char *)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE);
+}
+
+uint32_t internal_node_child(void *node, uint32_t child_num)
+{
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if (child_num > num_keys)
+  {
+    printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+    exit(EXIT_FAILURE);
+  }
+  if (child_num == num_keys)
+  {
+    return *internal_node_right_child(node);
+  }
+  return *internal_node_cell(node, child_num);
+}
+
+void set_internal_node_child(void *node, uint32_t child_num, uint32_t child_page_num)
+{
+  if (child_num == *internal_node_num_keys(node))
+  {
+    *internal_node_right_child(node) = child_page_num;
+  }
+  else
+  {
+    *internal_node_cell(node, child_num) = child_page_num;
+  }
+}
+
+void slotted_leaf_clear(void *node, uint32_t page_size)
+{
+  *leaf_node_num_cells(node) = 0;
+  *slotted_leaf_content_start(node) = page_size;
+}
+
+void initialize_leaf_node(const LeafLayout *layout, void *node)
+{
+  set_node_type(node, NODE_LEAF);
+  set_node_root(node, false);
+  *((uint8_t *)node + LEAF_FORMAT_OFFSET) = (uint8_t)layout->format;
+  set_node_page_size(node, layout->page_size);
+  *leaf_node_num_cells(node) = 0;
+  *leaf_node_next_leaf(node) = 0; // 0 represents no sibling
+  if (layout->format == RECORD_VARIABLE)
+  {
+    slotted_leaf_clear(node, layout->page_size);
+  }
+}
+
+// Add a cell after the last one of a slotted leaf with room for it.
+void slotted_leaf_append(void *node, const char *record, uint32_t length)
+{
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t start = *slotted_leaf_content_start(node) - slotted_cell_size(length);
+  memset((char *)node + start, 0, slotted_cell_size(length));
+  memcpy((char *)node + start, record, length);
+  uint16_t *slot = slotted_leaf_slot(node, num_cells);
+  slot[0] = start;
+  slot[1] = length;
+  *slotted_leaf_content_start(node) = start;
+  *leaf_node_num_cells(node) = num_cells + 1;
+}
+
+void initialize_internal_node(void *node, uint32_t page_size)
+{
+  set_node_type(node, NODE_INTERNAL);
+  set_node_root(node, false);
+  *((uint8_t *)node + LEAF_FORMAT_OFFSET) = 0;
+  set_node_page_size(node, page_size);
+  *internal_node_num_keys(node) = 0;
+}
+
+// Index of the child that may contain the given key.
+uint32_t internal_node_find_child(void *node, uint32_t key)
+{
+  uint32_t num_keys = *internal_node_num_keys(node);
+
+  // Binary search for the first separator >= key
+  uint32_t min_index = 0;
+  uint32_t max_index = num_keys; // there is one more child than key
+  while (min_index != max_index)
+  {
+    uint32_t index = (min_index + max_index) / 2;
+    uint32_t key_to_right = *internal_node_key(node, index);
+    if (key_to_right >= key)
+    {
+      max_index = index;
+    }
+    else
+    {
+      min_index = index + 1;
+    }
+  }
+  return min_index;
+}
+
+// Position of the key in the leaf, or of where it would be inserted.
+uint32_t leaf_node_find_cell(const LeafLayout *layout, void *node, uint32_t key)
+{
+  uint32_t min_index = 0;
+  uint32_t one_past_max_index = *leaf_node_num_cells(node);
+  while (one_past_max_index != min_index)
+  {
+    uint32_t index = (min_index + one_past_max_index) / 2;
+    uint32_t key_at_index = *leaf_node_key(layout, node, index);
+    if (key == key_at_index)
+    {
+      return index;
+    }
+    if (key < key_at_index)
+    {
+      one_past_max_index = index;
+    }
+    else
+    {
+      min_index = index + 1;
+    }
+  }
+  return min_index;
+}
+
+// New pages are always appended to the end of the database file.
+uint32_t get_unused_page_num(Pager *pager)
+{
+  return pager->num_pages;
+}
+
+uint32_t tree_depth(Table *table)
+{
+  uint32_t depth = 1;
+  void *node = get_page(table->pager, table->root_page_num);
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    node = get_page(table->pager, *internal_node_right_child(node));
+    depth++;
+  }
+  return depth;
+}
+
+Cursor *table_start(Table *table)
+{
+  Cursor *cursor = (Cursor *)malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor->page_num = table->root_page_num;
+  cursor->cell_num = 0;
+
+  void *node = get_page(table->pager, cursor->page_num);
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    cursor->page_num = internal_node_child(node, 0);
+    node = get_page(table->pager, cursor->page_num);
+  }
+  cursor->end_of_table = (*leaf_node_num_cells(node) == 0);
+  return cursor;
+}
+
+// Put the cursor on key in the leaf the table's key hash last saw it in,
+// if it is still there; it moves when that leaf splits.
+bool cursor_seek_hint(Cursor *cursor, uint32_t key)
+{
+  Table *table = cursor->table;
+  uint32_t hint = key_hash_get(table->key_pages, key);
+  if (hint == KEY_HASH_MISSING)
+  {
+    return false;
+  }
+  void *node = get_page(table->pager, hint);
+  if (get_node_type(node) != NODE_LEAF)
+  {
+    return false;
+  }
+  uint32_t cell_num = leaf_node_find_cell(&table->layout, node, key);
+  if (cell_num == *leaf_node_num_cells(node) || *leaf_node_key(&table->layout, node, cell_num) != key)
+  {
+    return false;
+  }
+  cursor->page_num = hint;
+  cursor->cell_num = cell_num;
+  cursor->end_of_table = false;
+  return true;
+}
+
+/*
+Return the position of the given key.
+If the key is not present, return the position
+where it should be inserted
+*/
+void cursor_seek(Cursor *cursor, uint32_t key)
+{
+  Table *table = cursor->table;
+  if (table->key_pages != NULL && cursor_seek_hint(cursor, key))
+  {
+    return;
+  }
+  cursor->page_num = table->root_page_num;
+
+  void *node = get_page(table->pager, cursor->page_num);
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    cursor->page_num = internal_node_child(node, internal_node_find_child(node, key));
+    node = get_page(table->pager, cursor->page_num);
+  }
+  cursor->cell_num = leaf_node_find_cell(&table->layout, node, key);
+  if (table->key_pages != NULL && cursor->cell_num < *leaf_node_num_cells(node) &&
+      *leaf_node_key(&table->layout, node, cursor->cell_num) == key)
+  {
+    key_hash_put(table->key_pages, key, cursor->page_num);
+  }
+
+  // A key past the end of this leaf belongs to the start of the next one.
+  if (cursor->cell_num == *leaf_node_num_cells(node))
+  {
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num == 0)
+    {
+      cursor->end_of_table = true;
+      return;
+    }
+    cursor->page_num = next_page_num;
+    cursor->cell_num = 0;
+  }
+  cursor->end_of_table = false;
+}
+
+Cursor *table_find(Table *table, uint32_t key)
+{
+  Cursor *cursor = (Cursor *)malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor_seek(cursor, key);
+  return cursor;
+}
+
+uint32_t cursor_key(Cursor *cursor)
+{
+  void *page = get_page(cursor->table->pager, cursor->page_num);
+  return *leaf_node_key(&cursor->table->layout, page, cursor->cell_num);
+}
+
+RowView cursor_row(Cursor *cursor)
+{
+  const LeafLayout *layout = &cursor->table->layout;
+  void *page = get_page(cursor->table->pager, cursor->page_num);
+  if (layout->format == RECORD_COLUMNAR)
+  {
+    RowView row = {(const char *)page, RECORD_COLUMNAR, cursor->cell_num, layout->columns};
+    return row;
+  }
+  return row_view(leaf_node_value(layout, page, cursor->cell_num), layout->format);
+}
+
+uint32_t cursor_leaf_cells(Cursor *cursor)
+{
+  return *leaf_node_num_cells(get_page(cursor->table->pager, cursor->page_num));
+}
+
+const char *cursor_leaf_column(Cursor *cursor, uint32_t column)
+{
+  return (const char *)get_page(cursor->table->pager, cursor->page_num) + cursor->table->layout.columns[column];
+}
+
+void cursor_next_leaf(Cursor *cursor)
+{
+  uint32_t next_page_num = *leaf_node_next_leaf(get_page(cursor->table->pager, cursor->page_num));
+  if (next_page_num == 0)
+  {
+    cursor->end_of_table = true;
+    return;
+  }
+  cursor->page_num = next_page_num;
+  cursor->cell_num = 0;
+}
+
+// Append the leaves under page_num, depth levels above them, whose keys
+// may fall in [low, high]. Child i holds keys up to key i, and the right
+// child those above the last key.
+typedef struct
+{
+  uint32_t *pages;
+  uint32_t count;
+  uint32_t capacity;
+} PageList;
+
+void collect_leaves(Table *table, uint32_t page_num, uint32_t depth, uint32_t low, uint32_t high, PageList *list)
+{
+  if (depth == 0)
+  {
+    if (list->count == list->capacity)
+    {
+      list->capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+      list->pages = (uint32_t *)realloc(list->pages, list->capacity * sizeof(uint32_t));
+    }
+    list->pages[list->count++] = page_num;
+    return;
+  }
+  void *node = get_page(table->pager, page_num);
+  // Fetching a child can evict this node, so copy out what is needed.
+  uint32_t first = internal_node_find_child(node, low);
+  uint32_t last = internal_node_find_child(node, high);
+  uint32_t *children = (uint32_t *)malloc((last - first + 1) * sizeof(uint32_t));
+  for (uint32_t i = first; i <= last; i++)
+  {
+    children[i - first] = internal_node_child(node, i);
+  }
+  // The next level down is read in full, so ask for all of it at once.
+  if (depth > 1)
+  {
+    pager_prefetch(table->pager, children, last - first + 1);
+  }
+  for (uint32_t i = first; i <= last; i++)
+  {
+    collect_leaves(table, children[i - first], depth - 1, low, high, list);
+  }
+  free(children);
+}
+
+uint32_t table_leaves(Table *table, uint32_t low, uint32_t high, uint32_t **pages)
+{
+  PageList list = {NULL, 0, 0};
+  collect_leaves(table, table->root_page_num, tree_depth(table) - 1, low, high, &list);
+  *pages = list.pages;
+  return list.count;
+}
+
+uint32_t table_max_leaf_cells(const Table *table)
+{
+  return table->layout.format == RECORD_VARIABLE ? slotted_leaf_max_cells(table->layout.page_size)
+                                                 : table->layout.max_cells;
+}
+
+void leaf_acquire(Table *table, uint32_t page_num, Leaf *leaf)
+{
+  Pager *pager = table->pager;
+  pthread_mutex_lock(&pager->latch);
+  leaf->table = table;
+  leaf->page_num = page_num;
+  void *node = get_page(pager, page_num);
+  pager_pin(pager, page_num);
+  pthread_mutex_unlock(&pager->latch);
+  leaf->node = node;
+  leaf->num_cells = *leaf_node_num_cells(node);
+}
+
+void leaf_release(Leaf *leaf)
+{
+  Pager *pager = leaf->table->pager;
+  pthread_mutex_lock(&pager->latch);
+  pager_unpin(pager, leaf->page_num);
+  pthread_mutex_unlock(&pager->latch);
+}
+
+uint32_t leaf_key(const Leaf *leaf, uint32_t cell_num)
+{
+  return *leaf_node_key(&leaf->table->layout, (void *)leaf->node, cell_num);
+}
+
+RowView leaf_row(const Leaf *leaf, uint32_t cell_num)
+{
+  const LeafLayout *layout = &leaf->table->layout;
+  if (layout->format == RECORD_COLUMNAR)
+  {
+    RowView row = {(const char *)leaf->node, RECORD_COLUMNAR, cell_num, layout->columns};
+    return row;
+  }
+  return row_view(leaf_node_value(layout, (void *)leaf->node, cell_num), layout->format);
+}
+
+const char *leaf_column(const Leaf *leaf, uint32_t column)
+{
+  return (const char *)leaf->node + leaf->table->layout.columns[column];
+}
+
+void cursor_advance(Cursor *cursor)
+{
+  void *node = get_page(cursor->table->pager, cursor->page_num);
+  cursor->cell_num += 1;
+  if (cursor->cell_num >= (*leaf_node_num_cells(node)))
+  {
+    // Advance to next leaf node
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num == 0)
+    {
+      // This was rightmost leaf
+      cursor->end_of_table = true;
+    }
+    else
+    {
+      cursor->page_num = next_page_num;
+      cursor->cell_num = 0;
+    }
+  }
+}
+
+// Result of inserting into a subtree. When the subtree's root node split,
+// its page kept the lower half (whose largest key is left_max_key) and the
+// upper half moved to right_page_num.
+typedef struct
+{
+  bool split;
+  bool duplicate; // the key was already present and nothing was written
+  uint32_t left_max_key;
+  uint32_t right_page_num;
+} SplitResult;
+
+SplitResult fixed_leaf_insert(Table *table, uint32_t page_num, uint32_t cell_num, uint32_t key,
+                              const void *record)
+{
+  SplitResult result = {false, false, 0, 0};
+  Pager *pager = table->pager;
+  const LeafLayout *layout = &table->layout;
+  void *node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  if (num_cells < layout->max_cells)
+  {
+    if (cell_num < num_cells)
+    {
+      memmove(leaf_node_cell(layout, node, cell_num + 1), leaf_node_cell(layout, node, cell_num),
+              (num_cells - cell_num) * layout->cell_size);
+    }
+    *leaf_node_num_cells(node) = num_cells + 1;
+    *leaf_node_key(layout, node, cell_num) = key;
+    memcpy(leaf_node_value(layout, node, cell_num), record, layout->row_size);
+    return result;
+  }
+
+  /*
+  Create a new node and move half the cells over.
+  Insert the new value in one of the two nodes.
+  Appending past the end of the last leaf leaves it full and starts the new
+  leaf with just the new cell, so ascending inserts pack leaves completely.
+  */
+  bool append = cell_num == num_cells && *leaf_node_next_leaf(node) == 0;
+  uint32_t left_count = append ? num_cells : layout->left_split_count;
+  uint32_t right_count = num_cells + 1 - left_count;
+  uint32_t cell_size = layout->cell_size;
+  // A full leaf plus one cell, which is never more than two pages.
+  char *cells = (char *)malloc(2 * layout->page_size);
+  memcpy(cells, leaf_node_cell(layout, node, 0), cell_num * cell_size);
+  memset(cells + cell_num * cell_size, 0, cell_size);
+  memcpy(cells + cell_num * cell_size, &key, LEAF_NODE_KEY_SIZE);
+  memcpy(cells + cell_num * cell_size + LEAF_NODE_VALUE_OFFSET, record, layout->row_size);
+  memcpy(cells + (cell_num + 1) * cell_size, leaf_node_cell(layout, node, cell_num),
+         (num_cells - cell_num) * cell_size);
+
+  pager_pin(pager, page_num);
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void *new_node = get_page(pager, new_page_num);
+  pager_mark_dirty(pager, new_page_num);
+  initialize_leaf_node(layout, new_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(node);
+  *leaf_node_next_leaf(node) = new_page_num;
+
+  memcpy(leaf_node_cell(layout, node, 0), cells, left_count * cell_size);
+  memcpy(leaf_node_cell(layout, new_node, 0), cells + left_count * cell_size, right_count * cell_size);
+  *leaf_node_num_cells(node) = left_count;
+  *leaf_node_num_cells(new_node) = right_count;
+  pager_unpin(pager, page_num);
+  free(cells);
+
+  result.split = true;
+  result.left_max_key = *leaf_node_key(layout, node, left_count - 1);
+  result.right_page_num = new_page_num;
+  return result;
+}
+
+SplitResult slotted_leaf_insert(Table *table, uint32_t page_num, uint32_t cell_num, const char *record,
+                                uint32_t length)
+{
+  SplitResult result = {false, false, 0, 0};
+  Pager *pager = table->pager;
+  void *node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t cell_size = slotted_cell_size(length);
+
+  if (SLOTTED_LEAF_SLOT_SIZE + cell_size <= slotted_leaf_free_space(node))
+  {
+    uint32_t start = *slotted_leaf_content_start(node) - cell_size;
+    memset((char *)node + start, 0, cell_size);
+    memcpy((char *)node + start, record, length);
+    memmove(slotted_leaf_slot(node, cell_num + 1), slotted_leaf_slot(node, cell_num),
+            (num_cells - cell_num) * SLOTTED_LEAF_SLOT_SIZE);
+    uint16_t *slot = slotted_leaf_slot(node, cell_num);
+    slot[0] = start;
+    slot[1] = length;
+    *slotted_leaf_content_start(node) = start;
+    *leaf_node_num_cells(node) = num_cells + 1;
+    return result;
+  }
+
+  // Gather the cells in key order with the new one in place: their
+  // contents, then where each starts, then their lengths.
+  const LeafLayout *layout = &table->layout;
+  uint32_t max_cells = slotted_leaf_max_cells(layout->page_size) + 1;
+  char *cells = (char *)malloc(2 * layout->page_size + max_cells * (sizeof(uint32_t) + sizeof(uint16_t)));
+  uint32_t *offsets = (uint32_t *)(cells + 2 * layout->page_size);
+  uint16_t *lengths = (uint16_t *)(offsets + max_cells);
+  uint32_t used = 0;
+  for (uint32_t i = 0, old = 0; i <= num_cells; i++)
+  {
+    const char *source = record;
+    if (i != cell_num)
+    {
+      uint16_t *slot = slotted_leaf_slot(node, old++);
+      source = (char *)node + slot[0];
+      lengths[i] = slot[1];
+    }
+    else
+    {
+      lengths[i] = length;
+    }
+    offsets[i] = used;
+    memcpy(cells + used, source, lengths[i]);
+    used += slotted_cell_size(lengths[i]);
+  }
+
+  /*
+  Split by bytes, so each half holds about half the content however the
+  record sizes vary. As with fixed leaves, appending to the rightmost leaf
+  keeps it full and starts the new one with just the new cell.
+  */
+  uint32_t total = used + (num_cells + 1) * SLOTTED_LEAF_SLOT_SIZE;
+  uint32_t left_count = 0;
+  if (cell_num == num_cells && *leaf_node_next_leaf(node) == 0)
+  {
+    left_count = num_cells;
+  }
+  else
+  {
+    uint32_t left_bytes = 0;
+    while (left_count < num_cells && left_bytes < total / 2)
+    {
+      left_bytes += SLOTTED_LEAF_SLOT_SIZE + slotted_cell_size(lengths[left_count++]);
+    }
+  }
+
+  pager_pin(pager, page_num);
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void *new_node = get_page(pager, new_page_num);
+  pager_mark_dirty(pager, new_page_num);
+  initialize_leaf_node(layout, new_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(node);
+  *leaf_node_next_leaf(node) = new_page_num;
+
+  slotted_leaf_clear(node, layout->page_size);
+  for (uint32_t i = 0; i <= num_cells; i++)
+  {
+    slotted_leaf_append(i < left_count ? node : new_node, cells + offsets[i], lengths[i]);
+  }
+  pager_unpin(pager, page_num);
+
+  result.split = true;
+  result.left_max_key = record_key(cells + offsets[left_count - 1]);
+  result.right_page_num = new_page_num;
+  free(cells);
+  return result;
+}
+
+SplitResult columnar_leaf_insert(Table *table, uint32_t page_num, uint32_t cell_num, const char *row)
+{
+  SplitResult result = {false, false, 0, 0};
+  Pager *pager = table->pager;
+  const LeafLayout *layout = &table->layout;
+  const TableSchema *schema = table->schema;
+  void *node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  if (num_cells < layout->max_cells)
+  {
+    for (uint32_t i = 0; i < schema->num_columns; i++)
+    {
+      memmove(columnar_leaf_value(table, node, i, cell_num + 1), columnar_leaf_value(table, node, i, cell_num),
+              (num_cells - cell_num) * schema->columns[i].size);
+    }
+    columnar_leaf_write(table, node, cell_num, row);
+    *leaf_node_num_cells(node) = num_cells + 1;
+    return result;
+  }
+
+  // Gather the rows with the new one in place and split them as a fixed
+  // leaf would.
+  bool append = cell_num == num_cells && *leaf_node_next_leaf(node) == 0;
+  uint32_t left_count = append ? num_cells : layout->left_split_count;
+  uint32_t row_size = layout->row_size;
+  char *rows = (char *)malloc(2 * layout->page_size);
+  for (uint32_t i = 0, old = 0; i <= num_cells; i++)
+  {
+    if (i == cell_num)
+    {
+      memcpy(rows + i * row_size, row, row_size);
+    }
+    else
+    {
+      columnar_leaf_read(table, node, old++, rows + i * row_size);
+    }
+  }
+
+  pager_pin(pager, page_num);
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void *new_node = get_page(pager, new_page_num);
+  pager_mark_dirty(pager, new_page_num);
+  initialize_leaf_node(layout, new_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(node);
+  *leaf_node_next_leaf(node) = new_page_num;
+
+  for (uint32_t i = 0; i <= num_cells; i++)
+  {
+    bool left = i < left_count;
+    columnar_leaf_write(table, left ? node : new_node, left ? i : i - left_count, rows + i * row_size);
+  }
+  *leaf_node_num_cells(node) = left_count;
+  *leaf_node_num_cells(new_node) = num_cells + 1 - left_count;
+  pager_unpin(pager, page_num);
+
+  result.split = true;
+  result.left_max_key = record_key(rows + (left_count - 1) * row_size);
+  result.right_page_num = new_page_num;
+  free(rows);
+  return result;
+}
+
+// record is length bytes in the table's format, or a fixed-layout row for
+// a columnar table.
+SplitResult leaf_node_insert(Table *table, uint32_t page_num, uint32_t cell_num, uint32_t key,
+                             const void *record, uint32_t length)
+{
+  switch (table->layout.format)
+  {
+  case (RECORD_VARIABLE):
+    return slotted_leaf_insert(table, page_num, cell_num, (const char *)record, length);
+  case (RECORD_COLUMNAR):
+    return columnar_leaf_insert(table, page_num, cell_num, (const char *)record);
+  default:
+    return fixed_leaf_insert(table, page_num, cell_num, key, record);
+  }
+}
+
+/*
+Child child_index of the internal node split into itself and right_page_num.
+Record the new child, splitting this node too if it is already full.
+*/
+SplitResult internal_node_insert(Table *table, uint32_t page_num, uint32_t child_index, SplitResult child)
+{
+  SplitResult result = {false, false, 0, 0};
+  Pager *pager = table->pager;
+  void *node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  uint32_t num_keys = *internal_node_num_keys(node);
+  uint32_t page_size = table->layout.page_size;
+  uint32_t max_keys = internal_node_max_keys(page_size);
+
+  // Gather children and separators, with the new child right after the old.
+  uint32_t *children = (uint32_t *)malloc((2 * max_keys + 3) * sizeof(uint32_t));
+  uint32_t *keys = children + max_keys + 2;
+  uint32_t n = 0;
+  for (uint32_t i = 0; i <= num_keys; i++)
+  {
+    children[n] = internal_node_child(node, i);
+    if (i == child_index)
+    {
+      keys[n] = child.left_max_key;
+      n++;
+      children[n] = child.right_page_num;
+    }
+    if (i < num_keys)
+    {
+      keys[n] = *internal_node_key(node, i);
+    }
+    n++;
+  }
+  // n children and n - 1 separators now
+
+  if (n - 1 <= max_keys)
+  {
+    *internal_node_num_keys(node) = n - 1;
+    for (uint32_t i = 0; i < n - 1; i++)
+    {
+      *internal_node_cell(node, i) = children[i];
+      *internal_node_key(node, i) = keys[i];
+    }
+    *internal_node_right_child(node) = children[n - 1];
+    free(children);
+    return result;
+  }
+
+  // Left keeps children [0, left_count), right gets the rest. The separator
+  // between them moves up to the parent. As with leaves, a split of the last
+  // child leaves this node full and starts the new one with only that child.
+  uint32_t left_count = child_index == num_keys ? n - 1 : n / 2;
+  pager_pin(pager, page_num);
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void *new_node = get_page(pager, new_page_num);
+  pager_mark_dirty(pager, new_page_num);
+  initialize_internal_node(new_node, page_size);
+
+  *internal_node_num_keys(node) = left_count - 1;
+  for (uint32_t i = 0; i < left_count - 1; i++)
+  {
+    *internal_node_cell(node, i) = children[i];
+    *internal_node_key(node, i) = keys[i];
+  }
+  *internal_node_right_child(node) = children[left_count - 1];
+
+  uint32_t right_count = n - left_count;
+  *internal_node_num_keys(new_node) = right_count - 1;
+  for (uint32_t i = 0; i < right_count - 1; i++)
+  {
+    *internal_node_cell(new_node, i) = children[left_count + i];
+    *internal_node_key(new_node, i) = keys[left_count + i];
+  }
+  *internal_node_right_child(new_node) = children[n - 1];
+  pager_unpin(pager, page_num);
+
+  result.split = true;
+  result.left_max_key = keys[left_count - 1];
+  result.right_page_num = new_page_num;
+  free(children);
+  return result;
+}
+
+SplitResult subtree_insert(Table *table, uint32_t page_num, uint32_t key, const void *record, uint32_t length)
+{
+  void *node = get_page(table->pager, page_num);
+  if (get_node_type(node) == NODE_LEAF)
+  {
+    uint32_t cell_num = leaf_node_find_cell(&table->layout, node, key);
+    if (cell_num < *leaf_node_num_cells(node) && *leaf_node_key(&table->layout, node, cell_num) == key)
+    {
+      SplitResult duplicate = {false, true, 0, 0};
+      return duplicate;
+    }
+    SplitResult split = leaf_node_insert(table, page_num, cell_num, key, record, length);
+    if (table->key_pages != NULL)
+    {
+      // A split keeps the lower half in place and moves the upper half out.
+      bool moved = split.split && key > split.left_max_key;
+      key_hash_put(table->key_pages, key, moved ? split.right_page_num : page_num);
+    }
+    return split;
+  }
+
+  uint32_t child_index = internal_node_find_child(node, key);
+  uint32_t child_page_num = internal_node_child(node, child_index);
+  SplitResult child = subtree_insert(table, child_page_num, key, record, length);
+  if (!child.split)
+  {
+    return child;
+  }
+  return internal_node_insert(table, page_num, child_index, child);
+}
+
+/*
+The root page never moves. When it splits, its lower half is copied out to
+a new page and the root becomes an internal node over both halves.
+*/
+void create_new_root(Table *table, SplitResult split)
+{
+  Pager *pager = table->pager;
+  void *root = get_page(pager, table->root_page_num);
+  pager_pin(pager, table->root_page_num);
+
+  uint32_t left_child_page_num = get_unused_page_num(pager);
+  void *left_child = get_page(pager, left_child_page_num);
+  pager_mark_dirty(pager, left_child_page_num);
+  memcpy(left_child, root, table->layout.page_size);
+  set_node_root(left_child, false);
+
+  pager_mark_dirty(pager, table->root_page_num);
+  initialize_internal_node(root, table->layout.page_size);
+  set_node_root(root, true);
+  *internal_node_num_keys(root) = 1;
+  *internal_node_cell(root, 0) = left_child_page_num;
+  *internal_node_key(root, 0) = split.left_max_key;
+  *internal_node_right_child(root) = split.right_page_num;
+  pager_unpin(pager, table->root_page_num);
+}
+
+ExecuteResult btree_insert_record(Table *table, uint32_t key, const void *record)
+{
+  char encoded[SCHEMA_MAX_RECORD_SIZE];
+  uint32_t length = table->layout.row_size;
+  if (table->layout.format == RECORD_VARIABLE)
+  {
+    length = record_encode(table->schema, (const char *)record, encoded);
+    record = encoded;
+  }
+  SplitResult split = subtree_insert(table, table->root_page_num, key, record, length);
+  if (split.duplicate)
+  {
+    return EXECUTE_DUPLICATE_KEY;
+  }
+  if (split.split)
+  {
+    create_new_root(table, split);
+  }
+  if (table->num_rows != TABLE_ROWS_UNKNOWN)
+  {
+    table->num_rows++;
+  }
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult btree_insert(Table *table, uint32_t key, Row *value)
+{
+  char record[ROW_SIZE];
+  serialize_row(value, record);
+  return btree_insert_record(table, key, record);
+}
+
+// Largest key in the table, found down the right edge of the tree.
+bool table_max_key(Table *table, uint32_t *key)
+{
+  void *node = get_page(table->pager, table->root_page_num);
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    node = get_page(table->pager, *internal_node_right_child(node));
+  }
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (num_cells == 0)
+  {
+    return false;
+  }
+  *key = *leaf_node_key(&table->layout, node, num_cells - 1);
+  return true;
+}
+
+/*
+Key-range summaries read off the tree's structure. Internal key i is the
+largest key under child i, so the first key at or after low is under the
+child internal_node_find_child picks, and the last key at or before high
+is under the child it picks for high or else is the separator just left
+of it.
+*/
+bool table_first_key(Table *table, uint32_t low, uint32_t *key)
+{
+  void *node = get_page(table->pager, table->root_page_num);
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    node = get_page(table->pager, internal_node_child(node, internal_node_find_child(node, low)));
+  }
+  uint32_t cell = leaf_node_find_cell(&table->layout, node, low);
+  if (cell == *leaf_node_num_cells(node))
+  {
+    return false;
+  }
+  *key = *leaf_node_key(&table->layout, node, cell);
+  return true;
+}
+
+bool subtree_last_key(Table *table, uint32_t page_num, uint32_t high, uint32_t *key)
+{
+  void *node = get_page(table->pager, page_num);
+  if (get_node_type(node) == NODE_LEAF)
+  {
+    uint32_t cell = leaf_node_find_cell(&table->layout, node, high);
+    if (cell < *leaf_node_num_cells(node) && *leaf_node_key(&table->layout, node, cell) == high)
+    {
+      *key = high;
+      return true;
+    }
+    if (cell == 0)
+    {
+      return false;
+    }
+    *key = *leaf_node_key(&table->layout, node, cell - 1);
+    return true;
+  }
+  // Fetching the child can evict this node, so copy out what is needed.
+  uint32_t index = internal_node_find_child(node, high);
+  uint32_t child = internal_node_child(node, index);
+  uint32_t left = index > 0 ? *internal_node_key(node, index - 1) : 0;
+  if (subtree_last_key(table, child, high, key))
+  {
+    return true;
+  }
+  *key = left;
+  return index > 0;
+}
+
+bool table_last_key(Table *table, uint32_t high, uint32_t *key)
+{
+  return subtree_last_key(table, table->root_page_num, high, key);
+}
+
+// Leaf headers hold their cell counts, and only the first and last leaves
+// in range can hold keys outside it, so only those are searched.
+uint32_t table_count_keys(Table *table, uint32_t low, uint32_t high)
+{
+  if (low == 0 && high == UINT32_MAX && table->num_rows != TABLE_ROWS_UNKNOWN)
+  {
+    return table->num_rows;
+  }
+  uint32_t *pages;
+  uint32_t num_leaves = table_leaves(table, low, high, &pages);
+  const LeafLayout *layout = &table->layout;
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < num_leaves; i++)
+  {
+    void *node = get_page(table->pager, pages[i]);
+    uint32_t first = 0, end = *leaf_node_num_cells(node);
+    if (i == 0)
+    {
+      first = leaf_node_find_cell(layout, node, low);
+    }
+    if (i == num_leaves - 1)
+    {
+      uint32_t cell = leaf_node_find_cell(layout, node, high);
+      end = cell < end && *leaf_node_key(layout, node, cell) == high ? cell + 1 : cell;
+    }
+    count += end > first ? end - first : 0;
+  }
+  free(pages);
+  // A view sees a snapshot, which moves on, so only the writer keeps it.
+  if (low == 0 && high == UINT32_MAX && table->pager->read_slot == WAL_NO_READER)
+  {
+    table->num_rows = count;
+  }
+  return count;
+}
+
+// How many of the records from first on fill the next bulk-loaded leaf.
+uint32_t bulk_leaf_cells(Table *table, const char *records, uint32_t first, uint32_t num_rows)
+{
+  const LeafLayout *layout = &table->layout;
+  uint32_t remaining = num_rows - first;
+  if (layout->format != RECORD_VARIABLE)
+  {
+    return remaining < layout->max_cells ? remaining : layout->max_cells;
+  }
+  uint32_t space = slotted_leaf_space(layout->page_size);
+  uint32_t cells = 0;
+  while (cells < remaining)
+  {
+    const char *record = records + (size_t)(first + cells) * layout->row_size;
+    uint32_t needed = SLOTTED_LEAF_SLOT_SIZE + slotted_cell_size(record_encoded_size(table->schema, record));
+    if (needed > space)
+    {
+      break;
+    }
+    space -= needed;
+    cells++;
+  }
+  return cells;
+}
+
+/*
+Build the tree bottom-up from records sorted by key into an empty table. Every
+leaf is packed full and each level is written left to right on fresh
+pages, except that the single node of the top level becomes the root page.
+*/
+#define BULK_LOAD_MAX_LEVELS 16
+
+ExecuteResult bulk_load(Table *table, const char *records, uint32_t num_rows)
+{
+  Pager *pager = table->pager;
+  const LeafLayout *layout = &table->layout;
+  uint32_t max_keys = internal_node_max_keys(layout->page_size);
+
+  uint32_t level_sizes[BULK_LOAD_MAX_LEVELS];
+  uint32_t num_levels = 0;
+  uint32_t count = 0;
+  for (uint32_t first = 0; first < num_rows; first += bulk_leaf_cells(table, records, first, num_rows))
+  {
+    count++;
+  }
+  uint32_t pages_needed = 0;
+  while (true)
+  {
+    level_sizes[num_levels++] = count;
+    pages_needed += count;
+    if (count == 1)
+    {
+      break;
+    }
+    count = (count + max_keys) / (max_keys + 1);
+  }
+  // The top node reuses the root page.
+  if ((uint64_t)get_unused_page_num(pager) + pages_needed - 1 > pager_max_pages(pager))
+  {
+    return EXECUTE_TABLE_FULL;
+  }
+
+  // Page number and largest key of every node on the level just built.
+  uint32_t *child_pages = (uint32_t *)malloc(level_sizes[0] * sizeof(uint32_t));
+  uint32_t *child_max_keys = (uint32_t *)malloc(level_sizes[0] * sizeof(uint32_t));
+
+  uint32_t first_leaf = get_unused_page_num(pager);
+  uint32_t first = 0;
+  for (uint32_t leaf = 0; leaf < level_sizes[0]; leaf++)
+  {
+    bool top = num_levels == 1;
+    uint32_t page_num = top ? table->root_page_num : first_leaf + leaf;
+    void *node = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    initialize_leaf_node(layout, node);
+    set_node_root(node, top);
+
+    uint32_t cells = bulk_leaf_cells(table, records, first, num_rows);
+    for (uint32_t i = 0; i < cells; i++)
+    {
+      const char *record = records + (size_t)(first + i) * layout->row_size;
+      if (layout->format == RECORD_VARIABLE)
+      {
+        char encoded[SCHEMA_MAX_RECORD_SIZE];
+        slotted_leaf_append(node, encoded, record_encode(table->schema, record, encoded));
+        continue;
+      }
+      if (layout->format == RECORD_COLUMNAR)
+      {
+        columnar_leaf_write(table, node, i, record);
+        continue;
+      }
+      *leaf_node_key(layout, node, i) = record_key(record);
+      memcpy(leaf_node_value(layout, node, i), record, layout->row_size);
+    }
+    if (table->key_pages != NULL)
+    {
+      for (uint32_t i = 0; i < cells; i++)
+      {
+        key_hash_put(table->key_pages, record_key(records + (size_t)(first + i) * layout->row_size), page_num);
+      }
+    }
+    *leaf_node_num_cells(node) = cells;
+    *leaf_node_next_leaf(node) = leaf + 1 < level_sizes[0] ? page_num + 1 : 0;
+
+    child_pages[leaf] = page_num;
+    child_max_keys[leaf] = record_key(records + (size_t)(first + cells - 1) * layout->row_size);
+    first += cells;
+  }
+
+  for (uint32_t level = 1; level < num_levels; level++)
+  {
+    uint32_t num_children = level_sizes[level - 1];
+    uint32_t first_page = get_unused_page_num(pager);
+    for (uint32_t n = 0; n < level_sizes[level]; n++)
+    {
+      bool top = level == num_levels - 1;
+      uint32_t page_num = top ? table->root_page_num : first_page + n;
+      void *node = get_page(pager, page_num);
+      pager_mark_dirty(pager, page_num);
+      initialize_internal_node(node, layout->page_size);
+      set_node_root(node, top);
+
+      uint32_t first = n * (max_keys + 1);
+      uint32_t children = num_children - first < max_keys + 1 ? num_children - first : max_keys + 1;
+      for (uint32_t i = 0; i + 1 < children; i++)
+      {
+        *internal_node_cell(node, i) = child_pages[first + i];
+        *internal_node_key(node, i) = child_max_keys[first + i];
+      }
+      *internal_node_num_keys(node) = children - 1;
+      *internal_node_right_child(node) = child_pages[first + children - 1];
+
+      // Safe to overwrite in place: node n only reads children at or after n.
+      child_pages[n] = page_num;
+      child_max_keys[n] = child_max_keys[first + children - 1];
+    }
+  }
+
+  free(child_pages);
+  free(child_max_keys);
+  table->num_rows = num_rows;
+  return EXECUTE_SUCCESS;
+}
+
+// Put every key of the table in its key hash, counting the rows on the way.
+void table_fill_key_hash(Table *table)
+{
+  uint32_t num_rows = 0;
+  Cursor *cursor = table_start(table);
+  while (!cursor->end_of_table)
+  {
+    void *node = get_page(table->pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    for (uint32_t i = 0; i < num_cells; i++)
+    {
+      key_hash_put(table->key_pages, *leaf_node_key(&table->layout, node, i), cursor->page_num);
+    }
+    num_rows += num_cells;
+    cursor_next_leaf(cursor);
+  }
+  free(cursor);
+  table->keys_hashed = true;
+  table->num_rows = num_rows;
+}
+
+int compare_uint32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Fail if any key is already in the table or repeats within the batch.
+ExecuteResult check_duplicate_keys(Table *table, const char *records, uint32_t num_records)
+{
+  uint32_t row_size = table->layout.row_size;
+  if (table->key_pages != NULL && !table->keys_hashed)
+  {
+    table_fill_key_hash(table);
+  }
+  uint32_t *keys = (uint32_t *)malloc(num_records * sizeof(uint32_t));
+  ExecuteResult result = EXECUTE_SUCCESS;
+  for (uint32_t i = 0; i < num_records && result == EXECUTE_SUCCESS; i++)
+  {
+    keys[i] = record_key(records + (size_t)i * row_size);
+    if (table->key_pages != NULL)
+    {
+      if (key_hash_get(table->key_pages, keys[i]) != KEY_HASH_MISSING)
+      {
+        result = EXECUTE_DUPLICATE_KEY;
+      }
+      continue;
+    }
+    Cursor *cursor = table_find(table, keys[i]);
+    if (!cursor->end_of_table && cursor_key(cursor) == keys[i])
+    {
+      result = EXECUTE_DUPLICATE_KEY;
+    }
+    free(cursor);
+  }
+  if (result == EXECUTE_SUCCESS)
+  {
+    qsort(keys, num_records, sizeof(uint32_t), compare_uint32);
+    for (uint32_t i = 1; i < num_records; i++)
+    {
+      if (keys[i] == keys[i - 1])
+      {
+        result = EXECUTE_DUPLICATE_KEY;
+        break;
+      }
+    }
+  }
+  free(keys);
+  return result;
+}
+
+/*
+Insert a batch of records. A duplicate key rejects the whole batch before
+anything is written. Records sorted by key skip the per-record duplicate
+lookups when they all come after the current largest key, and load
+bottom-up when the table is empty. Running out of pages stops the batch
+part way.
+*/
+ExecuteResult insert_records(Table *table, const char *records, uint32_t num_records)
+{
+  if (num_records == 0)
+  {
+    return EXECUTE_SUCCESS;
+  }
+
+  uint32_t row_size = table->layout.row_size;
+  bool sorted = true;
+  for (uint32_t i = 1; i < num_records && sorted; i++)
+  {
+    sorted = record_key(records + (size_t)(i - 1) * row_size) < record_key(records + (size_t)i * row_size);
+  }
+  uint32_t max_key;
+  bool empty = !table_max_key(table, &max_key);
+  if (sorted && empty)
+  {
+    return bulk_load(table, records, num_records);
+  }
+  if (!sorted || record_key(records) <= max_key)
+  {
+    ExecuteResult result = check_duplicate_keys(table, records, num_records);
+    if (result != EXECUTE_SUCCESS)
+    {
+      return result;
+    }
+  }
+
+  for (uint32_t i = 0; i < num_records; i++)
+  {
+    // An insert splits at most one node per level plus a new root.
+    if ((uint64_t)get_unused_page_num(table->pager) + tree_depth(table) + 1 > pager_max_pages(table->pager))
+    {
+      return EXECUTE_TABLE_FULL;
+    }
+    const char *record = records + (size_t)i * row_size;
+    ExecuteResult result = btree_insert_record(table, record_key(record), record);
+    if (result != EXECUTE_SUCCESS)
+    {
+      return result;
+    }
+  }
+  return EXECUTE_SUCCESS;
+}
+
+// Users rows are serialized into one packed batch first.
+ExecuteResult insert_rows(Table *table, Row *rows, uint32_t num_rows)
+{
+  char *records = (char *)malloc((size_t)num_rows * ROW_SIZE);
+  for (uint32_t i = 0; i < num_rows; i++)
+  {
+    serialize_row(&rows[i], records + (size_t)i * ROW_SIZE);
+  }
+  ExecuteResult result = insert_records(table, records, num_rows);
+  free(records);
+  return result;
+}
+
+/*
+ * Index Node Layout
+ *
+ * Index nodes keep the table nodes' headers, so an index leaf's entry
+ * count and next leaf, and an internal node's key count and right child,
+ * are read with the same accessors. A leaf's body is its entries back to
+ * back. An internal node's cells are a child followed by the largest entry
+ * under it, and entries greater than every separator live under the right
+ * child.
+ */
+#define INDEX_MAX_ENTRY_SIZE ((SCHEMA_MAX_TEXT_SIZE + 3) / 4 * 4 + sizeof(uint32_t))
+
+uint32_t index_max_entries(const Index *index)
+{
+  return (index->pager->page_size - LEAF_NODE_HEADER_SIZE) / index->entry_size;
+}
+
+uint32_t index_max_keys(const Index *index)
+{
+  return (index->pager->page_size - INTERNAL_NODE_HEADER_SIZE) / (INTERNAL_NODE_CHILD_SIZE + index->entry_size);
+}
+
+char *index_leaf_entry(const Index *index, void *node, uint32_t entry_num)
+{
+  return (char *)node + LEAF_NODE_HEADER_SIZE + entry_num * index->entry_size;
+}
+
+char *index_internal_cell(const Index *index, void *node, uint32_t cell_num)
+{
+  return (char *)node + INTERNAL_NODE_HEADER_SIZE + cell_num * (INTERNAL_NODE_CHILD_SIZE + index->entry_size);
+}
+
+char *index_internal_separator(const Index *index, void *node, uint32_t cell_num)
+{
+  return index_internal_cell(index, node, cell_num) + INTERNAL_NODE_CHILD_SIZE;
+}
+
+uint32_t index_internal_child(const Index *index, void *node, uint32_t child_num)
+{
+  if (child_num == *internal_node_num_keys(node))
+  {
+    return *internal_node_right_child(node);
+  }
+  uint32_t child;
+  memcpy(&child, index_internal_cell(index, node, child_num), sizeof(child));
+  return child;
+}
+
+void index_set_cell(const Index *index, void *node, uint32_t cell_num, uint32_t child, const char *separator)
+{
+  char *cell = index_internal_cell(index, node, cell_num);
+  memcpy(cell, &child, sizeof(child));
+  memcpy(cell + INTERNAL_NODE_CHILD_SIZE, separator, index->entry_size);
+}
+
+void initialize_index_node(void *node, NodeType type, uint32_t page_size)
+{
+  set_node_type(node, type);
+  set_node_root(node, false);
+  *((uint8_t *)node + LEAF_FORMAT_OFFSET) = 0;
+  set_node_page_size(node, page_size);
+  // The entry or key count, then the next leaf or the right child.
+  *leaf_node_num_cells(node) = 0;
+  *leaf_node_next_leaf(node) = 0;
+}
+
+void index_make_entry(const Index *index, const char *value, uint32_t length, uint32_t key, char *entry)
+{
+  memset(entry, 0, index->entry_size);
+  memcpy(entry, value, length);
+  memcpy(entry + index->entry_size - sizeof(uint32_t), &key, sizeof(key));
+}
+
+uint32_t index_entry_key(const Index *index, const char *entry)
+{
+  uint32_t key;
+  memcpy(&key, entry + index->entry_size - sizeof(uint32_t), sizeof(key));
+  return key;
+}
+
+// Order of two entries: by value, whose NUL padding sorts a value before
+// any longer one it is a prefix of, then by key.
+int index_compare(const Index *index, const char *entry, const char *other)
+{
+  int result = memcmp(entry, other, index->value_size);
+  if (result != 0)
+  {
+    return result;
+  }
+  uint32_t key = index_entry_key(index, entry), other_key = index_entry_key(index, other);
+  return key < other_key ? -1 : key > other_key;
+}
+
+// Index of the child that may contain the entry.
+uint32_t index_find_child(const Index *index, void *node, const char *entry)
+{
+  uint32_t min_index = 0;
+  uint32_t max_index = *internal_node_num_keys(node);
+  while (min_index != max_index)
+  {
+    uint32_t middle = (min_index + max_index) / 2;
+    if (index_compare(index, index_internal_separator(index, node, middle), entry) >= 0)
+    {
+      max_index = middle;
+    }
+    else
+    {
+      min_index = middle + 1;
+    }
+  }
+  return min_index;
+}
+
+// Position of the first entry of the leaf not less than entry.
+uint32_t index_find_entry(const Index *index, void *node, const char *entry)
+{
+  uint32_t min_index = 0;
+  uint32_t max_index = *leaf_node_num_cells(node);
+  while (min_index != max_index)
+  {
+    uint32_t middle = (min_index + max_index) / 2;
+    if (index_compare(index, index_leaf_entry(index, node, middle), entry) >= 0)
+    {
+      max_index = middle;
+    }
+    else
+    {
+      min_index = middle + 1;
+    }
+  }
+  return min_index;
+}
+
+uint32_t index_depth(Index *index)
+{
+  uint32_t depth = 1;
+  void *node = get_page(index->pager, index->root_page_num);
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    node = get_page(index->pager, *internal_node_right_child(node));
+    depth++;
+  }
+  return depth;
+}
+
+// SplitResult for index nodes, whose separators are whole entries.
+typedef struct
+{
+  bool split;
+  bool duplicate;
+  uint32_t right_page_num;
+  char left_max_entry[INDEX_MAX_ENTRY_SIZE];
+} IndexSplit;
+
+IndexSplit index_leaf_insert(Index *index, uint32_t page_num, uint32_t entry_num, const char *entry)
+{
+  IndexSplit result;
+  result.split = false;
+  result.duplicate = false;
+  Pager *pager = index->pager;
+  uint32_t entry_size = index->entry_size;
+  void *node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  uint32_t num_entries = *leaf_node_num_cells(node);
+
+  if (num_entries < index_max_entries(index))
+  {
+    memmove(index_leaf_entry(index, node, entry_num + 1), index_leaf_entry(index, node, entry_num),
+            (num_entries - entry_num) * entry_size);
+    memcpy(index_leaf_entry(index, node, entry_num), entry, entry_size);
+    *leaf_node_num_cells(node) = num_entries + 1;
+    return result;
+  }
+
+  // As with table leaves, an entry past the end of the last leaf starts a
+  // new one so entries added in order pack their leaves.
+  bool append = entry_num == num_entries && *leaf_node_next_leaf(node) == 0;
+  uint32_t left_count = append ? num_entries : (num_entries + 1) / 2;
+  uint32_t right_count = num_entries + 1 - left_count;
+  char *entries = (char *)malloc((size_t)(num_entries + 1) * entry_size);
+  memcpy(entries, index_leaf_entry(index, node, 0), entry_num * entry_size);
+  memcpy(entries + entry_num * entry_size, entry, entry_size);
+  memcpy(entries + (entry_num + 1) * entry_size, index_leaf_entry(index, node, entry_num),
+         (num_entries - entry_num) * entry_size);
+
+  pager_pin(pager, page_num);
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void *new_node = get_page(pager, new_page_num);
+  pager_mark_dirty(pager, new_page_num);
+  initialize_index_node(new_node, NODE_LEAF, pager->page_size);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(node);
+  *leaf_node_next_leaf(node) = new_page_num;
+
+  memcpy(index_leaf_entry(index, node, 0), entries, left_count * entry_size);
+  memcpy(index_leaf_entry(index, new_node, 0), entries + left_count * entry_size, right_count * entry_size);
+  *leaf_node_num_cells(node) = left_count;
+  *leaf_node_num_cells(new_node) = right_count;
+  pager_unpin(pager, page_num);
+
+  result.split = true;
+  result.right_page_num = new_page_num;
+  memcpy(result.left_max_entry, entries + (left_count - 1) * entry_size, entry_size);
+  free(entries);
+  return result;
+}
+
+// internal_node_insert for index nodes.
+IndexSplit index_internal_insert(Index *index, uint32_t page_num, uint32_t child_index, const IndexSplit *child)
+{
+  IndexSplit result;
+  result.split = false;
+  result.duplicate = false;
+  Pager *pager = index->pager;
+  uint32_t entry_size = index->entry_size;
+  void *node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  uint32_t num_keys = *internal_node_num_keys(node);
+  uint32_t max_keys = index_max_keys(index);
+
+  // Gather children and separators, with the new child right after the old.
+  uint32_t *children = (uint32_t *)malloc((num_keys + 2) * sizeof(uint32_t));
+  char *separators = (char *)malloc((size_t)(num_keys + 1) * entry_size);
+  uint32_t n = 0;
+  for (uint32_t i = 0; i <= num_keys; i++)
+  {
+    children[n] = index_internal_child(index, node, i);
+    if (i == child_index)
+    {
+      memcpy(separators + n * entry_size, child->left_max_entry, entry_size);
+      n++;
+      children[n] = child->right_page_num;
+    }
+    if (i < num_keys)
+    {
+      memcpy(separators + n * entry_size, index_internal_separator(index, node, i), entry_size);
+    }
+    n++;
+  }
+
+  uint32_t left_count = n;
+  void *new_node = NULL;
+  uint32_t new_page_num = 0;
+  if (n - 1 > max_keys)
+  {
+    left_count = child_index == num_keys ? n - 1 : n / 2;
+    pager_pin(pager, page_num);
+    new_page_num = get_unused_page_num(pager);
+    new_node = get_page(pager, new_page_num);
+    pager_mark_dirty(pager, new_page_num);
+    initialize_index_node(new_node, NODE_INTERNAL, pager->page_size);
+  }
+
+  *internal_node_num_keys(node) = left_count - 1;
+  for (uint32_t i = 0; i < left_count - 1; i++)
+  {
+    index_set_cell(index, node, i, children[i], separators + i * entry_size);
+  }
+  *internal_node_right_child(node) = children[left_count - 1];
+  if (new_node != NULL)
+  {
+    uint32_t right_count = n - left_count;
+    *internal_node_num_keys(new_node) = right_count - 1;
+    for (uint32_t i = 0; i < right_count - 1; i++)
+    {
+      index_set_cell(index, new_node, i, children[left_count + i], separators + (left_count + i) * entry_size);
+    }
+    *internal_node_right_child(new_node) = children[n - 1];
+    pager_unpin(pager, page_num);
+
+    result.split = true;
+    result.right_page_num = new_page_num;
+    memcpy(result.left_max_entry, separators + (left_count - 1) * entry_size, entry_size);
+  }
+  free(children);
+  free(separators);
+  return result;
+}
+
+IndexSplit index_subtree_insert(Index *index, uint32_t page_num, const char *entry)
+{
+  void *node = get_page(index->pager, page_num);
+  if (get_node_type(node) == NODE_LEAF)
+  {
+    uint32_t entry_num = index_find_entry(index, node, entry);
+    if (entry_num < *leaf_node_num_cells(node) &&
+        index_compare(index, index_leaf_entry(index, node, entry_num), entry) == 0)
+    {
+      IndexSplit duplicate;
+      duplicate.split = false;
+      duplicate.duplicate = true;
+      return duplicate;
+    }
+    return index_leaf_insert(index, page_num, entry_num, entry);
+  }
+
+  uint32_t child_index = index_find_child(index, node, entry);
+  IndexSplit child = index_subtree_insert(index, index_internal_child(index, node, child_index), entry);
+  if (!child.split)
+  {
+    return child;
+  }
+  return index_internal_insert(index, page_num, child_index, &child);
+}
+
+ExecuteResult index_insert(Index *index, const char *value, uint32_t length, uint32_t key)
+{
+  Pager *pager = index->pager;
+  if ((uint64_t)get_unused_page_num(pager) + index_depth(index) + 1 > pager_max_pages(pager))
+  {
+    return EXECUTE_TABLE_FULL;
+  }
+  char entry[INDEX_MAX_ENTRY_SIZE];
+  index_make_entry(index, value, length, key, entry);
+  IndexSplit split = index_subtree_insert(index, index->root_page_num, entry);
+  if (split.duplicate)
+  {
+    return EXECUTE_DUPLICATE_KEY;
+  }
+  if (split.split)
+  {
+    // The root stays put, as in create_new_root.
+    void *root = get_page(pager, index->root_page_num);
+    pager_pin(pager, index->root_page_num);
+    uint32_t left_child_page_num = get_unused_page_num(pager);
+    void *left_child = get_page(pager, left_child_page_num);
+    pager_mark_dirty(pager, left_child_page_num);
+    memcpy(left_child, root, pager->page_size);
+    set_node_root(left_child, false);
+
+    pager_mark_dirty(pager, index->root_page_num);
+    initialize_index_node(root, NODE_INTERNAL, pager->page_size);
+    set_node_root(root, true);
+    *internal_node_num_keys(root) = 1;
+    index_set_cell(index, root, 0, left_child_page_num, split.left_max_entry);
+    *internal_node_right_child(root) = split.right_page_num;
+    pager_unpin(pager, index->root_page_num);
+  }
+  return EXECUTE_SUCCESS;
+}
+
+void index_seek(Index *index, const char *value, uint32_t length, IndexCursor *cursor)
+{
+  char entry[INDEX_MAX_ENTRY_SIZE];
+  index_make_entry(index, value, length, 0, entry);
+  cursor->index = index;
+  cursor->page_num = index->root_page_num;
+  void *node = get_page(index->pager, cursor->page_num);
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    cursor->page_num = index_internal_child(index, node, index_find_child(index, node, entry));
+    node = get_page(index->pager, cursor->page_num);
+  }
+  cursor->entry_num = index_find_entry(index, node, entry);
+  cursor->end_of_index = false;
+  // An entry past the end of this leaf belongs to the start of the next one.
+  if (cursor->entry_num == *leaf_node_num_cells(node))
+  {
+    cursor->page_num = *leaf_node_next_leaf(node);
+    cursor->entry_num = 0;
+    cursor->end_of_index = cursor->page_num == 0;
+  }
+}
+
+const char *index_cursor_value(IndexCursor *cursor, uint32_t *length)
+{
+  void *node = get_page(cursor->index->pager, cursor->page_num);
+  const char *entry = index_leaf_entry(cursor->index, node, cursor->entry_num);
+  *length = strnlen(entry, cursor->index->value_size);
+  return entry;
+}
+
+uint32_t index_cursor_key(IndexCursor *cursor)
+{
+  void *node = get_page(cursor->index->pager, cursor->page_num);
+  return index_entry_key(cursor->index, index_leaf_entry(cursor->index, node, cursor->entry_num));
+}
+
+void index_cursor_advance(IndexCursor *cursor)
+{
+  void *node = get_page(cursor->index->pager, cursor->page_num);
+  cursor->entry_num++;
+  if (cursor->entry_num >= *leaf_node_num_cells(node))
+  {
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num == 0)
+    {
+      cursor->end_of_index = true;
+      return;
+    }
+    cursor->page_num = next_page_num;
+    cursor->entry_num = 0;
+  }
+}
+
+Index *index_open(Pager *pager, uint32_t root_page_num, uint32_t value_size)
+{
+  Index *index = (Index *)malloc(sizeof(Index));
+  index->pager = pager;
+  index->root_page_num = root_page_num;
+  index->value_size = value_size;
+  index->entry_size = (value_size + 3) / 4 * 4 + sizeof(uint32_t);
+  if (root_page_num >= pager->num_pages)
+  {
+    // A new index, or one whose first commit never reached the log.
+    void *root = get_page(pager, root_page_num);
+    pager_mark_dirty(pager, root_page_num);
+    initialize_index_node(root, NODE_LEAF, pager->page_size);
+    set_node_root(root, true);
+  }
+  return index;
+}
+
+Index *index_create(Pager *pager, uint32_t value_size)
+{
+  if (get_unused_page_num(pager) >= pager_max_pages(pager))
+  {
+    return NULL;
+  }
+  return index_open(pager, get_unused_page_num(pager), value_size);
+}
+
+Index *index_view(Pager *pager, const Index *index)
+{
+  Index *view = (Index *)malloc(sizeof(Index));
+  *view = *index;
+  view->pager = pager;
+  return view;
+}
+
+void index_close(Index *index)
+{
+  free(index);
+}
+
+void indent(uint32_t level)
+{
+  for (uint32_t i = 0; i < level; i++)
+  {
+    printf("  ");
+  }
+}
+
+void print_tree(Table *table, uint32_t page_num, uint32_t indentation_level)
+{
+  Pager *pager = table->pager;
+  void *node = get_page(pager, page_num);
+  uint32_t num_keys, child;
+
+  switch (get_node_type(node))
+  {
+  case (NODE_LEAF):
+    num_keys = *leaf_node_num_cells(node);
+    indent(indentation_level);
+    printf("- leaf (size %d)\n", num_keys);
+    for (uint32_t i = 0; i < num_keys; i++)
+    {
+      node = get_page(pager, page_num);
+      indent(indentation_level + 1);
+      printf("- %d\n", *leaf_node_key(&table->layout, node, i));
+    }
+    break;
+  case (NODE_INTERNAL):
+    num_keys = *internal_node_num_keys(node);
+    indent(indentation_level);
+    printf("- internal (size %d)\n", num_keys);
+    for (uint32_t i = 0; i < num_keys; i++)
+    {
+      node = get_page(pager, page_num);
+      child = *internal_node_cell(node, i);
+      print_tree(table, child, indentation_level + 1);
+
+      node = get_page(pager, page_num);
+      indent(indentation_level + 1);
+      printf("- key %d\n", *internal_node_key(node, i));
+    }
+    node = get_page(pager, page_num);
+    child = *internal_node_right_child(node);
+    print_tree(table, child, indentation_level + 1);
+    break;
+  }
+}
+
+// Sizes that depend on the page size are given for page_size.
+void print_constants(uint32_t page_size)
+{
+  printf("PAGE_SIZE: %d\n", page_size);
+  printf("ROW_SIZE: %d\n", ROW_SIZE);
+  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", page_size - LEAF_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_MAX_CELLS: %d\n", leaf_node_max_cells(ROW_SIZE, page_size));
+  printf("SLOTTED_LEAF_HEADER_SIZE: %d\n", SLOTTED_LEAF_HEADER_SIZE);
+  printf("SLOTTED_LEAF_SPACE: %d\n", slotted_leaf_space(page_size));
+  printf("INTERNAL_NODE_MAX_KEYS: %d\n", internal_node_max_keys(page_size));
+}
+
+// The format of an existing tree, from its leftmost leaf.
+RecordFormat tree_format(Pager *pager, uint32_t root_page_num)
+{
+  void *node = get_page(pager, root_page_num);
+  while (get_node_type(node) == NODE_INTERNAL)
+  {
+    node = get_page(pager, internal_node_child(node, 0));
+  }
+  return leaf_node_format(node);
+}
+
+Table *table_open(Pager *pager, uint32_t root_page_num, const TableSchema *schema, RecordFormat format)
+{
+  Table *table = (Table *)malloc(sizeof(Table));
+  table->pager = pager;
+  table->root_page_num = root_page_num;
+  table->schema = schema;
+  table->key_pages = NULL;
+  table->keys_hashed = false;
+  table->num_rows = TABLE_ROWS_UNKNOWN;
+
+  if (root_page_num >= pager->num_pages)
+  {
+    // A new file, or a table whose first commit never reached the log.
+    table->layout = leaf_layout(schema, format, pager->page_size);
+    void *root_node = get_page(pager, root_page_num);
+    pager_mark_dirty(pager, root_page_num);
+    initialize_leaf_node(&table->layout, root_node);
+    set_node_root(root_node, true);
+    table->num_rows = 0;
+  }
+  else
+  {
+    table->layout = leaf_layout(schema, tree_format(pager, root_page_num), pager->page_size);
+  }
+  return table;
+}
+
+Table *table_create(Pager *pager, const TableSchema *schema, RecordFormat format)
+{
+  if (get_unused_page_num(pager) >= pager_max_pages(pager))
+  {
+    return NULL;
+  }
+  return table_open(pager, get_unused_page_num(pager), schema, format);
+}
+
+Table *table_view(Pager *pager, const Table *table, const TableSchema *schema)
+{
+  Table *view = (Table *)malloc(sizeof(Table));
+  *view = *table;
+  view->pager = pager;
+  view->schema = schema;
+  // The hash is the writer's; a view finds keys from the root.
+  view->key_pages = NULL;
+  view->num_rows = TABLE_ROWS_UNKNOWN;
+  return view;
+}
+
+void table_close(Table *table)
+{
+  if (table->key_pages != NULL)
+  {
+    key_hash_close(table->key_pages);
+  }
+  free(table);
+}
+
+void table_hash_keys(Table *table)
+{
+  if (table->key_pages != NULL)
+  {
+    return;
+  }
+  table->key_pages = key_hash_open();
+  table->keys_hashed = table->num_rows == 0;
+}
+
+Table *db_open(const char *filename, bool use_mmap, WalSyncMode sync_mode, RecordFormat format,
+               uint32_t page_size)
+{
+  Pager *pager = pager_open(filename, PAGER_CACHE_PAGES, use_mmap, sync_mode, page_size);
+  Table *table = table_open(pager, 0, users_schema(), format);
+  // Record the page size in an older file's header.
+  void *header = get_page(pager, 0);
+  if (*((uint8_t *)header + PAGE_SIZE_SHIFT_OFFSET) == 0)
+  {
+    pager_mark_dirty(pager, 0);
+    set_node_page_size(header, pager->page_size);
+  }
+  return table;
+}
+
+void db_close(Table *table)
+{
+  pager_close(table->pager);
+  table_close(table);
+}
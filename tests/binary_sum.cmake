@@ -0,0 +1,23 @@
+# A sum past 2^32 keeps its high half in binary output: the aggregate is
+# written as a u64, not cut to the u32 of an integer column.
+# Run as cmake -DSQLITE=<repl> -DWORK_DIR=<dir> -P binary_sum.cmake.
+set(db "${WORK_DIR}/binary_sum.db")
+file(REMOVE "${db}" "${db}-wal" "${db}-catalog")
+file(WRITE "${WORK_DIR}/binary_sum.sql"
+  "insert 4000000000 a a@example.com\n"
+  "insert 4000000001 b b@example.com\n"
+  ".mode binary\n"
+  "select sum(id) from users\n"
+  ".exit\n")
+execute_process(COMMAND "${SQLITE}" "${db}" --batch
+  INPUT_FILE "${WORK_DIR}/binary_sum.sql"
+  OUTPUT_FILE "${WORK_DIR}/binary_sum.out"
+  RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+  message(FATAL_ERROR "sqlite exited with ${result}")
+endif()
+file(READ "${WORK_DIR}/binary_sum.out" output HEX)
+# 8000000001 = 0x1dcd65001, little-endian in 8 bytes
+if (NOT output STREQUAL "0150d6dc01000000")
+  message(FATAL_ERROR "binary sum(id) was ${output}, not 0150d6dc01000000")
+endif()